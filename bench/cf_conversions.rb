@@ -0,0 +1,45 @@
+# Time and allocations per conversion between ruby objects and CF types, in each direction.
+# On Linux this runs against the CoreFoundation stand-in in ext/portable_cf.c.
+#
+# Keychain::Conversions is only in builds configured with extconf.rb --enable-bench-conversions,
+# so run it with
+#
+#   rake bench_conversions [BENCH_ITERATIONS=n]
+#
+# or, against such a build, ruby -Ilib bench/cf_conversions.rb [iterations]
+require 'keychain'
+
+abort 'Keychain::Conversions is missing: build with extconf.rb --enable-bench-conversions, or run rake bench_conversions' unless defined?(Keychain::Conversions)
+
+iterations = (ARGV[0] || 200_000).to_i
+
+values = {
+  'String (ASCII)' => ['account-name', false],
+  'String (UTF-8)' => ["compte-utilisé-été", false],
+  'String (ISO-8859-1)' => ["compte-utilis\xe9".force_encoding('ISO-8859-1'), false],
+  'String (4KB UTF-8)' => ["é" * 2048, false],
+  'Data (ASCII-8BIT)' => [Random.new(1).bytes(64), true],
+  'Data (UTF-8)' => ["sécret-password", true],
+  'Number' => [8080, false],
+  'Date' => [Time.at(1_400_000_000, 250_000), false],
+  'Boolean' => [true, false]
+}
+
+def measure(iterations)
+  GC.start
+  allocated = GC.stat(:total_allocated_objects)
+  start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  yield
+  elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+  [elapsed * 1e9 / iterations, (GC.stat(:total_allocated_objects) - allocated).to_f / iterations]
+end
+
+conversions = Keychain::Conversions
+puts format('%-22s %12s %10s %12s %10s', '', 'to CF ns', 'allocs', 'from CF ns', 'allocs')
+values.each do |name, (value, as_data)|
+  conversions.to_cf(value, 1000, as_data)
+  conversions.from_cf(value, 1000, as_data)
+  to_cf = measure(iterations) { conversions.to_cf(value, iterations, as_data) }
+  from_cf = measure(iterations) { conversions.from_cf(value, iterations, as_data) }
+  puts format('%-22s %12.1f %10.2f %12.1f %10.2f', name, *to_cf, *from_cf)
+end
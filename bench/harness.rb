@@ -0,0 +1,80 @@
+# A small benchmark harness. Each benchmark times every operation individually and reports
+# throughput, p50/p99 latency and allocations per operation as a line of JSON on the output,
+# with a readable summary on stderr.
+require 'json'
+require 'rbconfig'
+
+module Bench
+  class Harness
+    def initialize(output = $stdout)
+      @output = output
+      @output.sync = true
+      emit :type => 'environment', :ruby => RUBY_DESCRIPTION, :platform => RUBY_PLATFORM,
+           :backend => (Keychain::BACKEND rescue nil), :time => Time.now.utc.to_s
+    end
+
+    # Runs the block ops times, split across threads, after warmup untimed runs. The block is
+    # passed the operation's index (warmup runs count on from ops, so every index is unique)
+    # and the index of the thread running it.
+    #
+    # @option options [Integer] :ops (100)
+    # @option options [Integer] :threads (1)
+    # @option options [Integer] :warmup (ops / 10)
+    # @option options [Integer] :items_per_op (1) the number of items each operation handles,
+    #   reported as items_per_sec
+    # @option options [Hash] :params extra values to include in the report
+    def run(name, options = {})
+      ops = options.fetch(:ops, 100)
+      threads = options.fetch(:threads, 1)
+      options.fetch(:warmup, ops / 10).times {|i| yield ops + i, 0}
+
+      GC.start
+      allocated = GC.stat(:total_allocated_objects)
+      start = now
+      latencies = Array.new(threads) do |thread_index|
+        Thread.new do
+          (thread_index...ops).step(threads).map do |i|
+            op_start = now
+            yield i, thread_index
+            now - op_start
+          end
+        end
+      end.flat_map(&:value)
+      elapsed = now - start
+      allocations = GC.stat(:total_allocated_objects) - allocated
+
+      latencies.sort!
+      report = {
+        :type => 'result',
+        :name => name,
+        :ops => ops,
+        :threads => threads,
+        :seconds => elapsed.round(6),
+        :ops_per_sec => (ops / elapsed).round(1),
+        :p50_us => (percentile(latencies, 0.50) * 1e6).round(2),
+        :p99_us => (percentile(latencies, 0.99) * 1e6).round(2),
+        :allocations_per_op => (allocations.to_f / ops).round(2)
+      }
+      report[:items_per_sec] = (ops * options[:items_per_op] / elapsed).round(1) if options[:items_per_op]
+      report.merge!(options[:params]) if options[:params]
+      emit report
+      $stderr.puts format('%-40s %12.1f ops/s  p50 %10.1fus  p99 %10.1fus  %8.2f allocs/op',
+                          name, report[:ops_per_sec], report[:p50_us], report[:p99_us], report[:allocations_per_op])
+      report
+    end
+
+    private
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    def percentile(sorted, fraction)
+      sorted[((sorted.length - 1) * fraction).round]
+    end
+
+    def emit(record)
+      @output.puts JSON.generate(record)
+    end
+  end
+end
@@ -0,0 +1,37 @@
+# Allocations per item for a find(:all), with and without reading attributes.
+#
+#   ruby -Ilib bench/item_allocations.rb [item count]
+require 'keychain'
+require 'tmpdir'
+
+count = (ARGV[0] || 1000).to_i
+keychain = Keychain.create(File.join(Dir.tmpdir, "item_allocations_#{Process.pid}.keychain"), 'pass')
+begin
+  count.times.each_slice(1000) do |slice|
+    keychain.add_passwords(Keychain::Item::Classes::GENERIC,
+                           slice.map {|i| {:service => "service-#{i}", :account => 'account', :password => "password-#{i}"}},
+                           :return_items => false)
+  end
+
+  def allocations
+    GC.start
+    before = GC.stat(:total_allocated_objects)
+    yield
+    GC.stat(:total_allocated_objects) - before
+  end
+
+  proxy = keychain.generic_passwords.where(:account => 'account')
+  proxy.all # warm up
+  attributes = Keychain::KEYCHAIN_MAP.keys - [:password]
+
+  results = {
+    'find(:all)' => allocations { proxy.all },
+    'find(:all), reading account' => allocations { proxy.all.each(&:account) },
+    'find(:all), reading every attribute' => allocations { proxy.all.each {|item| attributes.each {|name| item.send(name)}} }
+  }
+  results.each do |name, total|
+    puts format('%-40s %8.1f allocations/item', name, total.to_f / count)
+  end
+ensure
+  keychain.delete
+end
@@ -0,0 +1,171 @@
+# Benchmarks lookups, find(:all), inserts, updates and concurrent lookups, reporting each as
+# a line of JSON (see bench/harness.rb). Run with rake bench or
+#
+#   ruby -Ilib bench/keychain_bench.rb
+#
+# BENCH_SIZES     keychain sizes for find(:all) (default 100,10000,100000)
+# BENCH_THREADS   threads for the concurrent lookup benchmark (default 4)
+# BENCH_DIR       where the benchmark keychains are created (default Dir.tmpdir)
+# BENCH_OUTPUT    file to write the JSON to (default stdout)
+#
+# On Linux this runs against the file backed keychain, on OS X against real keychains.
+require 'keychain'
+require 'tmpdir'
+require File.expand_path('../harness', __FILE__)
+
+sizes = (ENV['BENCH_SIZES'] || '100,10000,100000').split(',').map(&:to_i)
+thread_count = (ENV['BENCH_THREADS'] || 4).to_i
+directory = ENV['BENCH_DIR'] || Dir.tmpdir
+output = ENV['BENCH_OUTPUT'] ? File.open(ENV['BENCH_OUTPUT'], 'w') : $stdout
+
+GENERIC = Keychain::Item::Classes::GENERIC
+keychains = []
+
+create_keychain = lambda do |name|
+  keychain = Keychain.create(File.join(directory, "bench_#{name}_#{Process.pid}.keychain"), 'pass')
+  keychains << keychain
+  keychain
+end
+
+populate = lambda do |keychain, count|
+  count.times.each_slice(1000) do |slice|
+    keychain.add_passwords(GENERIC, slice.map {|i| {:service => "service-#{i}", :account => 'account', :password => "password-#{i}"}},
+                           :return_items => false)
+  end
+end
+
+begin
+  harness = Bench::Harness.new(output)
+
+  lookup_size = sizes.select {|size| size <= 10_000}.max || sizes.min
+  by_size = {}
+  sizes.each do |size|
+    by_size[size] = create_keychain.call(size)
+    populate.call(by_size[size], size)
+  end
+  keychain = by_size[lookup_size]
+  params = {:items => lookup_size}
+
+  harness.run('lookup', :ops => 1000, :params => params) do |i|
+    keychain.generic_passwords.where(:service => "service-#{i % lookup_size}").first
+  end
+
+  # adding an item that may already exist, rescuing the error or checking the status
+  harness.run('duplicate add (rescue)', :ops => 1000, :params => params) do
+    begin
+      keychain.add_password(GENERIC, :service => 'service-0', :account => 'account', :password => 'password')
+    rescue Keychain::DuplicateItemError
+    end
+  end
+
+  harness.run('duplicate add (try_add_password)', :ops => 1000, :params => params) do
+    keychain.try_add_password(GENERIC, :service => 'service-0', :account => 'account', :password => 'password')
+  end
+
+  # probing for a credential that isn't there
+  harness.run('missing item (first)', :ops => 1000, :params => params) do |i|
+    keychain.generic_passwords.where(:service => "missing-#{i}").first
+  end
+
+  harness.run('missing item (find_status)', :ops => 1000, :params => params) do |i|
+    keychain.generic_passwords.where(:service => "missing-#{i}").find_status
+  end
+
+  harness.run('Keychain.default', :ops => 10_000, :params => params) do
+    Keychain.default
+  end
+
+  prepared = keychain.generic_passwords.prepare(:service)
+  harness.run('lookup (prepared)', :ops => 1000, :params => params) do |i|
+    prepared.first(:service => "service-#{i % lookup_size}")
+  end
+
+  items = keychain.generic_passwords.limit(1000).all
+  harness.run('password', :ops => 1000, :params => params) do |i|
+    items[i % items.length].password
+  end
+
+  sizes.each do |size|
+    proxy = by_size[size].generic_passwords.where(:account => 'account')
+    harness.run("find(:all) #{size} items", :ops => [3, 100_000 / size].max, :warmup => 1, :items_per_op => size, :params => {:items => size}) do
+      proxy.all
+    end
+  end
+
+  # predicates are evaluated on the raw results, so only the matching items are built
+  harness.run("where prefix #{lookup_size} items", :ops => 20, :warmup => 2, :items_per_op => lookup_size, :params => params) do
+    keychain.generic_passwords.where(:service => Keychain.prefix('service-99')).all
+  end
+
+  harness.run("where regexp #{lookup_size} items", :ops => 20, :warmup => 2, :items_per_op => lookup_size, :params => params) do
+    keychain.generic_passwords.where(:service => /\Aservice-99/).all
+  end
+
+  harness.run("all.select #{lookup_size} items", :ops => 20, :warmup => 2, :items_per_op => lookup_size, :params => params) do
+    keychain.generic_passwords.all.select {|item| item.service.start_with?('service-99')}
+  end
+
+  snapshot = StringIO.new(''.b)
+  harness.run("export_snapshot #{lookup_size} items", :ops => 3, :warmup => 1, :items_per_op => lookup_size, :params => params) do
+    snapshot = StringIO.new(''.b)
+    keychain.export_snapshot(snapshot, :passphrase => 'passphrase')
+  end
+
+  harness.run("import_snapshot #{lookup_size} items", :ops => 3, :warmup => 0, :items_per_op => lookup_size, :params => params) do |i|
+    Keychain.import_snapshot(snapshot.string, :passphrase => 'passphrase', :keychain => create_keychain.call("import-#{i}"))
+  end
+
+  inserts = create_keychain.call('inserts')
+  harness.run('add_password', :ops => 100) do |i|
+    inserts.add_password(GENERIC, :service => 'single', :account => "account-#{i}", :password => 'password')
+  end
+
+  harness.run('add_passwords (1000 items)', :ops => 10, :warmup => 1, :items_per_op => 1000) do |i|
+    inserts.add_passwords(GENERIC, Array.new(1000) {|j| {:service => "bulk-#{i}", :account => "account-#{j}", :password => 'password'}},
+                          :return_items => false)
+  end
+
+  harness.run('update_all (1000 items)', :ops => 10, :warmup => 1, :items_per_op => 1000) do |i|
+    inserts.generic_passwords.where(:service => "bulk-#{i}").update_all(:password => "rotated-#{i}")
+  end
+
+  rotated = inserts.generic_passwords.where(:service => 'bulk-0').all
+  harness.run('save_all (1000 items)', :ops => 10, :warmup => 1, :items_per_op => rotated.length) do |i|
+    rotated.each {|item| item.password = "rotated-#{i}"}
+    Keychain::Item.save_all(rotated)
+  end
+
+  item = keychain.generic_passwords.where(:service => 'service-0').first
+  harness.run('save! (password rotation)', :ops => 100, :params => params) do |i|
+    item.password = "password-#{i}"
+    item.save!
+  end
+
+  harness.run('save! + reload', :ops => 100, :params => params) do |i|
+    item.comment = "comment-#{i}"
+    item.save!
+    item.reload
+  end
+
+  # the same search across several keychains, one after another and on a thread per keychain
+  project_keychains = Array.new(8) do |i|
+    project = create_keychain.call("project-#{i}")
+    populate.call(project, 1000)
+    project
+  end
+  fan_out = project_keychains.length * 1000
+  [nil, true].each do |parallel|
+    proxy = Keychain.generic_passwords.where(:account => 'account').in(project_keychains, :parallel => parallel)
+    harness.run("find(:all) #{project_keychains.length} keychains#{' (parallel)' if parallel}", :ops => 20, :warmup => 2,
+                :items_per_op => fan_out, :params => {:items => fan_out, :keychains => project_keychains.length}) do
+      proxy.all
+    end
+  end
+
+  harness.run("lookup (#{thread_count} threads)", :ops => 4000, :threads => thread_count, :params => params) do |i|
+    keychain.generic_passwords.where(:service => "service-#{i % lookup_size}").first
+  end
+ensure
+  keychains.each(&:delete)
+  output.close if output != $stdout
+end
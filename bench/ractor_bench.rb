@@ -0,0 +1,52 @@
+# Lookup throughput as the same lookups are spread across more ractors, sharing one keychain.
+# Reports each ractor count as a line of JSON like bench/harness.rb, with the speedup over a
+# single ractor.
+#
+#   ruby -Ilib bench/ractor_bench.rb [lookups]
+#
+# BENCH_RACTORS   ractor counts to run (default 1,2,4,8)
+# BENCH_DIR       where the benchmark keychain is created (default Dir.tmpdir)
+require 'keychain'
+require 'json'
+require 'tmpdir'
+
+abort 'ractors need ruby 3.0 or later' unless defined?(Ractor)
+Warning[:experimental] = false
+
+lookups = (ARGV[0] || 20_000).to_i
+counts = (ENV['BENCH_RACTORS'] || '1,2,4,8').split(',').map(&:to_i)
+size = 1000
+
+keychain = Keychain.create(File.join(ENV['BENCH_DIR'] || Dir.tmpdir, "ractor_bench_#{Process.pid}.keychain"), 'pass')
+begin
+  keychain.add_passwords(Keychain::Item::Classes::GENERIC,
+                         size.times.map {|i| {:service => "service-#{i}", :account => 'account', :password => "password-#{i}"}},
+                         :return_items => false)
+
+  $stdout.sync = true
+  puts JSON.generate(:type => 'environment', :ruby => RUBY_DESCRIPTION, :platform => RUBY_PLATFORM,
+                     :backend => (Keychain::BACKEND rescue nil), :time => Time.now.utc.to_s)
+  baseline = nil
+  counts.each do |count|
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    ractors = Array.new(count) do |index|
+      Ractor.new(keychain, index, count, lookups, size) do |shared, first, step, total, items|
+        (first...total).step(step).count do |i|
+          shared.generic_passwords.where(:service => "service-#{i % items}").first
+        end
+      end
+    end
+    found = ractors.sum(&:take)
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+    abort "expected #{lookups} lookups, ran #{found}" unless found == lookups
+
+    ops_per_sec = lookups / elapsed
+    baseline ||= ops_per_sec
+    puts JSON.generate(:type => 'result', :name => 'ractor lookup', :ops => lookups, :ractors => count,
+                       :items => size, :seconds => elapsed.round(6), :ops_per_sec => ops_per_sec.round(1),
+                       :speedup => (ops_per_sec / baseline).round(2))
+    $stderr.puts format('%-40s %12.1f ops/s  %6.2fx', "ractor lookup (#{count} ractors)", ops_per_sec, ops_per_sec / baseline)
+  end
+ensure
+  keychain.delete
+end
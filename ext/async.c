@@ -0,0 +1,498 @@
+#define _DEFAULT_SOURCE
+
+#include "async.h"
+#include "metrics.h"
+#include "cf_conversions.h"
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include "ruby/thread.h"
+#else
+#define rb_thread_call_without_gvl(func, data, ubf, data2) (void*)rb_thread_blocking_region((rb_blocking_function_t*)(func), (data), (ubf), (data2))
+#endif
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#ifndef HAVE_RB_GC_MARK_MOVABLE
+#define rb_gc_mark_movable rb_gc_mark
+#define rb_gc_location(value) (value)
+#endif
+#ifndef RUBY_TYPED_FREE_IMMEDIATELY
+#define RUBY_TYPED_FREE_IMMEDIATELY 0
+#endif
+
+VALUE rb_mKeychainAsync;
+static VALUE rb_cKeychainAsyncFuture;
+static VALUE rb_eKeychainAsyncCancelledError;
+
+enum {
+  JOB_PENDING,
+  JOB_RUNNING,
+  JOB_DONE,
+  JOB_CANCELLED
+};
+
+/*
+ * The queue, the worker counts and every job's state and refs are guarded by pool_mutex.
+ * A job is referenced by its future and, until a worker has finished with it, by the pool.
+ */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+static keychain_async_job *queue_head = NULL;
+static keychain_async_job *queue_tail = NULL;
+static int pool_size = 4;
+static int workers_running = 0;
+
+keychain_async_job *keychain_async_job_new(CFTypeRef input, CFTypeRef other_input){
+  keychain_async_job *job = calloc(1, sizeof(keychain_async_job));
+  if(!job){
+    if(input){
+      CFRelease(input);
+    }
+    if(other_input){
+      CFRelease(other_input);
+    }
+    rb_memerror();
+  }
+  pthread_cond_init(&job->done, NULL);
+  job->inputs[0] = input;
+  job->inputs[1] = other_input;
+  return job;
+}
+
+/* Called with pool_mutex held */
+static void job_release(keychain_async_job *job){
+  if(--job->refs > 0){
+    return;
+  }
+  for(int i = 0; i < 3; i++){
+    if(job->inputs[i]){
+      CFRelease(job->inputs[i]);
+    }
+  }
+  if(job->output){
+    CFRelease(job->output);
+  }
+  if(job->data && job->free_data){
+    job->free_data(job->data);
+  }
+  pthread_cond_destroy(&job->done);
+  free(job);
+}
+
+static void *worker_main(void *unused){
+  pthread_mutex_lock(&pool_mutex);
+  for(;;){
+    while(!queue_head && workers_running <= pool_size){
+      pthread_cond_wait(&work_available, &pool_mutex);
+    }
+    if(workers_running > pool_size){
+      workers_running--;
+      pthread_mutex_unlock(&pool_mutex);
+      return NULL;
+    }
+    keychain_async_job *job = queue_head;
+    queue_head = job->next;
+    if(!queue_head){
+      queue_tail = NULL;
+    }
+    job->next = NULL;
+    job->state = JOB_RUNNING;
+    pthread_mutex_unlock(&pool_mutex);
+
+    uint64_t start = keychain_metrics_now();
+    job->run(job);
+    job->elapsed_ns = keychain_metrics_now() - start;
+
+    pthread_mutex_lock(&pool_mutex);
+    job->state = JOB_DONE;
+    pthread_cond_broadcast(&job->done);
+    job_release(job);
+  }
+}
+
+/* Called with pool_mutex held */
+static void start_workers(void){
+  while(workers_running < pool_size){
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    int error = pthread_create(&thread, &attributes, worker_main, NULL);
+    pthread_attr_destroy(&attributes);
+    if(error){
+      if(workers_running == 0){
+        pthread_mutex_unlock(&pool_mutex);
+        errno = error;
+        rb_sys_fail("pthread_create");
+      }
+      break;
+    }
+    workers_running++;
+  }
+}
+
+/* the threads don't survive a fork: the child starts new ones for any queued jobs when it next submits one */
+static void pool_after_fork_in_child(void){
+  pthread_mutex_init(&pool_mutex, NULL);
+  pthread_cond_init(&work_available, NULL);
+  workers_running = 0;
+}
+
+typedef struct {
+  keychain_async_job *job;
+  VALUE context;
+  VALUE value;
+  VALUE error;
+  int resolved;
+  /* set, under pool_mutex, while a thread converts the result: other threads wait for it on resolved_cond */
+  int resolving;
+  pthread_cond_t resolved_cond;
+} keychain_future;
+
+static void keychain_future_mark(void *ptr){
+  keychain_future *future = ptr;
+  rb_gc_mark_movable(future->context);
+  rb_gc_mark_movable(future->value);
+  rb_gc_mark_movable(future->error);
+}
+
+static void keychain_future_compact(void *ptr){
+  keychain_future *future = ptr;
+  future->context = rb_gc_location(future->context);
+  future->value = rb_gc_location(future->value);
+  future->error = rb_gc_location(future->error);
+}
+
+static void keychain_future_free(void *ptr){
+  keychain_future *future = ptr;
+  if(future->job){
+    pthread_mutex_lock(&pool_mutex);
+    job_release(future->job);
+    pthread_mutex_unlock(&pool_mutex);
+  }
+  pthread_cond_destroy(&future->resolved_cond);
+  xfree(future);
+}
+
+static size_t keychain_future_memsize(const void *ptr){
+  const keychain_future *future = ptr;
+  size_t size = sizeof(keychain_future);
+  keychain_async_job *job = future->job;
+  if(job){
+    size += sizeof(keychain_async_job) + cf_memsize(job->inputs[0]) + cf_memsize(job->inputs[1]);
+    /* the rest is filled in by the worker, so is only counted once it has finished */
+    pthread_mutex_lock(&pool_mutex);
+    if(job->state >= JOB_DONE){
+      size += cf_memsize(job->inputs[2]) + cf_memsize(job->output) + (job->data ? job->length : 0);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+  }
+  return size;
+}
+
+static const rb_data_type_t keychain_future_type = {
+  "Keychain::Async::Future",
+  {keychain_future_mark, keychain_future_free, keychain_future_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+   keychain_future_compact,
+#endif
+  },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE future_new(VALUE context){
+  keychain_future *future;
+  VALUE rb_future = TypedData_Make_Struct(rb_cKeychainAsyncFuture, keychain_future, &keychain_future_type, future);
+  future->context = context;
+  future->value = Qnil;
+  future->error = Qnil;
+  pthread_cond_init(&future->resolved_cond, NULL);
+  return rb_future;
+}
+
+VALUE keychain_async_submit(keychain_async_job *job, VALUE context){
+  int state = 0;
+  VALUE rb_future = rb_protect(future_new, context, &state);
+  if(state){
+    pthread_mutex_lock(&pool_mutex);
+    job->refs = 1;
+    job_release(job);
+    pthread_mutex_unlock(&pool_mutex);
+    rb_jump_tag(state);
+  }
+  keychain_future *future;
+  TypedData_Get_Struct(rb_future, keychain_future, &keychain_future_type, future);
+  future->job = job;
+
+  pthread_mutex_lock(&pool_mutex);
+  job->refs = 2;
+  job->state = JOB_PENDING;
+  if(queue_tail){
+    queue_tail->next = job;
+  }else{
+    queue_head = job;
+  }
+  queue_tail = job;
+  start_workers();
+  pthread_cond_signal(&work_available);
+  pthread_mutex_unlock(&pool_mutex);
+  return rb_future;
+}
+
+static keychain_future *get_keychain_future(VALUE self){
+  keychain_future *future;
+  TypedData_Get_Struct(self, keychain_future, &keychain_future_type, future);
+  if(!future->job){
+    rb_raise(rb_eTypeError, "uninitialized future");
+  }
+  return future;
+}
+
+struct future_wait_call {
+  keychain_async_job *job;
+  double timeout; /* negative to wait until the job is done */
+  int interrupted;
+  int finished;
+};
+
+static void *future_wait_without_gvl(void *data){
+  struct future_wait_call *call = data;
+  struct timespec deadline;
+  if(call->timeout >= 0){
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    double seconds = now.tv_sec + now.tv_usec / 1e6 + call->timeout;
+    deadline.tv_sec = (time_t)seconds;
+    deadline.tv_nsec = (long)((seconds - floor(seconds)) * 1e9);
+  }
+  pthread_mutex_lock(&pool_mutex);
+  while(call->job->state < JOB_DONE && !call->interrupted){
+    if(call->timeout < 0){
+      pthread_cond_wait(&call->job->done, &pool_mutex);
+    }else if(pthread_cond_timedwait(&call->job->done, &pool_mutex, &deadline) == ETIMEDOUT){
+      break;
+    }
+  }
+  call->finished = call->job->state >= JOB_DONE;
+  pthread_mutex_unlock(&pool_mutex);
+  return NULL;
+}
+
+static void future_wait_interrupt(void *data){
+  struct future_wait_call *call = data;
+  pthread_mutex_lock(&pool_mutex);
+  call->interrupted = 1;
+  pthread_cond_broadcast(&call->job->done);
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Waits, without the GVL, until the job is done or cancelled or timeout seconds have passed */
+static int future_wait(keychain_future *future, double timeout){
+  struct future_wait_call call = {future->job, timeout, 0, 0};
+  for(;;){
+    rb_thread_call_without_gvl(future_wait_without_gvl, &call, future_wait_interrupt, &call);
+    if(call.finished || !call.interrupted){
+      return call.finished;
+    }
+    /* raises if the thread was interrupted by Thread#raise, Thread#kill or a signal */
+    rb_thread_check_ints();
+    call.interrupted = 0;
+  }
+}
+
+static VALUE future_resolve(VALUE data){
+  keychain_future *future = (keychain_future*)data;
+  return future->job->resolve(future->job, future->context);
+}
+
+/* Future#wait(timeout = nil) returns whether the call has finished (or been cancelled) */
+static VALUE rb_keychain_future_wait(int argc, VALUE *argv, VALUE self){
+  VALUE timeout;
+  rb_scan_args(argc, argv, "01", &timeout);
+  keychain_future *future = get_keychain_future(self);
+  return future_wait(future, NIL_P(timeout) ? -1 : NUM2DBL(timeout)) ? Qtrue : Qfalse;
+}
+
+struct future_resolution_wait_call {
+  keychain_future *future;
+  int interrupted;
+};
+
+static void *future_resolution_wait_without_gvl(void *data){
+  struct future_resolution_wait_call *call = data;
+  pthread_mutex_lock(&pool_mutex);
+  while(call->future->resolving && !call->interrupted){
+    pthread_cond_wait(&call->future->resolved_cond, &pool_mutex);
+  }
+  pthread_mutex_unlock(&pool_mutex);
+  return NULL;
+}
+
+static void future_resolution_wait_interrupt(void *data){
+  struct future_resolution_wait_call *call = data;
+  pthread_mutex_lock(&pool_mutex);
+  call->interrupted = 1;
+  pthread_cond_broadcast(&call->future->resolved_cond);
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Waits, without the GVL, until the thread resolving the future has finished */
+static void future_wait_for_resolution(keychain_future *future){
+  struct future_resolution_wait_call call = {future, 0};
+  for(;;){
+    rb_thread_call_without_gvl(future_resolution_wait_without_gvl, &call, future_resolution_wait_interrupt, &call);
+    if(!call.interrupted){
+      return;
+    }
+    rb_thread_check_ints();
+    call.interrupted = 0;
+  }
+}
+
+static void future_set_resolving(keychain_future *future, int resolving){
+  pthread_mutex_lock(&pool_mutex);
+  future->resolving = resolving;
+  if(!resolving){
+    pthread_cond_broadcast(&future->resolved_cond);
+  }
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+/*
+ * Future#value waits for the call, then returns its result or raises its error. Only one
+ * thread converts the result, which can release the GVL: others calling value meanwhile wait
+ * for it to finish.
+ */
+static VALUE rb_keychain_future_value(VALUE self){
+  keychain_future *future = get_keychain_future(self);
+  while(!future->resolved){
+    if(future->resolving){
+      future_wait_for_resolution(future);
+      continue;
+    }
+    future_wait(future, -1);
+    if(future->resolved || future->resolving){
+      continue;
+    }
+    future_set_resolving(future, 1);
+    if(future->job->state == JOB_CANCELLED){
+      future->error = rb_exc_new_cstr(rb_eKeychainAsyncCancelledError, "the keychain call was cancelled");
+    }else{
+      int state = 0;
+      future->value = rb_protect(future_resolve, (VALUE)future, &state);
+      if(state){
+        VALUE error = rb_errinfo();
+        if(!rb_obj_is_kind_of(error, rb_eException)){
+          /* Thread#kill or throw: the result may be half converted, so it can't be resolved again */
+          future->error = rb_exc_new_cstr(rb_eKeychainAsyncCancelledError, "interrupted while resolving the keychain call");
+          future->resolved = 1;
+          future->context = Qnil;
+          future_set_resolving(future, 0);
+          rb_jump_tag(state);
+        }
+        future->error = error;
+        rb_set_errinfo(Qnil);
+      }
+    }
+    future->resolved = 1;
+    future->context = Qnil;
+    future_set_resolving(future, 0);
+  }
+  keychain_metrics_notify();
+  if(!NIL_P(future->error)){
+    rb_exc_raise(future->error);
+  }
+  return future->value;
+}
+
+static VALUE rb_keychain_future_ready(VALUE self){
+  keychain_future *future = get_keychain_future(self);
+  pthread_mutex_lock(&pool_mutex);
+  int ready = future->job->state >= JOB_DONE;
+  pthread_mutex_unlock(&pool_mutex);
+  return ready ? Qtrue : Qfalse;
+}
+
+/* Future#cancel stops the call if a worker hasn't started it yet, returning whether it did */
+static VALUE rb_keychain_future_cancel(VALUE self){
+  keychain_future *future = get_keychain_future(self);
+  keychain_async_job *job = future->job;
+  int cancelled = 0;
+  pthread_mutex_lock(&pool_mutex);
+  if(job->state == JOB_PENDING){
+    keychain_async_job *previous = NULL;
+    for(keychain_async_job *queued = queue_head; queued; previous = queued, queued = queued->next){
+      if(queued == job){
+        if(previous){
+          previous->next = job->next;
+        }else{
+          queue_head = job->next;
+        }
+        if(queue_tail == job){
+          queue_tail = previous;
+        }
+        break;
+      }
+    }
+    job->next = NULL;
+    job->state = JOB_CANCELLED;
+    pthread_cond_broadcast(&job->done);
+    job_release(job);
+    cancelled = 1;
+  }
+  pthread_mutex_unlock(&pool_mutex);
+  if(cancelled && job->cancelled){
+    job->cancelled(job, future->context);
+  }
+  return cancelled ? Qtrue : Qfalse;
+}
+
+static VALUE rb_keychain_future_cancelled(VALUE self){
+  keychain_future *future = get_keychain_future(self);
+  pthread_mutex_lock(&pool_mutex);
+  int cancelled = future->job->state == JOB_CANCELLED;
+  pthread_mutex_unlock(&pool_mutex);
+  return cancelled ? Qtrue : Qfalse;
+}
+
+static VALUE rb_keychain_async_pool_size(VALUE self){
+  pthread_mutex_lock(&pool_mutex);
+  int size = pool_size;
+  pthread_mutex_unlock(&pool_mutex);
+  return INT2NUM(size);
+}
+
+/* Keychain::Async.pool_size = n sets the number of worker threads. Surplus workers exit once idle */
+static VALUE rb_keychain_async_set_pool_size(VALUE self, VALUE size){
+  int new_size = NUM2INT(size);
+  if(new_size < 1){
+    rb_raise(rb_eArgError, "pool size must be at least 1");
+  }
+  pthread_mutex_lock(&pool_mutex);
+  pool_size = new_size;
+  if(queue_head){
+    start_workers();
+  }
+  pthread_cond_broadcast(&work_available);
+  pthread_mutex_unlock(&pool_mutex);
+  return size;
+}
+
+void Init_keychain_async(VALUE rb_cKeychain){
+  pthread_atfork(NULL, NULL, pool_after_fork_in_child);
+
+  rb_mKeychainAsync = rb_define_module_under(rb_cKeychain, "Async");
+  rb_define_singleton_method(rb_mKeychainAsync, "pool_size", RUBY_METHOD_FUNC(rb_keychain_async_pool_size), 0);
+  rb_define_singleton_method(rb_mKeychainAsync, "pool_size=", RUBY_METHOD_FUNC(rb_keychain_async_set_pool_size), 1);
+
+  rb_eKeychainAsyncCancelledError = rb_define_class_under(rb_mKeychainAsync, "CancelledError", rb_eStandardError);
+
+  rb_cKeychainAsyncFuture = rb_define_class_under(rb_mKeychainAsync, "Future", rb_cObject);
+  rb_undef_alloc_func(rb_cKeychainAsyncFuture);
+  rb_define_method(rb_cKeychainAsyncFuture, "value", RUBY_METHOD_FUNC(rb_keychain_future_value), 0);
+  rb_define_method(rb_cKeychainAsyncFuture, "wait", RUBY_METHOD_FUNC(rb_keychain_future_wait), -1);
+  rb_define_method(rb_cKeychainAsyncFuture, "ready?", RUBY_METHOD_FUNC(rb_keychain_future_ready), 0);
+  rb_define_method(rb_cKeychainAsyncFuture, "cancel", RUBY_METHOD_FUNC(rb_keychain_future_cancel), 0);
+  rb_define_method(rb_cKeychainAsyncFuture, "cancelled?", RUBY_METHOD_FUNC(rb_keychain_future_cancelled), 0);
+}
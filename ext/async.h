@@ -0,0 +1,66 @@
+#ifndef KEYCHAIN_ASYNC_H
+#define KEYCHAIN_ASYNC_H
+
+/*
+ * A pool of native threads that make Security calls on behalf of
+ * Keychain::Async, and the Keychain::Async::Future returned for each call.
+ *
+ * A job's CF arguments are built, and its results converted, by the ruby
+ * thread that submits or resolves it: the worker threads never touch ruby
+ * objects or need the GVL. The pool is shared by every ractor, while each
+ * future belongs to the ractor that submitted it.
+ */
+
+#include "ruby.h"
+#include <stdint.h>
+#include <pthread.h>
+#ifdef KEYCHAIN_FILE_BACKEND
+#include "file_keychain.h"
+#else
+#include <Security/Security.h>
+#endif
+
+typedef struct keychain_async_job keychain_async_job;
+
+struct keychain_async_job {
+  /* called on a worker thread without the GVL */
+  void (*run)(keychain_async_job *job);
+  /* called with the GVL by the first Future#value after run has returned; may raise */
+  VALUE (*resolve)(keychain_async_job *job, VALUE context);
+  /* called with the GVL, if not NULL, when Future#cancel stops the job before it has run */
+  void (*cancelled)(keychain_async_job *job, VALUE context);
+  /* releases data, if run left any that resolve didn't take */
+  void (*free_data)(void *data);
+
+  /* CF objects released with the job, if not NULL */
+  CFTypeRef inputs[3];
+  CFTypeRef output;
+  void *data;
+  UInt32 length;
+  OSStatus status;
+  long mode;
+  uint64_t elapsed_ns;
+
+  /* owned by async.c */
+  int state;
+  int refs;
+  keychain_async_job *next;
+  pthread_cond_t done;
+};
+
+extern VALUE rb_mKeychainAsync;
+
+/*
+ * Returns a zeroed job, to be passed to keychain_async_submit, taking ownership of its first
+ * two inputs (either of which may be NULL). They are released if the job can't be allocated.
+ */
+keychain_async_job *keychain_async_job_new(CFTypeRef input, CFTypeRef other_input);
+/*
+ * Queues job and returns its Future. context is kept alive until the future is resolved.
+ * If the future can't be allocated the job is released before the error is raised.
+ */
+VALUE keychain_async_submit(keychain_async_job *job, VALUE context);
+
+void Init_keychain_async(VALUE rb_cKeychain);
+
+#endif
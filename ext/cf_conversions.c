@@ -0,0 +1,262 @@
+#include "cf_conversions.h"
+#include "secret_buffer.h"
+#include "ruby/encoding.h"
+#include <math.h>
+#include <string.h>
+
+void *cf_scratch_reserve(cf_scratch *scratch, size_t size){
+  if(size <= CF_SCRATCH_STACK_SIZE){
+    return scratch->stack;
+  }
+  if(scratch->heap){
+    rb_free_tmp_buffer(&scratch->heap);
+  }
+  return rb_alloc_tmp_buffer(&scratch->heap, (long)size);
+}
+
+void cf_scratch_release(cf_scratch *scratch){
+  if(scratch->heap){
+    rb_free_tmp_buffer(&scratch->heap);
+  }
+}
+
+/*
+ * Returns string, or a UTF-8 copy of it if its bytes aren't already valid as UTF-8. Only
+ * strings in some other encoding with non ASCII characters are transcoded.
+ */
+static VALUE rb_string_as_utf8(VALUE string){
+  int index = rb_enc_get_index(string);
+  if(index == rb_utf8_encindex() || rb_enc_str_asciionly_p(string)){
+    return string;
+  }
+  return rb_str_export_to_enc(string, rb_utf8_encoding());
+}
+
+CFStringRef rb_create_cf_string(VALUE string){
+  StringValue(string);
+  string = rb_string_as_utf8(string);
+  const char *bytes = RSTRING_PTR(string);
+  long length = RSTRING_LEN(string);
+  if(memchr(bytes, '\0', length)){
+    rb_raise(rb_eArgError, "string contains null byte");
+  }
+  CFStringRef result = CFStringCreateWithBytes(NULL, (const UInt8*)bytes, length, kCFStringEncodingUTF8, false);
+  if(!result){
+    rb_raise(rb_eArgError, "invalid byte sequence in %s", rb_enc_name(rb_enc_get(string)));
+  }
+  return result;
+}
+
+CFDataRef rb_create_cf_data(VALUE string){
+  StringValue(string);
+  if(rb_enc_get_index(string) != rb_ascii8bit_encindex()){
+    string = rb_string_as_utf8(string);
+  }
+  return CFDataCreate(NULL, (const UInt8*)RSTRING_PTR(string), RSTRING_LEN(string));
+}
+
+static CFDateRef rb_create_cf_date(VALUE time){
+  struct timespec ts = rb_time_timespec(time);
+  CFAbsoluteTime abstime = (double)ts.tv_sec + ts.tv_nsec / 1e9 - kCFAbsoluteTimeIntervalSince1970;
+  return CFDateCreate(NULL, abstime);
+}
+
+/* The secret is copied once, by CF, straight from the locked buffer */
+static CFTypeRef rb_create_cf_value_from_secret(VALUE secret, int as_data){
+  const char *bytes;
+  long length;
+  secret_buffer_get(secret, &bytes, &length);
+  if(as_data){
+    return CFDataCreate(NULL, (const UInt8*)bytes, length);
+  }
+  CFStringRef result = CFStringCreateWithBytes(NULL, (const UInt8*)bytes, length, kCFStringEncodingUTF8, false);
+  if(!result){
+    rb_raise(rb_eArgError, "invalid byte sequence in secret");
+  }
+  return result;
+}
+
+CFTypeRef rb_create_cf_value(VALUE value, int as_data){
+  switch(TYPE(value)){
+    case T_STRING:
+      return as_data ? (CFTypeRef)rb_create_cf_data(value) : (CFTypeRef)rb_create_cf_string(value);
+    case T_BIGNUM:
+    case T_FIXNUM:
+      {
+        long long longLongValue = NUM2LL(value);
+        return CFNumberCreate(NULL,kCFNumberLongLongType,&longLongValue);
+      }
+    case T_TRUE:
+      return CFRetain(kCFBooleanTrue);
+    case T_FALSE:
+      return CFRetain(kCFBooleanFalse);
+    case T_DATA:
+      if(rb_obj_is_kind_of(value, rb_cTime)){
+        return rb_create_cf_date(value);
+      }
+      if(rb_obj_is_kind_of(value, rb_cKeychainSecretBuffer)){
+        return rb_create_cf_value_from_secret(value, as_data);
+      }
+    default:
+      rb_raise(rb_eTypeError, "Can't convert value to cftype: %s", rb_obj_classname(value));
+  }
+  return NULL;
+}
+
+VALUE cf_release_on_raise(VALUE (*fn)(VALUE), VALUE arg, CFTypeRef owned){
+  int state = 0;
+  VALUE result = rb_protect(fn, arg, &state);
+  if(state){
+    if(owned){
+      CFRelease(owned);
+    }
+    rb_jump_tag(state);
+  }
+  return result;
+}
+
+VALUE cfstring_to_rb_string(CFStringRef s){
+  if(CFStringGetTypeID() != CFGetTypeID(s)){
+    rb_raise(rb_eTypeError, "Non cfstring passed to cfstring_to_rb_string");
+  }
+  const char * fastBuffer = CFStringGetCStringPtr(s, kCFStringEncodingUTF8);
+  if(fastBuffer){
+    return rb_utf8_str_new_cstr(fastBuffer);
+  }
+
+  CFIndex length = CFStringGetLength(s);
+  cf_scratch scratch = CF_SCRATCH_INIT;
+  CFIndex bufferLength = CFStringGetMaximumSizeForEncoding(length, kCFStringEncodingUTF8);
+  UInt8 *buffer = cf_scratch_reserve(&scratch, bufferLength);
+  CFIndex used = 0;
+  CFStringGetBytes(s, CFRangeMake(0, length), kCFStringEncodingUTF8, 0, false, buffer, bufferLength, &used);
+  VALUE rb_string = rb_utf8_str_new((const char*)buffer, used);
+  cf_scratch_release(&scratch);
+  return rb_string;
+}
+
+VALUE cf_value_to_rb_value(CFTypeRef value){
+  CFTypeID type = CFGetTypeID(value);
+
+  if(CFStringGetTypeID() == type){
+    return cfstring_to_rb_string((CFStringRef)value);
+  }
+  else if(CFDataGetTypeID() == type){
+    CFDataRef data = (CFDataRef)value;
+    return rb_str_new((const char*)CFDataGetBytePtr(data), CFDataGetLength(data));
+  }
+  else if(CFBooleanGetTypeID() == type){
+    return CFBooleanGetValue(value) ? Qtrue : Qfalse;
+  }
+  else if(CFNumberGetTypeID() == type){
+    if(CFNumberIsFloatType(value))
+    {
+      double doubleValue;
+      CFNumberGetValue(value, kCFNumberDoubleType, &doubleValue);
+      return rb_float_new(doubleValue);
+    }else{
+      long long longValue;
+      CFNumberGetValue(value, kCFNumberLongLongType, &longValue);
+      return LL2NUM(longValue);
+    }
+  }
+  else if (CFDateGetTypeID() == type){
+    double secondsSinceUnixEpoch = CFDateGetAbsoluteTime((CFDateRef)value) + kCFAbsoluteTimeIntervalSince1970;
+    double seconds = floor(secondsSinceUnixEpoch);
+    return rb_time_new((time_t)seconds, (long)((secondsSinceUnixEpoch - seconds) * 1000000));
+  }
+  return Qnil;
+}
+
+/* the header every CF object starts with, as a rough size for those whose layout is private */
+#define CF_OBJECT_SIZE (2 * sizeof(void*))
+
+static void add_dictionary_entry_memsize(const void *key, const void *value, void *context){
+  /* keys are the framework's constant strings, so only the slot for them counts */
+  *(size_t*)context += 2 * sizeof(void*) + cf_memsize(value);
+}
+
+size_t cf_memsize(CFTypeRef value){
+  if(!value){
+    return 0;
+  }
+  CFTypeID type = CFGetTypeID(value);
+  size_t size = CF_OBJECT_SIZE;
+  if(CFBooleanGetTypeID() == type){
+    return 0;
+  }
+  else if(CFStringGetTypeID() == type){
+    size += CFStringGetLength((CFStringRef)value);
+  }
+  else if(CFDataGetTypeID() == type){
+    size += CFDataGetLength((CFDataRef)value);
+  }
+  else if(CFNumberGetTypeID() == type || CFDateGetTypeID() == type){
+    size += sizeof(double);
+  }
+  else if(CFArrayGetTypeID() == type){
+    CFIndex count = CFArrayGetCount((CFArrayRef)value);
+    for(CFIndex i = 0; i < count; i++){
+      size += sizeof(void*) + cf_memsize(CFArrayGetValueAtIndex((CFArrayRef)value, i));
+    }
+  }
+  else if(CFDictionaryGetTypeID() == type){
+    CFDictionaryApplyFunction((CFDictionaryRef)value, add_dictionary_entry_memsize, &size);
+  }
+  return size;
+}
+
+#ifdef KEYCHAIN_BENCH_CONVERSIONS
+/*
+ * Keychain::Conversions exists for bench/cf_conversions.rb: it repeats a conversion in C so
+ * that the timings aren't swamped by the cost of calling a ruby method per conversion. It is
+ * only built with extconf.rb --enable-bench-conversions.
+ */
+
+/* Converts value to a CF type iterations times */
+static VALUE rb_conversions_to_cf(int argc, VALUE *argv, VALUE self){
+  VALUE value, iterations, as_data;
+  rb_scan_args(argc, argv, "21", &value, &iterations, &as_data);
+  long count = NUM2LONG(iterations);
+  for(long i = 0; i < count; i++){
+    CFRelease(rb_create_cf_value(value, RTEST(as_data)));
+  }
+  return Qnil;
+}
+
+struct conversions_from_cf_args {
+  CFTypeRef cf_value;
+  long count;
+};
+
+static VALUE conversions_from_cf(VALUE data){
+  struct conversions_from_cf_args *args = (struct conversions_from_cf_args*)data;
+  VALUE result = Qnil;
+  for(long i = 0; i < args->count; i++){
+    result = cf_value_to_rb_value(args->cf_value);
+  }
+  return result;
+}
+
+static VALUE conversions_release(VALUE data){
+  CFRelease(((struct conversions_from_cf_args*)data)->cf_value);
+  return Qnil;
+}
+
+/* Converts value to a CF type once, then back to ruby iterations times, returning the last conversion */
+static VALUE rb_conversions_from_cf(int argc, VALUE *argv, VALUE self){
+  VALUE value, iterations, as_data;
+  rb_scan_args(argc, argv, "21", &value, &iterations, &as_data);
+  struct conversions_from_cf_args args = {NULL, NUM2LONG(iterations)};
+  args.cf_value = rb_create_cf_value(value, RTEST(as_data));
+  return rb_ensure(conversions_from_cf, (VALUE)&args, conversions_release, (VALUE)&args);
+}
+#endif
+
+void Init_cf_conversions(VALUE rb_cKeychain){
+#ifdef KEYCHAIN_BENCH_CONVERSIONS
+  VALUE conversions = rb_define_module_under(rb_cKeychain, "Conversions");
+  rb_define_singleton_method(conversions, "to_cf", RUBY_METHOD_FUNC(rb_conversions_to_cf), -1);
+  rb_define_singleton_method(conversions, "from_cf", RUBY_METHOD_FUNC(rb_conversions_from_cf), -1);
+#endif
+}
@@ -0,0 +1,57 @@
+#ifndef KEYCHAIN_CF_CONVERSIONS_H
+#define KEYCHAIN_CF_CONVERSIONS_H
+
+/*
+ * Conversions between ruby objects and the CoreFoundation types the keychain
+ * uses: strings, data, numbers, dates and booleans.
+ *
+ * Strings that are already UTF-8 (or ASCII only) are handed to CoreFoundation
+ * as they are, without being transcoded or copied first. Conversions that need
+ * somewhere to put intermediate bytes use a cf_scratch buffer on the caller's
+ * stack, which only falls back to the heap for large values.
+ */
+
+#include "ruby.h"
+#ifdef KEYCHAIN_FILE_BACKEND
+#include "portable_cf.h"
+#else
+#include <CoreFoundation/CoreFoundation.h>
+#endif
+
+#define CF_SCRATCH_STACK_SIZE 256
+
+typedef struct {
+  char stack[CF_SCRATCH_STACK_SIZE];
+  VALUE heap; /* temporary buffer owned by the GC, so it isn't leaked if a conversion raises */
+} cf_scratch;
+
+#define CF_SCRATCH_INIT {{0}, 0}
+
+void *cf_scratch_reserve(cf_scratch *scratch, size_t size);
+void cf_scratch_release(cf_scratch *scratch);
+
+CFStringRef rb_create_cf_string(VALUE string);
+CFDataRef rb_create_cf_data(VALUE string);
+/* Strings become CFData if as_data is set, otherwise CFString. Raises TypeError for unsupported values */
+CFTypeRef rb_create_cf_value(VALUE value, int as_data);
+
+/*
+ * Returns fn(arg). If it raises, owned (which may be NULL) is released before the exception
+ * propagates, so a CF object being filled in from ruby values isn't leaked when one can't be
+ * converted.
+ */
+VALUE cf_release_on_raise(VALUE (*fn)(VALUE), VALUE arg, CFTypeRef owned);
+
+VALUE cfstring_to_rb_string(CFStringRef string);
+/* Returns nil for unsupported types */
+VALUE cf_value_to_rb_value(CFTypeRef value);
+
+/*
+ * An estimate of the memory value retains, including what it contains, for the dsize
+ * functions behind ObjectSpace.memsize_of. Objects shared with others are counted in full.
+ */
+size_t cf_memsize(CFTypeRef value);
+
+void Init_cf_conversions(VALUE rb_cKeychain);
+
+#endif
@@ -0,0 +1,397 @@
+#define _DEFAULT_SOURCE
+
+#include "events.h"
+#include "registry.h"
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include "ruby/thread.h"
+#else
+#define rb_thread_call_without_gvl(func, data, ubf, data2) (void*)rb_thread_blocking_region((rb_blocking_function_t*)(func), (data), (ubf), (data2))
+#endif
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Once this many events are waiting, new ones are dropped (and every cached status with them) */
+#define KEYCHAIN_EVENTS_MAX_QUEUED 10000
+#define KEYCHAIN_EVENTS_MASK (kSecLockEventMask | kSecUnlockEventMask | kSecAddEventMask | kSecUpdateEventMask | kSecDeleteEventMask)
+
+typedef struct keychain_event {
+  SecKeychainEvent type;
+  SecKeychainRef keychain; /* retained; NULL if the event didn't say */
+  pid_t pid;
+  struct keychain_event *next;
+} keychain_event;
+
+/*
+ * The queue and the flags below are guarded by queue_mutex. generation changes whenever
+ * events stop, so that a dispatcher thread left over from before knows to exit.
+ */
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;
+static keychain_event *queue_head = NULL;
+static keychain_event *queue_tail = NULL;
+static long queue_length = 0;
+static int dispatcher_interrupted = 0;
+static unsigned long generation = 0;
+
+/* Only used from the main ractor */
+static VALUE rb_cKeychainClass;
+static VALUE dispatcher = Qnil;
+static int listening = 0;
+/*
+ * Used from every ractor, so guarded by status_mutex. status_generations counts how often each
+ * keychain's cached status has been dropped, and statuses_forgotten how often every status has
+ * been: a status read before either changed may already be out of date, so isn't cached.
+ */
+static pthread_mutex_t status_mutex = PTHREAD_MUTEX_INITIALIZER;
+static CFMutableDictionaryRef status_cache = NULL;
+static CFMutableDictionaryRef status_generations = NULL;
+static unsigned long statuses_forgotten = 0;
+
+static void forget_all_statuses(void);
+
+/*
+ * Statuses are dropped here rather than when the event is delivered, so that they are never
+ * cached after a lock or unlock while the event waits behind slow subscribers.
+ */
+static OSStatus keychain_event_callback(SecKeychainEvent type, SecKeychainCallbackInfo *info, void *context){
+  if(info->keychain && (type == kSecLockEvent || type == kSecUnlockEvent)){
+    keychain_events_forget_status(info->keychain);
+  }
+  keychain_event *event = malloc(sizeof(keychain_event));
+  pthread_mutex_lock(&queue_mutex);
+  if(!event || queue_length == KEYCHAIN_EVENTS_MAX_QUEUED){
+    pthread_mutex_unlock(&queue_mutex);
+    free(event);
+    /* a lock or unlock without a keychain might have been missed */
+    forget_all_statuses();
+    return noErr;
+  }
+  event->type = type;
+  event->keychain = info->keychain ? (SecKeychainRef)CFRetain(info->keychain) : NULL;
+  event->pid = info->pid;
+  event->next = NULL;
+  if(queue_tail){
+    queue_tail->next = event;
+  }else{
+    queue_head = event;
+  }
+  queue_tail = event;
+  queue_length++;
+  pthread_cond_signal(&queue_changed);
+  pthread_mutex_unlock(&queue_mutex);
+  return noErr;
+}
+
+static void free_event(keychain_event *event){
+  if(event->keychain){
+    CFRelease(event->keychain);
+  }
+  free(event);
+}
+
+#ifdef KEYCHAIN_FILE_BACKEND
+
+/* The file backend calls callbacks on whichever thread made the change */
+static OSStatus start_listener(void){
+  return SecKeychainAddCallback(keychain_event_callback, KEYCHAIN_EVENTS_MASK, NULL);
+}
+
+static void stop_listener(void){
+  SecKeychainRemoveCallback(keychain_event_callback);
+}
+
+#else
+
+/*
+ * Security calls callbacks on the run loop of the thread that added them, so a native thread
+ * adds the callback and runs a run loop until events stop.
+ */
+static pthread_t listener_thread;
+static CFRunLoopRef listener_run_loop;
+static OSStatus listener_status;
+static int listener_started;
+static int listener_stopping;
+
+static void keep_run_loop_alive(CFRunLoopTimerRef timer, void *info){
+}
+
+static void *listener_main(void *unused){
+  OSStatus status = SecKeychainAddCallback(keychain_event_callback, KEYCHAIN_EVENTS_MASK, NULL);
+  pthread_mutex_lock(&queue_mutex);
+  listener_run_loop = CFRunLoopGetCurrent();
+  listener_status = status;
+  listener_started = 1;
+  pthread_cond_broadcast(&queue_changed);
+  pthread_mutex_unlock(&queue_mutex);
+  if(status != noErr){
+    return NULL;
+  }
+
+  /* without a timer the run loop returns at once if no notification source has been added yet */
+  CFRunLoopTimerRef timer = CFRunLoopTimerCreate(NULL, CFAbsoluteTimeGetCurrent() + 1e10, 1e10, 0, 0, keep_run_loop_alive, NULL);
+  CFRunLoopAddTimer(listener_run_loop, timer, kCFRunLoopDefaultMode);
+  for(;;){
+    pthread_mutex_lock(&queue_mutex);
+    int stopping = listener_stopping;
+    pthread_mutex_unlock(&queue_mutex);
+    if(stopping){
+      break;
+    }
+    /* a stop requested just before this call is noticed within a second */
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 1.0, false);
+  }
+  CFRunLoopRemoveTimer(listener_run_loop, timer, kCFRunLoopDefaultMode);
+  CFRelease(timer);
+  SecKeychainRemoveCallback(keychain_event_callback);
+  return NULL;
+}
+
+static OSStatus start_listener(void){
+  listener_started = 0;
+  listener_stopping = 0;
+  if(pthread_create(&listener_thread, NULL, listener_main, NULL) != 0){
+    return errSecAllocate;
+  }
+  pthread_mutex_lock(&queue_mutex);
+  while(!listener_started){
+    pthread_cond_wait(&queue_changed, &queue_mutex);
+  }
+  OSStatus status = listener_status;
+  pthread_mutex_unlock(&queue_mutex);
+  if(status != noErr){
+    pthread_join(listener_thread, NULL);
+  }
+  return status;
+}
+
+static void *join_listener(void *unused){
+  pthread_join(listener_thread, NULL);
+  return NULL;
+}
+
+static void stop_listener(void){
+  pthread_mutex_lock(&queue_mutex);
+  listener_stopping = 1;
+  pthread_mutex_unlock(&queue_mutex);
+  CFRunLoopStop(listener_run_loop);
+  rb_thread_call_without_gvl(join_listener, NULL, NULL, NULL);
+}
+
+#endif
+
+int keychain_events_cached_status(SecKeychainRef keychain, SecKeychainStatus *status){
+  pthread_mutex_lock(&status_mutex);
+  CFNumberRef cached = status_cache ? CFDictionaryGetValue(status_cache, keychain) : NULL;
+  int found = cached && CFNumberGetValue(cached, kCFNumberSInt32Type, status);
+  pthread_mutex_unlock(&status_mutex);
+  return found;
+}
+
+/* The number of times keychain's status has been dropped. Called with status_mutex held */
+static long keychain_status_drops(SecKeychainRef keychain){
+  long drops = 0;
+  CFNumberRef value = status_generations ? CFDictionaryGetValue(status_generations, keychain) : NULL;
+  if(value){
+    CFNumberGetValue(value, kCFNumberLongType, &drops);
+  }
+  return drops;
+}
+
+/* Called with status_mutex held */
+static unsigned long status_generation(SecKeychainRef keychain){
+  return (unsigned long)keychain_status_drops(keychain) + statuses_forgotten;
+}
+
+unsigned long keychain_events_status_generation(SecKeychainRef keychain){
+  pthread_mutex_lock(&status_mutex);
+  unsigned long generation = status_generation(keychain);
+  pthread_mutex_unlock(&status_mutex);
+  return generation;
+}
+
+void keychain_events_cache_status(SecKeychainRef keychain, SecKeychainStatus status, unsigned long generation){
+  pthread_mutex_lock(&status_mutex);
+  if(status_cache && status_generation(keychain) == generation){
+    CFNumberRef value = CFNumberCreate(NULL, kCFNumberSInt32Type, &status);
+    CFDictionarySetValue(status_cache, keychain, value);
+    CFRelease(value);
+  }
+  pthread_mutex_unlock(&status_mutex);
+}
+
+void keychain_events_forget_status(SecKeychainRef keychain){
+  pthread_mutex_lock(&status_mutex);
+  if(status_cache){
+    CFDictionaryRemoveValue(status_cache, keychain);
+    if(!status_generations){
+      status_generations = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    }
+    long drops = keychain_status_drops(keychain) + 1;
+    CFNumberRef value = CFNumberCreate(NULL, kCFNumberLongType, &drops);
+    CFDictionarySetValue(status_generations, keychain, value);
+    CFRelease(value);
+  }
+  pthread_mutex_unlock(&status_mutex);
+}
+
+static void forget_all_statuses(void){
+  pthread_mutex_lock(&status_mutex);
+  statuses_forgotten++;
+  if(status_cache){
+    CFDictionaryRemoveAllValues(status_cache);
+  }
+  pthread_mutex_unlock(&status_mutex);
+}
+
+static VALUE event_name(SecKeychainEvent type){
+  switch(type){
+    case kSecLockEvent: return ID2SYM(rb_intern("lock"));
+    case kSecUnlockEvent: return ID2SYM(rb_intern("unlock"));
+    case kSecAddEvent: return ID2SYM(rb_intern("add"));
+    case kSecUpdateEvent: return ID2SYM(rb_intern("update"));
+    case kSecDeleteEvent: return ID2SYM(rb_intern("delete"));
+  }
+  return Qnil;
+}
+
+static VALUE deliver_event(VALUE data){
+  keychain_event *event = (keychain_event*)data;
+  VALUE name = event_name(event->type);
+  if(NIL_P(name)){
+    return Qnil;
+  }
+  VALUE keychain = Qnil;
+  if(event->keychain){
+    keychain = keychain_registry_wrap((SecKeychainRef)CFRetain(event->keychain));
+  }
+  return rb_funcall(rb_cKeychainClass, rb_intern("deliver_event"), 3, name, keychain, INT2NUM(event->pid));
+}
+
+static void *wait_for_event(void *data){
+  unsigned long dispatcher_generation = *(unsigned long*)data;
+  pthread_mutex_lock(&queue_mutex);
+  while(!queue_head && !dispatcher_interrupted && generation == dispatcher_generation){
+    pthread_cond_wait(&queue_changed, &queue_mutex);
+  }
+  dispatcher_interrupted = 0;
+  pthread_mutex_unlock(&queue_mutex);
+  return NULL;
+}
+
+static void interrupt_wait(void *unused){
+  pthread_mutex_lock(&queue_mutex);
+  dispatcher_interrupted = 1;
+  pthread_cond_broadcast(&queue_changed);
+  pthread_mutex_unlock(&queue_mutex);
+}
+
+/* The body of the dispatcher thread. Events are taken off the queue one at a time, with the GVL */
+static VALUE dispatch_events(void *data){
+  unsigned long dispatcher_generation = (unsigned long)data;
+  for(;;){
+    rb_thread_call_without_gvl(wait_for_event, &dispatcher_generation, interrupt_wait, NULL);
+
+    pthread_mutex_lock(&queue_mutex);
+    if(generation != dispatcher_generation){
+      pthread_mutex_unlock(&queue_mutex);
+      break;
+    }
+    keychain_event *event = queue_head;
+    if(event){
+      queue_head = event->next;
+      if(!queue_head){
+        queue_tail = NULL;
+      }
+      queue_length--;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+
+    if(!event){
+      continue;
+    }
+    int state = 0;
+    rb_protect(deliver_event, (VALUE)event, &state);
+    free_event(event);
+    if(state){
+      if(!rb_obj_is_kind_of(rb_errinfo(), rb_eException)){
+        rb_jump_tag(state); /* Thread#kill */
+      }
+      rb_warn("Keychain event delivery raised %"PRIsVALUE, rb_errinfo());
+      rb_set_errinfo(Qnil);
+    }
+  }
+  return Qnil;
+}
+
+static void discard_queued_events(void){
+  pthread_mutex_lock(&queue_mutex);
+  keychain_event *event = queue_head;
+  queue_head = queue_tail = NULL;
+  queue_length = 0;
+  generation++;
+  pthread_cond_broadcast(&queue_changed);
+  pthread_mutex_unlock(&queue_mutex);
+  while(event){
+    keychain_event *next = event->next;
+    free_event(event);
+    event = next;
+  }
+}
+
+/* Keychain.start_events - starts receiving events, if it hasn't already. Called by Keychain.subscribe */
+static VALUE rb_keychain_start_events(VALUE self){
+  keychain_check_main_ractor("keychain events");
+  if(listening){
+    return Qfalse;
+  }
+  OSStatus status = start_listener();
+  if(status != noErr){
+    VALUE message = rb_sprintf("couldn't add the keychain callback (OSStatus %d)", (int)status);
+    rb_exc_raise(rb_funcall(rb_const_get(rb_cKeychainClass, rb_intern("Error")), rb_intern("new"), 2, message, INT2NUM(status)));
+  }
+  listening = 1;
+  pthread_mutex_lock(&status_mutex);
+  /* changes made while events weren't being received weren't seen */
+  statuses_forgotten++;
+  status_cache = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  pthread_mutex_unlock(&status_mutex);
+  pthread_mutex_lock(&queue_mutex);
+  unsigned long dispatcher_generation = generation;
+  pthread_mutex_unlock(&queue_mutex);
+  dispatcher = rb_thread_create(dispatch_events, (void*)dispatcher_generation);
+  rb_funcall(dispatcher, rb_intern("name="), 1, rb_str_new_cstr("keychain events"));
+  return Qtrue;
+}
+
+/*
+ * Keychain.stop_events - stops receiving events and discards those not yet delivered. The
+ * dispatcher thread exits once it has delivered the event it is delivering, if any.
+ */
+static VALUE rb_keychain_stop_events(VALUE self){
+  keychain_check_main_ractor("keychain events");
+  if(!listening){
+    return Qfalse;
+  }
+  stop_listener();
+  listening = 0;
+  pthread_mutex_lock(&status_mutex);
+  CFRelease(status_cache);
+  status_cache = NULL;
+  pthread_mutex_unlock(&status_mutex);
+  discard_queued_events();
+  dispatcher = Qnil;
+  return Qtrue;
+}
+
+static VALUE rb_keychain_receiving_events(VALUE self){
+  return listening ? Qtrue : Qfalse;
+}
+
+void Init_keychain_events(VALUE rb_cKeychain){
+  rb_cKeychainClass = rb_cKeychain;
+  rb_gc_register_address(&dispatcher);
+  rb_define_singleton_method(rb_cKeychain, "start_events", RUBY_METHOD_FUNC(rb_keychain_start_events), 0);
+  rb_define_singleton_method(rb_cKeychain, "stop_events", RUBY_METHOD_FUNC(rb_keychain_stop_events), 0);
+  rb_define_singleton_method(rb_cKeychain, "receiving_events?", RUBY_METHOD_FUNC(rb_keychain_receiving_events), 0);
+}
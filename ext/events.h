@@ -0,0 +1,39 @@
+#ifndef KEYCHAIN_EVENTS_H
+#define KEYCHAIN_EVENTS_H
+
+/*
+ * Keychain change notifications (lock, unlock, add, update and delete) for
+ * Keychain.subscribe and Keychain#on.
+ *
+ * The Security callback only copies each event onto a queue, so securityd is
+ * never kept waiting on ruby. A ruby thread takes events off the queue and
+ * passes them to Keychain.deliver_event. That thread, and the subscriptions,
+ * belong to the main ractor.
+ *
+ * While events are being received, keychain statuses are cached. Each cached
+ * status is dropped as soon as the callback sees its keychain locked or unlocked, so that
+ * Keychain#locked? and friends rarely need to make a call.
+ */
+
+#include "ruby.h"
+#ifdef KEYCHAIN_FILE_BACKEND
+#include "file_keychain.h"
+#else
+#include <Security/Security.h>
+#endif
+
+/* Sets status to the cached status of keychain, returning 0 if there isn't one */
+int keychain_events_cached_status(SecKeychainRef keychain, SecKeychainStatus *status);
+/* Changes whenever the cached status of keychain is dropped. Read before fetching the status */
+unsigned long keychain_events_status_generation(SecKeychainRef keychain);
+/*
+ * Caches the status of keychain, if events are being received and it hasn't been dropped since
+ * generation was read
+ */
+void keychain_events_cache_status(SecKeychainRef keychain, SecKeychainStatus status, unsigned long generation);
+/* Drops the cached status of keychain, when it is locked, unlocked or deleted */
+void keychain_events_forget_status(SecKeychainRef keychain);
+
+void Init_keychain_events(VALUE rb_cKeychain);
+
+#endif
@@ -1,4 +1,32 @@
 require 'mkmf'
 $CFLAGS << ' -std=c99'
-$DLDFLAGS << ' -framework Security -framework CoreFoundation'
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_func('rb_str_to_interned_str', 'ruby.h')
+have_func('rb_enc_interned_str', 'ruby.h')
+have_func('rb_gc_mark_movable', 'ruby.h')
+have_func('rb_ext_ractor_safe', 'ruby.h')
+
+# Security.framework is used on OS X. Elsewhere (or with --with-file-backend)
+# the extension is built against the file backed keychain in file_keychain.c
+if RUBY_PLATFORM =~ /darwin/ && !with_config('file-backend')
+  $DLDFLAGS << ' -framework Security -framework CoreFoundation'
+else
+  unless have_header('openssl/evp.h') && have_library('crypto', 'EVP_EncryptInit_ex')
+    abort 'libcrypto (OpenSSL) is required to build the file backed keychain'
+  end
+  have_library('pthread')
+  $defs << '-DKEYCHAIN_FILE_BACKEND'
+end
+
+# --enable-bench-conversions adds Keychain::Conversions, which only bench/cf_conversions.rb
+# uses (rake bench_conversions builds it this way)
+if enable_config('bench-conversions')
+  $defs << '-DKEYCHAIN_BENCH_CONVERSIONS'
+end
+
+# --with-sanitizer=address instruments the extension, for spec/leak_check.rb (rake leaks)
+if (sanitizer = with_config('sanitizer'))
+  $CFLAGS << " -fsanitize=#{sanitizer} -fno-omit-frame-pointer -g"
+  $LDFLAGS << " -fsanitize=#{sanitizer}"
+end
 create_makefile('keychain', 'ext')
@@ -0,0 +1,2511 @@
+#ifdef KEYCHAIN_FILE_BACKEND
+
+#define _DEFAULT_SOURCE
+#define _DARWIN_C_SOURCE
+
+#include "file_keychain.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+#define KC_CONST_STRING(name, literal) \
+  static struct __CFString name##Storage = KCF_CONST_STRING_INITIALIZER(literal); \
+  const CFStringRef name = &name##Storage;
+
+KC_CONST_STRING(kSecClass, "class")
+KC_CONST_STRING(kSecClassGenericPassword, "genp")
+KC_CONST_STRING(kSecClassInternetPassword, "inet")
+
+KC_CONST_STRING(kSecAttrCreationDate, "cdat")
+KC_CONST_STRING(kSecAttrModificationDate, "mdat")
+KC_CONST_STRING(kSecAttrDescription, "desc")
+KC_CONST_STRING(kSecAttrComment, "icmt")
+KC_CONST_STRING(kSecAttrAccount, "acct")
+KC_CONST_STRING(kSecAttrService, "svce")
+KC_CONST_STRING(kSecAttrGeneric, "gena")
+KC_CONST_STRING(kSecAttrServer, "srvr")
+KC_CONST_STRING(kSecAttrPort, "port")
+KC_CONST_STRING(kSecAttrSecurityDomain, "sdmn")
+KC_CONST_STRING(kSecAttrIsNegative, "nega")
+KC_CONST_STRING(kSecAttrIsInvisible, "invi")
+KC_CONST_STRING(kSecAttrLabel, "labl")
+KC_CONST_STRING(kSecAttrPath, "path")
+KC_CONST_STRING(kSecAttrProtocol, "ptcl")
+KC_CONST_STRING(kSecAttrAuthenticationType, "atyp")
+
+KC_CONST_STRING(kSecValueData, "v_Data")
+KC_CONST_STRING(kSecValueRef, "v_Ref")
+
+KC_CONST_STRING(kSecReturnAttributes, "r_Attributes")
+KC_CONST_STRING(kSecReturnRef, "r_Ref")
+KC_CONST_STRING(kSecReturnData, "r_Data")
+
+KC_CONST_STRING(kSecMatchLimit, "m_Limit")
+KC_CONST_STRING(kSecMatchLimitOne, "m_LimitOne")
+KC_CONST_STRING(kSecMatchLimitAll, "m_LimitAll")
+KC_CONST_STRING(kSecMatchSearchList, "m_SearchList")
+KC_CONST_STRING(kSecMatchItemList, "m_ItemList")
+
+KC_CONST_STRING(kSecUseKeychain, "u_Keychain")
+
+/* File format. All integers are little endian.
+ *
+ * header (KC_HEADER_SIZE bytes)
+ *   0   magic "RKCHAIN1"
+ *   8   u32 format version
+ *   12  u32 key derivation iterations
+ *   16  salt[16]
+ *   32  password verifier[32]
+ *   64  u32 lock interval
+ *   68  u8 lock on sleep, 3 bytes padding
+ *   72  u64 next item id
+ *   80  u32 item count
+ *   84  u32 index entry count
+ *   88  u64 records offset
+ *   96  u64 records size
+ *   104 u64 index offset
+ *   112 u64 id table offset
+ *   120 reserved
+ *
+ * record
+ *   u32 record length, u32 class, u64 id, u32 attribute count,
+ *   attributes: u8 key length, key, u8 value type, u32 value length, value
+ *   u32 secret length, secret (nonce | ciphertext | tag)
+ *
+ * index entry: u32 hash of (field, class, value), u32 field, u64 record offset
+ *   sorted by hash then offset
+ * id table entry: u64 item id, u64 record offset, sorted by id
+ */
+#define KC_MAGIC "RKCHAIN1"
+#define KC_FORMAT_VERSION 1
+#define KC_HEADER_SIZE 128
+#define KC_KDF_ITERATIONS 20000
+#define KC_SALT_SIZE 16
+#define KC_KEY_SIZE 32
+#define KC_VERIFIER_SIZE 32
+#define KC_NONCE_SIZE 12
+#define KC_TAG_SIZE 16
+#define KC_INDEX_ENTRY_SIZE 16
+#define KC_ID_ENTRY_SIZE 16
+#define KC_RECORD_FIXED_SIZE 24
+
+enum {
+  KC_VALUE_STRING = 1,
+  KC_VALUE_DATA,
+  KC_VALUE_INTEGER,
+  KC_VALUE_REAL,
+  KC_VALUE_BOOLEAN,
+  KC_VALUE_DATE
+};
+
+enum {
+  KC_INDEX_CLASS = 0,
+  KC_INDEX_SERVICE,
+  KC_INDEX_ACCOUNT,
+  KC_INDEX_SERVER,
+  KC_INDEX_FIELD_COUNT
+};
+
+typedef struct {
+  UInt32 iterations;
+  UInt8 salt[KC_SALT_SIZE];
+  UInt8 verifier[KC_VERIFIER_SIZE];
+  UInt32 lock_interval;
+  Boolean lock_on_sleep;
+  UInt64 next_id;
+  UInt32 item_count;
+  UInt32 index_count;
+  UInt64 records_offset;
+  UInt64 records_size;
+  UInt64 index_offset;
+  UInt64 ids_offset;
+} kc_header;
+
+typedef struct kc_store {
+  struct kc_store *next;
+  char *path;
+  pthread_mutex_t mutex;
+  Boolean unlocked;
+  Boolean tried_empty_password;
+  UInt8 key[KC_KEY_SIZE];
+  const UInt8 *map;
+  size_t map_size;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  kc_header header;
+} kc_store;
+
+struct OpaqueSecKeychainRef {
+  KCFRuntimeBase base;
+  kc_store *store;
+};
+
+struct OpaqueSecKeychainItemRef {
+  KCFRuntimeBase base;
+  SecKeychainRef keychain;
+  UInt64 id;
+  FourCharCode cls;
+};
+
+typedef struct {
+  const UInt8 *bytes;
+  UInt32 length;
+  UInt64 offset;
+  FourCharCode cls;
+  UInt64 id;
+  UInt32 attr_count;
+  const UInt8 *attrs;
+  const UInt8 *attrs_end;
+  const UInt8 *secret;
+  UInt32 secret_length;
+} kc_record;
+
+typedef struct {
+  const UInt8 *key;
+  UInt8 key_length;
+  UInt8 type;
+  const UInt8 *value;
+  UInt32 value_length;
+} kc_attr;
+
+typedef struct {
+  UInt8 *bytes;
+  size_t length;
+  size_t capacity;
+} kc_buf;
+
+typedef struct {
+  FourCharCode cls;
+  CFIndex condition_count;
+  CFStringRef *condition_keys;
+  CFTypeRef *condition_values;
+  CFArrayRef item_list;
+  CFIndex limit; /* -1 for all */
+  Boolean limit_one;
+  Boolean return_attributes;
+  Boolean return_ref;
+  Boolean return_data;
+} kc_query;
+
+static pthread_once_t kc_init_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t kc_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static kc_store *kc_stores = NULL;
+static kc_store **kc_search_list = NULL;
+static size_t kc_search_list_count = 0;
+static kc_store *kc_default = NULL;
+static CFTypeID kc_keychain_type_id;
+static CFTypeID kc_item_type_id;
+static long kc_simulated_latency_usec = 0;
+
+/* Little endian helpers */
+
+static UInt32 kc_get_u32(const UInt8 *p){
+  return (UInt32)p[0] | ((UInt32)p[1] << 8) | ((UInt32)p[2] << 16) | ((UInt32)p[3] << 24);
+}
+
+static UInt64 kc_get_u64(const UInt8 *p){
+  return (UInt64)kc_get_u32(p) | ((UInt64)kc_get_u32(p + 4) << 32);
+}
+
+static void kc_put_u32(UInt8 *p, UInt32 value){
+  p[0] = (UInt8)value;
+  p[1] = (UInt8)(value >> 8);
+  p[2] = (UInt8)(value >> 16);
+  p[3] = (UInt8)(value >> 24);
+}
+
+static void kc_put_u64(UInt8 *p, UInt64 value){
+  kc_put_u32(p, (UInt32)value);
+  kc_put_u32(p + 4, (UInt32)(value >> 32));
+}
+
+/* Growable byte buffers */
+
+static void kc_buf_reserve(kc_buf *buf, size_t extra){
+  if(buf->length + extra <= buf->capacity){
+    return;
+  }
+  size_t capacity = buf->capacity ? buf->capacity : 256;
+  while(capacity < buf->length + extra){
+    capacity *= 2;
+  }
+  UInt8 *bytes = realloc(buf->bytes, capacity);
+  if(!bytes){
+    abort();
+  }
+  buf->bytes = bytes;
+  buf->capacity = capacity;
+}
+
+static void kc_buf_append(kc_buf *buf, const void *bytes, size_t length){
+  kc_buf_reserve(buf, length);
+  if(length){
+    memcpy(buf->bytes + buf->length, bytes, length);
+  }
+  buf->length += length;
+}
+
+static void kc_buf_append_u8(kc_buf *buf, UInt8 value){
+  kc_buf_append(buf, &value, 1);
+}
+
+static void kc_buf_append_u32(kc_buf *buf, UInt32 value){
+  kc_buf_reserve(buf, 4);
+  kc_put_u32(buf->bytes + buf->length, value);
+  buf->length += 4;
+}
+
+static void kc_buf_append_u64(kc_buf *buf, UInt64 value){
+  kc_buf_reserve(buf, 8);
+  kc_put_u64(buf->bytes + buf->length, value);
+  buf->length += 8;
+}
+
+static void kc_buf_free(kc_buf *buf){
+  free(buf->bytes);
+  buf->bytes = NULL;
+  buf->length = buf->capacity = 0;
+}
+
+static const char *kc_string_bytes(CFStringRef string, size_t *length){
+  *length = string->byte_length;
+  return string->bytes;
+}
+
+/* Item classes */
+
+static FourCharCode kc_class_from_string(CFTypeRef value){
+  if(!value || CFGetTypeID(value) != CFStringGetTypeID() || ((CFStringRef)value)->byte_length != 4){
+    return 0;
+  }
+  size_t length;
+  const UInt8 *bytes = (const UInt8*)kc_string_bytes(value, &length);
+  FourCharCode cls = KCF_FOURCC(bytes[0], bytes[1], bytes[2], bytes[3]);
+  if(cls != kSecGenericPasswordItemClass && cls != kSecInternetPasswordItemClass){
+    return 0;
+  }
+  return cls;
+}
+
+static CFStringRef kc_class_string(FourCharCode cls){
+  return cls == kSecInternetPasswordItemClass ? kSecClassInternetPassword : kSecClassGenericPassword;
+}
+
+/* Attributes which determine whether two items are duplicates */
+static CFIndex kc_primary_key(FourCharCode cls, CFStringRef keys[7]){
+  if(cls == kSecInternetPasswordItemClass){
+    keys[0] = kSecAttrAccount;
+    keys[1] = kSecAttrSecurityDomain;
+    keys[2] = kSecAttrServer;
+    keys[3] = kSecAttrProtocol;
+    keys[4] = kSecAttrAuthenticationType;
+    keys[5] = kSecAttrPort;
+    keys[6] = kSecAttrPath;
+    return 7;
+  }
+  keys[0] = kSecAttrAccount;
+  keys[1] = kSecAttrService;
+  return 2;
+}
+
+/* Keys in a query or attribute dictionary that aren't item attributes */
+static Boolean kc_is_attribute_key(CFTypeRef key){
+  if(CFGetTypeID(key) != CFStringGetTypeID() || CFEqual(key, kSecClass)){
+    return false;
+  }
+  size_t length;
+  const char *bytes = kc_string_bytes(key, &length);
+  if(length == 0 || length > 255){
+    return false;
+  }
+  if(length > 2 && bytes[1] == '_' && (bytes[0] == 'm' || bytes[0] == 'r' || bytes[0] == 'u' || bytes[0] == 'v')){
+    return false;
+  }
+  return true;
+}
+
+static int kc_index_field(const UInt8 *key, size_t key_length){
+  if(key_length != 4){
+    return -1;
+  }
+  if(!memcmp(key, "svce", 4)){
+    return KC_INDEX_SERVICE;
+  }
+  if(!memcmp(key, "acct", 4)){
+    return KC_INDEX_ACCOUNT;
+  }
+  if(!memcmp(key, "srvr", 4)){
+    return KC_INDEX_SERVER;
+  }
+  return -1;
+}
+
+static UInt32 kc_index_hash(int field, FourCharCode cls, const UInt8 *value, size_t length){
+  UInt64 hash = 14695981039346656037ULL;
+  UInt8 prefix[5] = {(UInt8)field, (UInt8)(cls >> 24), (UInt8)(cls >> 16), (UInt8)(cls >> 8), (UInt8)cls};
+  for(size_t i = 0; i < sizeof(prefix); i++){
+    hash ^= prefix[i];
+    hash *= 1099511628211ULL;
+  }
+  for(size_t i = 0; i < length; i++){
+    hash ^= value[i];
+    hash *= 1099511628211ULL;
+  }
+  return (UInt32)(hash ^ (hash >> 32));
+}
+
+/* Attribute values */
+
+static const UInt8 *kc_attr_read(const UInt8 *cursor, const UInt8 *end, kc_attr *attr){
+  if(cursor >= end){
+    return NULL;
+  }
+  attr->key_length = cursor[0];
+  cursor++;
+  if((size_t)(end - cursor) < (size_t)attr->key_length + 5){
+    return NULL;
+  }
+  attr->key = cursor;
+  cursor += attr->key_length;
+  attr->type = cursor[0];
+  attr->value_length = kc_get_u32(cursor + 1);
+  cursor += 5;
+  if((size_t)(end - cursor) < attr->value_length){
+    return NULL;
+  }
+  attr->value = cursor;
+  return cursor + attr->value_length;
+}
+
+static double kc_get_double(const UInt8 *p){
+  UInt64 bits = kc_get_u64(p);
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static void kc_buf_append_double(kc_buf *buf, double value){
+  UInt64 bits;
+  memcpy(&bits, &value, sizeof(bits));
+  kc_buf_append_u64(buf, bits);
+}
+
+static CFTypeRef kc_attr_copy_value(const kc_attr *attr){
+  switch(attr->type){
+    case KC_VALUE_STRING:
+      return CFStringCreateWithBytes(NULL, attr->value, attr->value_length, kCFStringEncodingUTF8, false);
+    case KC_VALUE_DATA:
+      return CFDataCreate(NULL, attr->value, attr->value_length);
+    case KC_VALUE_INTEGER:
+      if(attr->value_length == 8){
+        long long value = (long long)kc_get_u64(attr->value);
+        return CFNumberCreate(NULL, kCFNumberLongLongType, &value);
+      }
+      break;
+    case KC_VALUE_REAL:
+      if(attr->value_length == 8){
+        double value = kc_get_double(attr->value);
+        return CFNumberCreate(NULL, kCFNumberDoubleType, &value);
+      }
+      break;
+    case KC_VALUE_BOOLEAN:
+      if(attr->value_length == 1){
+        return attr->value[0] ? kCFBooleanTrue : kCFBooleanFalse;
+      }
+      break;
+    case KC_VALUE_DATE:
+      if(attr->value_length == 8){
+        return CFDateCreate(NULL, kc_get_double(attr->value));
+      }
+      break;
+  }
+  return NULL;
+}
+
+static Boolean kc_attr_equals(const kc_attr *attr, CFTypeRef value){
+  CFTypeID type = CFGetTypeID(value);
+  if(type == CFStringGetTypeID()){
+    size_t length;
+    const char *bytes = kc_string_bytes(value, &length);
+    return attr->type == KC_VALUE_STRING && attr->value_length == length && !memcmp(attr->value, bytes, length);
+  }
+  if(type == CFDataGetTypeID()){
+    CFIndex length = CFDataGetLength(value);
+    return attr->type == KC_VALUE_DATA && attr->value_length == (UInt32)length && !memcmp(attr->value, CFDataGetBytePtr(value), length);
+  }
+  if(type == CFBooleanGetTypeID()){
+    return attr->type == KC_VALUE_BOOLEAN && attr->value_length == 1 && !attr->value[0] == !CFBooleanGetValue(value);
+  }
+  if(type == CFNumberGetTypeID()){
+    if(attr->value_length != 8){
+      return false;
+    }
+    if(attr->type == KC_VALUE_INTEGER){
+      long long stored = (long long)kc_get_u64(attr->value);
+      long long wanted;
+      return CFNumberGetValue(value, kCFNumberLongLongType, &wanted) && stored == wanted;
+    }
+    if(attr->type == KC_VALUE_REAL){
+      double wanted;
+      CFNumberGetValue(value, kCFNumberDoubleType, &wanted);
+      return kc_get_double(attr->value) == wanted;
+    }
+    return false;
+  }
+  if(type == CFDateGetTypeID()){
+    return attr->type == KC_VALUE_DATE && attr->value_length == 8 && kc_get_double(attr->value) == CFDateGetAbsoluteTime(value);
+  }
+  return false;
+}
+
+static Boolean kc_buf_append_attr(kc_buf *buf, CFStringRef key, CFTypeRef value){
+  CFTypeID type = CFGetTypeID(value);
+  size_t key_length;
+  const char *key_bytes = kc_string_bytes(key, &key_length);
+  if(key_length == 0 || key_length > 255){
+    return false;
+  }
+  if(type != CFStringGetTypeID() && type != CFDataGetTypeID() && type != CFBooleanGetTypeID() &&
+     type != CFNumberGetTypeID() && type != CFDateGetTypeID()){
+    return false;
+  }
+  kc_buf_append_u8(buf, (UInt8)key_length);
+  kc_buf_append(buf, key_bytes, key_length);
+  if(type == CFStringGetTypeID()){
+    size_t length;
+    const char *bytes = kc_string_bytes(value, &length);
+    kc_buf_append_u8(buf, KC_VALUE_STRING);
+    kc_buf_append_u32(buf, (UInt32)length);
+    kc_buf_append(buf, bytes, length);
+  }else if(type == CFDataGetTypeID()){
+    kc_buf_append_u8(buf, KC_VALUE_DATA);
+    kc_buf_append_u32(buf, (UInt32)CFDataGetLength(value));
+    kc_buf_append(buf, CFDataGetBytePtr(value), CFDataGetLength(value));
+  }else if(type == CFBooleanGetTypeID()){
+    kc_buf_append_u8(buf, KC_VALUE_BOOLEAN);
+    kc_buf_append_u32(buf, 1);
+    kc_buf_append_u8(buf, CFBooleanGetValue(value) ? 1 : 0);
+  }else if(type == CFNumberGetTypeID()){
+    if(CFNumberIsFloatType(value)){
+      double real;
+      CFNumberGetValue(value, kCFNumberDoubleType, &real);
+      kc_buf_append_u8(buf, KC_VALUE_REAL);
+      kc_buf_append_u32(buf, 8);
+      kc_buf_append_double(buf, real);
+    }else{
+      long long integer;
+      CFNumberGetValue(value, kCFNumberLongLongType, &integer);
+      kc_buf_append_u8(buf, KC_VALUE_INTEGER);
+      kc_buf_append_u32(buf, 8);
+      kc_buf_append_u64(buf, (UInt64)integer);
+    }
+  }else{
+    kc_buf_append_u8(buf, KC_VALUE_DATE);
+    kc_buf_append_u32(buf, 8);
+    kc_buf_append_double(buf, CFDateGetAbsoluteTime(value));
+  }
+  return true;
+}
+
+/* Records */
+
+static Boolean kc_record_parse(const UInt8 *bytes, size_t available, UInt64 offset, kc_record *record){
+  if(available < KC_RECORD_FIXED_SIZE){
+    return false;
+  }
+  record->length = kc_get_u32(bytes);
+  if(record->length < KC_RECORD_FIXED_SIZE || record->length > available){
+    return false;
+  }
+  const UInt8 *end = bytes + record->length;
+  record->bytes = bytes;
+  record->offset = offset;
+  record->cls = kc_get_u32(bytes + 4);
+  record->id = kc_get_u64(bytes + 8);
+  record->attr_count = kc_get_u32(bytes + 16);
+  record->attrs = bytes + 20;
+
+  const UInt8 *cursor = record->attrs;
+  for(UInt32 i = 0; i < record->attr_count; i++){
+    kc_attr attr;
+    cursor = kc_attr_read(cursor, end - 4, &attr);
+    if(!cursor){
+      return false;
+    }
+  }
+  record->attrs_end = cursor;
+  record->secret_length = kc_get_u32(cursor);
+  record->secret = cursor + 4;
+  return (size_t)(end - record->secret) == record->secret_length;
+}
+
+static Boolean kc_record_find_attr(const kc_record *record, CFStringRef key, kc_attr *attr){
+  size_t key_length;
+  const char *key_bytes = kc_string_bytes(key, &key_length);
+  const UInt8 *cursor = record->attrs;
+  while((cursor = kc_attr_read(cursor, record->attrs_end, attr))){
+    if(attr->key_length == key_length && !memcmp(attr->key, key_bytes, key_length)){
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Copies the attributes of the record, without the class */
+static CFMutableDictionaryRef kc_record_copy_attributes(const kc_record *record){
+  CFMutableDictionaryRef attributes = CFDictionaryCreateMutable(NULL, record->attr_count + 4, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  const UInt8 *cursor = record->attrs;
+  kc_attr attr;
+  while((cursor = kc_attr_read(cursor, record->attrs_end, &attr))){
+    CFStringRef key = CFStringCreateWithBytes(NULL, attr.key, attr.key_length, kCFStringEncodingUTF8, false);
+    CFTypeRef value = kc_attr_copy_value(&attr);
+    if(key && value){
+      CFDictionarySetValue(attributes, key, value);
+    }
+    if(key){
+      CFRelease(key);
+    }
+    if(value){
+      CFRelease(value);
+    }
+  }
+  return attributes;
+}
+
+typedef struct {
+  kc_buf *buf;
+  UInt32 count;
+  Boolean failed;
+} kc_encode_context;
+
+static void kc_encode_attribute(const void *key, const void *value, void *ctx){
+  kc_encode_context *context = ctx;
+  if(kc_is_attribute_key(key)){
+    if(kc_buf_append_attr(context->buf, key, value)){
+      context->count++;
+    }else{
+      context->failed = true;
+    }
+  }
+}
+
+static OSStatus kc_record_encode(kc_buf *buf, FourCharCode cls, UInt64 id, CFDictionaryRef attributes, const UInt8 *secret, UInt32 secret_length){
+  size_t start = buf->length;
+  kc_buf_append_u32(buf, 0);
+  kc_buf_append_u32(buf, cls);
+  kc_buf_append_u64(buf, id);
+  kc_buf_append_u32(buf, 0);
+  kc_encode_context context = {buf, 0, false};
+  CFDictionaryApplyFunction(attributes, kc_encode_attribute, &context);
+  if(context.failed){
+    buf->length = start;
+    return errSecParam;
+  }
+  kc_buf_append_u32(buf, secret_length);
+  kc_buf_append(buf, secret, secret_length);
+  kc_put_u32(buf->bytes + start, (UInt32)(buf->length - start));
+  kc_put_u32(buf->bytes + start + 16, context.count);
+  return errSecSuccess;
+}
+
+/* Encryption of item secrets */
+
+static Boolean kc_derive_key(const void *password, size_t length, const UInt8 *salt, UInt32 iterations, UInt8 key[KC_KEY_SIZE], UInt8 verifier[KC_VERIFIER_SIZE]){
+  UInt8 output[KC_KEY_SIZE + KC_VERIFIER_SIZE];
+  if(!PKCS5_PBKDF2_HMAC(length ? password : "", (int)length, salt, KC_SALT_SIZE, (int)iterations, EVP_sha256(), sizeof(output), output)){
+    return false;
+  }
+  memcpy(key, output, KC_KEY_SIZE);
+  memcpy(verifier, output + KC_KEY_SIZE, KC_VERIFIER_SIZE);
+  OPENSSL_cleanse(output, sizeof(output));
+  return true;
+}
+
+static void kc_secret_aad(UInt64 id, FourCharCode cls, UInt8 aad[12]){
+  kc_put_u64(aad, id);
+  kc_put_u32(aad + 8, cls);
+}
+
+static OSStatus kc_seal(const kc_store *store, UInt64 id, FourCharCode cls, const UInt8 *plaintext, size_t length, kc_buf *out){
+  UInt8 aad[12];
+  int written = 0;
+  OSStatus status = errSecIO;
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  if(!ctx){
+    return errSecAllocate;
+  }
+  kc_secret_aad(id, cls, aad);
+  kc_buf_reserve(out, KC_NONCE_SIZE + length + KC_TAG_SIZE);
+  UInt8 *nonce = out->bytes + out->length;
+  UInt8 *ciphertext = nonce + KC_NONCE_SIZE;
+  if(RAND_bytes(nonce, KC_NONCE_SIZE) == 1 &&
+     EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, store->key, nonce) == 1 &&
+     EVP_EncryptUpdate(ctx, NULL, &written, aad, sizeof(aad)) == 1 &&
+     EVP_EncryptUpdate(ctx, ciphertext, &written, plaintext, (int)length) == 1 &&
+     EVP_EncryptFinal_ex(ctx, ciphertext + written, &written) == 1 &&
+     EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, KC_TAG_SIZE, ciphertext + length) == 1){
+    out->length += KC_NONCE_SIZE + length + KC_TAG_SIZE;
+    status = errSecSuccess;
+  }
+  EVP_CIPHER_CTX_free(ctx);
+  return status;
+}
+
+/* Decrypts into a buffer allocated with kc_secret_alloc */
+static OSStatus kc_unseal(const kc_store *store, const kc_record *record, UInt8 *plaintext){
+  UInt8 aad[12];
+  int written = 0;
+  OSStatus status = errSecDecode;
+  if(record->secret_length == 0){
+    return errSecSuccess;
+  }
+  if(record->secret_length < KC_NONCE_SIZE + KC_TAG_SIZE){
+    return errSecDecode;
+  }
+  size_t length = record->secret_length - KC_NONCE_SIZE - KC_TAG_SIZE;
+  const UInt8 *nonce = record->secret;
+  const UInt8 *ciphertext = nonce + KC_NONCE_SIZE;
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  if(!ctx){
+    return errSecAllocate;
+  }
+  kc_secret_aad(record->id, record->cls, aad);
+  if(EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, store->key, nonce) == 1 &&
+     EVP_DecryptUpdate(ctx, NULL, &written, aad, sizeof(aad)) == 1 &&
+     EVP_DecryptUpdate(ctx, plaintext, &written, ciphertext, (int)length) == 1 &&
+     EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, KC_TAG_SIZE, (void*)(ciphertext + length)) == 1 &&
+     EVP_DecryptFinal_ex(ctx, plaintext + written, &written) == 1){
+    status = errSecSuccess;
+  }else{
+    OPENSSL_cleanse(plaintext, length);
+  }
+  EVP_CIPHER_CTX_free(ctx);
+  return status;
+}
+
+static size_t kc_secret_length(const kc_record *record){
+  return record->secret_length ? record->secret_length - KC_NONCE_SIZE - KC_TAG_SIZE : 0;
+}
+
+/* Secrets handed out to callers remember their length so that they can be wiped when freed */
+static UInt8 *kc_secret_alloc(size_t length){
+  size_t *block = malloc(sizeof(size_t) + (length ? length : 1));
+  if(!block){
+    return NULL;
+  }
+  *block = length;
+  return (UInt8*)(block + 1);
+}
+
+static void kc_secret_free(void *secret){
+  if(secret){
+    size_t *block = ((size_t*)secret) - 1;
+    OPENSSL_cleanse(block, sizeof(size_t) + *block);
+    free(block);
+  }
+}
+
+/* Stores: the process wide state of a keychain file */
+
+static char *kc_canonical_path(const char *path){
+  char resolved[PATH_MAX];
+  if(realpath(path, resolved)){
+    return strdup(resolved);
+  }
+  const char *slash = strrchr(path, '/');
+  const char *base = slash ? slash + 1 : path;
+  char *directory = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+  char *result = NULL;
+  if(directory && realpath(directory, resolved)){
+    size_t length = strlen(resolved) + strlen(base) + 2;
+    result = malloc(length);
+    if(result){
+      snprintf(result, length, "%s%s%s", resolved, strcmp(resolved, "/") ? "/" : "", base);
+    }
+  }
+  free(directory);
+  return result ? result : strdup(path);
+}
+
+static kc_store *kc_store_for_path(const char *path){
+  char *canonical = kc_canonical_path(path);
+  if(!canonical){
+    return NULL;
+  }
+  pthread_mutex_lock(&kc_registry_mutex);
+  kc_store *store = kc_stores;
+  while(store && strcmp(store->path, canonical)){
+    store = store->next;
+  }
+  if(store){
+    free(canonical);
+  }else{
+    store = calloc(1, sizeof(kc_store));
+    if(store){
+      store->path = canonical;
+      pthread_mutex_init(&store->mutex, NULL);
+      store->next = kc_stores;
+      kc_stores = store;
+    }else{
+      free(canonical);
+    }
+  }
+  pthread_mutex_unlock(&kc_registry_mutex);
+  return store;
+}
+
+static void kc_store_forget_key(kc_store *store){
+  OPENSSL_cleanse(store->key, sizeof(store->key));
+  store->unlocked = false;
+  store->tried_empty_password = false;
+}
+
+static void kc_store_unmap(kc_store *store){
+  if(store->map){
+    munmap((void*)store->map, store->map_size);
+    store->map = NULL;
+    store->map_size = 0;
+  }
+}
+
+static Boolean kc_header_parse(const UInt8 *bytes, size_t size, kc_header *header){
+  if(size < KC_HEADER_SIZE || memcmp(bytes, KC_MAGIC, 8) || kc_get_u32(bytes + 8) != KC_FORMAT_VERSION){
+    return false;
+  }
+  header->iterations = kc_get_u32(bytes + 12);
+  memcpy(header->salt, bytes + 16, KC_SALT_SIZE);
+  memcpy(header->verifier, bytes + 32, KC_VERIFIER_SIZE);
+  header->lock_interval = kc_get_u32(bytes + 64);
+  header->lock_on_sleep = bytes[68];
+  header->next_id = kc_get_u64(bytes + 72);
+  header->item_count = kc_get_u32(bytes + 80);
+  header->index_count = kc_get_u32(bytes + 84);
+  header->records_offset = kc_get_u64(bytes + 88);
+  header->records_size = kc_get_u64(bytes + 96);
+  header->index_offset = kc_get_u64(bytes + 104);
+  header->ids_offset = kc_get_u64(bytes + 112);
+
+  return header->records_offset >= KC_HEADER_SIZE &&
+         header->records_offset <= size && header->records_size <= size - header->records_offset &&
+         header->index_offset <= size && (UInt64)header->index_count * KC_INDEX_ENTRY_SIZE <= size - header->index_offset &&
+         header->ids_offset <= size && (UInt64)header->item_count * KC_ID_ENTRY_SIZE <= size - header->ids_offset;
+}
+
+static void kc_header_write(UInt8 *bytes, const kc_header *header){
+  memset(bytes, 0, KC_HEADER_SIZE);
+  memcpy(bytes, KC_MAGIC, 8);
+  kc_put_u32(bytes + 8, KC_FORMAT_VERSION);
+  kc_put_u32(bytes + 12, header->iterations);
+  memcpy(bytes + 16, header->salt, KC_SALT_SIZE);
+  memcpy(bytes + 32, header->verifier, KC_VERIFIER_SIZE);
+  kc_put_u32(bytes + 64, header->lock_interval);
+  bytes[68] = header->lock_on_sleep ? 1 : 0;
+  kc_put_u64(bytes + 72, header->next_id);
+  kc_put_u32(bytes + 80, header->item_count);
+  kc_put_u32(bytes + 84, header->index_count);
+  kc_put_u64(bytes + 88, header->records_offset);
+  kc_put_u64(bytes + 96, header->records_size);
+  kc_put_u64(bytes + 104, header->index_offset);
+  kc_put_u64(bytes + 112, header->ids_offset);
+}
+
+/* Makes sure the mapping reflects the file currently on disk. Called with the store mutex held */
+static OSStatus kc_store_sync(kc_store *store){
+  struct stat info;
+  if(stat(store->path, &info)){
+    kc_store_unmap(store);
+    return errno == ENOENT || errno == ENOTDIR ? errSecNoSuchKeychain : errSecIO;
+  }
+  if(store->map && info.st_dev == store->dev && info.st_ino == store->ino &&
+     (size_t)info.st_size == store->map_size &&
+     info.st_mtim.tv_sec == store->mtime.tv_sec && info.st_mtim.tv_nsec == store->mtime.tv_nsec){
+    return errSecSuccess;
+  }
+
+  int fd = open(store->path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0){
+    kc_store_unmap(store);
+    return errno == ENOENT ? errSecNoSuchKeychain : errSecIO;
+  }
+  if(fstat(fd, &info) || (size_t)info.st_size < KC_HEADER_SIZE){
+    close(fd);
+    kc_store_unmap(store);
+    return errSecInvalidKeychain;
+  }
+  void *map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED){
+    kc_store_unmap(store);
+    return errSecIO;
+  }
+  kc_header header;
+  if(!kc_header_parse(map, (size_t)info.st_size, &header)){
+    munmap(map, (size_t)info.st_size);
+    kc_store_unmap(store);
+    return errSecInvalidKeychain;
+  }
+  if(memcmp(header.salt, store->header.salt, KC_SALT_SIZE)){
+    /* a different keychain now lives at this path */
+    kc_store_forget_key(store);
+  }
+  kc_store_unmap(store);
+  store->map = map;
+  store->map_size = (size_t)info.st_size;
+  store->dev = info.st_dev;
+  store->ino = info.st_ino;
+  store->mtime = info.st_mtim;
+  store->header = header;
+  return errSecSuccess;
+}
+
+static OSStatus kc_store_try_unlock(kc_store *store, const void *password, size_t length){
+  UInt8 key[KC_KEY_SIZE];
+  UInt8 verifier[KC_VERIFIER_SIZE];
+  if(!kc_derive_key(password, length, store->header.salt, store->header.iterations, key, verifier)){
+    return errSecIO;
+  }
+  OSStatus status = errSecAuthFailed;
+  if(!CRYPTO_memcmp(verifier, store->header.verifier, KC_VERIFIER_SIZE)){
+    memcpy(store->key, key, KC_KEY_SIZE);
+    store->unlocked = true;
+    status = errSecSuccess;
+  }
+  OPENSSL_cleanse(key, sizeof(key));
+  return status;
+}
+
+/* Keychains with an empty password are unlocked on first use, as there is no user to prompt */
+static OSStatus kc_store_ensure_unlocked(kc_store *store){
+  if(store->unlocked){
+    return errSecSuccess;
+  }
+  if(!store->tried_empty_password){
+    store->tried_empty_password = true;
+    if(kc_store_try_unlock(store, "", 0) == errSecSuccess){
+      return errSecSuccess;
+    }
+  }
+  return errSecInteractionNotAllowed;
+}
+
+static Boolean kc_store_record_at(const kc_store *store, UInt64 offset, kc_record *record){
+  UInt64 records_end = store->header.records_offset + store->header.records_size;
+  if(offset < store->header.records_offset || offset >= records_end){
+    return false;
+  }
+  return kc_record_parse(store->map + offset, (size_t)(records_end - offset), offset, record);
+}
+
+static Boolean kc_store_find_record(const kc_store *store, UInt64 id, kc_record *record){
+  const UInt8 *ids = store->map + store->header.ids_offset;
+  size_t low = 0, high = store->header.item_count;
+  while(low < high){
+    size_t middle = low + (high - low) / 2;
+    UInt64 candidate = kc_get_u64(ids + middle * KC_ID_ENTRY_SIZE);
+    if(candidate == id){
+      return kc_store_record_at(store, kc_get_u64(ids + middle * KC_ID_ENTRY_SIZE + 8), record) && record->id == id;
+    }
+    if(candidate < id){
+      low = middle + 1;
+    }else{
+      high = middle;
+    }
+  }
+  return false;
+}
+
+/* Range of index entries with the given hash */
+static void kc_store_index_range(const kc_store *store, UInt32 hash, size_t *first, size_t *last){
+  const UInt8 *index = store->map + store->header.index_offset;
+  size_t low = 0, high = store->header.index_count;
+  while(low < high){
+    size_t middle = low + (high - low) / 2;
+    if(kc_get_u32(index + middle * KC_INDEX_ENTRY_SIZE) < hash){
+      low = middle + 1;
+    }else{
+      high = middle;
+    }
+  }
+  *first = low;
+  high = store->header.index_count;
+  while(low < high){
+    size_t middle = low + (high - low) / 2;
+    if(kc_get_u32(index + middle * KC_INDEX_ENTRY_SIZE) <= hash){
+      low = middle + 1;
+    }else{
+      high = middle;
+    }
+  }
+  *last = low;
+}
+
+/* Queries */
+
+static void kc_query_free(kc_query *query){
+  free(query->condition_keys);
+  free(query->condition_values);
+  query->condition_keys = NULL;
+  query->condition_values = NULL;
+}
+
+static void kc_query_add_condition(const void *key, const void *value, void *ctx){
+  kc_query *query = ctx;
+  if(kc_is_attribute_key(key)){
+    query->condition_keys[query->condition_count] = key;
+    query->condition_values[query->condition_count] = value;
+    query->condition_count++;
+  }
+}
+
+static OSStatus kc_query_init(kc_query *query, CFDictionaryRef dict){
+  memset(query, 0, sizeof(*query));
+  query->cls = kc_class_from_string(CFDictionaryGetValue(dict, kSecClass));
+  if(!query->cls){
+    return CFDictionaryContainsKey(dict, kSecClass) ? errSecUnimplemented : errSecParam;
+  }
+  CFIndex count = CFDictionaryGetCount(dict);
+  query->condition_keys = malloc(sizeof(CFStringRef) * (count + 1));
+  query->condition_values = malloc(sizeof(CFTypeRef) * (count + 1));
+  if(!query->condition_keys || !query->condition_values){
+    kc_query_free(query);
+    return errSecAllocate;
+  }
+  CFDictionaryApplyFunction(dict, kc_query_add_condition, query);
+
+  CFTypeRef item_list = CFDictionaryGetValue(dict, kSecMatchItemList);
+  if(item_list && CFGetTypeID(item_list) == CFArrayGetTypeID()){
+    query->item_list = item_list;
+  }
+
+  query->limit = 1;
+  query->limit_one = true;
+  CFTypeRef limit = CFDictionaryGetValue(dict, kSecMatchLimit);
+  if(limit){
+    if(CFEqual(limit, kSecMatchLimitAll)){
+      query->limit = -1;
+      query->limit_one = false;
+    }else if(CFGetTypeID(limit) == CFNumberGetTypeID()){
+      long value = 0;
+      CFNumberGetValue(limit, kCFNumberLongType, &value);
+      query->limit = value > 0 ? value : 1;
+      query->limit_one = false;
+    }
+  }
+
+  CFTypeRef flag;
+  query->return_attributes = (flag = CFDictionaryGetValue(dict, kSecReturnAttributes)) && CFEqual(flag, kCFBooleanTrue);
+  query->return_ref = (flag = CFDictionaryGetValue(dict, kSecReturnRef)) && CFEqual(flag, kCFBooleanTrue);
+  query->return_data = (flag = CFDictionaryGetValue(dict, kSecReturnData)) && CFEqual(flag, kCFBooleanTrue);
+  return errSecSuccess;
+}
+
+static Boolean kc_record_matches(const kc_record *record, const kc_query *query){
+  if(record->cls != query->cls){
+    return false;
+  }
+  for(CFIndex i = 0; i < query->condition_count; i++){
+    kc_attr attr;
+    if(!kc_record_find_attr(record, query->condition_keys[i], &attr) || !kc_attr_equals(&attr, query->condition_values[i])){
+      return false;
+    }
+  }
+  return true;
+}
+
+typedef Boolean (*kc_match_visitor)(kc_store *store, const kc_record *record, void *ctx);
+
+/* Calls visitor with each matching record, in insertion order, until it returns false.
+ * Candidates come from the index entry for the most selective exact match condition. */
+static void kc_store_each_match(kc_store *store, SecKeychainRef keychain, const kc_query *query, kc_match_visitor visitor, void *ctx){
+  kc_record record;
+  if(query->item_list){
+    for(CFIndex i = 0; i < CFArrayGetCount(query->item_list); i++){
+      SecKeychainItemRef item = (SecKeychainItemRef)CFArrayGetValueAtIndex(query->item_list, i);
+      if(CFGetTypeID(item) != kc_item_type_id || item->keychain->store != store){
+        continue;
+      }
+      if(kc_store_find_record(store, item->id, &record) && kc_record_matches(&record, query)){
+        if(!visitor(store, &record, ctx)){
+          return;
+        }
+      }
+    }
+    return;
+  }
+
+  size_t best_first, best_last;
+  int best_field = KC_INDEX_CLASS;
+  kc_store_index_range(store, kc_index_hash(KC_INDEX_CLASS, query->cls, NULL, 0), &best_first, &best_last);
+  for(CFIndex i = 0; i < query->condition_count; i++){
+    size_t key_length;
+    const char *key = kc_string_bytes(query->condition_keys[i], &key_length);
+    int field = kc_index_field((const UInt8*)key, key_length);
+    CFTypeRef value = query->condition_values[i];
+    if(field < 0 || CFGetTypeID(value) != CFStringGetTypeID()){
+      continue;
+    }
+    size_t length, first, last;
+    const char *bytes = kc_string_bytes(value, &length);
+    kc_store_index_range(store, kc_index_hash(field, query->cls, (const UInt8*)bytes, length), &first, &last);
+    if(last - first < best_last - best_first){
+      best_first = first;
+      best_last = last;
+      best_field = field;
+    }
+  }
+
+  const UInt8 *index = store->map + store->header.index_offset;
+  for(size_t i = best_first; i < best_last; i++){
+    const UInt8 *entry = index + i * KC_INDEX_ENTRY_SIZE;
+    if(kc_get_u32(entry + 4) != (UInt32)best_field){
+      continue;
+    }
+    if(kc_store_record_at(store, kc_get_u64(entry + 8), &record) && kc_record_matches(&record, query)){
+      if(!visitor(store, &record, ctx)){
+        return;
+      }
+    }
+  }
+}
+
+/* Writing */
+
+typedef struct {
+  UInt32 hash;
+  UInt32 field;
+  UInt64 offset;
+} kc_index_entry;
+
+typedef struct {
+  UInt64 id;
+  UInt64 offset;
+} kc_id_entry;
+
+static int kc_index_entry_compare(const void *a, const void *b){
+  const kc_index_entry *x = a, *y = b;
+  if(x->hash != y->hash){
+    return x->hash < y->hash ? -1 : 1;
+  }
+  return x->offset < y->offset ? -1 : x->offset > y->offset ? 1 : 0;
+}
+
+static int kc_id_entry_compare(const void *a, const void *b){
+  const kc_id_entry *x = a, *y = b;
+  return x->id < y->id ? -1 : x->id > y->id ? 1 : 0;
+}
+
+static Boolean kc_write_all(int fd, const UInt8 *bytes, size_t length){
+  while(length){
+    ssize_t written = write(fd, bytes, length);
+    if(written < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      return false;
+    }
+    bytes += written;
+    length -= (size_t)written;
+  }
+  return true;
+}
+
+/* Makes room for one more index entry. Records may repeat an indexed attribute, so entries are
+ * counted one at a time rather than assumed per record. */
+static Boolean kc_index_entries_reserve(kc_index_entry **entries, size_t *capacity, size_t count){
+  if(count < *capacity){
+    return true;
+  }
+  kc_index_entry *grown = realloc(*entries, sizeof(kc_index_entry) * *capacity * 2);
+  if(!grown){
+    return false;
+  }
+  *entries = grown;
+  *capacity *= 2;
+  return true;
+}
+
+/* Writes a new image of the keychain from the given header settings and records,
+ * builds the index and id table, and renames it over the keychain file. */
+static OSStatus kc_write_image(const char *path, const kc_header *settings, const kc_buf *records){
+  kc_header header = *settings;
+  size_t capacity = 64, count = 0, index_count = 0;
+  kc_index_entry *entries = malloc(sizeof(kc_index_entry) * capacity);
+  kc_id_entry *ids = NULL;
+  kc_buf tail = {0};
+  OSStatus status = errSecSuccess;
+  if(!entries){
+    return errSecAllocate;
+  }
+
+  size_t position = 0;
+  while(position < records->length){
+    kc_record record;
+    UInt64 offset = KC_HEADER_SIZE + position;
+    if(!kc_record_parse(records->bytes + position, records->length - position, offset, &record)){
+      free(entries);
+      return errSecDecode;
+    }
+    if(!kc_index_entries_reserve(&entries, &capacity, index_count)){
+      free(entries);
+      return errSecAllocate;
+    }
+    entries[index_count++] = (kc_index_entry){kc_index_hash(KC_INDEX_CLASS, record.cls, NULL, 0), KC_INDEX_CLASS, offset};
+    const UInt8 *cursor = record.attrs;
+    kc_attr attr;
+    while((cursor = kc_attr_read(cursor, record.attrs_end, &attr))){
+      int field = kc_index_field(attr.key, attr.key_length);
+      if(field >= 0 && attr.type == KC_VALUE_STRING){
+        if(!kc_index_entries_reserve(&entries, &capacity, index_count)){
+          free(entries);
+          return errSecAllocate;
+        }
+        entries[index_count++] = (kc_index_entry){kc_index_hash(field, record.cls, attr.value, attr.value_length), (UInt32)field, offset};
+      }
+    }
+    count++;
+    position += record.length;
+  }
+  qsort(entries, index_count, sizeof(kc_index_entry), kc_index_entry_compare);
+
+  ids = malloc(sizeof(kc_id_entry) * (count ? count : 1));
+  if(!ids){
+    free(entries);
+    return errSecAllocate;
+  }
+  count = 0;
+  position = 0;
+  while(position < records->length){
+    kc_record record;
+    kc_record_parse(records->bytes + position, records->length - position, KC_HEADER_SIZE + position, &record);
+    ids[count++] = (kc_id_entry){record.id, record.offset};
+    if(record.id >= header.next_id){
+      header.next_id = record.id + 1;
+    }
+    position += record.length;
+  }
+  qsort(ids, count, sizeof(kc_id_entry), kc_id_entry_compare);
+
+  for(size_t i = 0; i < index_count; i++){
+    kc_buf_append_u32(&tail, entries[i].hash);
+    kc_buf_append_u32(&tail, entries[i].field);
+    kc_buf_append_u64(&tail, entries[i].offset);
+  }
+  for(size_t i = 0; i < count; i++){
+    kc_buf_append_u64(&tail, ids[i].id);
+    kc_buf_append_u64(&tail, ids[i].offset);
+  }
+  free(entries);
+  free(ids);
+
+  header.item_count = (UInt32)count;
+  header.index_count = (UInt32)index_count;
+  header.records_offset = KC_HEADER_SIZE;
+  header.records_size = records->length;
+  header.index_offset = KC_HEADER_SIZE + records->length;
+  header.ids_offset = header.index_offset + (UInt64)index_count * KC_INDEX_ENTRY_SIZE;
+  UInt8 header_bytes[KC_HEADER_SIZE];
+  kc_header_write(header_bytes, &header);
+
+  size_t path_length = strlen(path);
+  char *temp_path = malloc(path_length + 8);
+  if(!temp_path){
+    kc_buf_free(&tail);
+    return errSecAllocate;
+  }
+  memcpy(temp_path, path, path_length);
+  memcpy(temp_path + path_length, ".XXXXXX", 8);
+  int fd = mkstemp(temp_path);
+  if(fd < 0){
+    status = errno == ENOENT || errno == ENOTDIR ? errSecNoSuchKeychain : errSecIO;
+  }else{
+    if(fchmod(fd, S_IRUSR | S_IWUSR) ||
+       !kc_write_all(fd, header_bytes, sizeof(header_bytes)) ||
+       !kc_write_all(fd, records->bytes, records->length) ||
+       !kc_write_all(fd, tail.bytes, tail.length) ||
+       fsync(fd)){
+      status = errSecIO;
+    }
+    close(fd);
+    if(status == errSecSuccess && rename(temp_path, path)){
+      status = errSecIO;
+    }
+    if(status != errSecSuccess){
+      unlink(temp_path);
+    }
+  }
+  free(temp_path);
+  kc_buf_free(&tail);
+  return status;
+}
+
+/* Takes the cross process write lock: an exclusive flock on the current keychain file.
+ * Writers replace the file, so retry until the locked file is the one at the path. */
+static OSStatus kc_store_begin_write(kc_store *store, int *lock_fd){
+  for(;;){
+    int fd = open(store->path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+      return errno == ENOENT || errno == ENOTDIR ? errSecNoSuchKeychain : errSecIO;
+    }
+    if(flock(fd, LOCK_EX)){
+      close(fd);
+      return errSecIO;
+    }
+    struct stat locked, current;
+    if(!fstat(fd, &locked) && !stat(store->path, &current) && locked.st_dev == current.st_dev && locked.st_ino == current.st_ino){
+      *lock_fd = fd;
+      OSStatus status = kc_store_sync(store);
+      if(status != errSecSuccess){
+        close(fd);
+      }
+      return status;
+    }
+    close(fd);
+  }
+}
+
+static OSStatus kc_store_commit(kc_store *store, int lock_fd, const kc_header *header, const kc_buf *records){
+  OSStatus status = kc_write_image(store->path, header, records);
+  if(status == errSecSuccess){
+    status = kc_store_sync(store);
+  }
+  close(lock_fd);
+  return status;
+}
+
+static void kc_store_copy_records(const kc_store *store, kc_buf *records){
+  kc_buf_append(records, store->map + store->header.records_offset, store->header.records_size);
+}
+
+/* Simulated latency */
+
+void FileKeychainSetSimulatedLatency(double seconds){
+  __atomic_store_n(&kc_simulated_latency_usec, seconds > 0 ? (long)(seconds * 1000000) : 0, __ATOMIC_RELAXED);
+}
+
+double FileKeychainGetSimulatedLatency(void){
+  return __atomic_load_n(&kc_simulated_latency_usec, __ATOMIC_RELAXED) / 1000000.0;
+}
+
+static void kc_simulate_latency(void){
+  long usec = __atomic_load_n(&kc_simulated_latency_usec, __ATOMIC_RELAXED);
+  if(usec > 0){
+    struct timespec remaining = {usec / 1000000, (usec % 1000000) * 1000};
+    while(nanosleep(&remaining, &remaining) && errno == EINTR){
+    }
+  }
+}
+
+/* Callbacks registered with SecKeychainAddCallback */
+
+#define KC_MAX_CALLBACKS 16
+
+typedef struct {
+  SecKeychainCallback function;
+  SecKeychainEventMask mask;
+  void *context;
+} kc_callback;
+
+static pthread_mutex_t kc_callbacks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static kc_callback kc_callbacks[KC_MAX_CALLBACKS];
+static int kc_callback_count = 0;
+
+OSStatus SecKeychainAddCallback(SecKeychainCallback callbackFunction, SecKeychainEventMask eventMask, void *userContext){
+  OSStatus status = errSecSuccess;
+  pthread_mutex_lock(&kc_callbacks_mutex);
+  for(int i = 0; i < kc_callback_count; i++){
+    if(kc_callbacks[i].function == callbackFunction){
+      status = errSecDuplicateCallback;
+    }
+  }
+  if(status == errSecSuccess && kc_callback_count == KC_MAX_CALLBACKS){
+    status = errSecAllocate;
+  }
+  if(status == errSecSuccess){
+    kc_callbacks[kc_callback_count++] = (kc_callback){callbackFunction, eventMask, userContext};
+  }
+  pthread_mutex_unlock(&kc_callbacks_mutex);
+  return status;
+}
+
+OSStatus SecKeychainRemoveCallback(SecKeychainCallback callbackFunction){
+  OSStatus status = errSecInvalidCallback;
+  pthread_mutex_lock(&kc_callbacks_mutex);
+  for(int i = 0; i < kc_callback_count; i++){
+    if(kc_callbacks[i].function == callbackFunction){
+      kc_callbacks[i] = kc_callbacks[--kc_callback_count];
+      status = errSecSuccess;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&kc_callbacks_mutex);
+  return status;
+}
+
+/* Reports count events to the registered callbacks. Must not be called with a store's mutex held */
+static void kc_notify(SecKeychainEvent event, SecKeychainRef keychain, size_t count){
+  kc_callback callbacks[KC_MAX_CALLBACKS];
+  int callback_count = 0;
+  pthread_mutex_lock(&kc_callbacks_mutex);
+  for(int i = 0; i < kc_callback_count; i++){
+    if(kc_callbacks[i].mask & (1u << event)){
+      callbacks[callback_count++] = kc_callbacks[i];
+    }
+  }
+  pthread_mutex_unlock(&kc_callbacks_mutex);
+
+  SecKeychainCallbackInfo info = {1, NULL, keychain, getpid()};
+  for(size_t n = 0; n < count; n++){
+    for(int i = 0; i < callback_count; i++){
+      callbacks[i].function(event, &info, callbacks[i].context);
+    }
+  }
+}
+
+/* CF types for keychain and item references */
+
+static void kc_item_finalize(CFTypeRef cf){
+  CFRelease(((SecKeychainItemRef)cf)->keychain);
+}
+
+static Boolean kc_keychain_equal(CFTypeRef cf1, CFTypeRef cf2){
+  return ((SecKeychainRef)cf1)->store == ((SecKeychainRef)cf2)->store;
+}
+
+static CFHashCode kc_keychain_hash(CFTypeRef cf){
+  return (CFHashCode)((SecKeychainRef)cf)->store;
+}
+
+static Boolean kc_item_equal(CFTypeRef cf1, CFTypeRef cf2){
+  SecKeychainItemRef item1 = (SecKeychainItemRef)cf1, item2 = (SecKeychainItemRef)cf2;
+  return item1->id == item2->id && item1->keychain->store == item2->keychain->store;
+}
+
+static CFHashCode kc_item_hash(CFTypeRef cf){
+  return (CFHashCode)((SecKeychainItemRef)cf)->id;
+}
+
+static const KCFRuntimeClass kc_keychain_class = {"SecKeychain", NULL, kc_keychain_equal, kc_keychain_hash};
+static const KCFRuntimeClass kc_item_class = {"SecKeychainItem", kc_item_finalize, kc_item_equal, kc_item_hash};
+
+static void kc_initialize(void){
+  kc_keychain_type_id = _KCFRuntimeRegisterClass(&kc_keychain_class);
+  kc_item_type_id = _KCFRuntimeRegisterClass(&kc_item_class);
+}
+
+static void kc_init(void){
+  pthread_once(&kc_init_once, kc_initialize);
+}
+
+static SecKeychainRef kc_keychain_create(kc_store *store){
+  SecKeychainRef keychain = _KCFRuntimeCreateInstance(kc_keychain_type_id, sizeof(struct OpaqueSecKeychainRef));
+  keychain->store = store;
+  return keychain;
+}
+
+static SecKeychainItemRef kc_item_create(SecKeychainRef keychain, const kc_record *record){
+  SecKeychainItemRef item = _KCFRuntimeCreateInstance(kc_item_type_id, sizeof(struct OpaqueSecKeychainItemRef));
+  item->keychain = (SecKeychainRef)CFRetain(keychain);
+  item->id = record->id;
+  item->cls = record->cls;
+  return item;
+}
+
+static Boolean kc_is_keychain(CFTypeRef cf){
+  return cf && CFGetTypeID(cf) == kc_keychain_type_id;
+}
+
+/* Search list */
+
+static OSStatus kc_create_file(kc_store *store, const void *password, size_t length){
+  kc_header header;
+  memset(&header, 0, sizeof(header));
+  header.iterations = KC_KDF_ITERATIONS;
+  header.lock_interval = 300;
+  header.lock_on_sleep = true;
+  header.next_id = 1;
+  UInt8 key[KC_KEY_SIZE];
+  if(RAND_bytes(header.salt, KC_SALT_SIZE) != 1 || !kc_derive_key(password, length, header.salt, header.iterations, key, header.verifier)){
+    return errSecIO;
+  }
+  kc_buf records = {0};
+  OSStatus status = kc_write_image(store->path, &header, &records);
+  if(status == errSecSuccess){
+    status = kc_store_sync(store);
+  }
+  if(status == errSecSuccess){
+    memcpy(store->key, key, KC_KEY_SIZE);
+    store->unlocked = true;
+    store->tried_empty_password = true;
+  }
+  OPENSSL_cleanse(key, sizeof(key));
+  return status;
+}
+
+static void kc_make_parent_directories(const char *path){
+  char *copy = strdup(path);
+  if(!copy){
+    return;
+  }
+  for(char *p = copy + 1; *p; p++){
+    if(*p == '/'){
+      *p = '\0';
+      mkdir(copy, S_IRWXU);
+      *p = '/';
+    }
+  }
+  free(copy);
+}
+
+static void kc_search_list_add(kc_store *store){
+  for(size_t i = 0; i < kc_search_list_count; i++){
+    if(kc_search_list[i] == store){
+      return;
+    }
+  }
+  kc_store **grown = realloc(kc_search_list, sizeof(kc_store*) * (kc_search_list_count + 1));
+  if(grown){
+    kc_search_list = grown;
+    kc_search_list[kc_search_list_count++] = store;
+  }
+}
+
+static void kc_search_list_remove(kc_store *store){
+  for(size_t i = 0; i < kc_search_list_count; i++){
+    if(kc_search_list[i] == store){
+      memmove(kc_search_list + i, kc_search_list + i + 1, sizeof(kc_store*) * (kc_search_list_count - i - 1));
+      kc_search_list_count--;
+      return;
+    }
+  }
+}
+
+static kc_store *kc_default_store(void){
+  pthread_mutex_lock(&kc_registry_mutex);
+  kc_store *store = kc_default;
+  pthread_mutex_unlock(&kc_registry_mutex);
+  if(store){
+    return store;
+  }
+
+  const char *path = getenv("KEYCHAIN_DEFAULT_PATH");
+  char *built = NULL;
+  if(!path || !*path){
+    const char *home = getenv("HOME");
+    size_t length = strlen(home ? home : "") + sizeof("/Library/Keychains/login.keychain");
+    built = malloc(length);
+    if(!built){
+      return NULL;
+    }
+    snprintf(built, length, "%s/Library/Keychains/login.keychain", home ? home : "");
+    path = built;
+  }
+  kc_make_parent_directories(path);
+  store = kc_store_for_path(path);
+  free(built);
+  if(!store){
+    return NULL;
+  }
+
+  pthread_mutex_lock(&store->mutex);
+  if(kc_store_sync(store) == errSecNoSuchKeychain){
+    kc_create_file(store, "", 0);
+  }
+  pthread_mutex_unlock(&store->mutex);
+
+  pthread_mutex_lock(&kc_registry_mutex);
+  if(!kc_default){
+    kc_default = store;
+    kc_search_list_add(store);
+  }
+  store = kc_default;
+  pthread_mutex_unlock(&kc_registry_mutex);
+  return store;
+}
+
+/* The keychains a query applies to, as an array of SecKeychainRefs */
+static CFArrayRef kc_copy_search_list(CFDictionaryRef query){
+  CFTypeRef search_list = CFDictionaryGetValue(query, kSecMatchSearchList);
+  if(search_list && CFGetTypeID(search_list) == CFArrayGetTypeID()){
+    return CFRetain(search_list);
+  }
+  CFTypeRef keychain = CFDictionaryGetValue(query, kSecUseKeychain);
+  if(kc_is_keychain(keychain)){
+    return CFArrayCreate(NULL, &keychain, 1, &kCFTypeArrayCallBacks);
+  }
+
+  CFMutableArrayRef keychains = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+  CFTypeRef item_list = CFDictionaryGetValue(query, kSecMatchItemList);
+  if(item_list && CFGetTypeID(item_list) == CFArrayGetTypeID()){
+    for(CFIndex i = 0; i < CFArrayGetCount(item_list); i++){
+      SecKeychainItemRef item = (SecKeychainItemRef)CFArrayGetValueAtIndex(item_list, i);
+      if(CFGetTypeID(item) != kc_item_type_id){
+        continue;
+      }
+      Boolean seen = false;
+      for(CFIndex j = 0; j < CFArrayGetCount(keychains) && !seen; j++){
+        seen = CFEqual(CFArrayGetValueAtIndex(keychains, j), item->keychain);
+      }
+      if(!seen){
+        CFArrayAppendValue(keychains, item->keychain);
+      }
+    }
+    return keychains;
+  }
+
+  kc_default_store();
+  pthread_mutex_lock(&kc_registry_mutex);
+  for(size_t i = 0; i < kc_search_list_count; i++){
+    SecKeychainRef handle = kc_keychain_create(kc_search_list[i]);
+    CFArrayAppendValue(keychains, handle);
+    CFRelease(handle);
+  }
+  pthread_mutex_unlock(&kc_registry_mutex);
+  return keychains;
+}
+
+/* Results */
+
+static CFTypeRef kc_copy_result(kc_store *store, SecKeychainRef keychain, const kc_record *record, const kc_query *query, OSStatus *status){
+  CFDataRef data = NULL;
+  *status = errSecSuccess;
+  if(query->return_data){
+    if((*status = kc_store_ensure_unlocked(store)) != errSecSuccess){
+      return NULL;
+    }
+    size_t length = kc_secret_length(record);
+    UInt8 *plaintext = kc_secret_alloc(length);
+    if(!plaintext){
+      *status = errSecAllocate;
+      return NULL;
+    }
+    *status = kc_unseal(store, record, plaintext);
+    if(*status == errSecSuccess){
+      data = CFDataCreate(NULL, plaintext, (CFIndex)length);
+    }
+    kc_secret_free(plaintext);
+    if(*status != errSecSuccess){
+      return NULL;
+    }
+  }
+
+  int returns = query->return_attributes + query->return_ref + query->return_data;
+  if(returns == 1 && query->return_data){
+    return data;
+  }
+  if(returns == 1 && query->return_ref){
+    return kc_item_create(keychain, record);
+  }
+
+  CFMutableDictionaryRef result = query->return_attributes ? kc_record_copy_attributes(record) :
+    CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  if(query->return_attributes){
+    CFDictionarySetValue(result, kSecClass, kc_class_string(record->cls));
+  }
+  if(query->return_ref){
+    SecKeychainItemRef item = kc_item_create(keychain, record);
+    CFDictionarySetValue(result, kSecValueRef, item);
+    CFRelease(item);
+  }
+  if(data){
+    CFDictionarySetValue(result, kSecValueData, data);
+    CFRelease(data);
+  }
+  return result;
+}
+
+typedef struct {
+  const kc_query *query;
+  SecKeychainRef keychain;
+  CFMutableArrayRef results;
+  OSStatus status;
+} kc_collect_context;
+
+static Boolean kc_collect_match(kc_store *store, const kc_record *record, void *ctx){
+  kc_collect_context *context = ctx;
+  CFTypeRef result = kc_copy_result(store, context->keychain, record, context->query, &context->status);
+  if(!result){
+    return context->status == errSecSuccess;
+  }
+  CFArrayAppendValue(context->results, result);
+  CFRelease(result);
+  return context->query->limit < 0 || CFArrayGetCount(context->results) < context->query->limit;
+}
+
+static OSStatus kc_collect(CFDictionaryRef dict, const kc_query *query, CFMutableArrayRef results){
+  CFArrayRef keychains = kc_copy_search_list(dict);
+  OSStatus status = errSecSuccess;
+  for(CFIndex i = 0; i < CFArrayGetCount(keychains); i++){
+    SecKeychainRef keychain = (SecKeychainRef)CFArrayGetValueAtIndex(keychains, i);
+    if(!kc_is_keychain(keychain)){
+      status = errSecParam;
+      break;
+    }
+    kc_store *store = keychain->store;
+    pthread_mutex_lock(&store->mutex);
+    status = kc_store_sync(store);
+    if(status == errSecSuccess){
+      kc_collect_context context = {query, keychain, results, errSecSuccess};
+      kc_store_each_match(store, keychain, query, kc_collect_match, &context);
+      status = context.status;
+    }
+    pthread_mutex_unlock(&store->mutex);
+    if(status == errSecNoSuchKeychain){
+      status = errSecSuccess;
+      continue;
+    }
+    if(status != errSecSuccess || (query->limit >= 0 && CFArrayGetCount(results) >= query->limit)){
+      break;
+    }
+  }
+  CFRelease(keychains);
+  return status;
+}
+
+OSStatus SecItemCopyMatching(CFDictionaryRef dict, CFTypeRef *result){
+  kc_init();
+  kc_simulate_latency();
+  if(result){
+    *result = NULL;
+  }
+  kc_query query;
+  OSStatus status = kc_query_init(&query, dict);
+  if(status != errSecSuccess){
+    return status;
+  }
+  CFMutableArrayRef results = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+  status = kc_collect(dict, &query, results);
+  if(status == errSecSuccess && CFArrayGetCount(results) == 0){
+    status = errSecItemNotFound;
+  }
+  if(status == errSecSuccess && result && (query.return_attributes || query.return_ref || query.return_data)){
+    if(query.limit_one){
+      *result = CFRetain(CFArrayGetValueAtIndex(results, 0));
+    }else{
+      *result = CFRetain(results);
+    }
+  }
+  CFRelease(results);
+  kc_query_free(&query);
+  return status;
+}
+
+/* True if an item other than those excluded has the same primary key as the attributes */
+static Boolean kc_store_has_duplicate(kc_store *store, FourCharCode cls, CFDictionaryRef attributes, const UInt64 *excluded, size_t excluded_count);
+
+typedef struct {
+  CFStringRef *keys;
+  CFIndex key_count;
+  CFDictionaryRef attributes;
+  const UInt64 *excluded;
+  size_t excluded_count;
+  Boolean found;
+} kc_duplicate_context;
+
+static Boolean kc_check_duplicate(kc_store *store, const kc_record *record, void *ctx){
+  kc_duplicate_context *context = ctx;
+  for(size_t i = 0; i < context->excluded_count; i++){
+    if(context->excluded[i] == record->id){
+      return true;
+    }
+  }
+  for(CFIndex i = 0; i < context->key_count; i++){
+    if(!CFDictionaryContainsKey(context->attributes, context->keys[i])){
+      kc_attr attr;
+      if(kc_record_find_attr(record, context->keys[i], &attr)){
+        return true;
+      }
+    }
+  }
+  context->found = true;
+  return false;
+}
+
+static Boolean kc_store_has_duplicate(kc_store *store, FourCharCode cls, CFDictionaryRef attributes, const UInt64 *excluded, size_t excluded_count){
+  CFStringRef keys[7];
+  CFStringRef condition_keys[7];
+  CFTypeRef condition_values[7];
+  CFIndex key_count = kc_primary_key(cls, keys);
+  kc_query query;
+  memset(&query, 0, sizeof(query));
+  query.cls = cls;
+  query.limit = -1;
+  query.condition_keys = condition_keys;
+  query.condition_values = condition_values;
+  for(CFIndex i = 0; i < key_count; i++){
+    CFTypeRef value = CFDictionaryGetValue(attributes, keys[i]);
+    if(value){
+      condition_keys[query.condition_count] = keys[i];
+      condition_values[query.condition_count] = value;
+      query.condition_count++;
+    }
+  }
+  kc_duplicate_context context = {keys, key_count, attributes, excluded, excluded_count, false};
+  kc_store_each_match(store, NULL, &query, kc_check_duplicate, &context);
+  return context.found;
+}
+
+static Boolean kc_primary_keys_equal(FourCharCode cls, CFDictionaryRef a, CFDictionaryRef b){
+  CFStringRef keys[7];
+  CFIndex key_count = kc_primary_key(cls, keys);
+  for(CFIndex i = 0; i < key_count; i++){
+    CFTypeRef x = CFDictionaryGetValue(a, keys[i]);
+    CFTypeRef y = CFDictionaryGetValue(b, keys[i]);
+    if((x == NULL) != (y == NULL) || (x && !CFEqual(x, y))){
+      return false;
+    }
+  }
+  return true;
+}
+
+static CFDataRef kc_copy_secret_value(CFTypeRef value){
+  if(!value){
+    return NULL;
+  }
+  if(CFGetTypeID(value) == CFDataGetTypeID()){
+    return CFRetain(value);
+  }
+  if(CFGetTypeID(value) == CFStringGetTypeID()){
+    size_t length;
+    const char *bytes = kc_string_bytes(value, &length);
+    return CFDataCreate(NULL, (const UInt8*)bytes, (CFIndex)length);
+  }
+  return NULL;
+}
+
+static void kc_set_timestamps(CFMutableDictionaryRef attributes, Boolean created){
+  CFDateRef now = CFDateCreate(NULL, CFAbsoluteTimeGetCurrent());
+  if(created && !CFDictionaryContainsKey(attributes, kSecAttrCreationDate)){
+    CFDictionarySetValue(attributes, kSecAttrCreationDate, now);
+  }
+  CFDictionarySetValue(attributes, kSecAttrModificationDate, now);
+  CFRelease(now);
+}
+
+typedef struct {
+  CFMutableDictionaryRef attributes;
+} kc_filter_context;
+
+static void kc_copy_attribute(const void *key, const void *value, void *ctx){
+  if(kc_is_attribute_key(key)){
+    CFDictionarySetValue(((kc_filter_context*)ctx)->attributes, key, value);
+  }
+}
+
+static CFMutableDictionaryRef kc_copy_item_attributes(CFDictionaryRef dict){
+  kc_filter_context context = {CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks)};
+  CFDictionaryApplyFunction(dict, kc_copy_attribute, &context);
+  return context.attributes;
+}
+
+static CFHashCode kc_primary_key_hash(FourCharCode cls, CFDictionaryRef attributes){
+  CFStringRef keys[7];
+  CFIndex key_count = kc_primary_key(cls, keys);
+  CFHashCode hash = cls;
+  for(CFIndex i = 0; i < key_count; i++){
+    CFTypeRef value = CFDictionaryGetValue(attributes, keys[i]);
+    hash = hash * 31 + (value ? CFHash(value) : 0);
+  }
+  return hash;
+}
+
+/* An item being added, and the open addressed table used to find duplicates within a batch */
+typedef struct {
+  FourCharCode cls;
+  CFMutableDictionaryRef attributes;
+  CFHashCode key_hash;
+  UInt64 id;
+} kc_pending_item;
+
+typedef struct {
+  size_t *slots; /* index + 1 into the pending items, 0 if empty */
+  size_t mask;
+} kc_pending_table;
+
+static Boolean kc_pending_table_init(kc_pending_table *table, size_t count){
+  size_t size = 16;
+  while(size < count * 2){
+    size *= 2;
+  }
+  table->slots = calloc(size, sizeof(size_t));
+  table->mask = size - 1;
+  return table->slots != NULL;
+}
+
+/* Adds the item unless an earlier item in the batch has the same primary key */
+static Boolean kc_pending_table_insert(kc_pending_table *table, kc_pending_item *items, size_t index){
+  kc_pending_item *item = &items[index];
+  for(size_t slot = item->key_hash & table->mask; ; slot = (slot + 1) & table->mask){
+    if(!table->slots[slot]){
+      table->slots[slot] = index + 1;
+      return true;
+    }
+    kc_pending_item *other = &items[table->slots[slot] - 1];
+    if(other->key_hash == item->key_hash && other->cls == item->cls && kc_primary_keys_equal(item->cls, item->attributes, other->attributes)){
+      return false;
+    }
+  }
+}
+
+static CFTypeRef kc_copy_add_result(kc_store *store, SecKeychainRef keychain, CFDictionaryRef dict, UInt64 id, OSStatus *status){
+  kc_record record;
+  if(!kc_store_find_record(store, id, &record)){
+    return NULL;
+  }
+  kc_query result_query;
+  memset(&result_query, 0, sizeof(result_query));
+  result_query.return_attributes = (CFDictionaryGetValue(dict, kSecReturnAttributes) == kCFBooleanTrue);
+  result_query.return_ref = (CFDictionaryGetValue(dict, kSecReturnRef) == kCFBooleanTrue);
+  result_query.return_data = (CFDictionaryGetValue(dict, kSecReturnData) == kCFBooleanTrue);
+  if(!result_query.return_attributes && !result_query.return_ref && !result_query.return_data){
+    return NULL;
+  }
+  return kc_copy_result(store, keychain, &record, &result_query, status);
+}
+
+/*
+ * Adds items to a keychain with a single write of the keychain file. Each item's status is
+ * set independently, so a duplicate doesn't prevent the other items from being added.
+ */
+static void kc_add_items(SecKeychainRef keychain, CFIndex count, const CFDictionaryRef *dicts, OSStatus *statuses, CFTypeRef *results){
+  kc_store *store = keychain->store;
+  kc_pending_item *items = calloc((size_t)count, sizeof(kc_pending_item));
+  kc_pending_table table = {NULL, 0};
+  if(!items || !kc_pending_table_init(&table, (size_t)count)){
+    for(CFIndex i = 0; i < count; i++){
+      statuses[i] = errSecAllocate;
+    }
+    free(items);
+    return;
+  }
+
+  for(CFIndex i = 0; i < count; i++){
+    if(results){
+      results[i] = NULL;
+    }
+    kc_query query;
+    statuses[i] = kc_query_init(&query, dicts[i]);
+    if(statuses[i] == errSecSuccess){
+      items[i].cls = query.cls;
+      kc_query_free(&query);
+      items[i].attributes = kc_copy_item_attributes(dicts[i]);
+      kc_set_timestamps(items[i].attributes, true);
+      items[i].key_hash = kc_primary_key_hash(items[i].cls, items[i].attributes);
+    }
+  }
+
+  int lock_fd = -1;
+  size_t added = 0;
+  pthread_mutex_lock(&store->mutex);
+  OSStatus status = kc_store_begin_write(store, &lock_fd);
+  if(status == errSecSuccess){
+    status = kc_store_ensure_unlocked(store);
+    if(status != errSecSuccess){
+      close(lock_fd);
+    }
+  }
+  if(status == errSecSuccess){
+    kc_buf records = {0};
+    kc_buf sealed = {0};
+    kc_header header = store->header;
+    kc_store_copy_records(store, &records);
+    for(CFIndex i = 0; i < count; i++){
+      kc_pending_item *item = &items[i];
+      if(statuses[i] != errSecSuccess){
+        continue;
+      }
+      if(kc_store_has_duplicate(store, item->cls, item->attributes, NULL, 0) || !kc_pending_table_insert(&table, items, (size_t)i)){
+        statuses[i] = errSecDuplicateItem;
+        continue;
+      }
+      item->id = header.next_id;
+      CFDataRef secret = kc_copy_secret_value(CFDictionaryGetValue(dicts[i], kSecValueData));
+      sealed.length = 0;
+      if(secret){
+        statuses[i] = kc_seal(store, item->id, item->cls, CFDataGetBytePtr(secret), (size_t)CFDataGetLength(secret), &sealed);
+        CFRelease(secret);
+      }
+      if(statuses[i] == errSecSuccess){
+        statuses[i] = kc_record_encode(&records, item->cls, item->id, item->attributes, sealed.bytes, (UInt32)sealed.length);
+      }
+      if(statuses[i] == errSecSuccess){
+        header.next_id++;
+        added++;
+      }
+    }
+    if(added){
+      status = kc_store_commit(store, lock_fd, &header, &records);
+    }else{
+      close(lock_fd);
+    }
+    kc_buf_free(&records);
+    kc_buf_free(&sealed);
+  }
+
+  for(CFIndex i = 0; i < count; i++){
+    if(statuses[i] == errSecSuccess){
+      if(status != errSecSuccess){
+        statuses[i] = status;
+      }else if(results){
+        results[i] = kc_copy_add_result(store, keychain, dicts[i], items[i].id, &statuses[i]);
+      }
+    }
+    if(items[i].attributes){
+      CFRelease(items[i].attributes);
+    }
+  }
+  pthread_mutex_unlock(&store->mutex);
+  free(table.slots);
+  free(items);
+  if(status == errSecSuccess){
+    kc_notify(kSecAddEvent, keychain, added);
+  }
+}
+
+/* The keychain items are added to: kSecUseKeychain, or the default keychain */
+static OSStatus kc_copy_add_keychain(CFDictionaryRef dict, SecKeychainRef *keychain){
+  CFTypeRef keychain_value = CFDictionaryGetValue(dict, kSecUseKeychain);
+  if(keychain_value){
+    if(!kc_is_keychain(keychain_value)){
+      return errSecParam;
+    }
+    *keychain = (SecKeychainRef)CFRetain(keychain_value);
+    return errSecSuccess;
+  }
+  kc_store *store = kc_default_store();
+  if(!store){
+    return errSecNoDefaultKeychain;
+  }
+  *keychain = kc_keychain_create(store);
+  return errSecSuccess;
+}
+
+OSStatus SecItemAdd(CFDictionaryRef dict, CFTypeRef *result){
+  kc_init();
+  kc_simulate_latency();
+  if(result){
+    *result = NULL;
+  }
+  kc_query query;
+  OSStatus status = kc_query_init(&query, dict);
+  if(status != errSecSuccess){
+    return status;
+  }
+  kc_query_free(&query);
+
+  SecKeychainRef keychain = NULL;
+  status = kc_copy_add_keychain(dict, &keychain);
+  if(status != errSecSuccess){
+    return status;
+  }
+  CFTypeRef results[1] = {NULL};
+  kc_add_items(keychain, 1, &dict, &status, result ? results : NULL);
+  if(result){
+    *result = results[0];
+  }
+  CFRelease(keychain);
+  return status;
+}
+
+void FileKeychainItemAddBatch(CFIndex count, const CFDictionaryRef *items, OSStatus *statuses, CFTypeRef *results){
+  kc_init();
+  kc_simulate_latency();
+  if(count <= 0){
+    return;
+  }
+  SecKeychainRef keychain = NULL;
+  OSStatus status = kc_copy_add_keychain(items[0], &keychain);
+  for(CFIndex i = 1; i < count && status == errSecSuccess; i++){
+    CFTypeRef keychain_value = CFDictionaryGetValue(items[i], kSecUseKeychain);
+    if(keychain_value ? !CFEqual(keychain_value, keychain) : keychain->store != kc_default_store()){
+      status = errSecParam;
+    }
+  }
+  if(status != errSecSuccess){
+    for(CFIndex i = 0; i < count; i++){
+      statuses[i] = status;
+      if(results){
+        results[i] = NULL;
+      }
+    }
+  }else{
+    kc_add_items(keychain, count, items, statuses, results);
+  }
+  if(keychain){
+    CFRelease(keychain);
+  }
+}
+
+typedef struct {
+  UInt64 *ids;
+  size_t count;
+  size_t capacity;
+} kc_id_list;
+
+static Boolean kc_collect_id(kc_store *store, const kc_record *record, void *ctx){
+  kc_id_list *list = ctx;
+  if(list->count == list->capacity){
+    size_t capacity = list->capacity ? list->capacity * 2 : 16;
+    UInt64 *ids = realloc(list->ids, sizeof(UInt64) * capacity);
+    if(!ids){
+      return false;
+    }
+    list->ids = ids;
+    list->capacity = capacity;
+  }
+  list->ids[list->count++] = record->id;
+  return true;
+}
+
+static Boolean kc_id_list_contains(const kc_id_list *list, UInt64 id){
+  size_t low = 0, high = list->count;
+  while(low < high){
+    size_t middle = low + (high - low) / 2;
+    if(list->ids[middle] == id){
+      return true;
+    }
+    if(list->ids[middle] < id){
+      low = middle + 1;
+    }else{
+      high = middle;
+    }
+  }
+  return false;
+}
+
+static int kc_u64_compare(const void *a, const void *b){
+  UInt64 x = *(const UInt64*)a, y = *(const UInt64*)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Rewrites every record of the store, replacing those in `matched` with the result
+ * of applying `changes` (and `secret` if not NULL), or dropping them if `changes` is NULL. */
+static OSStatus kc_store_rewrite_matches(kc_store *store, const kc_id_list *matched, CFDictionaryRef changes, CFDataRef secret, kc_buf *records){
+  UInt64 records_end = store->header.records_offset + store->header.records_size;
+  UInt64 offset = store->header.records_offset;
+  CFMutableArrayRef updated = changes ? CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks) : NULL;
+  OSStatus status = errSecSuccess;
+
+  while(offset < records_end && status == errSecSuccess){
+    kc_record record;
+    if(!kc_store_record_at(store, offset, &record)){
+      status = errSecInvalidKeychain;
+      break;
+    }
+    offset += record.length;
+    if(!kc_id_list_contains(matched, record.id)){
+      kc_buf_append(records, record.bytes, record.length);
+      continue;
+    }
+    if(!changes){
+      continue;
+    }
+
+    CFMutableDictionaryRef attributes = kc_record_copy_attributes(&record);
+    kc_filter_context context = {attributes};
+    CFDictionaryApplyFunction(changes, kc_copy_attribute, &context);
+    kc_set_timestamps(attributes, false);
+
+    if(kc_store_has_duplicate(store, record.cls, attributes, matched->ids, matched->count)){
+      status = errSecDuplicateItem;
+    }
+    for(CFIndex i = 0; i < CFArrayGetCount(updated) && status == errSecSuccess; i++){
+      if(kc_primary_keys_equal(record.cls, attributes, CFArrayGetValueAtIndex(updated, i))){
+        status = errSecDuplicateItem;
+      }
+    }
+    CFArrayAppendValue(updated, attributes);
+
+    if(status == errSecSuccess){
+      if(secret){
+        kc_buf sealed = {0};
+        status = kc_seal(store, record.id, record.cls, CFDataGetBytePtr(secret), (size_t)CFDataGetLength(secret), &sealed);
+        if(status == errSecSuccess){
+          status = kc_record_encode(records, record.cls, record.id, attributes, sealed.bytes, (UInt32)sealed.length);
+        }
+        kc_buf_free(&sealed);
+      }else{
+        status = kc_record_encode(records, record.cls, record.id, attributes, record.secret, record.secret_length);
+      }
+    }
+    CFRelease(attributes);
+  }
+  if(updated){
+    CFRelease(updated);
+  }
+  return status;
+}
+
+/* Shared implementation of SecItemUpdate and SecItemDelete */
+static OSStatus kc_modify_matching(CFDictionaryRef dict, CFDictionaryRef changes){
+  kc_init();
+  kc_simulate_latency();
+  kc_query query;
+  OSStatus status = kc_query_init(&query, dict);
+  if(status != errSecSuccess){
+    return status;
+  }
+  query.limit = -1;
+  CFDataRef secret = changes ? kc_copy_secret_value(CFDictionaryGetValue(changes, kSecValueData)) : NULL;
+  CFArrayRef keychains = kc_copy_search_list(dict);
+  size_t total = 0;
+
+  for(CFIndex i = 0; i < CFArrayGetCount(keychains) && status == errSecSuccess; i++){
+    SecKeychainRef keychain = (SecKeychainRef)CFArrayGetValueAtIndex(keychains, i);
+    if(!kc_is_keychain(keychain)){
+      status = errSecParam;
+      break;
+    }
+    kc_store *store = keychain->store;
+    int lock_fd = -1;
+    pthread_mutex_lock(&store->mutex);
+    status = kc_store_begin_write(store, &lock_fd);
+    if(status == errSecNoSuchKeychain){
+      status = errSecSuccess;
+      pthread_mutex_unlock(&store->mutex);
+      continue;
+    }
+    if(status != errSecSuccess){
+      pthread_mutex_unlock(&store->mutex);
+      break;
+    }
+
+    kc_id_list matched = {0};
+    size_t changed = 0;
+    kc_store_each_match(store, keychain, &query, kc_collect_id, &matched);
+    qsort(matched.ids, matched.count, sizeof(UInt64), kc_u64_compare);
+    if(matched.count && secret){
+      status = kc_store_ensure_unlocked(store);
+    }
+    if(matched.count && status == errSecSuccess){
+      kc_buf records = {0};
+      status = kc_store_rewrite_matches(store, &matched, changes, secret, &records);
+      if(status == errSecSuccess){
+        status = kc_store_commit(store, lock_fd, &store->header, &records);
+        lock_fd = -1;
+        changed = matched.count;
+      }
+      kc_buf_free(&records);
+    }
+    if(lock_fd >= 0){
+      close(lock_fd);
+    }
+    free(matched.ids);
+    pthread_mutex_unlock(&store->mutex);
+    kc_notify(changes ? kSecUpdateEvent : kSecDeleteEvent, keychain, changed);
+    total += changed;
+  }
+
+  CFRelease(keychains);
+  if(secret){
+    CFRelease(secret);
+  }
+  kc_query_free(&query);
+  if(status == errSecSuccess && total == 0){
+    status = errSecItemNotFound;
+  }
+  return status;
+}
+
+OSStatus SecItemUpdate(CFDictionaryRef query, CFDictionaryRef attributesToUpdate){
+  if(!attributesToUpdate){
+    return errSecParam;
+  }
+  return kc_modify_matching(query, attributesToUpdate);
+}
+
+OSStatus SecItemDelete(CFDictionaryRef query){
+  return kc_modify_matching(query, NULL);
+}
+
+/* Keychains */
+
+OSStatus SecKeychainCopyDefault(SecKeychainRef *keychain){
+  kc_init();
+  kc_store *store = kc_default_store();
+  if(!store){
+    return errSecNoDefaultKeychain;
+  }
+  *keychain = kc_keychain_create(store);
+  return errSecSuccess;
+}
+
+OSStatus SecKeychainOpen(const char *pathName, SecKeychainRef *keychain){
+  kc_init();
+  kc_store *store = kc_store_for_path(pathName);
+  if(!store){
+    return errSecAllocate;
+  }
+  *keychain = kc_keychain_create(store);
+  return errSecSuccess;
+}
+
+OSStatus SecKeychainCreate(const char *pathName, UInt32 passwordLength, const void *password, Boolean promptUser, SecAccessRef initialAccess, SecKeychainRef *keychain){
+  kc_init();
+  kc_default_store();
+  kc_store *store = kc_store_for_path(pathName);
+  if(!store){
+    return errSecAllocate;
+  }
+  struct stat info;
+  pthread_mutex_lock(&store->mutex);
+  OSStatus status = stat(store->path, &info) == 0 ? errSecDuplicateKeychain : kc_create_file(store, password, password ? passwordLength : 0);
+  pthread_mutex_unlock(&store->mutex);
+  if(status != errSecSuccess){
+    return status;
+  }
+
+  pthread_mutex_lock(&kc_registry_mutex);
+  kc_search_list_add(store);
+  pthread_mutex_unlock(&kc_registry_mutex);
+  *keychain = kc_keychain_create(store);
+  return errSecSuccess;
+}
+
+OSStatus SecKeychainDelete(SecKeychainRef keychain){
+  if(!kc_is_keychain(keychain)){
+    return errSecInvalidKeychain;
+  }
+  kc_store *store = keychain->store;
+  pthread_mutex_lock(&store->mutex);
+  OSStatus status = errSecSuccess;
+  if(unlink(store->path)){
+    status = errno == ENOENT ? errSecNoSuchKeychain : errSecIO;
+  }
+  kc_store_unmap(store);
+  kc_store_forget_key(store);
+  memset(&store->header, 0, sizeof(store->header));
+  pthread_mutex_unlock(&store->mutex);
+
+  pthread_mutex_lock(&kc_registry_mutex);
+  kc_search_list_remove(store);
+  pthread_mutex_unlock(&kc_registry_mutex);
+  return status;
+}
+
+OSStatus SecKeychainGetPath(SecKeychainRef keychain, UInt32 *ioPathLength, char *pathName){
+  if(!kc_is_keychain(keychain)){
+    return errSecInvalidKeychain;
+  }
+  size_t length = strlen(keychain->store->path);
+  if(length >= *ioPathLength){
+    return errSecParam;
+  }
+  memcpy(pathName, keychain->store->path, length + 1);
+  *ioPathLength = (UInt32)length;
+  return errSecSuccess;
+}
+
+OSStatus SecKeychainGetStatus(SecKeychainRef keychain, SecKeychainStatus *keychainStatus){
+  if(!kc_is_keychain(keychain)){
+    return errSecInvalidKeychain;
+  }
+  kc_store *store = keychain->store;
+  pthread_mutex_lock(&store->mutex);
+  OSStatus status = kc_store_sync(store);
+  if(status == errSecSuccess){
+    kc_store_ensure_unlocked(store);
+    *keychainStatus = (store->unlocked ? kSecUnlockStateStatus : 0) |
+                      (access(store->path, R_OK) == 0 ? kSecReadPermStatus : 0) |
+                      (access(store->path, W_OK) == 0 ? kSecWritePermStatus : 0);
+  }
+  pthread_mutex_unlock(&store->mutex);
+  return status;
+}
+
+OSStatus SecKeychainLock(SecKeychainRef keychain){
+  if(!kc_is_keychain(keychain)){
+    return errSecInvalidKeychain;
+  }
+  kc_store *store = keychain->store;
+  pthread_mutex_lock(&store->mutex);
+  OSStatus status = kc_store_sync(store);
+  kc_store_forget_key(store);
+  store->tried_empty_password = true;
+  pthread_mutex_unlock(&store->mutex);
+  if(status == errSecSuccess){
+    kc_notify(kSecLockEvent, keychain, 1);
+  }
+  return status;
+}
+
+OSStatus SecKeychainUnlock(SecKeychainRef keychain, UInt32 passwordLength, const void *password, Boolean usePassword){
+  if(!kc_is_keychain(keychain)){
+    return errSecInvalidKeychain;
+  }
+  kc_simulate_latency();
+  kc_store *store = keychain->store;
+  pthread_mutex_lock(&store->mutex);
+  OSStatus status = kc_store_sync(store);
+  if(status == errSecSuccess){
+    if(usePassword){
+      status = kc_store_try_unlock(store, password, password ? passwordLength : 0);
+    }else{
+      store->tried_empty_password = false;
+      status = kc_store_ensure_unlocked(store);
+    }
+  }
+  pthread_mutex_unlock(&store->mutex);
+  if(status == errSecSuccess){
+    kc_notify(kSecUnlockEvent, keychain, 1);
+  }
+  return status;
+}
+
+OSStatus SecKeychainCopySettings(SecKeychainRef keychain, SecKeychainSettings *outSettings){
+  if(!kc_is_keychain(keychain)){
+    return errSecInvalidKeychain;
+  }
+  kc_store *store = keychain->store;
+  pthread_mutex_lock(&store->mutex);
+  OSStatus status = kc_store_sync(store);
+  if(status == errSecSuccess){
+    outSettings->lockOnSleep = store->header.lock_on_sleep;
+    outSettings->useLockInterval = false;
+    outSettings->lockInterval = store->header.lock_interval;
+  }
+  pthread_mutex_unlock(&store->mutex);
+  return status;
+}
+
+OSStatus SecKeychainSetSettings(SecKeychainRef keychain, const SecKeychainSettings *newSettings){
+  if(!kc_is_keychain(keychain)){
+    return errSecInvalidKeychain;
+  }
+  kc_store *store = keychain->store;
+  int lock_fd = -1;
+  pthread_mutex_lock(&store->mutex);
+  OSStatus status = kc_store_begin_write(store, &lock_fd);
+  if(status == errSecSuccess){
+    kc_header header = store->header;
+    header.lock_on_sleep = newSettings->lockOnSleep;
+    header.lock_interval = newSettings->lockInterval;
+    kc_buf records = {0};
+    kc_store_copy_records(store, &records);
+    status = kc_store_commit(store, lock_fd, &header, &records);
+    kc_buf_free(&records);
+  }
+  pthread_mutex_unlock(&store->mutex);
+  return status;
+}
+
+/* Items */
+
+OSStatus SecKeychainItemDelete(SecKeychainItemRef itemRef){
+  CFTypeRef items[1] = {itemRef};
+  CFArrayRef item_list = CFArrayCreate(NULL, items, 1, &kCFTypeArrayCallBacks);
+  CFTypeRef keys[2] = {kSecClass, kSecMatchItemList};
+  CFTypeRef values[2] = {kc_class_string(itemRef->cls), item_list};
+  CFDictionaryRef query = CFDictionaryCreate(NULL, keys, values, 2, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  OSStatus status = SecItemDelete(query);
+  CFRelease(query);
+  CFRelease(item_list);
+  return status == errSecItemNotFound ? errSecInvalidItemRef : status;
+}
+
+OSStatus SecKeychainItemCopyKeychain(SecKeychainItemRef itemRef, SecKeychainRef *keychainRef){
+  *keychainRef = (SecKeychainRef)CFRetain(itemRef->keychain);
+  return errSecSuccess;
+}
+
+OSStatus SecKeychainItemCopyContent(SecKeychainItemRef itemRef, SecItemClass *itemClass, SecKeychainAttributeList *attrList, UInt32 *length, void **outData){
+  if(itemClass){
+    *itemClass = itemRef->cls;
+  }
+  if(!outData){
+    return errSecSuccess;
+  }
+  kc_simulate_latency();
+  kc_store *store = itemRef->keychain->store;
+  pthread_mutex_lock(&store->mutex);
+  OSStatus status = kc_store_sync(store);
+  kc_record record;
+  if(status == errSecSuccess && !kc_store_find_record(store, itemRef->id, &record)){
+    status = errSecInvalidItemRef;
+  }
+  if(status == errSecSuccess){
+    status = kc_store_ensure_unlocked(store);
+  }
+  if(status == errSecSuccess){
+    size_t secret_length = kc_secret_length(&record);
+    UInt8 *plaintext = kc_secret_alloc(secret_length);
+    status = plaintext ? kc_unseal(store, &record, plaintext) : errSecAllocate;
+    if(status == errSecSuccess){
+      *outData = plaintext;
+      if(length){
+        *length = (UInt32)secret_length;
+      }
+    }else{
+      kc_secret_free(plaintext);
+    }
+  }
+  pthread_mutex_unlock(&store->mutex);
+  return status;
+}
+
+OSStatus SecKeychainItemFreeContent(SecKeychainAttributeList *attrList, void *data){
+  kc_secret_free(data);
+  return errSecSuccess;
+}
+
+OSStatus SecKeychainItemCopyAttributesAndData(SecKeychainItemRef itemRef, SecKeychainAttributeInfo *info, SecItemClass *itemClass, SecKeychainAttributeList **attrList, UInt32 *length, void **outData){
+  if(attrList){
+    *attrList = NULL;
+  }
+  return SecKeychainItemCopyContent(itemRef, itemClass, NULL, length, outData);
+}
+
+OSStatus SecKeychainItemFreeAttributesAndData(SecKeychainAttributeList *attrList, void *data){
+  kc_secret_free(data);
+  return errSecSuccess;
+}
+
+/* Errors */
+
+CFStringRef SecCopyErrorMessageString(OSStatus status, void *reserved){
+  const char *message;
+  char buffer[64];
+  switch(status){
+    case errSecSuccess: message = "No error."; break;
+    case errSecUnimplemented: message = "Function or operation not implemented."; break;
+    case errSecIO: message = "I/O error."; break;
+    case errSecParam: message = "One or more parameters passed to a function were not valid."; break;
+    case errSecAllocate: message = "Failed to allocate memory."; break;
+    case errSecReadOnly: message = "This keychain cannot be modified."; break;
+    case errSecAuthFailed: message = "The user name or passphrase you entered is not correct."; break;
+    case errSecNoSuchKeychain: message = "The specified keychain could not be found."; break;
+    case errSecInvalidKeychain: message = "The specified keychain is not a valid keychain file."; break;
+    case errSecDuplicateKeychain: message = "A keychain with the same name already exists."; break;
+    case errSecDuplicateItem: message = "The specified item already exists in the keychain."; break;
+    case errSecItemNotFound: message = "The specified item could not be found in the keychain."; break;
+    case errSecInvalidItemRef: message = "The specified item is no longer valid. It may have been deleted from the keychain."; break;
+    case errSecNoDefaultKeychain: message = "A default keychain could not be found."; break;
+    case errSecInteractionNotAllowed: message = "User interaction is not allowed."; break;
+    case errSecDecode: message = "Unable to decode the provided data."; break;
+    default:
+      snprintf(buffer, sizeof(buffer), "OSStatus %d", (int)status);
+      message = buffer;
+  }
+  return CFStringCreateWithCString(NULL, message, kCFStringEncodingUTF8);
+}
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef KEYCHAIN_FILE_KEYCHAIN_H
+#define KEYCHAIN_FILE_KEYCHAIN_H
+
+/*
+ * A file backed implementation of the subset of the Security framework used by
+ * the extension, for platforms without Security.framework.
+ *
+ * Each keychain is a single file which is memory mapped for reads. Items are
+ * stored as records whose attributes are in the clear (as with OS X file based
+ * keychains) and whose secrets are encrypted with AES-256-GCM using a key derived
+ * from the keychain password. The file ends with an index over class, service,
+ * account and server so exact match lookups don't scan every record. Writes
+ * build a new image of the file and atomically rename it into place.
+ *
+ * The default keychain is $KEYCHAIN_DEFAULT_PATH, or ~/Library/Keychains/login.keychain,
+ * created with an empty password if it doesn't exist. The search list is the
+ * default keychain plus any keychain created by this process.
+ */
+
+#include "portable_cf.h"
+#include <sys/types.h>
+
+typedef struct OpaqueSecKeychainRef *SecKeychainRef;
+typedef struct OpaqueSecKeychainItemRef *SecKeychainItemRef;
+typedef struct OpaqueSecAccessRef *SecAccessRef;
+typedef struct SecKeychainAttributeInfo SecKeychainAttributeInfo;
+typedef struct SecKeychainAttributeList SecKeychainAttributeList;
+
+typedef FourCharCode SecItemClass;
+enum {
+  kSecInternetPasswordItemClass = KCF_FOURCC('i','n','e','t'),
+  kSecGenericPasswordItemClass = KCF_FOURCC('g','e','n','p')
+};
+
+typedef UInt32 SecKeychainStatus;
+enum {
+  kSecUnlockStateStatus = 1,
+  kSecReadPermStatus = 2,
+  kSecWritePermStatus = 4
+};
+
+#define SEC_KEYCHAIN_SETTINGS_VERS1 1
+typedef struct {
+  UInt32 version;
+  Boolean lockOnSleep;
+  Boolean useLockInterval;
+  UInt32 lockInterval;
+} SecKeychainSettings;
+
+enum {
+  errSecSuccess = 0,
+  errSecUnimplemented = -4,
+  errSecIO = -36,
+  errSecParam = -50,
+  errSecAllocate = -108,
+  errSecReadOnly = -25292,
+  errSecAuthFailed = -25293,
+  errSecNoSuchKeychain = -25294,
+  errSecInvalidKeychain = -25295,
+  errSecDuplicateKeychain = -25296,
+  errSecDuplicateCallback = -25297,
+  errSecInvalidCallback = -25298,
+  errSecDuplicateItem = -25299,
+  errSecItemNotFound = -25300,
+  errSecInvalidItemRef = -25304,
+  errSecNoDefaultKeychain = -25307,
+  errSecInteractionNotAllowed = -25308,
+  errSecDecode = -26275
+};
+#ifndef noErr
+#define noErr 0
+#endif
+
+typedef FourCharCode SecProtocolType;
+enum {
+  kSecProtocolTypeFTP = KCF_FOURCC('f','t','p',' '),
+  kSecProtocolTypeFTPAccount = KCF_FOURCC('f','t','p','a'),
+  kSecProtocolTypeHTTP = KCF_FOURCC('h','t','t','p'),
+  kSecProtocolTypeIRC = KCF_FOURCC('i','r','c',' '),
+  kSecProtocolTypeNNTP = KCF_FOURCC('n','n','t','p'),
+  kSecProtocolTypePOP3 = KCF_FOURCC('p','o','p','3'),
+  kSecProtocolTypeSMTP = KCF_FOURCC('s','m','t','p'),
+  kSecProtocolTypeSOCKS = KCF_FOURCC('s','o','x',' '),
+  kSecProtocolTypeIMAP = KCF_FOURCC('i','m','a','p'),
+  kSecProtocolTypeLDAP = KCF_FOURCC('l','d','a','p'),
+  kSecProtocolTypeAppleTalk = KCF_FOURCC('a','t','l','k'),
+  kSecProtocolTypeAFP = KCF_FOURCC('a','f','p',' '),
+  kSecProtocolTypeTelnet = KCF_FOURCC('t','e','l','n'),
+  kSecProtocolTypeSSH = KCF_FOURCC('s','s','h',' '),
+  kSecProtocolTypeFTPS = KCF_FOURCC('f','t','p','s'),
+  kSecProtocolTypeHTTPS = KCF_FOURCC('h','t','p','s'),
+  kSecProtocolTypeHTTPProxy = KCF_FOURCC('h','t','p','x'),
+  kSecProtocolTypeHTTPSProxy = KCF_FOURCC('h','t','s','x'),
+  kSecProtocolTypeFTPProxy = KCF_FOURCC('f','t','p','x'),
+  kSecProtocolTypeCIFS = KCF_FOURCC('c','i','f','s'),
+  kSecProtocolTypeSMB = KCF_FOURCC('s','m','b',' '),
+  kSecProtocolTypeRTSP = KCF_FOURCC('r','t','s','p'),
+  kSecProtocolTypeRTSPProxy = KCF_FOURCC('r','t','s','x'),
+  kSecProtocolTypeDAAP = KCF_FOURCC('d','a','a','p'),
+  kSecProtocolTypeEPPC = KCF_FOURCC('e','p','p','c'),
+  kSecProtocolTypeIPP = KCF_FOURCC('i','p','p',' '),
+  kSecProtocolTypeNNTPS = KCF_FOURCC('n','t','p','s'),
+  kSecProtocolTypeLDAPS = KCF_FOURCC('l','d','p','s'),
+  kSecProtocolTypeTelnetS = KCF_FOURCC('t','e','l','s'),
+  kSecProtocolTypeIMAPS = KCF_FOURCC('i','m','p','s'),
+  kSecProtocolTypeIRCS = KCF_FOURCC('i','r','c','s'),
+  kSecProtocolTypePOP3S = KCF_FOURCC('p','o','p','s'),
+  kSecProtocolTypeCVSpserver = KCF_FOURCC('c','v','s','p'),
+  kSecProtocolTypeSVN = KCF_FOURCC('s','v','n',' '),
+  kSecProtocolTypeAny = 0
+};
+
+extern const CFStringRef kSecClass;
+extern const CFStringRef kSecClassGenericPassword;
+extern const CFStringRef kSecClassInternetPassword;
+
+extern const CFStringRef kSecAttrCreationDate;
+extern const CFStringRef kSecAttrModificationDate;
+extern const CFStringRef kSecAttrDescription;
+extern const CFStringRef kSecAttrComment;
+extern const CFStringRef kSecAttrAccount;
+extern const CFStringRef kSecAttrService;
+extern const CFStringRef kSecAttrGeneric;
+extern const CFStringRef kSecAttrServer;
+extern const CFStringRef kSecAttrPort;
+extern const CFStringRef kSecAttrSecurityDomain;
+extern const CFStringRef kSecAttrIsNegative;
+extern const CFStringRef kSecAttrIsInvisible;
+extern const CFStringRef kSecAttrLabel;
+extern const CFStringRef kSecAttrPath;
+extern const CFStringRef kSecAttrProtocol;
+extern const CFStringRef kSecAttrAuthenticationType;
+
+extern const CFStringRef kSecValueData;
+extern const CFStringRef kSecValueRef;
+
+extern const CFStringRef kSecReturnAttributes;
+extern const CFStringRef kSecReturnRef;
+extern const CFStringRef kSecReturnData;
+
+extern const CFStringRef kSecMatchLimit;
+extern const CFStringRef kSecMatchLimitOne;
+extern const CFStringRef kSecMatchLimitAll;
+extern const CFStringRef kSecMatchSearchList;
+extern const CFStringRef kSecMatchItemList;
+
+extern const CFStringRef kSecUseKeychain;
+
+CFStringRef SecCopyErrorMessageString(OSStatus status, void *reserved);
+
+OSStatus SecKeychainCopyDefault(SecKeychainRef *keychain);
+OSStatus SecKeychainOpen(const char *pathName, SecKeychainRef *keychain);
+OSStatus SecKeychainCreate(const char *pathName, UInt32 passwordLength, const void *password, Boolean promptUser, SecAccessRef initialAccess, SecKeychainRef *keychain);
+OSStatus SecKeychainDelete(SecKeychainRef keychain);
+OSStatus SecKeychainGetPath(SecKeychainRef keychain, UInt32 *ioPathLength, char *pathName);
+OSStatus SecKeychainGetStatus(SecKeychainRef keychain, SecKeychainStatus *keychainStatus);
+OSStatus SecKeychainLock(SecKeychainRef keychain);
+OSStatus SecKeychainUnlock(SecKeychainRef keychain, UInt32 passwordLength, const void *password, Boolean usePassword);
+OSStatus SecKeychainCopySettings(SecKeychainRef keychain, SecKeychainSettings *outSettings);
+OSStatus SecKeychainSetSettings(SecKeychainRef keychain, const SecKeychainSettings *newSettings);
+
+typedef UInt32 SecKeychainEvent;
+enum {
+  kSecLockEvent = 1,
+  kSecUnlockEvent = 2,
+  kSecAddEvent = 3,
+  kSecDeleteEvent = 4,
+  kSecUpdateEvent = 5
+};
+
+typedef UInt32 SecKeychainEventMask;
+enum {
+  kSecLockEventMask = 1 << kSecLockEvent,
+  kSecUnlockEventMask = 1 << kSecUnlockEvent,
+  kSecAddEventMask = 1 << kSecAddEvent,
+  kSecDeleteEventMask = 1 << kSecDeleteEvent,
+  kSecUpdateEventMask = 1 << kSecUpdateEvent,
+  kSecEveryEventMask = 0xffffffff
+};
+
+typedef struct SecKeychainCallbackInfo {
+  UInt32 version;
+  SecKeychainItemRef item;
+  SecKeychainRef keychain;
+  pid_t pid;
+} SecKeychainCallbackInfo;
+
+typedef OSStatus (*SecKeychainCallback)(SecKeychainEvent keychainEvent, SecKeychainCallbackInfo *info, void *context);
+
+/*
+ * Only changes made by this process are reported, and callbacks are called on the thread
+ * that made the change once it has been made (item is always NULL), rather than on a run loop.
+ */
+OSStatus SecKeychainAddCallback(SecKeychainCallback callbackFunction, SecKeychainEventMask eventMask, void *userContext);
+OSStatus SecKeychainRemoveCallback(SecKeychainCallback callbackFunction);
+
+OSStatus SecItemAdd(CFDictionaryRef attributes, CFTypeRef *result);
+OSStatus SecItemCopyMatching(CFDictionaryRef query, CFTypeRef *result);
+OSStatus SecItemUpdate(CFDictionaryRef query, CFDictionaryRef attributesToUpdate);
+OSStatus SecItemDelete(CFDictionaryRef query);
+
+OSStatus SecKeychainItemDelete(SecKeychainItemRef itemRef);
+OSStatus SecKeychainItemCopyKeychain(SecKeychainItemRef itemRef, SecKeychainRef *keychainRef);
+OSStatus SecKeychainItemCopyContent(SecKeychainItemRef itemRef, SecItemClass *itemClass, SecKeychainAttributeList *attrList, UInt32 *length, void **outData);
+OSStatus SecKeychainItemFreeContent(SecKeychainAttributeList *attrList, void *data);
+OSStatus SecKeychainItemCopyAttributesAndData(SecKeychainItemRef itemRef, SecKeychainAttributeInfo *info, SecItemClass *itemClass, SecKeychainAttributeList **attrList, UInt32 *length, void **outData);
+OSStatus SecKeychainItemFreeAttributesAndData(SecKeychainAttributeList *attrList, void *data);
+
+/*
+ * Not part of the Security framework: adds each item as SecItemAdd would, but
+ * writes the keychain file once for the whole batch. Each item gets its own
+ * status (and result, if results isn't NULL). All the items must be added to
+ * the same keychain.
+ */
+void FileKeychainItemAddBatch(CFIndex count, const CFDictionaryRef *items, OSStatus *statuses, CFTypeRef *results);
+
+/*
+ * Not part of the Security framework: makes the calls that can block on OS X
+ * (item lookups and changes, unlocking, reading secrets) sleep first, so that
+ * tests can stand in for a slow Security layer.
+ */
+void FileKeychainSetSimulatedLatency(double seconds);
+double FileKeychainGetSimulatedLatency(void);
+
+#endif
@@ -1,6 +1,34 @@
 #include "ruby.h"
 #include "ruby/encoding.h"
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include "ruby/thread.h"
+#else
+#define rb_thread_call_without_gvl(func, data, ubf, data2) (void*)rb_thread_blocking_region((rb_blocking_function_t*)(func), (data), (ubf), (data2))
+#endif
+#ifdef KEYCHAIN_FILE_BACKEND
+#include "file_keychain.h"
+#else
 #include <Security/Security.h>
+#endif
+#include "cf_conversions.h"
+#include "secret_buffer.h"
+#include "metrics.h"
+#include "async.h"
+#include "predicates.h"
+#include "events.h"
+#include "registry.h"
+
+#ifndef HAVE_RB_GC_MARK_MOVABLE
+/* no compaction before ruby 2.7, so nothing moves */
+#define rb_gc_mark_movable rb_gc_mark
+#define rb_gc_location(value) (value)
+#endif
+#ifndef RUBY_TYPED_FREE_IMMEDIATELY
+#define RUBY_TYPED_FREE_IMMEDIATELY 0
+#endif
+#ifndef RUBY_TYPED_FROZEN_SHAREABLE
+#define RUBY_TYPED_FROZEN_SHAREABLE 0
+#endif
 
 VALUE rb_cKeychain;
 VALUE rb_eKeychainError;
@@ -8,179 +36,529 @@ VALUE rb_eKeychainDuplicateItemError;
 VALUE rb_eKeychainNoSuchKeychainError;
 VALUE rb_eKeychainAuthFailedError;
 VALUE rb_cKeychainItem;
+VALUE rb_cKeychainQuery;
 
 VALUE rb_cKeychainSecMap;
 
-VALUE rb_cPointerWrapper;
+
+/* The ruby names of keychain attributes, filled in by build_keychain_sec_map */
+#define KEYCHAIN_ATTRIBUTE_COUNT 16
+static struct {
+  const char *ruby_name;
+  ID name;
+  CFStringRef sec_key;
+  VALUE sec_name; /* frozen, interned ruby copy of sec_key */
+} keychain_attributes[KEYCHAIN_ATTRIBUTE_COUNT];
+static int keychain_attribute_count = 0;
+
+static int keychain_attribute_index(VALUE name){
+  if(SYMBOL_P(name)){
+    ID id = SYM2ID(name);
+    for(int i = 0; i < keychain_attribute_count; i++){
+      if(keychain_attributes[i].name == id){
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+static CFStringRef sec_key_for_attribute(VALUE name){
+  int index = keychain_attribute_index(name);
+  return index < 0 ? NULL : keychain_attributes[index].sec_key;
+}
+
+/* code => frozen message, filled in as messages are asked for by the main ractor */
+static VALUE error_messages = Qnil;
+
+static VALUE error_message_from_description(VALUE description){
+  return rb_obj_freeze(cfstring_to_rb_string((CFStringRef)description));
+}
+
+/* Keychain.error_message(code) returns the Security framework's description of an OSStatus */
+static VALUE rb_keychain_error_message(VALUE self, VALUE code){
+  OSStatus err = NUM2INT(code);
+  VALUE key = INT2NUM(err);
+  int cached = keychain_main_ractor_p();
+  VALUE message = cached ? rb_hash_lookup2(error_messages, key, Qundef) : Qundef;
+  if(message != Qundef){
+    return message;
+  }
+  CFStringRef description = SecCopyErrorMessageString(err, NULL);
+  if(description){
+    message = cf_release_on_raise(error_message_from_description, (VALUE)description, description);
+    CFRelease(description);
+  }else{
+    message = rb_obj_freeze(rb_sprintf("OSStatus %d", (int)err));
+  }
+  if(cached){
+    rb_hash_aset(error_messages, key, message);
+  }
+  return message;
+}
+
+/*
+ * Errors are often rescued without their message being read, so only the code is set here:
+ * Keychain::Error#message looks the message up when it is first asked for.
+ */
+static VALUE rb_keychain_error_for_status(OSStatus err){
+  VALUE klass;
+
+  switch(err){
+    case errSecAuthFailed:
+      klass = rb_eKeychainAuthFailedError;
+      break;
+    case errSecNoSuchKeychain:
+      klass = rb_eKeychainNoSuchKeychainError;
+      break;
+    case errSecDuplicateItem:
+      klass = rb_eKeychainDuplicateItemError;
+      break;
+    default:
+      klass = rb_eKeychainError;
+  }
+  VALUE exception = rb_obj_alloc(klass);
+  rb_ivar_set(exception, rb_intern("@code"), INT2FIX(err));
+  return exception;
+}
+
+/* Keychain.error_for_status(code) returns (without raising) the error a failing call with that status raises */
+static VALUE rb_keychain_error_for_status_m(VALUE self, VALUE code){
+  return rb_keychain_error_for_status(NUM2INT(code));
+}
+
 static void CheckOSStatusOrRaise(OSStatus err){
   if(err != 0){
-    CFStringRef description = SecCopyErrorMessageString(err, NULL);
+    keychain_metrics_record_error(err);
+    keychain_metrics_notify();
+    rb_exc_raise(rb_keychain_error_for_status(err));
+  }
+}
 
-    CFIndex bufferSize = CFStringGetMaximumSizeForEncoding(CFStringGetLength(description), kCFStringEncodingUTF8);
-    char *buffer = malloc(bufferSize + 1);
-    CFStringGetCString(description, buffer, bufferSize + 1, kCFStringEncodingUTF8);
-    CFRelease(description);
+/*
+ * Security framework calls can block for a long time (a slow lookup, or a locked keychain
+ * prompting the user), so they are made without the GVL. Callers build their CF arguments
+ * beforehand and convert results afterwards, as neither can be done without the GVL.
+ */
+struct sec_item_call {
+  CFDictionaryRef query;
+  CFDictionaryRef attributes;
+  CFTypeRef *result;
+  OSStatus status;
+};
+
+static void *sec_item_copy_matching_without_gvl(void *data){
+  struct sec_item_call *call = data;
+  call->status = SecItemCopyMatching(call->query, call->result);
+  return NULL;
+}
+
+static void *sec_item_add_without_gvl(void *data){
+  struct sec_item_call *call = data;
+  call->status = SecItemAdd(call->attributes, call->result);
+  return NULL;
+}
+
+static void *sec_item_update_without_gvl(void *data){
+  struct sec_item_call *call = data;
+  call->status = SecItemUpdate(call->query, call->attributes);
+  return NULL;
+}
+
+static long copy_matching_item_count(OSStatus status, CFTypeRef result){
+  if(status != noErr){
+    return 0;
+  }
+  return CFGetTypeID(result) == CFArrayGetTypeID() ? CFArrayGetCount(result) : 1;
+}
+
+static void *sec_item_delete_without_gvl(void *data){
+  struct sec_item_call *call = data;
+  call->status = SecItemDelete(call->query);
+  return NULL;
+}
+
+static OSStatus rb_sec_item_copy_matching(CFDictionaryRef query, CFTypeRef *result){
+  struct sec_item_call call = {query, NULL, result, noErr};
+  uint64_t start = keychain_metrics_now();
+  rb_thread_call_without_gvl(sec_item_copy_matching_without_gvl, &call, NULL, NULL);
+  keychain_metrics_record(KEYCHAIN_OP_COPY_MATCHING, start, call.status, copy_matching_item_count(call.status, *result));
+  return call.status;
+}
+
+static OSStatus rb_sec_item_add(CFDictionaryRef attributes, CFTypeRef *result){
+  struct sec_item_call call = {NULL, attributes, result, noErr};
+  uint64_t start = keychain_metrics_now();
+  rb_thread_call_without_gvl(sec_item_add_without_gvl, &call, NULL, NULL);
+  keychain_metrics_record(KEYCHAIN_OP_ADD, start, call.status, call.status == noErr);
+  return call.status;
+}
+
+static OSStatus rb_sec_item_update(CFDictionaryRef query, CFDictionaryRef attributes){
+  struct sec_item_call call = {query, attributes, NULL, noErr};
+  uint64_t start = keychain_metrics_now();
+  rb_thread_call_without_gvl(sec_item_update_without_gvl, &call, NULL, NULL);
+  keychain_metrics_record(KEYCHAIN_OP_UPDATE, start, call.status, call.status == noErr);
+  return call.status;
+}
+
+static OSStatus rb_sec_item_delete(CFDictionaryRef query){
+  struct sec_item_call call = {query, NULL, NULL, noErr};
+  uint64_t start = keychain_metrics_now();
+  rb_thread_call_without_gvl(sec_item_delete_without_gvl, &call, NULL, NULL);
+  keychain_metrics_record(KEYCHAIN_OP_DELETE, start, call.status, call.status == noErr);
+  return call.status;
+}
+
+struct sec_keychain_unlock_call {
+  SecKeychainRef keychain;
+  UInt32 length;
+  const void *password;
+  Boolean use_password;
+  OSStatus status;
+};
+
+static void *sec_keychain_unlock_without_gvl(void *data){
+  struct sec_keychain_unlock_call *call = data;
+  call->status = SecKeychainUnlock(call->keychain, call->length, call->password, call->use_password);
+  return NULL;
+}
+
+struct sec_item_copy_data_call {
+  SecKeychainItemRef item;
+  UInt32 length;
+  void *data;
+  OSStatus status;
+};
+
+static void *sec_item_copy_data_without_gvl(void *data){
+  struct sec_item_copy_data_call *call = data;
+  call->status = SecKeychainItemCopyAttributesAndData(call->item, NULL, NULL, NULL, &call->length, &call->data);
+  return NULL;
+}
 
-    VALUE exceptionString = rb_enc_str_new(buffer, strlen(buffer), rb_utf8_encoding());
-    free(buffer);
-    VALUE exception = Qnil;
+/*
+ * Items keep the attribute dictionary returned by the Security framework and only convert an
+ * attribute to a ruby object the first time it is read. Each attribute in keychain_attributes
+ * has a slot, which is Qundef until the attribute is read or assigned.
+ *
+ * changed has a bit set for each attribute assigned since the item was last saved or loaded,
+ * and KEYCHAIN_ITEM_PASSWORD_CHANGED if the password was, so save! only sends those. Rather than
+ * fetching the item again, a save folds what it sent into sec_attributes; only the modification
+ * date is then out of date, and it is fetched if read (stale is set until then).
+ */
+#define KEYCHAIN_ITEM_PASSWORD_CHANGED (1u << KEYCHAIN_ATTRIBUTE_COUNT)
+
+typedef struct {
+  SecKeychainItemRef item;
+  CFDictionaryRef sec_attributes;
+  VALUE unsaved_password;
+  unsigned int changed;
+  int stale;
+  VALUE slots[KEYCHAIN_ATTRIBUTE_COUNT];
+} keychain_item;
+
+static void keychain_item_mark(void *ptr){
+  keychain_item *item = ptr;
+  rb_gc_mark_movable(item->unsaved_password);
+  for(int i = 0; i < KEYCHAIN_ATTRIBUTE_COUNT; i++){
+    if(item->slots[i] != Qundef){
+      rb_gc_mark_movable(item->slots[i]);
+    }
+  }
+}
 
-    switch(err){
-      case errSecAuthFailed:
-        exception = rb_obj_alloc(rb_eKeychainAuthFailedError);
-        break;
-      case errSecNoSuchKeychain:
-        exception = rb_obj_alloc(rb_eKeychainNoSuchKeychainError);
-        break;
-      case errSecDuplicateItem:
-        exception = rb_obj_alloc(rb_eKeychainDuplicateItemError);
-        break;
-      default:
-        exception = rb_obj_alloc(rb_eKeychainError);
+static void keychain_item_compact(void *ptr){
+  keychain_item *item = ptr;
+  item->unsaved_password = rb_gc_location(item->unsaved_password);
+  for(int i = 0; i < KEYCHAIN_ATTRIBUTE_COUNT; i++){
+    if(item->slots[i] != Qundef){
+      item->slots[i] = rb_gc_location(item->slots[i]);
     }
-    rb_funcall(exception, rb_intern("initialize"), 2,exceptionString, INT2FIX(err));
-    rb_exc_raise(exception);
   }
 }
 
-static CFStringRef rb_create_cf_string(VALUE string){
-  StringValue(string);
-  string = rb_str_export_to_enc(string, rb_utf8_encoding());
-  char * c_string= StringValueCStr(string);
-  return CFStringCreateWithCString(NULL, c_string, kCFStringEncodingUTF8);
+static void keychain_item_free(void *ptr){
+  keychain_item *item = ptr;
+  if(item->item){
+    CFRelease(item->item);
+  }
+  if(item->sec_attributes){
+    CFRelease(item->sec_attributes);
+  }
+  xfree(item);
+}
+
+/* copies share the attribute dictionary, so it is counted for each of them */
+static size_t keychain_item_memsize(const void *ptr){
+  const keychain_item *item = ptr;
+  return sizeof(keychain_item) + cf_memsize(item->sec_attributes);
 }
 
-static CFDataRef rb_create_cf_data(VALUE string){
-  StringValue(string);
-  if(rb_enc_get_index(rb_obj_encoding(string))== rb_ascii8bit_encindex()){
-    return CFDataCreate(NULL, (UInt8*)RSTRING_PTR(string), RSTRING_LEN(string));
+/* a frozen item is never changed, even by reading it (see Item#freeze), so it can be shared */
+static const rb_data_type_t keychain_item_type = {
+  "Keychain::Item",
+  {keychain_item_mark, keychain_item_free, keychain_item_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+   keychain_item_compact,
+#endif
+  },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static keychain_item *get_keychain_item(VALUE self){
+  keychain_item *item;
+  TypedData_Get_Struct(self, keychain_item, &keychain_item_type, item);
+  if(!item->item){
+    rb_raise(rb_eTypeError, "uninitialized keychain item");
   }
-  else{
-    string = rb_str_export_to_enc(string, rb_utf8_encoding());
-    return CFDataCreate(NULL, (UInt8*)RSTRING_PTR(string), RSTRING_LEN(string));
+  return item;
+}
+
+/* For methods that assign to or save the item */
+static keychain_item *get_unfrozen_keychain_item(VALUE self){
+  rb_check_frozen(self);
+  return get_keychain_item(self);
+}
+
+static VALUE rb_keychain_item_alloc(VALUE klass){
+  keychain_item *item;
+  VALUE rb_item = TypedData_Make_Struct(klass, keychain_item, &keychain_item_type, item);
+  item->unsaved_password = Qnil;
+  for(int i = 0; i < KEYCHAIN_ATTRIBUTE_COUNT; i++){
+    item->slots[i] = Qundef;
+  }
+  return rb_item;
+}
+
+/* Copies share the underlying item and attribute dictionary, but not converted or assigned values */
+static VALUE rb_keychain_item_initialize_copy(VALUE self, VALUE original){
+  keychain_item *copy;
+  TypedData_Get_Struct(self, keychain_item, &keychain_item_type, copy);
+  keychain_item *item = get_keychain_item(original);
+  if(copy == item){
+    return self;
+  }
+  copy->item = (SecKeychainItemRef)CFRetain(item->item);
+  copy->unsaved_password = item->unsaved_password;
+  copy->changed = item->changed & KEYCHAIN_ITEM_PASSWORD_CHANGED;
+  copy->stale = item->stale;
+  if(item->sec_attributes){
+    copy->sec_attributes = CFRetain(item->sec_attributes);
   }
+  return self;
 }
 
-static VALUE cfstring_to_rb_string(CFStringRef s){
-  if(CFStringGetTypeID() != CFGetTypeID(s)){
-    rb_raise(rb_eTypeError, "Non cfstring passed to cfstring_to_rb_string");
+/* Replaces the attribute dictionary, discarding converted values but not unsaved changes */
+static void keychain_item_replace_sec_attributes(keychain_item *item, CFDictionaryRef dict){
+  CFRetain(dict);
+  if(item->sec_attributes){
+    CFRelease(item->sec_attributes);
   }
-  const char * fastBuffer = CFStringGetCStringPtr(s, kCFStringEncodingUTF8);
-  if(fastBuffer){
-    return rb_enc_str_new(fastBuffer, strlen(fastBuffer), rb_utf8_encoding());
-  }else{
-    CFIndex bufferLength = CFStringGetMaximumSizeForEncoding(CFStringGetLength(s),kCFStringEncodingUTF8);
-    char * buffer = malloc(bufferLength);
-    CFIndex used = 0;
-    CFStringGetBytes(s,CFRangeMake(0, CFStringGetLength(s)), kCFStringEncodingUTF8, 0, false, (UInt8*)buffer, bufferLength, &used);
-    VALUE rb_string = rb_enc_str_new(buffer, used, rb_utf8_encoding());
-    free(buffer);
-    return rb_string;
+  item->sec_attributes = dict;
+  item->stale = 0;
+  for(int i = 0; i < KEYCHAIN_ATTRIBUTE_COUNT; i++){
+    if(!(item->changed & (1u << i))){
+      item->slots[i] = Qundef;
+    }
   }
 }
 
+/* Replaces the attribute dictionary, discarding converted and assigned values */
+static void keychain_item_set_sec_attributes(keychain_item *item, CFDictionaryRef dict){
+  item->changed = 0;
+  keychain_item_replace_sec_attributes(item, dict);
+}
 
+static void set_dictionary_value(const void *key, const void *value, void *dict){
+  CFDictionarySetValue((CFMutableDictionaryRef)dict, key, value);
+}
 
+/*
+ * Called once the attributes in saved have been written to the item, with sent the changed
+ * bits they were built from. Changes made since they were built stay unsaved.
+ */
+static void keychain_item_saved(keychain_item *item, CFDictionaryRef saved, unsigned int sent){
+  CFMutableDictionaryRef dict = item->sec_attributes ?
+    CFDictionaryCreateMutableCopy(NULL, 0, item->sec_attributes) :
+    CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  CFDictionaryApplyFunction(saved, set_dictionary_value, dict);
+  /* a new password isn't kept: it may have come from a SecretBuffer */
+  CFDictionaryRemoveValue(dict, kSecValueData);
+  keychain_item_replace_sec_attributes(item, dict);
+  CFRelease(dict);
+  item->stale = 1;
+  if((sent & KEYCHAIN_ITEM_PASSWORD_CHANGED) && !(item->changed & KEYCHAIN_ITEM_PASSWORD_CHANGED)){
+    item->unsaved_password = Qnil;
+  }
+}
 
-static void cf_hash_to_rb_hash(const void *raw_key, const void * raw_value, void *ctx){
-  CFTypeRef value = (CFTypeRef)raw_value;
-  CFStringRef key = (CFStringRef)raw_key;
+static CFMutableDictionaryRef create_reload_query(SecKeychainItemRef keychainItem);
+
+/* Fetches the attributes again after a save, keeping unsaved changes */
+static void keychain_item_refresh(keychain_item *item){
+  CFMutableDictionaryRef query = create_reload_query(item->item);
+  CFDictionaryRef attributes;
+  OSStatus result = rb_sec_item_copy_matching(query, (CFTypeRef*)&attributes);
+  CFRelease(query);
+  CheckOSStatusOrRaise(result);
+  keychain_item_replace_sec_attributes(item, attributes);
+  CFRelease(attributes);
+}
 
-  VALUE rubyValue = Qnil;
-  VALUE hash = (VALUE)ctx;
+VALUE rb_keychain_item_from_sec_dictionary(CFDictionaryRef dict){
+  VALUE rb_item = rb_keychain_item_alloc(rb_cKeychainItem);
+  keychain_item *item;
+  TypedData_Get_Struct(rb_item, keychain_item, &keychain_item_type, item);
+  item->item = (SecKeychainItemRef)CFRetain(CFDictionaryGetValue(dict, kSecValueRef));
+  keychain_item_set_sec_attributes(item, dict);
+  return rb_item;
+}
 
-  if(CFStringGetTypeID() == CFGetTypeID(value)){
-    rubyValue = cfstring_to_rb_string((CFStringRef)value);
+static VALUE keychain_item_read_slot(VALUE self, int index){
+  keychain_item *item = get_keychain_item(self);
+  if(item->slots[index] != Qundef){
+    return item->slots[index];
   }
-  else if(CFDataGetTypeID() == CFGetTypeID(value)){
-    CFDataRef data = (CFDataRef)value;
-    rubyValue = rb_enc_str_new((const char*)CFDataGetBytePtr(data),CFDataGetLength(data), rb_ascii8bit_encoding());
+  int frozen = OBJ_FROZEN(self);
+  if(item->stale && !frozen && CFEqual(keychain_attributes[index].sec_key, kSecAttrModificationDate)){
+    keychain_item_refresh(item);
+    keychain_metrics_notify();
   }
-  else if(CFBooleanGetTypeID() == CFGetTypeID(value)){
-    Boolean booleanValue = CFBooleanGetValue(value);
-    rubyValue = booleanValue ? Qtrue : Qfalse;
+  CFTypeRef value = item->sec_attributes ? CFDictionaryGetValue(item->sec_attributes, keychain_attributes[index].sec_key) : NULL;
+  if(!value){
+    return Qnil;
   }
-  else if(CFNumberGetTypeID() == CFGetTypeID(value)){
-    if(CFNumberIsFloatType(value))
-    {
-      double doubleValue;
-      CFNumberGetValue(value, kCFNumberDoubleType, &doubleValue);
-      rubyValue = rb_float_new(doubleValue);
-    }else{
-      long long longValue;
-      CFNumberGetValue(value, kCFNumberLongLongType, &longValue);
-      rubyValue = LL2NUM(longValue);
-    }
+  VALUE rubyValue = cf_value_to_rb_value(value);
+  if(!NIL_P(rubyValue) && !frozen){
+    item->slots[index] = rubyValue;
   }
-  else if (CFDateGetTypeID() == CFGetTypeID(value)){
-    CFDateRef date = (CFDateRef) value;
-    CFAbsoluteTime abs_time = CFDateGetAbsoluteTime(date);
-    double secondsSinceUnixEpoch = abs_time + kCFAbsoluteTimeIntervalSince1970;
-    time_t seconds = (time_t)secondsSinceUnixEpoch;
-    long usec = (secondsSinceUnixEpoch - seconds) * 1000000;
-    rubyValue = rb_time_new((time_t)secondsSinceUnixEpoch, usec);
+  return rubyValue;
+}
+
+/*
+ * Converts every attribute (fetching the modification date again after a save) before the
+ * item is frozen, so that reading a frozen item doesn't change it. Ractor.make_shareable
+ * freezes items this way.
+ */
+static VALUE rb_keychain_item_freeze(VALUE self){
+  if(!OBJ_FROZEN(self)){
+    for(int i = 0; i < keychain_attribute_count; i++){
+      keychain_item_read_slot(self, i);
+    }
   }
+  return rb_call_super(0, NULL);
+}
+
+static VALUE keychain_item_write_slot(VALUE self, int index, VALUE value){
+  keychain_item *item = get_unfrozen_keychain_item(self);
+  item->slots[index] = value;
+  item->changed |= 1u << index;
+  return value;
+}
 
+#define KEYCHAIN_ITEM_ACCESSORS(index) \
+  static VALUE rb_keychain_item_get_##index(VALUE self){ return keychain_item_read_slot(self, index); } \
+  static VALUE rb_keychain_item_set_##index(VALUE self, VALUE value){ return keychain_item_write_slot(self, index, value); }
+
+KEYCHAIN_ITEM_ACCESSORS(0)
+KEYCHAIN_ITEM_ACCESSORS(1)
+KEYCHAIN_ITEM_ACCESSORS(2)
+KEYCHAIN_ITEM_ACCESSORS(3)
+KEYCHAIN_ITEM_ACCESSORS(4)
+KEYCHAIN_ITEM_ACCESSORS(5)
+KEYCHAIN_ITEM_ACCESSORS(6)
+KEYCHAIN_ITEM_ACCESSORS(7)
+KEYCHAIN_ITEM_ACCESSORS(8)
+KEYCHAIN_ITEM_ACCESSORS(9)
+KEYCHAIN_ITEM_ACCESSORS(10)
+KEYCHAIN_ITEM_ACCESSORS(11)
+KEYCHAIN_ITEM_ACCESSORS(12)
+KEYCHAIN_ITEM_ACCESSORS(13)
+KEYCHAIN_ITEM_ACCESSORS(14)
+KEYCHAIN_ITEM_ACCESSORS(15)
+
+static VALUE (*const keychain_item_getters[KEYCHAIN_ATTRIBUTE_COUNT])(VALUE) = {
+  rb_keychain_item_get_0, rb_keychain_item_get_1, rb_keychain_item_get_2, rb_keychain_item_get_3,
+  rb_keychain_item_get_4, rb_keychain_item_get_5, rb_keychain_item_get_6, rb_keychain_item_get_7,
+  rb_keychain_item_get_8, rb_keychain_item_get_9, rb_keychain_item_get_10, rb_keychain_item_get_11,
+  rb_keychain_item_get_12, rb_keychain_item_get_13, rb_keychain_item_get_14, rb_keychain_item_get_15
+};
+
+static VALUE (*const keychain_item_setters[KEYCHAIN_ATTRIBUTE_COUNT])(VALUE, VALUE) = {
+  rb_keychain_item_set_0, rb_keychain_item_set_1, rb_keychain_item_set_2, rb_keychain_item_set_3,
+  rb_keychain_item_set_4, rb_keychain_item_set_5, rb_keychain_item_set_6, rb_keychain_item_set_7,
+  rb_keychain_item_set_8, rb_keychain_item_set_9, rb_keychain_item_set_10, rb_keychain_item_set_11,
+  rb_keychain_item_set_12, rb_keychain_item_set_13, rb_keychain_item_set_14, rb_keychain_item_set_15
+};
+
+static void add_unknown_attribute_to_hash(const void *raw_key, const void *raw_value, void *ctx){
+  CFStringRef key = (CFStringRef)raw_key;
+  if(CFEqual(key, kSecValueRef)){
+    return;
+  }
+  for(int i = 0; i < keychain_attribute_count; i++){
+    if(CFEqual(key, keychain_attributes[i].sec_key)){
+      return;
+    }
+  }
+  VALUE rubyValue = cf_value_to_rb_value((CFTypeRef)raw_value);
   if(!NIL_P(rubyValue)){
-    rb_hash_aset(hash, cfstring_to_rb_string(key), rubyValue);
+    rb_hash_aset((VALUE)ctx, cfstring_to_rb_string(key), rubyValue);
   }
 }
 
-VALUE rb_keychain_item_from_sec_dictionary(CFDictionaryRef dict){
-  SecKeychainItemRef item = (SecKeychainItemRef) CFDictionaryGetValue(dict, kSecValueRef);
-  CFRetain(item);
-  VALUE rb_item = Data_Wrap_Struct(rb_cKeychainItem, NULL, CFRelease, item);
-  VALUE keychain_item_attributes = rb_hash_new();
-  CFDictionaryApplyFunction(dict, cf_hash_to_rb_hash, (void*)keychain_item_attributes);
-  rb_ivar_set(rb_item, rb_intern("@attributes"), keychain_item_attributes);
-  return rb_item;
+/*
+ * The item's attributes, keyed by attribute name. Attributes without a name are keyed by their
+ * Security framework name. The password is not included.
+ */
+static VALUE rb_keychain_item_to_h(VALUE self){
+  keychain_item *item = get_keychain_item(self);
+  VALUE hash = rb_hash_new();
+  for(int i = 0; i < keychain_attribute_count; i++){
+    if(CFEqual(keychain_attributes[i].sec_key, kSecValueData)){
+      continue;
+    }
+    VALUE value = keychain_item_read_slot(self, i);
+    if(!NIL_P(value)){
+      rb_hash_aset(hash, ID2SYM(keychain_attributes[i].name), value);
+    }
+  }
+  if(item->sec_attributes){
+    CFDictionaryApplyFunction(item->sec_attributes, add_unknown_attribute_to_hash, (void*)hash);
+  }
+  return hash;
 }
 
-static void rb_add_value_to_cf_dictionary(CFMutableDictionaryRef dict, CFStringRef key, VALUE value){
-  switch(TYPE(value)){
-    case T_STRING:
-      {
-        if(!CFStringCompare(key, kSecValueData,0) || !CFStringCompare(key, kSecAttrGeneric,0)){
-          CFDataRef dataValue = rb_create_cf_data(value);
-          CFDictionarySetValue(dict,key,dataValue);
-          CFRelease(dataValue);
-        }
-        else{
-          CFStringRef stringValue = rb_create_cf_string(value);
-          CFDictionarySetValue(dict,key,stringValue);
-          CFRelease(stringValue);
-        }
-      }
-      break;
-    case T_BIGNUM:
-    case T_FIXNUM:
-      {
-        long long longLongValue = NUM2LL(value);
-        CFNumberRef numberValue = CFNumberCreate(NULL,kCFNumberLongLongType,&longLongValue);
-        CFDictionarySetValue(dict,key,numberValue);
-        CFRelease(numberValue);
-        break;
-      }
-    case T_DATA:
-      {
-        if(rb_obj_is_kind_of(value, rb_cTime)){
-          VALUE floatTime = rb_funcall(value, rb_intern("to_f"),0);
-          CFAbsoluteTime abstime = RFLOAT_VALUE(floatTime) - kCFAbsoluteTimeIntervalSince1970;
-          CFDateRef cfdate = CFDateCreate(NULL, abstime);
-          CFDictionarySetValue(dict, key, cfdate);
-          CFRelease(cfdate);
-          break;
-        }
-      }
-    default:
-      rb_raise(rb_eTypeError, "Can't convert value to cftype: %s", rb_obj_classname(value));
+/* The names of the attributes assigned since the item was saved, including :password */
+static VALUE rb_keychain_item_changed(VALUE self){
+  keychain_item *item = get_keychain_item(self);
+  VALUE names = rb_ary_new();
+  for(int i = 0; i < keychain_attribute_count; i++){
+    if(item->changed & (1u << i)){
+      rb_ary_push(names, ID2SYM(keychain_attributes[i].name));
+    }
   }
+  if(item->changed & KEYCHAIN_ITEM_PASSWORD_CHANGED){
+    rb_ary_push(names, ID2SYM(rb_intern("password")));
+  }
+  return names;
+}
+
+static VALUE rb_keychain_item_is_changed(VALUE self){
+  return get_keychain_item(self)->changed ? Qtrue : Qfalse;
+}
+
+static void rb_add_value_to_cf_dictionary(CFMutableDictionaryRef dict, CFStringRef key, VALUE value){
+  int as_data = !CFStringCompare(key, kSecValueData,0) || !CFStringCompare(key, kSecAttrGeneric,0);
+  CFTypeRef cf_value = rb_create_cf_value(value, as_data);
+  CFDictionarySetValue(dict, key, cf_value);
+  CFRelease(cf_value);
 }
 
 
 static VALUE KeychainFromSecKeychainRef(SecKeychainRef keychainRef){
-  VALUE result = Data_Wrap_Struct(rb_cKeychain, NULL, CFRelease, keychainRef);
-  return result;
+  return keychain_registry_wrap(keychainRef);
 }
 
 static VALUE rb_default_keychain(VALUE self){
@@ -206,7 +584,7 @@ static VALUE rb_create_keychain(int argc, VALUE *argv, VALUE self){
   char * c_password = NULL;
   UInt32 passwordLength = 0;
   if(!NIL_P(password)){
-    password = rb_str_conv_enc(password, (rb_encoding*)rb_obj_encoding(password), rb_utf8_encoding());
+    password = rb_str_conv_enc(password, rb_enc_get(password), rb_utf8_encoding());
     c_password = StringValueCStr(password);
     passwordLength = (UInt32)strlen(c_password);
   }
@@ -219,317 +597,1616 @@ static VALUE rb_create_keychain(int argc, VALUE *argv, VALUE self){
 
 }
 
-static VALUE rb_keychain_path(VALUE self){
-  SecKeychainRef keychain=NULL;
-  Data_Get_Struct(self, struct OpaqueSecKeychainRef, keychain);
-  UInt32 pathLength = PATH_MAX;
-  char path[PATH_MAX];
-  OSStatus result = SecKeychainGetPath(keychain, &pathLength, path);
+static VALUE rb_keychain_path(VALUE self){
+  SecKeychainRef keychain = keychain_registry_ref(self);
+  UInt32 pathLength = PATH_MAX;
+  char path[PATH_MAX];
+  OSStatus result = SecKeychainGetPath(keychain, &pathLength, path);
+
+  CheckOSStatusOrRaise(result);
+  return rb_enc_str_new(path, pathLength, rb_utf8_encoding());
+}
+
+static VALUE rb_keychain_delete(VALUE self){
+
+  SecKeychainRef keychain = keychain_registry_ref(self);
+  OSStatus result = SecKeychainDelete(keychain);
+  /* a keychain that couldn't be deleted still exists, so stays interned */
+  CheckOSStatusOrRaise(result);
+  keychain_events_forget_status(keychain);
+  keychain_registry_forget(self);
+  return self;
+}
+
+static VALUE rb_keychain_item_delete(VALUE self){
+
+  SecKeychainItemRef keychainItem = get_keychain_item(self)->item;
+  uint64_t start = keychain_metrics_now();
+  OSStatus result = SecKeychainItemDelete(keychainItem);
+  keychain_metrics_record(KEYCHAIN_OP_DELETE, start, result, result == noErr);
+  CheckOSStatusOrRaise(result);
+  keychain_metrics_notify();
+  return self;
+}
+
+
+struct wrap_password_args {
+  VALUE (*wrap)(const char *, long);
+  void *data;
+  UInt32 length;
+};
+
+static VALUE wrap_password(VALUE data){
+  struct wrap_password_args *args = (struct wrap_password_args*)data;
+  return args->wrap(args->data, args->length);
+}
+
+/* Reads the saved password, passing its bytes to wrap */
+static VALUE keychain_item_read_password(keychain_item *item, VALUE (*wrap)(const char *, long)){
+  /* fetched along with the attributes when the item was found with :with_passwords */
+  CFTypeRef data = item->sec_attributes ? CFDictionaryGetValue(item->sec_attributes, kSecValueData) : NULL;
+  if(data && CFGetTypeID(data) == CFDataGetTypeID()){
+    return wrap((const char*)CFDataGetBytePtr(data), CFDataGetLength(data));
+  }
+
+  struct sec_item_copy_data_call call = {item->item, 0, NULL, noErr};
+  uint64_t start = keychain_metrics_now();
+  rb_thread_call_without_gvl(sec_item_copy_data_without_gvl, &call, NULL, NULL);
+  keychain_metrics_record(KEYCHAIN_OP_COPY_DATA, start, call.status, call.status == noErr);
+
+  CheckOSStatusOrRaise(call.status);
+
+  struct wrap_password_args args = {wrap, call.data, call.length};
+  int state = 0;
+  VALUE rb_data = rb_protect(wrap_password, (VALUE)&args, &state);
+  SecKeychainItemFreeAttributesAndData(NULL,call.data);
+  if(state){
+    rb_jump_tag(state);
+  }
+  return rb_data;
+}
+
+static VALUE rb_keychain_item_copy_password(VALUE self){
+  keychain_item *item = get_keychain_item(self);
+
+  if(!NIL_P(item->unsaved_password)){
+    return item->unsaved_password;
+  }
+  VALUE password = keychain_item_read_password(item, rb_str_new);
+  keychain_metrics_notify();
+  return password;
+}
+
+/* Like password, but copies the secret into a Keychain::SecretBuffer rather than a String */
+static VALUE rb_keychain_item_copy_password_buffer(VALUE self){
+  keychain_item *item = get_keychain_item(self);
+
+  if(!NIL_P(item->unsaved_password)){
+    if(rb_obj_is_kind_of(item->unsaved_password, rb_cKeychainSecretBuffer)){
+      return item->unsaved_password;
+    }
+    return rb_class_new_instance(1, &item->unsaved_password, rb_cKeychainSecretBuffer);
+  }
+  VALUE password = keychain_item_read_password(item, secret_buffer_new);
+  keychain_metrics_notify();
+  return password;
+}
+
+static VALUE rb_keychain_item_set_password(VALUE self, VALUE password){
+  keychain_item *item = get_unfrozen_keychain_item(self);
+  item->unsaved_password = password;
+  item->changed |= KEYCHAIN_ITEM_PASSWORD_CHANGED;
+  return password;
+}
+
+static int add_attribute_to_dictionary(VALUE key, VALUE value, VALUE dict){
+  CFStringRef sec_key = sec_key_for_attribute(key);
+  if(sec_key){
+    rb_add_value_to_cf_dictionary((CFMutableDictionaryRef)dict, sec_key, value);
+  }
+  return ST_CONTINUE;
+}
+
+struct add_password_attributes_args {
+  CFMutableDictionaryRef attributes;
+  VALUE kind;
+  VALUE options;
+};
+
+static VALUE fill_add_password_attributes(VALUE data){
+  struct add_password_attributes_args *args = (struct add_password_attributes_args*)data;
+  rb_add_value_to_cf_dictionary(args->attributes, kSecClass, args->kind);
+  rb_hash_foreach(args->options, add_attribute_to_dictionary, (VALUE)args->attributes);
+  return Qnil;
+}
+
+static CFMutableDictionaryRef create_add_password_attributes(VALUE self, VALUE kind, VALUE options){
+  SecKeychainRef keychain = keychain_registry_ref(self);
+
+  Check_Type(options, T_HASH);
+  Check_Type(kind, T_STRING);
+
+
+  CFMutableDictionaryRef attributes = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  CFDictionarySetValue(attributes, kSecReturnAttributes, kCFBooleanTrue);
+  CFDictionarySetValue(attributes, kSecReturnRef, kCFBooleanTrue);
+  CFDictionarySetValue(attributes, kSecUseKeychain, keychain);
+
+  struct add_password_attributes_args args = {attributes, kind, options};
+  cf_release_on_raise(fill_add_password_attributes, (VALUE)&args, attributes);
+  return attributes;
+}
+
+static VALUE rb_keychain_add_password(VALUE self, VALUE kind, VALUE options){
+  CFMutableDictionaryRef attributes = create_add_password_attributes(self, kind, options);
+  CFDictionaryRef result;
+
+  OSStatus status = rb_sec_item_add(attributes, (CFTypeRef*)&result);
+  CFRelease(attributes);
+  CheckOSStatusOrRaise(status);
+
+  VALUE rb_keychain_item = rb_keychain_item_from_sec_dictionary(result);
+  CFRelease(result);
+  keychain_metrics_notify();
+  return rb_keychain_item;
+}
+
+/*
+ * Keychain#try_add_password(kind, options) is add_password without the exception: it returns
+ * [status, item], where item is nil unless status is 0 (Keychain::Status::SUCCESS)
+ */
+static VALUE rb_keychain_try_add_password(VALUE self, VALUE kind, VALUE options){
+  CFMutableDictionaryRef attributes = create_add_password_attributes(self, kind, options);
+  CFDictionaryRef result = NULL;
+
+  OSStatus status = rb_sec_item_add(attributes, (CFTypeRef*)&result);
+  CFRelease(attributes);
+  if(status != noErr){
+    keychain_metrics_record_error(status);
+    keychain_metrics_notify();
+    return rb_assoc_new(INT2NUM(status), Qnil);
+  }
+  VALUE rb_keychain_item = rb_keychain_item_from_sec_dictionary(result);
+  CFRelease(result);
+  keychain_metrics_notify();
+  return rb_assoc_new(INT2NUM(status), rb_keychain_item);
+}
+
+
+struct sec_item_add_batch_call {
+  CFIndex count;
+  CFDictionaryRef *items;
+  OSStatus *statuses;
+  CFTypeRef *results;
+};
+
+static void *sec_item_add_batch_without_gvl(void *data){
+  struct sec_item_add_batch_call *call = data;
+#ifdef KEYCHAIN_FILE_BACKEND
+  FileKeychainItemAddBatch(call->count, (const CFDictionaryRef*)call->items, call->statuses, call->results);
+#else
+  for(CFIndex i = 0; i < call->count; i++){
+    call->statuses[i] = SecItemAdd(call->items[i], call->results ? &call->results[i] : NULL);
+  }
+#endif
+  return NULL;
+}
+
+struct add_passwords_args {
+  SecKeychainRef keychain;
+  VALUE kind;
+  VALUE items;
+  int return_items;
+  CFMutableDictionaryRef template;
+  struct sec_item_add_batch_call call;
+};
+
+static VALUE add_passwords_body(VALUE data){
+  struct add_passwords_args *args = (struct add_passwords_args*)data;
+  struct sec_item_add_batch_call *call = &args->call;
+  long count = RARRAY_LEN(args->items);
+
+  args->template = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  rb_add_value_to_cf_dictionary(args->template, kSecClass, args->kind);
+  CFDictionarySetValue(args->template, kSecUseKeychain, args->keychain);
+  if(args->return_items){
+    CFDictionarySetValue(args->template, kSecReturnAttributes, kCFBooleanTrue);
+    CFDictionarySetValue(args->template, kSecReturnRef, kCFBooleanTrue);
+  }
+
+  call->items = ALLOC_N(CFDictionaryRef, count);
+  call->statuses = ALLOC_N(OSStatus, count);
+  if(args->return_items){
+    call->results = ALLOC_N(CFTypeRef, count);
+    MEMZERO(call->results, CFTypeRef, count);
+  }
+  for(long i = 0; i < count; i++){
+    VALUE attributes = RARRAY_AREF(args->items, i);
+    Check_Type(attributes, T_HASH);
+    CFMutableDictionaryRef item = CFDictionaryCreateMutableCopy(NULL, 0, args->template);
+    call->items[call->count++] = item;
+    rb_hash_foreach(attributes, add_attribute_to_dictionary, (VALUE)item);
+  }
+
+  uint64_t start = keychain_metrics_now();
+  rb_thread_call_without_gvl(sec_item_add_batch_without_gvl, call, NULL, NULL);
+  OSStatus batch_status = noErr;
+  long added = 0;
+  for(long i = 0; i < count; i++){
+    if(call->statuses[i] == noErr){
+      added++;
+    }else if(batch_status == noErr){
+      batch_status = call->statuses[i];
+    }
+  }
+  keychain_metrics_record(KEYCHAIN_OP_ADD_BATCH, start, batch_status, added);
+
+  VALUE rb_results = rb_ary_new2(count);
+  for(long i = 0; i < count; i++){
+    if(call->statuses[i] != noErr){
+      rb_ary_push(rb_results, rb_keychain_error_for_status(call->statuses[i]));
+    }else if(args->return_items){
+      rb_ary_push(rb_results, rb_keychain_item_from_sec_dictionary(call->results[i]));
+    }else{
+      rb_ary_push(rb_results, Qtrue);
+    }
+  }
+  return rb_results;
+}
+
+static VALUE add_passwords_ensure(VALUE data){
+  struct add_passwords_args *args = (struct add_passwords_args*)data;
+  struct sec_item_add_batch_call *call = &args->call;
+  for(CFIndex i = 0; i < call->count; i++){
+    CFRelease(call->items[i]);
+    if(call->results && call->results[i]){
+      CFRelease(call->results[i]);
+    }
+  }
+  xfree(call->items);
+  xfree(call->statuses);
+  xfree(call->results);
+  if(args->template){
+    CFRelease(args->template);
+  }
+  return Qnil;
+}
+
+/*
+ * Adds an item for each hash of attributes, returning for each either the new item (or true if
+ * return_items is false) or the Keychain::Error describing why it couldn't be added.
+ */
+static VALUE rb_keychain_add_passwords(int argc, VALUE *argv, VALUE self){
+  SecKeychainRef keychain = keychain_registry_ref(self);
+
+  VALUE kind, items, options;
+  rb_scan_args(argc, argv, "21", &kind, &items, &options);
+  Check_Type(kind, T_STRING);
+  Check_Type(items, T_ARRAY);
+
+  struct add_passwords_args args;
+  MEMZERO(&args, struct add_passwords_args, 1);
+  args.keychain = keychain;
+  args.kind = kind;
+  args.items = items;
+  args.return_items = 1;
+  if(!NIL_P(options)){
+    Check_Type(options, T_HASH);
+    VALUE return_items = rb_hash_lookup2(options, ID2SYM(rb_intern("return_items")), Qundef);
+    if(return_items != Qundef){
+      args.return_items = RTEST(return_items);
+    }
+  }
+
+  VALUE results = rb_ensure(add_passwords_body, (VALUE)&args, add_passwords_ensure, (VALUE)&args);
+  keychain_metrics_notify();
+  return results;
+}
+
+
+static CFMutableDictionaryRef sec_query_identifying_item(SecKeychainItemRef item){
+  CFMutableDictionaryRef query = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+
+  CFArrayRef itemArray = CFArrayCreate(NULL, (const void**)&item, 1, &kCFTypeArrayCallBacks);
+
+  CFDictionarySetValue(query, kSecMatchItemList, itemArray);
+
+  CFRelease(itemArray);
+
+  return query;
+}
+
+
+static CFStringRef rb_copy_item_class(SecKeychainItemRef item){
+  SecItemClass secItemClass;
+  SecKeychainItemCopyContent(item, &secItemClass, NULL, NULL, NULL);
+  secItemClass = CFSwapInt32HostToBig(secItemClass);
+  CFStringRef cfclass = CFStringCreateWithBytes(NULL, (UInt8*)&secItemClass, sizeof(secItemClass), kCFStringEncodingUTF8, false);
+  return cfclass;
+}
+
+/* Doesn't need the GVL, so async workers can reload items too */
+static CFMutableDictionaryRef create_reload_query(SecKeychainItemRef keychainItem){
+  CFMutableDictionaryRef query = sec_query_identifying_item(keychainItem);
+
+  CFDictionarySetValue(query, kSecReturnAttributes, kCFBooleanTrue);
+  CFStringRef cfclass = rb_copy_item_class(keychainItem);
+  CFDictionarySetValue(query, kSecClass, cfclass);
+  CFRelease(cfclass);
+  return query;
+}
+
+static VALUE rb_keychain_item_reload(VALUE self){
+  keychain_item *item = get_unfrozen_keychain_item(self);
+
+  CFMutableDictionaryRef query = create_reload_query(item->item);
+  CFDictionaryRef attributes;
+  OSStatus result = rb_sec_item_copy_matching(query, (CFTypeRef*)&attributes);
+  CFRelease(query);
+  CheckOSStatusOrRaise(result);
+  keychain_item_set_sec_attributes(item, attributes);
+  item->unsaved_password = Qnil;
+  CFRelease(attributes);
+  keychain_metrics_notify();
+
+  return self;
+}
+
+struct item_update_args {
+  keychain_item *item;
+  CFMutableDictionaryRef attributes;
+};
+
+static VALUE fill_item_update(VALUE data){
+  struct item_update_args *args = (struct item_update_args*)data;
+  keychain_item *item = args->item;
+  CFMutableDictionaryRef attributes = args->attributes;
+
+  for(int i = 0; i < keychain_attribute_count; i++){
+    CFStringRef sec_key = keychain_attributes[i].sec_key;
+    if((item->changed & (1u << i)) &&
+       CFStringCompare(sec_key, kSecAttrCreationDate, 0) &&
+       CFStringCompare(sec_key, kSecAttrModificationDate, 0) &&
+       CFStringCompare(sec_key, kSecClass, 0)){ /*these values ared read only*/
+      rb_add_value_to_cf_dictionary(attributes, sec_key, item->slots[i]);
+    }
+  }
+
+  if(item->changed & KEYCHAIN_ITEM_PASSWORD_CHANGED){
+    rb_add_value_to_cf_dictionary(attributes, kSecValueData, item->unsaved_password);
+  }
+  return Qnil;
+}
+
+/* Builds the query identifying item and the changed attributes save! sends */
+static CFMutableDictionaryRef create_item_update(keychain_item *item, CFMutableDictionaryRef *query_out){
+  SecKeychainItemRef keychainItem = item->item;
+
+  /* the attributes are converted first, as they're what can raise */
+  struct item_update_args args = {item, CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks)};
+  cf_release_on_raise(fill_item_update, (VALUE)&args, args.attributes);
+  CFMutableDictionaryRef attributes = args.attributes;
+
+  CFMutableDictionaryRef query = sec_query_identifying_item(keychainItem);
+  CFStringRef cfclass = rb_copy_item_class(keychainItem);
+  CFDictionarySetValue(query, kSecClass, cfclass);
+  CFRelease(cfclass);
+  *query_out = query;
+  return attributes;
+}
+
+/*
+ * save!(options = {}) sends the attributes and password assigned since the item was last
+ * saved, if any. Pass :reload => true to fetch all the attributes again afterwards.
+ */
+static VALUE rb_keychain_item_save(int argc, VALUE *argv, VALUE self){
+  VALUE options;
+  rb_scan_args(argc, argv, "01", &options);
+  int reload = 0;
+  if(!NIL_P(options)){
+    Check_Type(options, T_HASH);
+    reload = RTEST(rb_hash_aref(options, ID2SYM(rb_intern("reload"))));
+  }
+
+  keychain_item *item = get_unfrozen_keychain_item(self);
+  if(item->changed){
+    CFMutableDictionaryRef query;
+    CFMutableDictionaryRef attributes = create_item_update(item, &query);
+    unsigned int sent = item->changed;
+    item->changed = 0;
+
+    OSStatus result = noErr;
+    if(CFDictionaryGetCount(attributes) > 0){
+      result = rb_sec_item_update(query, attributes);
+      if(result == noErr){
+        keychain_item_saved(item, attributes, sent);
+      }else{
+        item->changed |= sent;
+      }
+    }
+
+    CFRelease(query);
+    CFRelease(attributes);
+    CheckOSStatusOrRaise(result);
+  }
+  if(reload){
+    rb_keychain_item_reload(self);
+  }
+  keychain_metrics_notify();
+  return self;
+}
+
+struct sec_item_update_batch_call {
+  CFIndex count;
+  CFDictionaryRef *queries;
+  CFDictionaryRef *changes;
+  OSStatus *statuses;
+};
+
+static void *sec_item_update_batch_without_gvl(void *data){
+  struct sec_item_update_batch_call *call = data;
+  for(CFIndex i = 0; i < call->count; i++){
+    call->statuses[i] = noErr;
+    if(call->changes[i] && CFDictionaryGetCount(call->changes[i]) > 0){
+      call->statuses[i] = SecItemUpdate(call->queries[i], call->changes[i]);
+    }
+  }
+  return NULL;
+}
+
+struct save_all_args {
+  VALUE items;
+  unsigned int *sent;
+  struct sec_item_update_batch_call call;
+};
+
+static VALUE save_all_body(VALUE data){
+  struct save_all_args *args = (struct save_all_args*)data;
+  struct sec_item_update_batch_call *call = &args->call;
+  long count = RARRAY_LEN(args->items);
+
+  call->queries = ALLOC_N(CFDictionaryRef, count);
+  call->changes = ALLOC_N(CFDictionaryRef, count);
+  call->statuses = ALLOC_N(OSStatus, count);
+  args->sent = ALLOC_N(unsigned int, count);
+  for(long i = 0; i < count; i++){
+    VALUE rb_item = RARRAY_AREF(args->items, i);
+    if(!rb_obj_is_kind_of(rb_item, rb_cKeychainItem)){
+      rb_raise(rb_eTypeError, "expected a Keychain::Item");
+    }
+    keychain_item *item = get_unfrozen_keychain_item(rb_item);
+    call->queries[i] = NULL;
+    call->changes[i] = NULL;
+    call->count++;
+    if(item->changed){
+      CFMutableDictionaryRef query;
+      call->changes[i] = create_item_update(item, &query);
+      call->queries[i] = query;
+    }
+  }
+  /* only once every update has been built, so that a bad value leaves all the items unsaved */
+  for(long i = 0; i < count; i++){
+    keychain_item *item = get_keychain_item(RARRAY_AREF(args->items, i));
+    args->sent[i] = item->changed;
+    item->changed = 0;
+  }
+
+  uint64_t start = keychain_metrics_now();
+  rb_thread_call_without_gvl(sec_item_update_batch_without_gvl, call, NULL, NULL);
+  OSStatus batch_status = noErr;
+  long updated = 0;
+  for(long i = 0; i < count; i++){
+    if(call->statuses[i] != noErr){
+      if(batch_status == noErr){
+        batch_status = call->statuses[i];
+      }
+    }else if(call->changes[i] && CFDictionaryGetCount(call->changes[i]) > 0){
+      updated++;
+    }
+  }
+  keychain_metrics_record(KEYCHAIN_OP_UPDATE_BATCH, start, batch_status, updated);
+
+  VALUE rb_results = rb_ary_new2(count);
+  for(long i = 0; i < count; i++){
+    VALUE rb_item = RARRAY_AREF(args->items, i);
+    keychain_item *item = get_keychain_item(rb_item);
+    if(call->statuses[i] != noErr){
+      item->changed |= args->sent[i];
+      rb_ary_push(rb_results, rb_keychain_error_for_status(call->statuses[i]));
+    }else{
+      if(call->changes[i] && CFDictionaryGetCount(call->changes[i]) > 0){
+        keychain_item_saved(item, call->changes[i], args->sent[i]);
+      }
+      rb_ary_push(rb_results, rb_item);
+    }
+  }
+  return rb_results;
+}
+
+static VALUE save_all_ensure(VALUE data){
+  struct save_all_args *args = (struct save_all_args*)data;
+  struct sec_item_update_batch_call *call = &args->call;
+  for(CFIndex i = 0; i < call->count; i++){
+    if(call->queries[i]){
+      CFRelease(call->queries[i]);
+      CFRelease(call->changes[i]);
+    }
+  }
+  xfree(call->queries);
+  xfree(call->changes);
+  xfree(call->statuses);
+  xfree(args->sent);
+  return Qnil;
+}
+
+/*
+ * Item.save_all(items) saves the changes to each item, making all the Security calls in one
+ * go without the GVL. Returns for each either the item or the Keychain::Error describing why
+ * it couldn't be saved.
+ */
+static VALUE rb_keychain_item_save_all(VALUE self, VALUE items){
+  Check_Type(items, T_ARRAY);
+  items = rb_ary_dup(items);
+
+  struct save_all_args args;
+  MEMZERO(&args, struct save_all_args, 1);
+  args.items = items;
+  VALUE results = rb_ensure(save_all_body, (VALUE)&args, save_all_ensure, (VALUE)&args);
+  RB_GC_GUARD(items);
+  keychain_metrics_notify();
+  return results;
+}
+
+
+
+
+/*
+ * find(:each) yields items as they are wrapped rather than building an array of all of them.
+ * Each result dictionary is released as soon as its item has been created, so the only
+ * references left are those held by items the caller has kept.
+ */
+struct find_each_args {
+  CFTypeRef *results;
+  CFIndex count;
+  CFIndex next;
+  long batch_size;
+};
+
+static VALUE find_each_take(struct find_each_args *args){
+  CFTypeRef result = args->results[args->next];
+  VALUE rb_item = rb_keychain_item_from_sec_dictionary(result);
+  args->results[args->next++] = NULL;
+  CFRelease(result);
+  return rb_item;
+}
+
+static VALUE find_each_yield(VALUE data){
+  struct find_each_args *args = (struct find_each_args*)data;
+  while(args->next < args->count){
+    if(args->batch_size > 0){
+      VALUE batch = rb_ary_new2(args->batch_size);
+      while(args->next < args->count && RARRAY_LEN(batch) < args->batch_size){
+        rb_ary_push(batch, find_each_take(args));
+      }
+      rb_yield(batch);
+    }else{
+      rb_yield(find_each_take(args));
+    }
+  }
+  return Qnil;
+}
+
+static VALUE find_each_release(VALUE data){
+  struct find_each_args *args = (struct find_each_args*)data;
+  for(CFIndex i = args->next; i < args->count; i++){
+    if(args->results[i]){
+      CFRelease(args->results[i]);
+    }
+  }
+  xfree(args->results);
+  return Qnil;
+}
+
+static VALUE find_each_allocate(VALUE data){
+  struct find_each_args *args = (struct find_each_args*)data;
+  args->results = ALLOC_N(CFTypeRef, args->count > 0 ? args->count : 1);
+  return Qnil;
+}
+
+static VALUE find_each_with_results(CFTypeRef result, long batch_size){
+  int is_array = CFArrayGetTypeID() == CFGetTypeID(result);
+  struct find_each_args args = {NULL, is_array ? CFArrayGetCount(result) : 1, 0, batch_size};
+  cf_release_on_raise(find_each_allocate, (VALUE)&args, result);
+  if(is_array){
+    for(CFIndex i = 0; i < args.count; i++){
+      args.results[i] = CFRetain(CFArrayGetValueAtIndex(result, i));
+    }
+    CFRelease(result);
+  }else{
+    args.results[0] = result;
+  }
+  rb_ensure(find_each_yield, (VALUE)&args, find_each_release, (VALUE)&args);
+  return Qnil;
+}
+
+struct find_condition_args {
+  CFMutableDictionaryRef query;
+  VALUE *predicates;
+};
+
+/* Adds an exact condition to the query, or any other to the predicates evaluated after it runs */
+static int add_find_condition(VALUE key, VALUE value, VALUE data){
+  struct find_condition_args *args = (struct find_condition_args*)data;
+  CFStringRef sec_key = sec_key_for_attribute(key);
+  if(!sec_key){
+    return ST_CONTINUE;
+  }
+  if(keychain_predicate_value_p(value)){
+    if(!args->predicates){
+      rb_raise(rb_eArgError, "update_all and delete_all only support exact conditions, not %"PRIsVALUE, rb_inspect(value));
+    }
+    if(NIL_P(*args->predicates)){
+      *args->predicates = keychain_predicates_new();
+    }
+    keychain_predicates_add(*args->predicates, sec_key, value);
+  }else{
+    rb_add_value_to_cf_dictionary(args->query, sec_key, value);
+  }
+  return ST_CONTINUE;
+}
+
+/*
+ * Adds the keychains, limit, with_passwords and conditions options of a find to query. Conditions
+ * that SecItemCopyMatching can't evaluate go in *predicates (nil if there are none); the query
+ * then returns every item matching the others and the limit is applied once they've been filtered.
+ * If predicates is NULL such conditions raise ArgumentError.
+ */
+static void add_find_options_to_query(CFMutableDictionaryRef query, VALUE attributes, long *batch_size, VALUE *predicates){
+  Check_Type(attributes, T_HASH);
+  VALUE rb_keychains = rb_hash_aref(attributes, ID2SYM(rb_intern("keychains")));
+  if(!NIL_P(rb_keychains)){
+    Check_Type(rb_keychains, T_ARRAY);
+    CFMutableArrayRef searchArray = CFArrayCreateMutable(NULL, RARRAY_LEN(rb_keychains), &kCFTypeArrayCallBacks);
+    /* owned by the query before anything is looked up, as that can raise */
+    CFDictionarySetValue(query, kSecMatchSearchList,searchArray);
+    CFRelease(searchArray);
+    for(int index=0; index < RARRAY_LEN(rb_keychains); index++){
+      SecKeychainRef keychain = keychain_registry_ref(RARRAY_PTR(rb_keychains)[index]);
+      CFArrayAppendValue(searchArray, keychain);
+    }
+  }  
+
+  VALUE limit = rb_hash_aref(attributes, ID2SYM(rb_intern("limit")));
+  if(!NIL_P(limit)){
+    Check_Type(limit, T_FIXNUM);
+    long c_limit = FIX2LONG(limit);
+    CFNumberRef cf_limit = CFNumberCreate(NULL, kCFNumberLongType, &c_limit);
+    CFDictionarySetValue(query, kSecMatchLimit, cf_limit);
+    CFRelease(cf_limit);
+  }
+
+  if(RTEST(rb_hash_aref(attributes, ID2SYM(rb_intern("with_passwords"))))){
+    CFDictionarySetValue(query, kSecReturnData, kCFBooleanTrue);
+  }
+
+  VALUE rb_batch_size = rb_hash_aref(attributes, ID2SYM(rb_intern("batch_size")));
+  if(!NIL_P(rb_batch_size)){
+    Check_Type(rb_batch_size, T_FIXNUM);
+    *batch_size = FIX2LONG(rb_batch_size);
+  }
+
+  VALUE conditions = rb_hash_aref(attributes, ID2SYM(rb_intern("conditions")));
+  
+  if(!NIL_P(conditions)){
+    Check_Type(conditions, T_HASH);
+    struct find_condition_args args = {query, predicates};
+    rb_hash_foreach(conditions, add_find_condition, (VALUE)&args);
+  }
+
+  if(predicates && !NIL_P(*predicates)){
+    if(!NIL_P(limit)){
+      keychain_predicates_set_limit(*predicates, FIX2LONG(limit));
+    }
+    CFDictionarySetValue(query, kSecMatchLimit, kSecMatchLimitAll);
+  }
+}
+
+struct find_query_args {
+  CFMutableDictionaryRef query;
+  VALUE kind;
+  VALUE options;
+  long *batch_size;
+  VALUE *predicates;
+};
+
+static VALUE fill_find_query(VALUE data){
+  struct find_query_args *args = (struct find_query_args*)data;
+  rb_add_value_to_cf_dictionary(args->query, kSecClass, args->kind);
+  if(!NIL_P(args->options)){
+    add_find_options_to_query(args->query, args->options, args->batch_size, args->predicates);
+  }
+  return Qnil;
+}
+
+/* Adds kind and the options of a find (which may be nil) to query, releasing query if they can't be converted */
+static void add_find_to_query(CFMutableDictionaryRef query, VALUE kind, VALUE options, long *batch_size, VALUE *predicates){
+  struct find_query_args args = {query, kind, options, batch_size, predicates};
+  cf_release_on_raise(fill_find_query, (VALUE)&args, query);
+}
+
+/* The query for find(:first), or for :all and :each if all is set */
+static CFMutableDictionaryRef create_find_query(VALUE kind, int all, VALUE options, long *batch_size, VALUE *predicates){
+  CFMutableDictionaryRef query = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+
+  CFDictionarySetValue(query, kSecReturnAttributes, kCFBooleanTrue);
+  CFDictionarySetValue(query, kSecReturnRef, kCFBooleanTrue);
+  if(all){
+    CFDictionarySetValue(query, kSecMatchLimit, kSecMatchLimitAll);
+  }
+  add_find_to_query(query, kind, options, batch_size, predicates);
+  return query;
+}
+
+static VALUE items_from_results(VALUE data){
+  CFTypeRef result = (CFTypeRef)data;
+  VALUE rb_items = rb_ary_new2(0);
+  if(CFArrayGetTypeID() == CFGetTypeID(result)){
+    CFArrayRef result_array = (CFArrayRef)result;
+    for(CFIndex i = 0; i < CFArrayGetCount(result_array); i++){
+      rb_ary_push(rb_items, rb_keychain_item_from_sec_dictionary(CFArrayGetValueAtIndex(result_array,i)));
+    }
+  }
+  else{
+    rb_ary_push(rb_items, rb_keychain_item_from_sec_dictionary(result));
+  }
+  return rb_items;
+}
+
+static VALUE release_results(VALUE data){
+  CFRelease((CFTypeRef)data);
+  return Qnil;
+}
+
+/*
+ * Converts what SecItemCopyMatching returned for a find query, releasing result. Only the
+ * dictionaries that match predicates (unless it is nil) become items.
+ */
+static VALUE find_results_to_ruby(OSStatus status, CFTypeRef result, ID mode, long batch_size, VALUE predicates){
+  if(status == noErr && !NIL_P(predicates)){
+    CFArrayRef matches = keychain_predicates_filter(predicates, result, mode == rb_intern("first"));
+    result = matches;
+    if(CFArrayGetCount(matches) == 0){
+      CFRelease(matches);
+      status = errSecItemNotFound;
+    }
+  }
+  if(mode == rb_intern("each")){
+    if(status == errSecItemNotFound){
+      return Qnil;
+    }
+    CheckOSStatusOrRaise(status);
+    return find_each_with_results((CFTypeRef)result, batch_size);
+  }
+
+  VALUE rb_item = Qnil;
+
+  switch(status){
+    case errSecItemNotFound: 
+      rb_item = rb_ary_new2(0);
+      break;
+    default:
+    CheckOSStatusOrRaise(status);
+    rb_item = rb_ensure(items_from_results, (VALUE)result, release_results, (VALUE)result);
+  }
+
+  if(mode == rb_intern("first")){
+    return rb_ary_entry(rb_item,0);
+  }
+  else{
+    return rb_item;
+  }
+}
+
+/* Runs a query built by create_find_query, returning (or yielding) items as find does for mode */
+static VALUE run_find_query(CFDictionaryRef query, ID mode, long batch_size, VALUE predicates){
+  CFTypeRef result;
+
+  OSStatus status = rb_sec_item_copy_matching(query, &result);
+  return find_results_to_ruby(status, result, mode, batch_size, predicates);
+}
+
+/*
+ * With :parallel and several :keychains, find runs one query per keychain on up to that many
+ * native threads, rather than a single query whose search list is walked one keychain after
+ * another, and merges the results in search list order. Once the keychains at the front of the
+ * list have returned as many items as the limit (one for :first) no more are queried. With
+ * predicates every keychain is, as matches are only counted once the results are filtered.
+ */
+#define PARALLEL_FIND_MAX_THREADS 16
+
+enum {
+  SEARCH_PENDING,
+  SEARCH_RUNNING,
+  SEARCH_DONE
+};
+
+struct parallel_search {
+  CFMutableDictionaryRef query;
+  CFTypeRef result;
+  OSStatus status;
+  uint64_t elapsed_ns;
+  int state;
+};
+
+/* next, merged, found, state, stop and interrupted are guarded by mutex */
+struct parallel_find {
+  CFIndex count;
+  struct parallel_search *searches;
+  int threads;
+  long limit; /* negative if every keychain has to be queried */
+  CFIndex next; /* the next keychain to query */
+  CFIndex merged; /* every keychain before this one has been queried */
+  long found; /* the items those keychains returned */
+  int stop;
+  int interrupted;
+  pthread_mutex_t mutex;
+
+  ID mode;
+  long batch_size;
+  VALUE predicates;
+};
+
+/* The number of items a query returns at most, or -1 if it returns them all */
+static long query_match_limit(CFDictionaryRef query){
+  CFTypeRef limit = CFDictionaryGetValue(query, kSecMatchLimit);
+  if(!limit || CFEqual(limit, kSecMatchLimitOne)){
+    return 1;
+  }
+  long c_limit = -1;
+  if(CFGetTypeID(limit) == CFNumberGetTypeID()){
+    CFNumberGetValue(limit, kCFNumberLongType, &c_limit);
+  }
+  return c_limit;
+}
+
+static void *parallel_find_worker(void *data){
+  struct parallel_find *find = data;
+  pthread_mutex_lock(&find->mutex);
+  while(!find->stop && !find->interrupted && find->next < find->count){
+    struct parallel_search *search = &find->searches[find->next++];
+    search->state = SEARCH_RUNNING;
+    pthread_mutex_unlock(&find->mutex);
+
+    uint64_t start = keychain_metrics_now();
+    search->status = SecItemCopyMatching(search->query, &search->result);
+    search->elapsed_ns = keychain_metrics_now() - start;
+
+    pthread_mutex_lock(&find->mutex);
+    search->state = SEARCH_DONE;
+    while(!find->stop && find->merged < find->count && find->searches[find->merged].state == SEARCH_DONE){
+      struct parallel_search *merged = &find->searches[find->merged++];
+      find->found += copy_matching_item_count(merged->status, merged->result);
+      /* a serial search stops at the first keychain that fails too */
+      if((merged->status != noErr && merged->status != errSecItemNotFound) || (find->limit >= 0 && find->found >= find->limit)){
+        find->stop = 1;
+      }
+    }
+  }
+  pthread_mutex_unlock(&find->mutex);
+  return NULL;
+}
+
+/* The calling thread queries keychains too, alongside up to threads - 1 others */
+static void *parallel_find_without_gvl(void *data){
+  struct parallel_find *find = data;
+  pthread_t threads[PARALLEL_FIND_MAX_THREADS];
+  int started = 0;
+  while(started < find->threads - 1 && pthread_create(&threads[started], NULL, parallel_find_worker, find) == 0){
+    started++;
+  }
+  parallel_find_worker(find);
+  for(int i = 0; i < started; i++){
+    pthread_join(threads[i], NULL);
+  }
+  return NULL;
+}
+
+/* Keychains already being queried can't be interrupted, but no more are started */
+static void parallel_find_interrupt(void *data){
+  struct parallel_find *find = data;
+  pthread_mutex_lock(&find->mutex);
+  find->interrupted = 1;
+  pthread_mutex_unlock(&find->mutex);
+}
 
-  CheckOSStatusOrRaise(result);
-  return rb_enc_str_new(path, pathLength, rb_utf8_encoding());
+/*
+ * Merges the results of each keychain in search list order, up to the limit, releasing them.
+ * The status is that of the first keychain to fail, as a serial search's would be.
+ */
+static CFTypeRef parallel_find_merge(struct parallel_find *find, OSStatus *status){
+  CFMutableArrayRef merged = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+  *status = errSecItemNotFound;
+  for(CFIndex i = 0; i < find->count && (find->limit < 0 || CFArrayGetCount(merged) < find->limit); i++){
+    struct parallel_search *search = &find->searches[i];
+    if(search->status == errSecItemNotFound){
+      continue;
+    }
+    if(search->status != noErr){
+      *status = search->status;
+      break;
+    }
+    *status = noErr;
+    if(CFGetTypeID(search->result) == CFArrayGetTypeID()){
+      for(CFIndex j = 0; j < CFArrayGetCount(search->result) && (find->limit < 0 || CFArrayGetCount(merged) < find->limit); j++){
+        CFArrayAppendValue(merged, CFArrayGetValueAtIndex(search->result, j));
+      }
+    }else{
+      CFArrayAppendValue(merged, search->result);
+    }
+  }
+  for(CFIndex i = 0; i < find->count; i++){
+    if(find->searches[i].result){
+      CFRelease(find->searches[i].result);
+      find->searches[i].result = NULL;
+    }
+  }
+  if(*status != noErr){
+    CFRelease(merged);
+    return NULL;
+  }
+  return merged;
 }
 
-static VALUE rb_keychain_delete(VALUE self){
+static VALUE parallel_find_body(VALUE data){
+  struct parallel_find *find = (struct parallel_find*)data;
+  for(;;){
+    rb_thread_call_without_gvl(parallel_find_without_gvl, find, parallel_find_interrupt, find);
+    if(!find->interrupted){
+      break;
+    }
+    /* raises if the thread was interrupted by Thread#raise, Thread#kill or a signal */
+    rb_thread_check_ints();
+    find->interrupted = 0;
+  }
+  for(CFIndex i = 0; i < find->count; i++){
+    struct parallel_search *search = &find->searches[i];
+    if(search->state == SEARCH_DONE){
+      keychain_metrics_record_elapsed(KEYCHAIN_OP_COPY_MATCHING, search->elapsed_ns, search->status, copy_matching_item_count(search->status, search->result));
+    }
+  }
+  OSStatus status;
+  CFTypeRef result = parallel_find_merge(find, &status);
+  return find_results_to_ruby(status, result, find->mode, find->batch_size, find->predicates);
+}
 
-  SecKeychainRef keychain=NULL;
-  Data_Get_Struct(self, struct OpaqueSecKeychainRef, keychain);
-  OSStatus result = SecKeychainDelete(keychain);
-  CheckOSStatusOrRaise(result);
-  return self;
+static VALUE parallel_find_release(VALUE data){
+  struct parallel_find *find = (struct parallel_find*)data;
+  for(CFIndex i = 0; i < find->count; i++){
+    CFRelease(find->searches[i].query);
+    if(find->searches[i].result){
+      CFRelease(find->searches[i].result);
+    }
+  }
+  xfree(find->searches);
+  pthread_mutex_destroy(&find->mutex);
+  return Qnil;
 }
 
-static VALUE rb_keychain_item_delete(VALUE self){
+static VALUE parallel_find_allocate(VALUE data){
+  struct parallel_find *find = (struct parallel_find*)data;
+  find->searches = ALLOC_N(struct parallel_search, find->count);
+  memset(find->searches, 0, sizeof(struct parallel_search) * find->count);
+  return Qnil;
+}
 
-  SecKeychainItemRef keychainItem=NULL;
-  Data_Get_Struct(self, struct OpaqueSecKeychainItemRef, keychainItem);
-  OSStatus result = SecKeychainItemDelete(keychainItem);
-  CheckOSStatusOrRaise(result);
-  return self;
+/*
+ * Runs a query built by create_find_query with a search list of count keychains, one keychain
+ * per thread. query is released.
+ */
+static VALUE run_parallel_find_query(CFMutableDictionaryRef query, CFIndex count, ID mode, long batch_size, VALUE predicates, int threads){
+  struct parallel_find find;
+  memset(&find, 0, sizeof(find));
+  find.count = count;
+  cf_release_on_raise(parallel_find_allocate, (VALUE)&find, query);
+  CFArrayRef search_list = CFDictionaryGetValue(query, kSecMatchSearchList);
+  for(CFIndex i = 0; i < count; i++){
+    const void *keychain = CFArrayGetValueAtIndex(search_list, i);
+    CFArrayRef single = CFArrayCreate(NULL, &keychain, 1, &kCFTypeArrayCallBacks);
+    find.searches[i].query = CFDictionaryCreateMutableCopy(NULL, 0, query);
+    CFDictionarySetValue(find.searches[i].query, kSecMatchSearchList, single);
+    CFRelease(single);
+  }
+  find.threads = threads < count ? threads : (int)count;
+  find.limit = query_match_limit(query);
+  CFRelease(query);
+  pthread_mutex_init(&find.mutex, NULL);
+  find.mode = mode;
+  find.batch_size = batch_size;
+  find.predicates = predicates;
+  VALUE result = rb_ensure(parallel_find_body, (VALUE)&find, parallel_find_release, (VALUE)&find);
+  RB_GC_GUARD(predicates);
+  return result;
 }
 
+/* The number of threads the :parallel option of a find asks for, or 0 */
+static int parallel_find_threads(VALUE attributes){
+  if(NIL_P(attributes)){
+    return 0;
+  }
+  Check_Type(attributes, T_HASH);
+  VALUE parallel = rb_hash_aref(attributes, ID2SYM(rb_intern("parallel")));
+  if(!RTEST(parallel)){
+    return 0;
+  }
+  if(parallel == Qtrue){
+    return PARALLEL_FIND_MAX_THREADS;
+  }
+  int threads = NUM2INT(parallel);
+  if(threads < 1){
+    rb_raise(rb_eArgError, "parallel must be true or a positive number of threads, not %d", threads);
+  }
+  return threads < PARALLEL_FIND_MAX_THREADS ? threads : PARALLEL_FIND_MAX_THREADS;
+}
 
-static VALUE rb_keychain_item_copy_password(VALUE self){
-  void *data;
-  SecKeychainItemRef keychainItem=NULL;
-  UInt32 dataLength;
-  Data_Get_Struct(self, struct OpaqueSecKeychainItemRef, keychainItem);
+static VALUE rb_keychain_find(int argc, VALUE *argv, VALUE self){
 
-  VALUE unsaved = rb_ivar_get(self, rb_intern("unsaved_password"));
+  VALUE kind;
+  VALUE attributes;
+  VALUE first_or_all;
+  rb_scan_args(argc, argv, "21", &first_or_all, &kind, &attributes);
 
+  Check_Type(first_or_all, T_SYMBOL);
+  Check_Type(kind, T_STRING);
 
-  if(!NIL_P(unsaved)){
-    return unsaved;
+  ID mode = rb_to_id(first_or_all);
+  if(mode == rb_intern("each")){
+    RETURN_ENUMERATOR(self, argc, argv);
   }
-  else{
-    OSStatus result = SecKeychainItemCopyAttributesAndData(keychainItem, NULL , NULL, NULL, &dataLength, &data);
-
-    CheckOSStatusOrRaise(result);
+  long batch_size = 0;
+  VALUE predicates = Qnil;
+  int threads = parallel_find_threads(attributes);
+  
+  CFMutableDictionaryRef query = create_find_query(kind, mode == rb_intern("all") || mode == rb_intern("each"), attributes, &batch_size, &predicates);
 
-    VALUE rb_data = rb_enc_str_new(data, dataLength, rb_ascii8bit_encoding());
-    SecKeychainItemFreeAttributesAndData(NULL,data);
-    return rb_data;
+  CFArrayRef search_list = CFDictionaryGetValue(query, kSecMatchSearchList);
+  if(threads > 0 && search_list && CFArrayGetCount(search_list) > 1){
+    VALUE result = run_parallel_find_query(query, CFArrayGetCount(search_list), mode, batch_size, predicates, threads);
+    keychain_metrics_notify();
+    return result;
   }
+  VALUE result = run_find_query(query, mode, batch_size, predicates);
+  CFRelease(query);
+  keychain_metrics_notify();
+  return result;
 }
 
-static VALUE add_conditions_to_query(VALUE pair, VALUE r_cfdict, int argc, VALUE argv[]){
+/*
+ * Keychain.find_status(kind, options = nil) returns the status Keychain.find(:first, kind, options)
+ * would have got - 0 if an item matches, Keychain::Status::ITEM_NOT_FOUND if none does - without
+ * raising or building an item. Without predicates only a reference to the first match is fetched.
+ */
+static VALUE rb_keychain_find_status(int argc, VALUE *argv, VALUE self){
+  VALUE kind;
+  VALUE attributes;
+  rb_scan_args(argc, argv, "11", &kind, &attributes);
+  Check_Type(kind, T_STRING);
 
-  VALUE key = RARRAY_PTR(pair)[0];
-  VALUE value = RARRAY_PTR(pair)[1];
+  long batch_size = 0;
+  VALUE predicates = Qnil;
+  CFMutableDictionaryRef query = create_find_query(kind, 0, attributes, &batch_size, &predicates);
+  CFDictionaryRemoveValue(query, kSecReturnData);
+  if(NIL_P(predicates)){
+    CFDictionaryRemoveValue(query, kSecReturnAttributes);
+    CFDictionaryRemoveValue(query, kSecMatchLimit);
+  }
 
-  VALUE sec_key = rb_hash_aref(rb_cKeychainSecMap, key);
-  if(!NIL_P(sec_key)){
-    CFDictionaryRef cfdict;
-    Data_Get_Struct(r_cfdict, struct __CFDictionary , cfdict);
-    CFStringRef cf_key = rb_create_cf_string(sec_key);
-    rb_add_value_to_cf_dictionary((CFMutableDictionaryRef)cfdict, cf_key, value);
-    CFRelease(cf_key);
+  CFTypeRef result = NULL;
+  OSStatus status = rb_sec_item_copy_matching(query, &result);
+  CFRelease(query);
+  if(status == noErr && !NIL_P(predicates)){
+    CFArrayRef matches = keychain_predicates_filter(predicates, result, 1);
+    if(CFArrayGetCount(matches) == 0){
+      status = errSecItemNotFound;
+    }
+    CFRelease(matches);
+  }else if(status == noErr && result){
+    CFRelease(result);
   }
-  return Qnil;
+  keychain_metrics_notify();
+  return INT2NUM(status);
 }
 
-static VALUE rb_keychain_add_password(VALUE self, VALUE kind, VALUE options){
-  SecKeychainRef keychain=NULL;
-  Data_Get_Struct(self, struct OpaqueSecKeychainRef, keychain);
-
-  Check_Type(options, T_HASH);
+/* The query find would use for kind and options, without a limit or anything to return */
+static CFMutableDictionaryRef create_modify_query(VALUE kind, VALUE options){
   Check_Type(kind, T_STRING);
+  Check_Type(options, T_HASH);
+  if(!NIL_P(rb_hash_aref(options, ID2SYM(rb_intern("limit"))))){
+    rb_raise(rb_eArgError, "update_all and delete_all change every matching item and can't be limited");
+  }
+  CFMutableDictionaryRef query = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  long batch_size = 0;
+  add_find_to_query(query, kind, options, &batch_size, NULL);
+  CFDictionaryRemoveValue(query, kSecReturnData);
+  return query;
+}
 
+/*
+ * Keychain.update_all(kind, options, attributes) sets attributes (which may include :password)
+ * on every item find would return, in a single call. Returns whether any item matched.
+ */
+struct update_all_args {
+  VALUE kind;
+  VALUE options;
+  VALUE attributes;
+  CFMutableDictionaryRef query;
+  CFMutableDictionaryRef changes;
+};
+
+/* Unlike add_attribute_to_dictionary, raises for attributes it doesn't know rather than leaving them out */
+static int add_update_to_dictionary(VALUE key, VALUE value, VALUE dict){
+  CFStringRef sec_key = sec_key_for_attribute(key);
+  if(!sec_key){
+    rb_raise(rb_eArgError, "unknown attribute %"PRIsVALUE, rb_inspect(key));
+  }
+  rb_add_value_to_cf_dictionary((CFMutableDictionaryRef)dict, sec_key, value);
+  return ST_CONTINUE;
+}
 
-  CFMutableDictionaryRef attributes = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-  rb_add_value_to_cf_dictionary(attributes, kSecClass, kind);
-  CFDictionarySetValue(attributes, kSecReturnAttributes, kCFBooleanTrue);
-  CFDictionarySetValue(attributes, kSecReturnRef, kCFBooleanTrue);
-  CFDictionarySetValue(attributes, kSecUseKeychain, keychain);
-
-  VALUE rAttributes = Data_Wrap_Struct(rb_cPointerWrapper, NULL, NULL, attributes);
-
-  rb_block_call(options, rb_intern("each"), 0, NULL, RUBY_METHOD_FUNC(add_conditions_to_query), (VALUE)rAttributes);
+static VALUE update_all_body(VALUE data){
+  struct update_all_args *args = (struct update_all_args*)data;
+  args->changes = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  rb_hash_foreach(args->attributes, add_update_to_dictionary, (VALUE)args->changes);
+  if(CFDictionaryGetCount(args->changes) == 0){
+    rb_raise(rb_eArgError, "no attributes to update");
+  }
+  args->query = create_modify_query(args->kind, args->options);
+  return INT2NUM(rb_sec_item_update(args->query, args->changes));
+}
 
-  CFDictionaryRef result;
+static VALUE update_all_ensure(VALUE data){
+  struct update_all_args *args = (struct update_all_args*)data;
+  if(args->query){
+    CFRelease(args->query);
+  }
+  if(args->changes){
+    CFRelease(args->changes);
+  }
+  return Qnil;
+}
 
-  OSStatus status = SecItemAdd(attributes, (CFTypeRef*)&result);
-  CFRelease(attributes);
+static VALUE rb_keychain_update_all(VALUE self, VALUE kind, VALUE options, VALUE attributes){
+  Check_Type(attributes, T_HASH);
+  struct update_all_args args = {kind, options, attributes, NULL, NULL};
+  OSStatus status = NUM2INT(rb_ensure(update_all_body, (VALUE)&args, update_all_ensure, (VALUE)&args));
+  keychain_metrics_notify();
+  if(status == errSecItemNotFound){
+    return Qfalse;
+  }
   CheckOSStatusOrRaise(status);
-
-  VALUE rb_keychain_item = rb_keychain_item_from_sec_dictionary(result);
-  CFRelease(result);
-  return rb_keychain_item;
+  return Qtrue;
 }
 
+/* Keychain.delete_all(kind, options) deletes every item find would return. Returns whether any matched */
+static VALUE rb_keychain_delete_all(VALUE self, VALUE kind, VALUE options){
+  CFMutableDictionaryRef query = create_modify_query(kind, options);
+  OSStatus status = rb_sec_item_delete(query);
+  CFRelease(query);
+  keychain_metrics_notify();
+  if(status == errSecItemNotFound){
+    return Qfalse;
+  }
+  CheckOSStatusOrRaise(status);
+  return Qtrue;
+}
 
-static VALUE copy_attributes_for_update(VALUE pair, VALUE r_cfdict, int argc, VALUE argv[]){
-
-  VALUE key = RARRAY_PTR(pair)[0];
-  VALUE value = RARRAY_PTR(pair)[1];
+/*
+ * A prepared query holds the dictionaries find would build for :first and for :all / :each,
+ * so that running it again only has to convert the values bound to its parameters.
+ */
+typedef struct {
+  CFDictionaryRef first_query;
+  CFDictionaryRef all_query;
+  long param_count;
+  CFStringRef *param_keys;
+  VALUE param_names;
+  long batch_size;
+  VALUE predicates;
+} keychain_query;
+
+static void keychain_query_mark(void *ptr){
+  keychain_query *query = ptr;
+  rb_gc_mark_movable(query->param_names);
+  rb_gc_mark_movable(query->predicates);
+}
 
-  CFStringRef cf_key = rb_create_cf_string(key);
-  if(CFStringCompare(cf_key, kSecAttrCreationDate, 0) &&
-     CFStringCompare(cf_key, kSecAttrModificationDate, 0) &&
-     CFStringCompare(cf_key, kSecClass, 0)){ /*these values ared read only*/
-    
-    CFMutableDictionaryRef cfdict;
-    Data_Get_Struct(r_cfdict, struct __CFDictionary , cfdict);
+static void keychain_query_compact(void *ptr){
+  keychain_query *query = ptr;
+  query->param_names = rb_gc_location(query->param_names);
+  query->predicates = rb_gc_location(query->predicates);
+}
 
-    rb_add_value_to_cf_dictionary(cfdict, cf_key, value);
+static void keychain_query_free(void *ptr){
+  keychain_query *query = ptr;
+  if(query->first_query){
+    CFRelease(query->first_query);
   }
-  CFRelease(cf_key);
-  
-  return Qnil;
+  if(query->all_query){
+    CFRelease(query->all_query);
+  }
+  xfree(query->param_keys);
+  xfree(query);
 }
 
-static CFMutableDictionaryRef sec_query_identifying_item(SecKeychainItemRef item){
-  CFMutableDictionaryRef query = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-
-  CFArrayRef itemArray = CFArrayCreate(NULL, (const void**)&item, 1, &kCFTypeArrayCallBacks);
-
-  CFDictionarySetValue(query, kSecMatchItemList, itemArray);
+static size_t keychain_query_memsize(const void *ptr){
+  const keychain_query *query = ptr;
+  return sizeof(keychain_query) + query->param_count * sizeof(CFStringRef) +
+    cf_memsize(query->first_query) + cf_memsize(query->all_query);
+}
 
-  CFRelease(itemArray);
+static const rb_data_type_t keychain_query_type = {
+  "Keychain::Query",
+  {keychain_query_mark, keychain_query_free, keychain_query_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+   keychain_query_compact,
+#endif
+  },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE rb_keychain_query_alloc(VALUE klass){
+  keychain_query *query;
+  VALUE rb_query = TypedData_Make_Struct(klass, keychain_query, &keychain_query_type, query);
+  query->param_names = Qnil;
+  query->predicates = Qnil;
+  return rb_query;
+}
 
+static keychain_query *get_keychain_query(VALUE self){
+  keychain_query *query;
+  TypedData_Get_Struct(self, keychain_query, &keychain_query_type, query);
+  if(!query->first_query){
+    rb_raise(rb_eTypeError, "uninitialized keychain query");
+  }
   return query;
 }
 
+/*
+ * Keychain::Query.new(kind, options, parameters) - options are those accepted by Keychain.find,
+ * parameters the names of the attributes whose values are supplied each time the query is run
+ */
+static VALUE rb_keychain_query_initialize(int argc, VALUE *argv, VALUE self){
+  VALUE kind;
+  VALUE attributes;
+  VALUE parameters;
+  rb_scan_args(argc, argv, "12", &kind, &attributes, &parameters);
+  Check_Type(kind, T_STRING);
 
-static CFStringRef rb_copy_item_class(SecKeychainItemRef item){
-  SecItemClass secItemClass;
-  SecKeychainItemCopyContent(item, &secItemClass, NULL, NULL, NULL);
-  secItemClass = CFSwapInt32HostToBig(secItemClass);
-  CFStringRef cfclass = CFStringCreateWithBytes(NULL, (UInt8*)&secItemClass, sizeof(secItemClass), kCFStringEncodingUTF8, false);
-  return cfclass;
-}
-
-static VALUE rb_keychain_item_reload(VALUE self){
-  SecKeychainItemRef keychainItem=NULL;
-  Data_Get_Struct(self, struct OpaqueSecKeychainItemRef, keychainItem);
+  keychain_query *query;
+  TypedData_Get_Struct(self, keychain_query, &keychain_query_type, query);
+  if(query->first_query){
+    rb_raise(rb_eTypeError, "already initialized keychain query");
+  }
 
-  CFMutableDictionaryRef query = sec_query_identifying_item(keychainItem);
+  parameters = NIL_P(parameters) ? rb_ary_new() : rb_ary_dup(rb_Array(parameters));
+  long param_count = RARRAY_LEN(parameters);
+  for(long i = 0; i < param_count; i++){
+    if(!sec_key_for_attribute(RARRAY_PTR(parameters)[i])){
+      rb_raise(rb_eArgError, "unknown query parameter %"PRIsVALUE, rb_inspect(RARRAY_PTR(parameters)[i]));
+    }
+  }
 
-  CFDictionarySetValue(query, kSecReturnAttributes, kCFBooleanTrue);
-  CFStringRef cfclass = rb_copy_item_class(keychainItem);
-  CFDictionarySetValue(query, kSecClass, cfclass);
-  CFRelease(cfclass);
+  /* allocated first, so that nothing that can raise is left once the query is built */
+  REALLOC_N(query->param_keys, CFStringRef, param_count > 0 ? param_count : 1);
+  CFMutableDictionaryRef first_query = create_find_query(kind, 0, attributes, &query->batch_size, &query->predicates);
 
-  CFDictionaryRef attributes;
-  OSStatus result = SecItemCopyMatching(query, (CFTypeRef*)&attributes);
-  CFRelease(query);
-  CheckOSStatusOrRaise(result);
-  VALUE new_attributes = rb_hash_new();
-  CFDictionaryApplyFunction(attributes, cf_hash_to_rb_hash, (void*)new_attributes);
-  rb_ivar_set(self, rb_intern("@attributes"), new_attributes);
-  rb_ivar_set(self, rb_intern("unsaved_password"), Qnil);
-  CFRelease(attributes);
+  for(long i = 0; i < param_count; i++){
+    query->param_keys[i] = sec_key_for_attribute(RARRAY_PTR(parameters)[i]);
+    CFDictionaryRemoveValue(first_query, query->param_keys[i]);
+  }
+  query->param_count = param_count;
+  query->param_names = rb_obj_freeze(parameters);
 
+  if(CFDictionaryContainsKey(first_query, kSecMatchLimit)){
+    query->all_query = CFRetain(first_query);
+  }else{
+    CFMutableDictionaryRef all_query = CFDictionaryCreateMutableCopy(NULL, 0, first_query);
+    CFDictionarySetValue(all_query, kSecMatchLimit, kSecMatchLimitAll);
+    query->all_query = all_query;
+  }
+  query->first_query = first_query;
   return self;
 }
 
-static VALUE rb_keychain_item_save(VALUE self){
-  SecKeychainItemRef keychainItem = NULL;
-  Data_Get_Struct(self, struct OpaqueSecKeychainItemRef, keychainItem);
+static VALUE rb_keychain_query_parameters(VALUE self){
+  return get_keychain_query(self)->param_names;
+}
 
-  CFMutableDictionaryRef query = sec_query_identifying_item(keychainItem);
+struct keychain_query_run_args {
+  keychain_query *compiled;
+  CFMutableDictionaryRef query;
+  VALUE bindings;
+  ID mode;
+};
+
+static VALUE keychain_query_run(VALUE data){
+  struct keychain_query_run_args *args = (struct keychain_query_run_args*)data;
+  for(long i = 0; i < args->compiled->param_count; i++){
+    VALUE value = rb_hash_aref(args->bindings, RARRAY_PTR(args->compiled->param_names)[i]);
+    rb_add_value_to_cf_dictionary(args->query, args->compiled->param_keys[i], value);
+  }
+  return run_find_query(args->query, args->mode, args->compiled->batch_size, args->compiled->predicates);
+}
 
-  CFMutableDictionaryRef attributes = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-  VALUE rb_attributes = rb_ivar_get(self, rb_intern("@attributes"));
+static VALUE keychain_query_release(VALUE data){
+  CFRelease(((struct keychain_query_run_args*)data)->query);
+  return Qnil;
+}
 
-  VALUE attributes_wrapper = Data_Wrap_Struct(rb_cPointerWrapper, NULL, NULL, attributes);
+static VALUE keychain_query_run_bound(VALUE self, ID mode, VALUE bindings){
+  keychain_query *query = get_keychain_query(self);
+  CFDictionaryRef compiled = mode == rb_intern("first") ? query->first_query : query->all_query;
 
-  rb_block_call(rb_attributes, rb_intern("each"), 0, NULL, RUBY_METHOD_FUNC(copy_attributes_for_update), (VALUE)attributes_wrapper);
+  if(NIL_P(bindings)){
+    if(query->param_count == 0){
+      return run_find_query(compiled, mode, query->batch_size, query->predicates);
+    }
+    bindings = rb_hash_new();
+  }
+  Check_Type(bindings, T_HASH);
 
-  VALUE newPassword = rb_ivar_get(self, rb_intern("@unsaved_password"));
-  if(!NIL_P(newPassword)){
-    rb_add_value_to_cf_dictionary(attributes, kSecValueData, newPassword);
+  for(long i = 0; i < query->param_count; i++){
+    VALUE name = RARRAY_PTR(query->param_names)[i];
+    if(rb_hash_lookup2(bindings, name, Qundef) == Qundef){
+      rb_raise(rb_eArgError, "no value bound to %"PRIsVALUE, rb_inspect(name));
+    }
+  }
+  if((long)RHASH_SIZE(bindings) != query->param_count){
+    rb_raise(rb_eArgError, "bindings %"PRIsVALUE" don't match the query parameters %"PRIsVALUE, rb_inspect(rb_funcall(bindings, rb_intern("keys"), 0)), rb_inspect(query->param_names));
+  }
+  if(query->param_count == 0){
+    return run_find_query(compiled, mode, query->batch_size, query->predicates);
   }
-  CFStringRef cfclass = rb_copy_item_class(keychainItem);
-  CFDictionarySetValue(query, kSecClass, cfclass);
-  CFRelease(cfclass);
-  
-  OSStatus result = SecItemUpdate(query, attributes);
 
-  CFRelease(query);
-  CFRelease(attributes);
-  CheckOSStatusOrRaise(result);
-  rb_keychain_item_reload(self);
-  return self;
+  struct keychain_query_run_args args = {query, CFDictionaryCreateMutableCopy(NULL, 0, compiled), bindings, mode};
+  return rb_ensure(keychain_query_run, (VALUE)&args, keychain_query_release, (VALUE)&args);
 }
 
+static VALUE keychain_query_execute(VALUE self, ID mode, VALUE bindings){
+  VALUE result = keychain_query_run_bound(self, mode, bindings);
+  keychain_metrics_notify();
+  return result;
+}
 
+static VALUE rb_keychain_query_first(int argc, VALUE *argv, VALUE self){
+  VALUE bindings;
+  rb_scan_args(argc, argv, "01", &bindings);
+  return keychain_query_execute(self, rb_intern("first"), bindings);
+}
 
+static VALUE rb_keychain_query_all(int argc, VALUE *argv, VALUE self){
+  VALUE bindings;
+  rb_scan_args(argc, argv, "01", &bindings);
+  return keychain_query_execute(self, rb_intern("all"), bindings);
+}
 
-static VALUE rb_keychain_find(int argc, VALUE *argv, VALUE self){
+static VALUE rb_keychain_query_each(int argc, VALUE *argv, VALUE self){
+  VALUE bindings;
+  rb_scan_args(argc, argv, "01", &bindings);
+  RETURN_ENUMERATOR(self, argc, argv);
+  keychain_query_execute(self, rb_intern("each"), bindings);
+  return self;
+}
 
-  VALUE kind;
-  VALUE attributes;
-  VALUE first_or_all;
-  rb_scan_args(argc, argv, "2:", &first_or_all, &kind, &attributes);
+/*
+ * Keychain::Async makes the same Security calls as find, add_password, Item#save! and
+ * Item#password on the async worker pool. The CF arguments are built before the job is
+ * submitted and the results are only turned into ruby objects by Future#value.
+ */
+static void async_copy_matching_run(keychain_async_job *job){
+  job->status = SecItemCopyMatching(job->inputs[0], &job->output);
+}
+
+static VALUE async_find_resolve(keychain_async_job *job, VALUE context){
+  CFTypeRef result = job->output;
+  job->output = NULL;
+  keychain_metrics_record_elapsed(KEYCHAIN_OP_COPY_MATCHING, job->elapsed_ns, job->status, copy_matching_item_count(job->status, result));
+  return find_results_to_ruby(job->status, result, (ID)job->mode, 0, context);
+}
+
+/* Keychain::Async.find(:first or :all, kind, options = nil) */
+static VALUE rb_keychain_async_find(int argc, VALUE *argv, VALUE self){
+  VALUE first_or_all, kind, attributes;
+  rb_scan_args(argc, argv, "21", &first_or_all, &kind, &attributes);
 
   Check_Type(first_or_all, T_SYMBOL);
   Check_Type(kind, T_STRING);
-  
-  CFMutableDictionaryRef query = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-
-  CFDictionarySetValue(query, kSecReturnAttributes, kCFBooleanTrue);
-  CFDictionarySetValue(query, kSecReturnRef, kCFBooleanTrue);
-  
 
-  if(rb_to_id(first_or_all) == rb_intern("all")){
-    CFDictionarySetValue(query, kSecMatchLimit, kSecMatchLimitAll);
+  ID mode = rb_to_id(first_or_all);
+  if(mode != rb_intern("first") && mode != rb_intern("all")){
+    rb_raise(rb_eArgError, "Keychain::Async.find only supports :first and :all");
   }
 
-  rb_add_value_to_cf_dictionary(query, kSecClass, kind);
+  long batch_size = 0;
+  VALUE predicates = Qnil;
+  CFMutableDictionaryRef query = create_find_query(kind, mode == rb_intern("all"), attributes, &batch_size, &predicates);
 
+  keychain_async_job *job = keychain_async_job_new(query, NULL);
+  job->run = async_copy_matching_run;
+  job->resolve = async_find_resolve;
+  job->mode = (long)mode;
+  return keychain_async_submit(job, predicates);
+}
 
-  if(!NIL_P(attributes)){
-    Check_Type(attributes, T_HASH);
-    VALUE rb_keychains = rb_hash_aref(attributes, ID2SYM(rb_intern("keychains")));
-    if(!NIL_P(rb_keychains)){
-      Check_Type(rb_keychains, T_ARRAY);
-      CFMutableArrayRef searchArray = CFArrayCreateMutable(NULL, RARRAY_LEN(rb_keychains), &kCFTypeArrayCallBacks);
-      for(int index=0; index < RARRAY_LEN(rb_keychains); index++){
-        SecKeychainRef keychain = NULL;
-        Data_Get_Struct(RARRAY_PTR(rb_keychains)[index], struct OpaqueSecKeychainRef, keychain);
-        CFArrayAppendValue(searchArray, keychain);
-      }
-      CFDictionarySetValue(query, kSecMatchSearchList,searchArray);
-      CFRelease(searchArray);
-    }  
+static void async_add_run(keychain_async_job *job){
+  job->status = SecItemAdd(job->inputs[0], &job->output);
+}
 
-    VALUE limit = rb_hash_aref(attributes, ID2SYM(rb_intern("limit")));
-    if(!NIL_P(limit)){
-      Check_Type(limit, T_FIXNUM);
-      long c_limit = FIX2LONG(limit);
-      CFNumberRef cf_limit = CFNumberCreate(NULL, kCFNumberLongType, &c_limit);
-      CFDictionarySetValue(query, kSecMatchLimit, cf_limit);
-      CFRelease(cf_limit);
-    }
+static VALUE async_add_resolve(keychain_async_job *job, VALUE context){
+  keychain_metrics_record_elapsed(KEYCHAIN_OP_ADD, job->elapsed_ns, job->status, job->status == noErr);
+  CheckOSStatusOrRaise(job->status);
+  return rb_keychain_item_from_sec_dictionary(job->output);
+}
+
+/* Keychain::Async.add_password(keychain, kind, attributes) */
+static VALUE rb_keychain_async_add_password(VALUE self, VALUE keychain, VALUE kind, VALUE options){
+  if(!rb_obj_is_kind_of(keychain, rb_cKeychain)){
+    rb_raise(rb_eTypeError, "expected a Keychain");
+  }
+  CFMutableDictionaryRef attributes = create_add_password_attributes(keychain, kind, options);
+
+  keychain_async_job *job = keychain_async_job_new(attributes, NULL);
+  job->run = async_add_run;
+  job->resolve = async_add_resolve;
+  return keychain_async_submit(job, Qnil);
+}
+
+/* inputs are the identifying query and the changed attributes. mode is the changed bits sent */
+static void async_save_run(keychain_async_job *job){
+  job->status = noErr;
+  if(CFDictionaryGetCount(job->inputs[1]) > 0){
+    job->status = SecItemUpdate(job->inputs[0], job->inputs[1]);
+  }
+}
 
-    VALUE conditions = rb_hash_aref(attributes, ID2SYM(rb_intern("conditions")));
-    
-    if(!NIL_P(conditions)){
-      Check_Type(conditions, T_HASH);
-      VALUE rQuery = Data_Wrap_Struct(rb_cPointerWrapper, NULL, NULL, query);
-      rb_block_call(conditions, rb_intern("each"), 0, NULL, RUBY_METHOD_FUNC(add_conditions_to_query), rQuery);
+static VALUE async_save_resolve(keychain_async_job *job, VALUE context){
+  keychain_item *item = get_keychain_item(context);
+  if(CFDictionaryGetCount(job->inputs[1]) > 0){
+    keychain_metrics_record_elapsed(KEYCHAIN_OP_UPDATE, job->elapsed_ns, job->status, job->status == noErr);
+    if(job->status == noErr){
+      keychain_item_saved(item, job->inputs[1], (unsigned int)job->mode);
+    }else{
+      item->changed |= (unsigned int)job->mode;
     }
   }
+  CheckOSStatusOrRaise(job->status);
+  return context;
+}
 
-  CFDictionaryRef result;
+/* the changes weren't sent, so are still unsaved */
+static void async_save_cancelled(keychain_async_job *job, VALUE context){
+  get_keychain_item(context)->changed |= (unsigned int)job->mode;
+}
 
-  OSStatus status = SecItemCopyMatching(query, (CFTypeRef*)&result);
-  CFRelease(query);
+/*
+ * Keychain::Async.save!(item) saves the changes made to item so far. Attributes assigned
+ * while the save is running are left unsaved.
+ */
+static VALUE rb_keychain_async_save(VALUE self, VALUE rb_item){
+  keychain_item *item = get_unfrozen_keychain_item(rb_item);
+  CFMutableDictionaryRef query;
+  CFMutableDictionaryRef attributes = create_item_update(item, &query);
+
+  keychain_async_job *job = keychain_async_job_new(query, attributes);
+  job->run = async_save_run;
+  job->resolve = async_save_resolve;
+  job->cancelled = async_save_cancelled;
+  job->mode = item->changed;
+  item->changed = 0;
+  return keychain_async_submit(job, rb_item);
+}
 
-  VALUE rb_item = rb_ary_new2(0);
+static void async_copy_data_run(keychain_async_job *job){
+  if(job->inputs[0]){
+    job->status = SecKeychainItemCopyAttributesAndData((SecKeychainItemRef)job->inputs[0], NULL, NULL, NULL, &job->length, &job->data);
+  }
+}
 
-  switch(status){
-    case errSecItemNotFound: 
-      break;
-    default:
-    CheckOSStatusOrRaise(status);
-    if(CFArrayGetTypeID() == CFGetTypeID(result)){
-      CFArrayRef result_array = (CFArrayRef)result;
-      for(CFIndex i = 0; i < CFArrayGetCount(result_array); i++){
-        rb_ary_push(rb_item,rb_keychain_item_from_sec_dictionary(CFArrayGetValueAtIndex(result_array,i)));
-      }
-    }
-    else{
-      rb_ary_push(rb_item, rb_keychain_item_from_sec_dictionary(result));
-    }
-    CFRelease(result);
+static void async_free_data(void *data){
+  SecKeychainItemFreeAttributesAndData(NULL, data);
+}
+
+static VALUE async_password_resolve(keychain_async_job *job, VALUE context){
+  if(!job->inputs[0]){
+    return rb_keychain_item_copy_password(context);
   }
+  keychain_metrics_record_elapsed(KEYCHAIN_OP_COPY_DATA, job->elapsed_ns, job->status, job->status == noErr);
+  CheckOSStatusOrRaise(job->status);
+  return rb_str_new(job->data, job->length);
+}
 
-  if(rb_to_id(first_or_all) == rb_intern("first")){
-    return rb_ary_entry(rb_item,0);
+/* Keychain::Async.password(item) */
+static VALUE rb_keychain_async_password(VALUE self, VALUE rb_item){
+  keychain_item *item = get_keychain_item(rb_item);
+
+  keychain_async_job *job = keychain_async_job_new(NULL, NULL);
+  job->run = async_copy_data_run;
+  job->resolve = async_password_resolve;
+  job->free_data = async_free_data;
+  /* an unsaved password, or one found with :with_passwords, needs no Security call */
+  CFTypeRef data = item->sec_attributes ? CFDictionaryGetValue(item->sec_attributes, kSecValueData) : NULL;
+  if(NIL_P(item->unsaved_password) && !(data && CFGetTypeID(data) == CFDataGetTypeID())){
+    job->inputs[0] = CFRetain(item->item);
   }
-  else{
-    return rb_item;
+  return keychain_async_submit(job, rb_item);
+}
+
+static void add_keychain_attribute(const char *name, CFStringRef sec_key){
+  VALUE sec_name = cfstring_to_rb_string(sec_key);
+#ifdef HAVE_RB_STR_TO_INTERNED_STR
+  sec_name = rb_str_to_interned_str(sec_name);
+#else
+  rb_obj_freeze(sec_name);
+#endif
+  rb_gc_register_mark_object(sec_name);
+
+  keychain_attributes[keychain_attribute_count].ruby_name = name;
+  keychain_attributes[keychain_attribute_count].name = rb_intern(name);
+  keychain_attributes[keychain_attribute_count].sec_key = sec_key;
+  keychain_attributes[keychain_attribute_count].sec_name = sec_name;
+  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern(name)), sec_name);
+  keychain_attribute_count++;
+}
+
+static void define_item_accessors(void){
+  for(int i = 0; i < keychain_attribute_count; i++){
+    if(CFEqual(keychain_attributes[i].sec_key, kSecValueData)){
+      continue; /* password has its own accessors */
+    }
+    char setter[64];
+    snprintf(setter, sizeof(setter), "%s=", keychain_attributes[i].ruby_name);
+    rb_define_method(rb_cKeychainItem, keychain_attributes[i].ruby_name, RUBY_METHOD_FUNC(keychain_item_getters[i]), 0);
+    rb_define_method(rb_cKeychainItem, setter, RUBY_METHOD_FUNC(keychain_item_setters[i]), 1);
   }
 }
 
 static void build_keychain_sec_map(void){
   rb_cKeychainSecMap = rb_hash_new();
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("created_at")), cfstring_to_rb_string(kSecAttrCreationDate));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("updated_at")), cfstring_to_rb_string(kSecAttrModificationDate));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("description")), cfstring_to_rb_string(kSecAttrDescription));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("comment")), cfstring_to_rb_string(kSecAttrComment));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("account")), cfstring_to_rb_string(kSecAttrAccount));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("service")), cfstring_to_rb_string(kSecAttrService));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("server")), cfstring_to_rb_string(kSecAttrServer));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("port")), cfstring_to_rb_string(kSecAttrPort));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("security_domain")), cfstring_to_rb_string(kSecAttrSecurityDomain));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("negative")), cfstring_to_rb_string(kSecAttrIsNegative));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("invisible")), cfstring_to_rb_string(kSecAttrIsInvisible));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("label")), cfstring_to_rb_string(kSecAttrLabel));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("path")), cfstring_to_rb_string(kSecAttrPath));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("protocol")), cfstring_to_rb_string(kSecAttrProtocol));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("password")), cfstring_to_rb_string(kSecValueData));
-  rb_hash_aset(rb_cKeychainSecMap, ID2SYM(rb_intern("klass")), cfstring_to_rb_string(kSecClass));
-
-  rb_const_set(rb_cKeychain, rb_intern("KEYCHAIN_MAP"), rb_cKeychainSecMap);
+  rb_gc_register_address(&rb_cKeychainSecMap);
+  add_keychain_attribute("created_at", kSecAttrCreationDate);
+  add_keychain_attribute("updated_at", kSecAttrModificationDate);
+  add_keychain_attribute("description", kSecAttrDescription);
+  add_keychain_attribute("comment", kSecAttrComment);
+  add_keychain_attribute("account", kSecAttrAccount);
+  add_keychain_attribute("service", kSecAttrService);
+  add_keychain_attribute("server", kSecAttrServer);
+  add_keychain_attribute("port", kSecAttrPort);
+  add_keychain_attribute("security_domain", kSecAttrSecurityDomain);
+  add_keychain_attribute("negative", kSecAttrIsNegative);
+  add_keychain_attribute("invisible", kSecAttrIsInvisible);
+  add_keychain_attribute("label", kSecAttrLabel);
+  add_keychain_attribute("path", kSecAttrPath);
+  add_keychain_attribute("protocol", kSecAttrProtocol);
+  add_keychain_attribute("password", kSecValueData);
+  add_keychain_attribute("klass", kSecClass);
+
+  rb_const_set(rb_cKeychain, rb_intern("KEYCHAIN_MAP"), rb_obj_freeze(rb_cKeychainSecMap));
 }
 
 static void build_classes(void){
   VALUE classes = rb_define_module_under(rb_cKeychainItem, "Classes");
-  rb_const_set(classes, rb_intern("INTERNET"), cfstring_to_rb_string(kSecClassInternetPassword));
-  rb_const_set(classes, rb_intern("GENERIC"), cfstring_to_rb_string(kSecClassGenericPassword));
+  rb_const_set(classes, rb_intern("INTERNET"), rb_obj_freeze(cfstring_to_rb_string(kSecClassInternetPassword)));
+  rb_const_set(classes, rb_intern("GENERIC"), rb_obj_freeze(cfstring_to_rb_string(kSecClassGenericPassword)));
+}
+
+/* The statuses the non-raising methods (find_status, try_add_password) most often return */
+static void build_statuses(void){
+  VALUE statuses = rb_define_module_under(rb_cKeychain, "Status");
+
+  rb_const_set(statuses, rb_intern("SUCCESS"), INT2NUM(errSecSuccess));
+  rb_const_set(statuses, rb_intern("ITEM_NOT_FOUND"), INT2NUM(errSecItemNotFound));
+  rb_const_set(statuses, rb_intern("DUPLICATE_ITEM"), INT2NUM(errSecDuplicateItem));
+  rb_const_set(statuses, rb_intern("NO_SUCH_KEYCHAIN"), INT2NUM(errSecNoSuchKeychain));
+  rb_const_set(statuses, rb_intern("AUTH_FAILED"), INT2NUM(errSecAuthFailed));
 }
 
 static void build_protocols(void){
@@ -574,16 +2251,14 @@ static void build_protocols(void){
 
 
 static void rb_get_keychain_settings(VALUE self, SecKeychainSettings *settings){
-  SecKeychainRef keychain=NULL;
-  Data_Get_Struct(self, struct OpaqueSecKeychainRef, keychain);
+  SecKeychainRef keychain = keychain_registry_ref(self);
   settings->version = SEC_KEYCHAIN_SETTINGS_VERS1;
   OSStatus result = SecKeychainCopySettings(keychain, settings);
   CheckOSStatusOrRaise(result);
 }
 
 static void rb_set_keychain_settings(VALUE self, SecKeychainSettings *settings){
-  SecKeychainRef keychain=NULL;
-  Data_Get_Struct(self, struct OpaqueSecKeychainRef, keychain);
+  SecKeychainRef keychain = keychain_registry_ref(self);
   OSStatus result = SecKeychainSetSettings(keychain, settings);
   CheckOSStatusOrRaise(result);
 }
@@ -617,50 +2292,93 @@ static VALUE rb_keychain_settings_set_lock_interval(VALUE self, VALUE newValue){
 }
 
 static VALUE rb_keychain_lock(VALUE self){
-  SecKeychainRef keychain=NULL;
-  Data_Get_Struct(self, struct OpaqueSecKeychainRef, keychain);
+  SecKeychainRef keychain = keychain_registry_ref(self);
+  uint64_t start = keychain_metrics_now();
   OSStatus result = SecKeychainLock(keychain);
+  keychain_metrics_record(KEYCHAIN_OP_LOCK, start, result, 0);
+  keychain_events_forget_status(keychain);
   CheckOSStatusOrRaise(result);
+  keychain_metrics_notify();
 
   return Qnil;
 }
 
 static VALUE rb_keychain_unlock(int argc, VALUE *argv, VALUE self){
-  SecKeychainRef keychain=NULL;
-  Data_Get_Struct(self, struct OpaqueSecKeychainRef, keychain);
+  SecKeychainRef keychain = keychain_registry_ref(self);
 
   VALUE password;
   rb_scan_args(argc, argv, "01", &password);
 
-  OSStatus result = noErr;
-  if(password){
+  struct sec_keychain_unlock_call call = {keychain, 0, NULL, false, noErr};
+  const char *secret;
+  long secret_length;
+  if(secret_buffer_get(password, &secret, &secret_length)){
+    /* the buffer's bytes don't move, and a concurrent wipe! only zeroes them */
+    call.length = (UInt32)secret_length;
+    call.password = secret;
+    call.use_password = true;
+  }else if(!NIL_P(password)){
     StringValue(password);
-    password = rb_str_export_to_enc(password, rb_utf8_encoding());
-
-    result = SecKeychainUnlock(keychain, (UInt32)RSTRING_LEN(password), (UInt8*)RSTRING_PTR(password), true);
-  }else{
-    result = SecKeychainUnlock(keychain,0,NULL,false);
+    /* a frozen copy, so that other threads can't change the bytes while the GVL is released */
+    password = rb_str_new_frozen(rb_str_export_to_enc(password, rb_utf8_encoding()));
+    call.length = (UInt32)RSTRING_LEN(password);
+    call.password = RSTRING_PTR(password);
+    call.use_password = true;
   }
+  uint64_t start = keychain_metrics_now();
+  rb_thread_call_without_gvl(sec_keychain_unlock_without_gvl, &call, NULL, NULL);
+  keychain_metrics_record(KEYCHAIN_OP_UNLOCK, start, call.status, 0);
+  keychain_events_forget_status(keychain);
+  RB_GC_GUARD(password);
 
-  CheckOSStatusOrRaise(result);
+  CheckOSStatusOrRaise(call.status);
+  keychain_metrics_notify();
 
   return Qnil;
 }
 
+/* While events are being received (see Keychain.subscribe) the status is cached until the keychain is locked or unlocked */
 static VALUE rb_keychain_status(VALUE self){
-  UInt32 status;
-  SecKeychainRef keychain=NULL;
-  Data_Get_Struct(self, struct OpaqueSecKeychainRef, keychain);
+  SecKeychainStatus status;
+  SecKeychainRef keychain = keychain_registry_ref(self);
+  if(keychain_events_cached_status(keychain, &status)){
+    return UINT2NUM(status);
+  }
+  unsigned long generation = keychain_events_status_generation(keychain);
+  uint64_t start = keychain_metrics_now();
   OSStatus result = SecKeychainGetStatus(keychain, &status);
+  keychain_metrics_record(KEYCHAIN_OP_STATUS, start, result, 0);
   CheckOSStatusOrRaise(result);
+  keychain_events_cache_status(keychain, status, generation);
+  keychain_metrics_notify();
   return UINT2NUM(status);
 }
 
+/*
+ * Keychain#exists? returns false for a keychain that has been deleted, raising only for other
+ * errors. No event says a keychain has been deleted, so the cached status can't tell.
+ */
+static VALUE rb_keychain_exists(VALUE self){
+  SecKeychainStatus status;
+  SecKeychainRef keychain = keychain_registry_ref(self);
+  unsigned long generation = keychain_events_status_generation(keychain);
+  uint64_t start = keychain_metrics_now();
+  OSStatus result = SecKeychainGetStatus(keychain, &status);
+  keychain_metrics_record(KEYCHAIN_OP_STATUS, start, result, 0);
+  if(result == errSecNoSuchKeychain){
+    keychain_events_forget_status(keychain);
+    keychain_metrics_notify();
+    return Qfalse;
+  }
+  CheckOSStatusOrRaise(result);
+  keychain_events_cache_status(keychain, status, generation);
+  keychain_metrics_notify();
+  return Qtrue;
+}
+
 static VALUE rb_keychain_item_keychain(VALUE self){
   SecKeychainRef keychain=NULL;
-  SecKeychainItemRef item=NULL;
-  Data_Get_Struct(self, struct OpaqueSecKeychainItemRef, item);
-  OSStatus result = SecKeychainItemCopyKeychain(item,&keychain);
+  OSStatus result = SecKeychainItemCopyKeychain(get_keychain_item(self)->item, &keychain);
   CheckOSStatusOrRaise(result);
   return KeychainFromSecKeychainRef(keychain);
 }
@@ -668,27 +2386,69 @@ static VALUE rb_keychain_item_keychain(VALUE self){
 static VALUE rb_keychain_compare(VALUE self, VALUE other){
   SecKeychainRef keychain=NULL;
   SecKeychainRef otherKeychain=NULL;
-  Data_Get_Struct(self, struct OpaqueSecKeychainRef, keychain);
-  Data_Get_Struct(other, struct OpaqueSecKeychainRef, otherKeychain);
+  if(self == other){
+    return Qtrue;
+  }
+  if(!rb_obj_is_kind_of(other, rb_cKeychain)){
+    return Qfalse;
+  }
+  keychain = keychain_registry_ref(self);
+  otherKeychain = keychain_registry_ref(other);
+
+  return CFEqual(keychain, otherKeychain) ? Qtrue : Qfalse;
+}
+
+#ifdef KEYCHAIN_FILE_BACKEND
+static VALUE rb_keychain_simulated_latency(VALUE self){
+  return rb_float_new(FileKeychainGetSimulatedLatency());
+}
 
-  return CFEqual(keychain, otherKeychain);
+static VALUE rb_keychain_set_simulated_latency(VALUE self, VALUE seconds){
+  FileKeychainSetSimulatedLatency(NUM2DBL(seconds));
+  return seconds;
 }
+#endif
 
 void Init_keychain(){
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  /* what isn't safe to use from other ractors checks keychain_main_ractor_p */
+  rb_ext_ractor_safe(true);
+#endif
   rb_cKeychain = rb_const_get(rb_cObject, rb_intern("Keychain"));
   rb_eKeychainError = rb_const_get(rb_cKeychain, rb_intern("Error"));
   rb_eKeychainDuplicateItemError = rb_const_get(rb_cKeychain, rb_intern("DuplicateItemError"));
   rb_eKeychainNoSuchKeychainError = rb_const_get(rb_cKeychain, rb_intern("NoSuchKeychainError"));
   rb_eKeychainAuthFailedError = rb_const_get(rb_cKeychain, rb_intern("AuthFailedError"));
+  /* classes defined in ruby can be moved by GC.compact; these are also copied into the other modules */
+  rb_gc_register_address(&rb_cKeychain);
+  rb_gc_register_address(&rb_eKeychainError);
+  rb_gc_register_address(&rb_eKeychainDuplicateItemError);
+  rb_gc_register_address(&rb_eKeychainNoSuchKeychainError);
+  rb_gc_register_address(&rb_eKeychainAuthFailedError);
 
   build_keychain_sec_map();
   build_protocols();
+  build_statuses();
+  error_messages = rb_hash_new();
+  rb_gc_register_address(&error_messages);
+#ifdef KEYCHAIN_FILE_BACKEND
+  rb_const_set(rb_cKeychain, rb_intern("BACKEND"), ID2SYM(rb_intern("file")));
+  rb_define_singleton_method(rb_cKeychain, "simulated_latency", RUBY_METHOD_FUNC(rb_keychain_simulated_latency), 0);
+  rb_define_singleton_method(rb_cKeychain, "simulated_latency=", RUBY_METHOD_FUNC(rb_keychain_set_simulated_latency), 1);
+#else
+  rb_const_set(rb_cKeychain, rb_intern("BACKEND"), ID2SYM(rb_intern("security_framework")));
+#endif
 
   rb_define_singleton_method(rb_cKeychain, "default", RUBY_METHOD_FUNC(rb_default_keychain), 0);
   rb_define_singleton_method(rb_cKeychain, "open", RUBY_METHOD_FUNC(rb_open_keychain), 1);
   rb_define_singleton_method(rb_cKeychain, "create", RUBY_METHOD_FUNC(rb_create_keychain), -1);
 
   rb_define_singleton_method(rb_cKeychain, "find", RUBY_METHOD_FUNC(rb_keychain_find), -1);
+  rb_define_singleton_method(rb_cKeychain, "find_status", RUBY_METHOD_FUNC(rb_keychain_find_status), -1);
+  rb_define_singleton_method(rb_cKeychain, "error_message", RUBY_METHOD_FUNC(rb_keychain_error_message), 1);
+  rb_define_singleton_method(rb_cKeychain, "error_for_status", RUBY_METHOD_FUNC(rb_keychain_error_for_status_m), 1);
+  rb_define_singleton_method(rb_cKeychain, "update_all", RUBY_METHOD_FUNC(rb_keychain_update_all), 3);
+  rb_define_singleton_method(rb_cKeychain, "delete_all", RUBY_METHOD_FUNC(rb_keychain_delete_all), 2);
 
   rb_define_method(rb_cKeychain, "==", RUBY_METHOD_FUNC(rb_keychain_compare), 1);
 
@@ -698,6 +2458,8 @@ void Init_keychain(){
   rb_define_method(rb_cKeychain, "delete", RUBY_METHOD_FUNC(rb_keychain_delete), 0);
   rb_define_method(rb_cKeychain, "path", RUBY_METHOD_FUNC(rb_keychain_path), 0);
   rb_define_method(rb_cKeychain, "add_password", RUBY_METHOD_FUNC(rb_keychain_add_password), 2);
+  rb_define_method(rb_cKeychain, "try_add_password", RUBY_METHOD_FUNC(rb_keychain_try_add_password), 2);
+  rb_define_method(rb_cKeychain, "add_passwords", RUBY_METHOD_FUNC(rb_keychain_add_passwords), -1);
 
   rb_define_method(rb_cKeychain, "lock_on_sleep?", RUBY_METHOD_FUNC(rb_keychain_settings_lock_on_sleep), 0);
   rb_define_method(rb_cKeychain, "lock_on_sleep=", RUBY_METHOD_FUNC(rb_keychain_settings_set_lock_on_sleep), 1);
@@ -706,18 +2468,48 @@ void Init_keychain(){
   rb_define_method(rb_cKeychain, "lock_interval=", RUBY_METHOD_FUNC(rb_keychain_settings_set_lock_interval), 1);
 
   rb_define_method(rb_cKeychain, "status", RUBY_METHOD_FUNC(rb_keychain_status), 0);
+  rb_define_method(rb_cKeychain, "exists?", RUBY_METHOD_FUNC(rb_keychain_exists), 0);
 
 //we don't bother with use_lock_interval - the underlying api appears to ignore it ( see http://www.opensource.apple.com/source/libsecurity_keychain/libsecurity_keychain-55050.9/lib/SecKeychain.cpp )
   rb_cKeychainItem = rb_define_class_under(rb_cKeychain, "Item", rb_cObject);
+  rb_define_alloc_func(rb_cKeychainItem, rb_keychain_item_alloc);
+  rb_define_method(rb_cKeychainItem, "initialize_copy", RUBY_METHOD_FUNC(rb_keychain_item_initialize_copy), 1);
   rb_define_method(rb_cKeychainItem, "keychain", RUBY_METHOD_FUNC(rb_keychain_item_keychain), 0);
 
   rb_define_method(rb_cKeychainItem, "delete", RUBY_METHOD_FUNC(rb_keychain_item_delete), 0);
   rb_define_method(rb_cKeychainItem, "password", RUBY_METHOD_FUNC(rb_keychain_item_copy_password), 0);
-
-  rb_define_method(rb_cKeychainItem, "save!", RUBY_METHOD_FUNC(rb_keychain_item_save), 0);
+  rb_define_method(rb_cKeychainItem, "password=", RUBY_METHOD_FUNC(rb_keychain_item_set_password), 1);
+  rb_define_method(rb_cKeychainItem, "password_buffer", RUBY_METHOD_FUNC(rb_keychain_item_copy_password_buffer), 0);
+  rb_define_method(rb_cKeychainItem, "to_h", RUBY_METHOD_FUNC(rb_keychain_item_to_h), 0);
+
+  rb_define_method(rb_cKeychainItem, "save!", RUBY_METHOD_FUNC(rb_keychain_item_save), -1);
+  rb_define_method(rb_cKeychainItem, "changed", RUBY_METHOD_FUNC(rb_keychain_item_changed), 0);
+  rb_define_method(rb_cKeychainItem, "changed?", RUBY_METHOD_FUNC(rb_keychain_item_is_changed), 0);
+  rb_define_singleton_method(rb_cKeychainItem, "save_all", RUBY_METHOD_FUNC(rb_keychain_item_save_all), 1);
+  rb_define_method(rb_cKeychainItem, "reload", RUBY_METHOD_FUNC(rb_keychain_item_reload), 0);
+  rb_define_method(rb_cKeychainItem, "freeze", RUBY_METHOD_FUNC(rb_keychain_item_freeze), 0);
+  define_item_accessors();
 
   build_classes();
+  Init_cf_conversions(rb_cKeychain);
+  Init_secret_buffer(rb_cKeychain);
+  Init_keychain_metrics(rb_cKeychain);
+  Init_keychain_registry(rb_cKeychain);
+  Init_keychain_async(rb_cKeychain);
+  Init_keychain_predicates(rb_cKeychain);
+  Init_keychain_events(rb_cKeychain);
+  rb_define_module_function(rb_mKeychainAsync, "find", RUBY_METHOD_FUNC(rb_keychain_async_find), -1);
+  rb_define_module_function(rb_mKeychainAsync, "add_password", RUBY_METHOD_FUNC(rb_keychain_async_add_password), 3);
+  rb_define_module_function(rb_mKeychainAsync, "save!", RUBY_METHOD_FUNC(rb_keychain_async_save), 1);
+  rb_define_module_function(rb_mKeychainAsync, "password", RUBY_METHOD_FUNC(rb_keychain_async_password), 1);
+
+  rb_cKeychainQuery = rb_define_class_under(rb_cKeychain, "Query", rb_cObject);
+  rb_define_alloc_func(rb_cKeychainQuery, rb_keychain_query_alloc);
+  rb_define_method(rb_cKeychainQuery, "initialize", RUBY_METHOD_FUNC(rb_keychain_query_initialize), -1);
+  rb_define_method(rb_cKeychainQuery, "parameters", RUBY_METHOD_FUNC(rb_keychain_query_parameters), 0);
+  rb_define_method(rb_cKeychainQuery, "first", RUBY_METHOD_FUNC(rb_keychain_query_first), -1);
+  rb_define_method(rb_cKeychainQuery, "all", RUBY_METHOD_FUNC(rb_keychain_query_all), -1);
+  rb_define_method(rb_cKeychainQuery, "each", RUBY_METHOD_FUNC(rb_keychain_query_each), -1);
 
-  rb_cPointerWrapper  = rb_define_class_under(rb_cKeychain, "PointerWrapper", rb_cObject);
 
 }
\ No newline at end of file
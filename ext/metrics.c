@@ -0,0 +1,249 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "metrics.h"
+#include "registry.h"
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+/* Bucket 0 counts calls under 1us, bucket n calls from 2^(n-1) up to 2^n us; the last has the rest */
+#define KEYCHAIN_METRICS_BUCKETS 32
+#define KEYCHAIN_METRICS_ERROR_SLOTS 64
+
+typedef struct {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t items;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[KEYCHAIN_METRICS_BUCKETS];
+} keychain_operation_stats;
+
+/* guards operation_stats and error_counts */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static keychain_operation_stats operation_stats[KEYCHAIN_OP_COUNT];
+
+/* error counts, in an open addressed table keyed by status. Status 0 marks an empty slot */
+static struct {
+  int32_t status;
+  uint64_t count;
+} error_counts[KEYCHAIN_METRICS_ERROR_SLOTS];
+
+static const char *operation_names[KEYCHAIN_OP_COUNT] = {
+  "copy_matching", "add", "add_batch", "update", "update_batch", "delete", "copy_data", "unlock", "lock", "status"
+};
+static VALUE operation_symbols[KEYCHAIN_OP_COUNT];
+
+/*
+ * Calls are passed to the subscriber by keychain_metrics_notify, once the caller has released
+ * its CF objects, so that a Thread#kill in the subscriber can't leak them. Until then each
+ * thread's calls wait in a thread local array. Another thread local marks threads running the
+ * subscriber, whose own calls aren't passed to it.
+ */
+static VALUE subscriber = Qnil;
+static ID id_pending_calls;
+static ID id_in_subscriber;
+
+uint64_t keychain_metrics_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int bucket_for(uint64_t ns){
+  uint64_t us = ns / 1000;
+  int bucket = 0;
+  while(us > 0 && bucket < KEYCHAIN_METRICS_BUCKETS - 1){
+    us >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+static VALUE call_subscriber(VALUE calls){
+  for(long i = 0; i < RARRAY_LEN(calls); i++){
+    VALUE call = RARRAY_AREF(calls, i);
+    rb_funcallv(subscriber, rb_intern("call"), (int)RARRAY_LEN(call), RARRAY_CONST_PTR(call));
+  }
+  return Qnil;
+}
+
+void keychain_metrics_notify(void){
+  if(NIL_P(subscriber)){
+    return;
+  }
+  VALUE thread = rb_thread_current();
+  VALUE calls = rb_thread_local_aref(thread, id_pending_calls);
+  if(NIL_P(calls)){
+    return;
+  }
+  rb_thread_local_aset(thread, id_pending_calls, Qnil);
+  int state = 0;
+  rb_thread_local_aset(thread, id_in_subscriber, Qtrue);
+  rb_protect(call_subscriber, calls, &state);
+  rb_thread_local_aset(thread, id_in_subscriber, Qnil);
+  if(state){
+    if(!rb_obj_is_kind_of(rb_errinfo(), rb_eException)){
+      rb_jump_tag(state); /* Thread#kill or throw */
+    }
+    /* a failing subscriber mustn't turn a completed keychain call into an error */
+    rb_warn("Keychain operation subscriber raised %"PRIsVALUE, rb_errinfo());
+    rb_set_errinfo(Qnil);
+  }
+}
+
+void keychain_metrics_record(keychain_operation op, uint64_t start, int32_t status, long items){
+  keychain_metrics_record_elapsed(op, keychain_metrics_now() - start, status, items);
+}
+
+void keychain_metrics_record_elapsed(keychain_operation op, uint64_t elapsed, int32_t status, long items){
+  int bucket = bucket_for(elapsed);
+  pthread_mutex_lock(&stats_mutex);
+  keychain_operation_stats *stats = &operation_stats[op];
+  stats->calls++;
+  stats->items += items;
+  stats->total_ns += elapsed;
+  if(elapsed > stats->max_ns){
+    stats->max_ns = elapsed;
+  }
+  stats->buckets[bucket]++;
+  if(status != 0){
+    stats->errors++;
+  }
+  pthread_mutex_unlock(&stats_mutex);
+
+  if(!NIL_P(subscriber) && keychain_main_ractor_p()){
+    VALUE thread = rb_thread_current();
+    if(RTEST(rb_thread_local_aref(thread, id_in_subscriber))){
+      return;
+    }
+    VALUE calls = rb_thread_local_aref(thread, id_pending_calls);
+    if(NIL_P(calls)){
+      calls = rb_ary_new();
+      rb_thread_local_aset(thread, id_pending_calls, calls);
+    }
+    rb_ary_push(calls, rb_ary_new_from_args(4, operation_symbols[op], rb_float_new(elapsed / 1e9), INT2NUM(status), LONG2NUM(items)));
+  }
+}
+
+void keychain_metrics_record_error(int32_t status){
+  unsigned slot = (unsigned)status % KEYCHAIN_METRICS_ERROR_SLOTS;
+  pthread_mutex_lock(&stats_mutex);
+  for(int probe = 0; probe < KEYCHAIN_METRICS_ERROR_SLOTS; probe++){
+    if(error_counts[slot].status == status || error_counts[slot].status == 0){
+      error_counts[slot].status = status;
+      error_counts[slot].count++;
+      break;
+    }
+    slot = (slot + 1) % KEYCHAIN_METRICS_ERROR_SLOTS;
+  }
+  pthread_mutex_unlock(&stats_mutex);
+}
+
+/* The upper bound, in microseconds, of the bucket containing the given fraction of calls */
+static uint64_t percentile_us(keychain_operation_stats *stats, double fraction){
+  uint64_t target = (uint64_t)(stats->calls * fraction + 0.5);
+  uint64_t seen = 0;
+  for(int bucket = 0; bucket < KEYCHAIN_METRICS_BUCKETS; bucket++){
+    seen += stats->buckets[bucket];
+    if(seen >= target && seen > 0){
+      return 1ull << bucket;
+    }
+  }
+  return 0;
+}
+
+static VALUE operation_stats_to_hash(keychain_operation_stats *stats){
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("calls")), ULL2NUM(stats->calls));
+  rb_hash_aset(hash, ID2SYM(rb_intern("errors")), ULL2NUM(stats->errors));
+  rb_hash_aset(hash, ID2SYM(rb_intern("items")), ULL2NUM(stats->items));
+  rb_hash_aset(hash, ID2SYM(rb_intern("total_seconds")), rb_float_new(stats->total_ns / 1e9));
+  rb_hash_aset(hash, ID2SYM(rb_intern("max_seconds")), rb_float_new(stats->max_ns / 1e9));
+  rb_hash_aset(hash, ID2SYM(rb_intern("p50_us")), ULL2NUM(percentile_us(stats, 0.5)));
+  rb_hash_aset(hash, ID2SYM(rb_intern("p99_us")), ULL2NUM(percentile_us(stats, 0.99)));
+
+  VALUE histogram = rb_hash_new();
+  for(int bucket = 0; bucket < KEYCHAIN_METRICS_BUCKETS; bucket++){
+    if(stats->buckets[bucket]){
+      rb_hash_aset(histogram, ULL2NUM(1ull << bucket), ULL2NUM(stats->buckets[bucket]));
+    }
+  }
+  rb_hash_aset(hash, ID2SYM(rb_intern("histogram")), histogram);
+  return hash;
+}
+
+/*
+ * Keychain.stats returns a hash with, for each operation, the number of calls, calls that
+ * failed, items returned or added, total and max time and a latency histogram (keyed by the
+ * bucket's upper bound in microseconds), plus :errors, the number of times each error code
+ * was raised.
+ */
+static VALUE rb_keychain_stats(VALUE self){
+  /* copied, so that the hashes aren't built while holding the mutex */
+  keychain_operation_stats snapshot[KEYCHAIN_OP_COUNT];
+  struct {
+    int32_t status;
+    uint64_t count;
+  } errors_snapshot[KEYCHAIN_METRICS_ERROR_SLOTS];
+  pthread_mutex_lock(&stats_mutex);
+  memcpy(snapshot, operation_stats, sizeof(snapshot));
+  for(int slot = 0; slot < KEYCHAIN_METRICS_ERROR_SLOTS; slot++){
+    errors_snapshot[slot].status = error_counts[slot].status;
+    errors_snapshot[slot].count = error_counts[slot].count;
+  }
+  pthread_mutex_unlock(&stats_mutex);
+
+  VALUE stats = rb_hash_new();
+  for(int op = 0; op < KEYCHAIN_OP_COUNT; op++){
+    rb_hash_aset(stats, operation_symbols[op], operation_stats_to_hash(&snapshot[op]));
+  }
+  VALUE errors = rb_hash_new();
+  for(int slot = 0; slot < KEYCHAIN_METRICS_ERROR_SLOTS; slot++){
+    if(errors_snapshot[slot].status){
+      rb_hash_aset(errors, INT2NUM(errors_snapshot[slot].status), ULL2NUM(errors_snapshot[slot].count));
+    }
+  }
+  rb_hash_aset(stats, ID2SYM(rb_intern("errors")), errors);
+  return stats;
+}
+
+static VALUE rb_keychain_reset_stats(VALUE self){
+  pthread_mutex_lock(&stats_mutex);
+  MEMZERO(operation_stats, keychain_operation_stats, KEYCHAIN_OP_COUNT);
+  MEMZERO(error_counts, error_counts[0], KEYCHAIN_METRICS_ERROR_SLOTS);
+  pthread_mutex_unlock(&stats_mutex);
+  return Qnil;
+}
+
+static VALUE rb_keychain_operation_subscriber(VALUE self){
+  keychain_check_main_ractor("the operation subscriber");
+  return subscriber;
+}
+
+/*
+ * Keychain.operation_subscriber = callable sets the object called with (operation, seconds,
+ * status, items) for every Security call, or removes it if nil. It is called on the thread that
+ * made the call, once the keychain method making it has finished with its results.
+ */
+static VALUE rb_keychain_set_operation_subscriber(VALUE self, VALUE callable){
+  keychain_check_main_ractor("the operation subscriber");
+  if(!NIL_P(callable) && !rb_respond_to(callable, rb_intern("call"))){
+    rb_raise(rb_eArgError, "operation subscriber must respond to call");
+  }
+  subscriber = callable;
+  return callable;
+}
+
+void Init_keychain_metrics(VALUE rb_cKeychain){
+  for(int op = 0; op < KEYCHAIN_OP_COUNT; op++){
+    operation_symbols[op] = ID2SYM(rb_intern(operation_names[op]));
+  }
+  rb_gc_register_address(&subscriber);
+  id_pending_calls = rb_intern("__keychain_pending_calls__");
+  id_in_subscriber = rb_intern("__keychain_in_subscriber__");
+  rb_define_singleton_method(rb_cKeychain, "stats", RUBY_METHOD_FUNC(rb_keychain_stats), 0);
+  rb_define_singleton_method(rb_cKeychain, "reset_stats", RUBY_METHOD_FUNC(rb_keychain_reset_stats), 0);
+  rb_define_singleton_method(rb_cKeychain, "operation_subscriber", RUBY_METHOD_FUNC(rb_keychain_operation_subscriber), 0);
+  rb_define_singleton_method(rb_cKeychain, "operation_subscriber=", RUBY_METHOD_FUNC(rb_keychain_set_operation_subscriber), 1);
+}
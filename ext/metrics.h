@@ -0,0 +1,44 @@
+#ifndef KEYCHAIN_METRICS_H
+#define KEYCHAIN_METRICS_H
+
+/*
+ * Counts and latency histograms for the Security calls the extension makes,
+ * and for the error codes it raises. Calls are made from every ractor, which
+ * don't share a GVL, so the counters are guarded by a mutex of their own. The
+ * operation subscriber belongs to the main ractor and only sees its calls.
+ */
+
+#include "ruby.h"
+#include <stdint.h>
+
+typedef enum {
+  KEYCHAIN_OP_COPY_MATCHING,
+  KEYCHAIN_OP_ADD,
+  KEYCHAIN_OP_ADD_BATCH,
+  KEYCHAIN_OP_UPDATE,
+  KEYCHAIN_OP_UPDATE_BATCH,
+  KEYCHAIN_OP_DELETE,
+  KEYCHAIN_OP_COPY_DATA,
+  KEYCHAIN_OP_UNLOCK,
+  KEYCHAIN_OP_LOCK,
+  KEYCHAIN_OP_STATUS,
+  KEYCHAIN_OP_COUNT
+} keychain_operation;
+
+/* A monotonic timestamp in nanoseconds, to pass to keychain_metrics_record */
+uint64_t keychain_metrics_now(void);
+/* Records a call to op that began at start, returned status and involved items items */
+void keychain_metrics_record(keychain_operation op, uint64_t start, int32_t status, long items);
+/* Records a call to op that took elapsed nanoseconds, such as one made by an async worker */
+void keychain_metrics_record_elapsed(keychain_operation op, uint64_t elapsed, int32_t status, long items);
+/*
+ * Passes the calls this thread has recorded to the operation subscriber, if there is one. Called
+ * once the caller holds no CF objects, as the subscriber may raise or the thread be killed.
+ */
+void keychain_metrics_notify(void);
+/* Counts an error raised as a Keychain::Error */
+void keychain_metrics_record_error(int32_t status);
+
+void Init_keychain_metrics(VALUE rb_cKeychain);
+
+#endif
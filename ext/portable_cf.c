@@ -0,0 +1,788 @@
+#ifdef KEYCHAIN_FILE_BACKEND
+
+#define _DEFAULT_SOURCE
+
+#include "portable_cf.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Builtin type ids. KCF_STRING_TYPE_ID is in the header for the constant string initializer */
+enum {
+  KCF_DATA_TYPE_ID = 2,
+  KCF_NUMBER_TYPE_ID,
+  KCF_BOOLEAN_TYPE_ID,
+  KCF_DATE_TYPE_ID,
+  KCF_ARRAY_TYPE_ID,
+  KCF_DICTIONARY_TYPE_ID,
+  KCF_FIRST_CUSTOM_TYPE_ID = 16,
+  KCF_MAX_TYPE_ID = 32
+};
+
+struct __CFData {
+  KCFRuntimeBase base;
+  CFIndex length;
+  UInt8 bytes[];
+};
+
+struct __CFNumber {
+  KCFRuntimeBase base;
+  Boolean is_float;
+  union {
+    long long integer;
+    double real;
+  } value;
+};
+
+struct __CFBoolean {
+  KCFRuntimeBase base;
+  Boolean value;
+};
+
+struct __CFDate {
+  KCFRuntimeBase base;
+  CFAbsoluteTime time;
+};
+
+struct __CFArray {
+  KCFRuntimeBase base;
+  Boolean retains;
+  CFIndex count;
+  CFIndex capacity;
+  const void **values;
+};
+
+struct __CFDictionary {
+  KCFRuntimeBase base;
+  Boolean retains;
+  CFIndex count;
+  CFIndex capacity;
+  const void **keys;
+  const void **values;
+  CFHashCode *hashes;
+};
+
+const CFArrayCallBacks kCFTypeArrayCallBacks = {0};
+const CFDictionaryKeyCallBacks kCFTypeDictionaryKeyCallBacks = {0};
+const CFDictionaryValueCallBacks kCFTypeDictionaryValueCallBacks = {0};
+
+static struct __CFBoolean kcf_true = {{KCF_BOOLEAN_TYPE_ID, -1}, true};
+static struct __CFBoolean kcf_false = {{KCF_BOOLEAN_TYPE_ID, -1}, false};
+const CFBooleanRef kCFBooleanTrue = &kcf_true;
+const CFBooleanRef kCFBooleanFalse = &kcf_false;
+
+static const KCFRuntimeClass *kcf_classes[KCF_MAX_TYPE_ID];
+static CFTypeID kcf_next_type_id = KCF_FIRST_CUSTOM_TYPE_ID;
+
+static void kcf_abort_oom(void){
+  abort();
+}
+
+static void *kcf_malloc(size_t size){
+  void *result = malloc(size);
+  if(!result){
+    kcf_abort_oom();
+  }
+  return result;
+}
+
+static void *kcf_realloc(void *ptr, size_t size){
+  void *result = realloc(ptr, size);
+  if(!result){
+    kcf_abort_oom();
+  }
+  return result;
+}
+
+CFTypeID _KCFRuntimeRegisterClass(const KCFRuntimeClass *cls){
+  CFTypeID type = __atomic_fetch_add(&kcf_next_type_id, 1, __ATOMIC_SEQ_CST);
+  if(type >= KCF_MAX_TYPE_ID){
+    abort();
+  }
+  kcf_classes[type] = cls;
+  return type;
+}
+
+void *_KCFRuntimeCreateInstance(CFTypeID type, size_t size){
+  KCFRuntimeBase *base = kcf_malloc(size);
+  memset(base, 0, size);
+  base->type = type;
+  base->refcount = 1;
+  return base;
+}
+
+static CFHashCode kcf_hash_bytes(const UInt8 *bytes, size_t length){
+  /* FNV-1a */
+  CFHashCode hash = (CFHashCode)14695981039346656037ULL;
+  for(size_t i = 0; i < length; i++){
+    hash ^= bytes[i];
+    hash *= (CFHashCode)1099511628211ULL;
+  }
+  return hash;
+}
+
+static void kcf_finalize(CFTypeRef cf);
+
+CFTypeRef CFRetain(CFTypeRef cf){
+  KCFRuntimeBase *base = (KCFRuntimeBase*)cf;
+  if(base->refcount >= 0){
+    __atomic_add_fetch(&base->refcount, 1, __ATOMIC_RELAXED);
+  }
+  return cf;
+}
+
+void CFRelease(CFTypeRef cf){
+  KCFRuntimeBase *base = (KCFRuntimeBase*)cf;
+  if(base->refcount < 0){
+    return;
+  }
+  if(__atomic_sub_fetch(&base->refcount, 1, __ATOMIC_ACQ_REL) == 0){
+    kcf_finalize(cf);
+  }
+}
+
+CFIndex CFGetRetainCount(CFTypeRef cf){
+  return __atomic_load_n(&((KCFRuntimeBase*)cf)->refcount, __ATOMIC_RELAXED);
+}
+
+CFTypeID CFGetTypeID(CFTypeRef cf){
+  return ((const KCFRuntimeBase*)cf)->type;
+}
+
+static void kcf_array_release_values(struct __CFArray *array){
+  if(array->retains){
+    for(CFIndex i = 0; i < array->count; i++){
+      CFRelease(array->values[i]);
+    }
+  }
+  free(array->values);
+}
+
+static void kcf_dictionary_release_values(struct __CFDictionary *dict){
+  if(dict->retains){
+    for(CFIndex i = 0; i < dict->count; i++){
+      CFRelease(dict->keys[i]);
+      CFRelease(dict->values[i]);
+    }
+  }
+  free(dict->keys);
+  free(dict->values);
+  free(dict->hashes);
+}
+
+static void kcf_finalize(CFTypeRef cf){
+  CFTypeID type = CFGetTypeID(cf);
+  switch(type){
+    case KCF_ARRAY_TYPE_ID:
+      kcf_array_release_values((struct __CFArray*)cf);
+      break;
+    case KCF_DICTIONARY_TYPE_ID:
+      kcf_dictionary_release_values((struct __CFDictionary*)cf);
+      break;
+    default:
+      if(type >= KCF_FIRST_CUSTOM_TYPE_ID && kcf_classes[type] && kcf_classes[type]->finalize){
+        kcf_classes[type]->finalize(cf);
+      }
+  }
+  free((void*)cf);
+}
+
+Boolean CFEqual(CFTypeRef cf1, CFTypeRef cf2){
+  if(cf1 == cf2){
+    return true;
+  }
+  CFTypeID type = CFGetTypeID(cf1);
+  if(type != CFGetTypeID(cf2)){
+    return false;
+  }
+  switch(type){
+    case KCF_STRING_TYPE_ID:
+      {
+        CFStringRef s1 = cf1, s2 = cf2;
+        return s1->byte_length == s2->byte_length && !memcmp(s1->bytes, s2->bytes, s1->byte_length);
+      }
+    case KCF_DATA_TYPE_ID:
+      {
+        CFDataRef d1 = cf1, d2 = cf2;
+        return d1->length == d2->length && !memcmp(d1->bytes, d2->bytes, d1->length);
+      }
+    case KCF_NUMBER_TYPE_ID:
+      {
+        CFNumberRef n1 = cf1, n2 = cf2;
+        if(n1->is_float || n2->is_float){
+          double v1 = n1->is_float ? n1->value.real : (double)n1->value.integer;
+          double v2 = n2->is_float ? n2->value.real : (double)n2->value.integer;
+          return v1 == v2;
+        }
+        return n1->value.integer == n2->value.integer;
+      }
+    case KCF_BOOLEAN_TYPE_ID:
+      return ((CFBooleanRef)cf1)->value == ((CFBooleanRef)cf2)->value;
+    case KCF_DATE_TYPE_ID:
+      return ((CFDateRef)cf1)->time == ((CFDateRef)cf2)->time;
+    case KCF_ARRAY_TYPE_ID:
+      {
+        CFArrayRef a1 = cf1, a2 = cf2;
+        if(a1->count != a2->count){
+          return false;
+        }
+        for(CFIndex i = 0; i < a1->count; i++){
+          if(!CFEqual(a1->values[i], a2->values[i])){
+            return false;
+          }
+        }
+        return true;
+      }
+    case KCF_DICTIONARY_TYPE_ID:
+      {
+        CFDictionaryRef d1 = cf1, d2 = cf2;
+        if(d1->count != d2->count){
+          return false;
+        }
+        for(CFIndex i = 0; i < d1->count; i++){
+          const void *other;
+          if(!CFDictionaryGetValueIfPresent(d2, d1->keys[i], &other) || !CFEqual(d1->values[i], other)){
+            return false;
+          }
+        }
+        return true;
+      }
+    default:
+      if(type >= KCF_FIRST_CUSTOM_TYPE_ID && kcf_classes[type] && kcf_classes[type]->equal){
+        return kcf_classes[type]->equal(cf1, cf2);
+      }
+      return false;
+  }
+}
+
+CFHashCode CFHash(CFTypeRef cf){
+  CFTypeID type = CFGetTypeID(cf);
+  switch(type){
+    case KCF_STRING_TYPE_ID:
+      {
+        struct __CFString *string = (struct __CFString*)cf;
+        CFHashCode hash = __atomic_load_n(&string->hash, __ATOMIC_RELAXED);
+        if(!hash){
+          hash = kcf_hash_bytes((const UInt8*)string->bytes, string->byte_length) | 1;
+          __atomic_store_n(&string->hash, hash, __ATOMIC_RELAXED);
+        }
+        return hash;
+      }
+    case KCF_DATA_TYPE_ID:
+      return kcf_hash_bytes(((CFDataRef)cf)->bytes, ((CFDataRef)cf)->length);
+    case KCF_NUMBER_TYPE_ID:
+      {
+        CFNumberRef number = cf;
+        if(number->is_float && number->value.real != (double)(long long)number->value.real){
+          return kcf_hash_bytes((const UInt8*)&number->value.real, sizeof(double));
+        }
+        return (CFHashCode)(number->is_float ? (long long)number->value.real : number->value.integer);
+      }
+    case KCF_BOOLEAN_TYPE_ID:
+      return ((CFBooleanRef)cf)->value;
+    case KCF_DATE_TYPE_ID:
+      return kcf_hash_bytes((const UInt8*)&((CFDateRef)cf)->time, sizeof(CFAbsoluteTime));
+    case KCF_ARRAY_TYPE_ID:
+      return ((CFArrayRef)cf)->count;
+    case KCF_DICTIONARY_TYPE_ID:
+      return ((CFDictionaryRef)cf)->count;
+    default:
+      if(type >= KCF_FIRST_CUSTOM_TYPE_ID && kcf_classes[type] && kcf_classes[type]->hash){
+        return kcf_classes[type]->hash(cf);
+      }
+      return (CFHashCode)cf;
+  }
+}
+
+/* Strings */
+
+CFTypeID CFStringGetTypeID(void){
+  return KCF_STRING_TYPE_ID;
+}
+
+static Boolean kcf_utf8_valid(const UInt8 *bytes, size_t length, CFIndex *utf16_length){
+  CFIndex units = 0;
+  size_t i = 0;
+  while(i < length){
+    UInt8 c = bytes[i];
+    size_t extra;
+    UInt32 codepoint;
+    if(c < 0x80){
+      extra = 0;
+      codepoint = c;
+    }else if((c & 0xE0) == 0xC0){
+      extra = 1;
+      codepoint = c & 0x1F;
+    }else if((c & 0xF0) == 0xE0){
+      extra = 2;
+      codepoint = c & 0x0F;
+    }else if((c & 0xF8) == 0xF0){
+      extra = 3;
+      codepoint = c & 0x07;
+    }else{
+      return false;
+    }
+    if(i + extra >= length){
+      return false;
+    }
+    for(size_t j = 1; j <= extra; j++){
+      if((bytes[i + j] & 0xC0) != 0x80){
+        return false;
+      }
+      codepoint = (codepoint << 6) | (bytes[i + j] & 0x3F);
+    }
+    if(codepoint > 0x10FFFF || (extra == 1 && codepoint < 0x80) || (extra == 2 && codepoint < 0x800) || (extra == 3 && codepoint < 0x10000)){
+      return false;
+    }
+    units += codepoint >= 0x10000 ? 2 : 1;
+    i += extra + 1;
+  }
+  *utf16_length = units;
+  return true;
+}
+
+CFStringRef CFStringCreateWithBytes(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex numBytes, CFStringEncoding encoding, Boolean isExternalRepresentation){
+  CFIndex length = 0;
+  if(numBytes < 0){
+    return NULL;
+  }
+  if(encoding == kCFStringEncodingASCII){
+    for(CFIndex i = 0; i < numBytes; i++){
+      if(bytes[i] & 0x80){
+        return NULL;
+      }
+    }
+    length = numBytes;
+  }else if(encoding != kCFStringEncodingUTF8 || !kcf_utf8_valid(bytes, (size_t)numBytes, &length)){
+    return NULL;
+  }
+  struct __CFString *string = _KCFRuntimeCreateInstance(KCF_STRING_TYPE_ID, sizeof(struct __CFString) + numBytes + 1);
+  string->bytes = (char*)(string + 1);
+  memcpy(string->bytes, bytes, numBytes);
+  string->bytes[numBytes] = '\0';
+  string->byte_length = (size_t)numBytes;
+  string->length = length;
+  return string;
+}
+
+CFStringRef CFStringCreateWithCString(CFAllocatorRef alloc, const char *cStr, CFStringEncoding encoding){
+  return CFStringCreateWithBytes(alloc, (const UInt8*)cStr, (CFIndex)strlen(cStr), encoding, false);
+}
+
+CFIndex CFStringGetLength(CFStringRef string){
+  return string->length;
+}
+
+CFIndex CFStringGetMaximumSizeForEncoding(CFIndex length, CFStringEncoding encoding){
+  return encoding == kCFStringEncodingUTF8 ? length * 3 : length;
+}
+
+static Boolean kcf_string_is_ascii(CFStringRef string){
+  return (size_t)string->length == string->byte_length;
+}
+
+Boolean CFStringGetCString(CFStringRef string, char *buffer, CFIndex bufferSize, CFStringEncoding encoding){
+  if(encoding == kCFStringEncodingASCII && !kcf_string_is_ascii(string)){
+    return false;
+  }
+  if(bufferSize < 0 || string->byte_length + 1 > (size_t)bufferSize){
+    return false;
+  }
+  memcpy(buffer, string->bytes, string->byte_length + 1);
+  return true;
+}
+
+const char *CFStringGetCStringPtr(CFStringRef string, CFStringEncoding encoding){
+  if(encoding == kCFStringEncodingASCII && !kcf_string_is_ascii(string)){
+    return NULL;
+  }
+  return string->bytes;
+}
+
+/* Returns the byte offset of the UTF-16 index `units` */
+static size_t kcf_string_byte_offset(CFStringRef string, CFIndex units){
+  if(kcf_string_is_ascii(string)){
+    return (size_t)units;
+  }
+  size_t offset = 0;
+  while(units > 0 && offset < string->byte_length){
+    UInt8 c = (UInt8)string->bytes[offset];
+    size_t width = c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : 4;
+    units -= width == 4 ? 2 : 1;
+    offset += width;
+  }
+  return offset;
+}
+
+CFIndex CFStringGetBytes(CFStringRef string, CFRange range, CFStringEncoding encoding, UInt8 lossByte, Boolean isExternalRepresentation, UInt8 *buffer, CFIndex maxBufLen, CFIndex *usedBufLen){
+  size_t start = kcf_string_byte_offset(string, range.location);
+  size_t end = kcf_string_byte_offset(string, range.location + range.length);
+  CFIndex converted = 0;
+  CFIndex used = 0;
+
+  size_t offset = start;
+  while(offset < end){
+    UInt8 c = (UInt8)string->bytes[offset];
+    size_t width = c < 0x80 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : 4;
+    if(encoding == kCFStringEncodingASCII && width > 1){
+      if(!lossByte){
+        break;
+      }
+      if(buffer){
+        if(used + 1 > maxBufLen){
+          break;
+        }
+        buffer[used] = lossByte;
+      }
+      used += 1;
+    }else{
+      if(buffer){
+        if(used + (CFIndex)width > maxBufLen){
+          break;
+        }
+        memcpy(buffer + used, string->bytes + offset, width);
+      }
+      used += (CFIndex)width;
+    }
+    converted += width == 4 ? 2 : 1;
+    offset += width;
+  }
+  if(usedBufLen){
+    *usedBufLen = used;
+  }
+  return converted;
+}
+
+CFComparisonResult CFStringCompare(CFStringRef string1, CFStringRef string2, CFOptionFlags compareOptions){
+  size_t length = string1->byte_length < string2->byte_length ? string1->byte_length : string2->byte_length;
+  int result = 0;
+  if(compareOptions & kCFCompareCaseInsensitive){
+    for(size_t i = 0; i < length && !result; i++){
+      UInt8 c1 = (UInt8)string1->bytes[i], c2 = (UInt8)string2->bytes[i];
+      if(c1 >= 'A' && c1 <= 'Z') c1 += 'a' - 'A';
+      if(c2 >= 'A' && c2 <= 'Z') c2 += 'a' - 'A';
+      result = (int)c1 - (int)c2;
+    }
+  }else{
+    result = memcmp(string1->bytes, string2->bytes, length);
+  }
+  if(!result){
+    result = string1->byte_length < string2->byte_length ? -1 : string1->byte_length > string2->byte_length ? 1 : 0;
+  }
+  return result < 0 ? kCFCompareLessThan : result > 0 ? kCFCompareGreaterThan : kCFCompareEqualTo;
+}
+
+Boolean CFStringHasPrefix(CFStringRef string, CFStringRef prefix){
+  return string->byte_length >= prefix->byte_length && !memcmp(string->bytes, prefix->bytes, prefix->byte_length);
+}
+
+/* Data */
+
+CFTypeID CFDataGetTypeID(void){
+  return KCF_DATA_TYPE_ID;
+}
+
+CFDataRef CFDataCreate(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex length){
+  struct __CFData *data = _KCFRuntimeCreateInstance(KCF_DATA_TYPE_ID, sizeof(struct __CFData) + length);
+  data->length = length;
+  if(length){
+    memcpy(data->bytes, bytes, length);
+  }
+  return data;
+}
+
+const UInt8 *CFDataGetBytePtr(CFDataRef data){
+  return data->bytes;
+}
+
+CFIndex CFDataGetLength(CFDataRef data){
+  return data->length;
+}
+
+/* Booleans */
+
+CFTypeID CFBooleanGetTypeID(void){
+  return KCF_BOOLEAN_TYPE_ID;
+}
+
+Boolean CFBooleanGetValue(CFBooleanRef boolean){
+  return boolean->value;
+}
+
+/* Numbers */
+
+CFTypeID CFNumberGetTypeID(void){
+  return KCF_NUMBER_TYPE_ID;
+}
+
+CFNumberRef CFNumberCreate(CFAllocatorRef alloc, CFNumberType theType, const void *valuePtr){
+  struct __CFNumber *number = _KCFRuntimeCreateInstance(KCF_NUMBER_TYPE_ID, sizeof(struct __CFNumber));
+  switch(theType){
+    case kCFNumberSInt32Type:
+      number->value.integer = *(const SInt32*)valuePtr;
+      break;
+    case kCFNumberIntType:
+      number->value.integer = *(const int*)valuePtr;
+      break;
+    case kCFNumberLongType:
+      number->value.integer = *(const long*)valuePtr;
+      break;
+    case kCFNumberSInt64Type:
+    case kCFNumberLongLongType:
+      number->value.integer = *(const long long*)valuePtr;
+      break;
+    case kCFNumberDoubleType:
+      number->is_float = true;
+      number->value.real = *(const double*)valuePtr;
+      break;
+    default:
+      free(number);
+      return NULL;
+  }
+  return number;
+}
+
+Boolean CFNumberGetValue(CFNumberRef number, CFNumberType theType, void *valuePtr){
+  long long integer = number->is_float ? (long long)number->value.real : number->value.integer;
+  Boolean exact = !number->is_float || (double)integer == number->value.real;
+  switch(theType){
+    case kCFNumberSInt32Type:
+      *(SInt32*)valuePtr = (SInt32)integer;
+      return exact && integer == (SInt32)integer;
+    case kCFNumberIntType:
+      *(int*)valuePtr = (int)integer;
+      return exact && integer == (int)integer;
+    case kCFNumberLongType:
+      *(long*)valuePtr = (long)integer;
+      return exact && integer == (long)integer;
+    case kCFNumberSInt64Type:
+    case kCFNumberLongLongType:
+      *(long long*)valuePtr = integer;
+      return exact;
+    case kCFNumberDoubleType:
+      *(double*)valuePtr = number->is_float ? number->value.real : (double)number->value.integer;
+      return true;
+    default:
+      return false;
+  }
+}
+
+Boolean CFNumberIsFloatType(CFNumberRef number){
+  return number->is_float;
+}
+
+CFComparisonResult CFNumberCompare(CFNumberRef number, CFNumberRef otherNumber, void *context){
+  if(number->is_float || otherNumber->is_float){
+    double v1 = number->is_float ? number->value.real : (double)number->value.integer;
+    double v2 = otherNumber->is_float ? otherNumber->value.real : (double)otherNumber->value.integer;
+    return v1 < v2 ? kCFCompareLessThan : v1 > v2 ? kCFCompareGreaterThan : kCFCompareEqualTo;
+  }
+  long long i1 = number->value.integer, i2 = otherNumber->value.integer;
+  return i1 < i2 ? kCFCompareLessThan : i1 > i2 ? kCFCompareGreaterThan : kCFCompareEqualTo;
+}
+
+/* Dates */
+
+CFTypeID CFDateGetTypeID(void){
+  return KCF_DATE_TYPE_ID;
+}
+
+CFDateRef CFDateCreate(CFAllocatorRef alloc, CFAbsoluteTime at){
+  struct __CFDate *date = _KCFRuntimeCreateInstance(KCF_DATE_TYPE_ID, sizeof(struct __CFDate));
+  date->time = at;
+  return date;
+}
+
+CFAbsoluteTime CFDateGetAbsoluteTime(CFDateRef date){
+  return date->time;
+}
+
+CFComparisonResult CFDateCompare(CFDateRef theDate, CFDateRef otherDate, void *context){
+  return theDate->time < otherDate->time ? kCFCompareLessThan : theDate->time > otherDate->time ? kCFCompareGreaterThan : kCFCompareEqualTo;
+}
+
+CFAbsoluteTime CFAbsoluteTimeGetCurrent(void){
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (double)now.tv_sec + now.tv_nsec / 1.0e9 - kCFAbsoluteTimeIntervalSince1970;
+}
+
+/* Arrays */
+
+CFTypeID CFArrayGetTypeID(void){
+  return KCF_ARRAY_TYPE_ID;
+}
+
+CFMutableArrayRef CFArrayCreateMutable(CFAllocatorRef alloc, CFIndex capacity, const CFArrayCallBacks *callBacks){
+  struct __CFArray *array = _KCFRuntimeCreateInstance(KCF_ARRAY_TYPE_ID, sizeof(struct __CFArray));
+  array->retains = callBacks != NULL;
+  array->capacity = capacity > 0 ? capacity : 4;
+  array->values = kcf_malloc(sizeof(void*) * array->capacity);
+  return array;
+}
+
+CFArrayRef CFArrayCreate(CFAllocatorRef alloc, const void **values, CFIndex numValues, const CFArrayCallBacks *callBacks){
+  CFMutableArrayRef array = CFArrayCreateMutable(alloc, numValues, callBacks);
+  for(CFIndex i = 0; i < numValues; i++){
+    CFArrayAppendValue(array, values[i]);
+  }
+  return array;
+}
+
+void CFArrayAppendValue(CFMutableArrayRef array, const void *value){
+  if(array->count == array->capacity){
+    array->capacity *= 2;
+    array->values = kcf_realloc(array->values, sizeof(void*) * array->capacity);
+  }
+  if(array->retains){
+    CFRetain(value);
+  }
+  array->values[array->count++] = value;
+}
+
+CFIndex CFArrayGetCount(CFArrayRef array){
+  return array->count;
+}
+
+const void *CFArrayGetValueAtIndex(CFArrayRef array, CFIndex idx){
+  return array->values[idx];
+}
+
+/* Dictionaries. These hold a handful of entries, so a flat table with cached hashes is enough */
+
+CFTypeID CFDictionaryGetTypeID(void){
+  return KCF_DICTIONARY_TYPE_ID;
+}
+
+CFMutableDictionaryRef CFDictionaryCreateMutable(CFAllocatorRef alloc, CFIndex capacity, const CFDictionaryKeyCallBacks *keyCallBacks, const CFDictionaryValueCallBacks *valueCallBacks){
+  struct __CFDictionary *dict = _KCFRuntimeCreateInstance(KCF_DICTIONARY_TYPE_ID, sizeof(struct __CFDictionary));
+  dict->retains = keyCallBacks != NULL || valueCallBacks != NULL;
+  dict->capacity = capacity > 0 ? capacity : 8;
+  dict->keys = kcf_malloc(sizeof(void*) * dict->capacity);
+  dict->values = kcf_malloc(sizeof(void*) * dict->capacity);
+  dict->hashes = kcf_malloc(sizeof(CFHashCode) * dict->capacity);
+  return dict;
+}
+
+CFDictionaryRef CFDictionaryCreate(CFAllocatorRef alloc, const void **keys, const void **values, CFIndex numValues, const CFDictionaryKeyCallBacks *keyCallBacks, const CFDictionaryValueCallBacks *valueCallBacks){
+  CFMutableDictionaryRef dict = CFDictionaryCreateMutable(alloc, numValues, keyCallBacks, valueCallBacks);
+  for(CFIndex i = 0; i < numValues; i++){
+    CFDictionarySetValue(dict, keys[i], values[i]);
+  }
+  return dict;
+}
+
+CFMutableDictionaryRef CFDictionaryCreateMutableCopy(CFAllocatorRef alloc, CFIndex capacity, CFDictionaryRef source){
+  CFIndex count = source->count;
+  struct __CFDictionary *dict = CFDictionaryCreateMutable(alloc, capacity > count ? capacity : count + 4, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+  memcpy(dict->keys, source->keys, sizeof(void*) * count);
+  memcpy(dict->values, source->values, sizeof(void*) * count);
+  memcpy(dict->hashes, source->hashes, sizeof(CFHashCode) * count);
+  dict->count = count;
+  for(CFIndex i = 0; i < count; i++){
+    CFRetain(dict->keys[i]);
+    CFRetain(dict->values[i]);
+  }
+  return dict;
+}
+
+static CFIndex kcf_dictionary_find(CFDictionaryRef dict, const void *key, CFHashCode hash){
+  for(CFIndex i = 0; i < dict->count; i++){
+    if(dict->keys[i] == key){
+      return i;
+    }
+  }
+  for(CFIndex i = 0; i < dict->count; i++){
+    if(dict->hashes[i] == hash && CFEqual(dict->keys[i], key)){
+      return i;
+    }
+  }
+  return -1;
+}
+
+CFIndex CFDictionaryGetCount(CFDictionaryRef dict){
+  return dict->count;
+}
+
+Boolean CFDictionaryGetValueIfPresent(CFDictionaryRef dict, const void *key, const void **value){
+  CFIndex index = kcf_dictionary_find(dict, key, CFHash(key));
+  if(index < 0){
+    return false;
+  }
+  if(value){
+    *value = dict->values[index];
+  }
+  return true;
+}
+
+const void *CFDictionaryGetValue(CFDictionaryRef dict, const void *key){
+  const void *value = NULL;
+  CFDictionaryGetValueIfPresent(dict, key, &value);
+  return value;
+}
+
+Boolean CFDictionaryContainsKey(CFDictionaryRef dict, const void *key){
+  return CFDictionaryGetValueIfPresent(dict, key, NULL);
+}
+
+void CFDictionarySetValue(CFMutableDictionaryRef dict, const void *key, const void *value){
+  CFHashCode hash = CFHash(key);
+  CFIndex index = kcf_dictionary_find(dict, key, hash);
+  if(dict->retains){
+    CFRetain(value);
+  }
+  if(index >= 0){
+    if(dict->retains){
+      CFRelease(dict->values[index]);
+    }
+    dict->values[index] = value;
+    return;
+  }
+  if(dict->count == dict->capacity){
+    dict->capacity *= 2;
+    dict->keys = kcf_realloc(dict->keys, sizeof(void*) * dict->capacity);
+    dict->values = kcf_realloc(dict->values, sizeof(void*) * dict->capacity);
+    dict->hashes = kcf_realloc(dict->hashes, sizeof(CFHashCode) * dict->capacity);
+  }
+  if(dict->retains){
+    CFRetain(key);
+  }
+  dict->keys[dict->count] = key;
+  dict->values[dict->count] = value;
+  dict->hashes[dict->count] = hash;
+  dict->count++;
+}
+
+void CFDictionaryRemoveValue(CFMutableDictionaryRef dict, const void *key){
+  CFIndex index = kcf_dictionary_find(dict, key, CFHash(key));
+  if(index < 0){
+    return;
+  }
+  if(dict->retains){
+    CFRelease(dict->keys[index]);
+    CFRelease(dict->values[index]);
+  }
+  CFIndex tail = dict->count - index - 1;
+  memmove(dict->keys + index, dict->keys + index + 1, sizeof(void*) * tail);
+  memmove(dict->values + index, dict->values + index + 1, sizeof(void*) * tail);
+  memmove(dict->hashes + index, dict->hashes + index + 1, sizeof(CFHashCode) * tail);
+  dict->count--;
+}
+
+void CFDictionaryRemoveAllValues(CFMutableDictionaryRef dict){
+  if(dict->retains){
+    for(CFIndex i = 0; i < dict->count; i++){
+      CFRelease(dict->keys[i]);
+      CFRelease(dict->values[i]);
+    }
+  }
+  dict->count = 0;
+}
+
+void CFDictionaryApplyFunction(CFDictionaryRef dict, CFDictionaryApplierFunction applier, void *context){
+  for(CFIndex i = 0; i < dict->count; i++){
+    applier(dict->keys[i], dict->values[i], context);
+  }
+}
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef KEYCHAIN_PORTABLE_CF_H
+#define KEYCHAIN_PORTABLE_CF_H
+
+/*
+ * The subset of CoreFoundation used by the extension, for platforms that
+ * don't have it. Names, types and semantics follow CoreFoundation so that
+ * keychain.c compiles unchanged against either this or the real framework.
+ * Only UTF-8 and ASCII string encodings are supported.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned char Boolean;
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef int32_t SInt32;
+typedef uint64_t UInt64;
+typedef int64_t SInt64;
+typedef int32_t OSStatus;
+typedef UInt32 FourCharCode;
+
+#define KCF_FOURCC(a,b,c,d) ((FourCharCode)(((UInt32)(a) << 24) | ((UInt32)(b) << 16) | ((UInt32)(c) << 8) | (UInt32)(d)))
+
+typedef long CFIndex;
+typedef unsigned long CFTypeID;
+typedef unsigned long CFHashCode;
+typedef unsigned long CFOptionFlags;
+typedef UInt32 CFStringEncoding;
+typedef double CFTimeInterval;
+typedef CFTimeInterval CFAbsoluteTime;
+
+typedef const void *CFTypeRef;
+typedef const struct __CFAllocator *CFAllocatorRef;
+typedef const struct __CFString *CFStringRef;
+typedef struct __CFString *CFMutableStringRef;
+typedef const struct __CFData *CFDataRef;
+typedef const struct __CFNumber *CFNumberRef;
+typedef const struct __CFBoolean *CFBooleanRef;
+typedef const struct __CFDate *CFDateRef;
+typedef const struct __CFArray *CFArrayRef;
+typedef struct __CFArray *CFMutableArrayRef;
+typedef const struct __CFDictionary *CFDictionaryRef;
+typedef struct __CFDictionary *CFMutableDictionaryRef;
+
+typedef struct {
+  CFIndex location;
+  CFIndex length;
+} CFRange;
+
+static inline CFRange CFRangeMake(CFIndex location, CFIndex length){
+  CFRange range = {location, length};
+  return range;
+}
+
+enum {
+  kCFStringEncodingASCII = 0x0600,
+  kCFStringEncodingUTF8 = 0x08000100
+};
+
+typedef CFIndex CFComparisonResult;
+enum {
+  kCFCompareLessThan = -1,
+  kCFCompareEqualTo = 0,
+  kCFCompareGreaterThan = 1
+};
+enum {
+  kCFCompareCaseInsensitive = 1
+};
+
+typedef CFIndex CFNumberType;
+enum {
+  kCFNumberSInt32Type = 3,
+  kCFNumberSInt64Type = 4,
+  kCFNumberIntType = 9,
+  kCFNumberLongType = 10,
+  kCFNumberLongLongType = 11,
+  kCFNumberDoubleType = 13
+};
+
+static const CFAbsoluteTime kCFAbsoluteTimeIntervalSince1970 = 978307200.0;
+
+static inline UInt32 CFSwapInt32HostToBig(UInt32 value){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return value;
+#else
+  return __builtin_bswap32(value);
+#endif
+}
+
+/* Only the kCFType callbacks are supported; passing NULL means values are not retained */
+typedef struct { CFIndex version; } CFArrayCallBacks;
+typedef struct { CFIndex version; } CFDictionaryKeyCallBacks;
+typedef struct { CFIndex version; } CFDictionaryValueCallBacks;
+extern const CFArrayCallBacks kCFTypeArrayCallBacks;
+extern const CFDictionaryKeyCallBacks kCFTypeDictionaryKeyCallBacks;
+extern const CFDictionaryValueCallBacks kCFTypeDictionaryValueCallBacks;
+
+typedef void (*CFDictionaryApplierFunction)(const void *key, const void *value, void *context);
+
+extern const CFBooleanRef kCFBooleanTrue;
+extern const CFBooleanRef kCFBooleanFalse;
+
+CFTypeRef CFRetain(CFTypeRef cf);
+void CFRelease(CFTypeRef cf);
+CFIndex CFGetRetainCount(CFTypeRef cf);
+CFTypeID CFGetTypeID(CFTypeRef cf);
+Boolean CFEqual(CFTypeRef cf1, CFTypeRef cf2);
+CFHashCode CFHash(CFTypeRef cf);
+
+CFTypeID CFStringGetTypeID(void);
+CFStringRef CFStringCreateWithCString(CFAllocatorRef alloc, const char *cStr, CFStringEncoding encoding);
+CFStringRef CFStringCreateWithBytes(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex numBytes, CFStringEncoding encoding, Boolean isExternalRepresentation);
+CFIndex CFStringGetLength(CFStringRef string);
+CFIndex CFStringGetMaximumSizeForEncoding(CFIndex length, CFStringEncoding encoding);
+Boolean CFStringGetCString(CFStringRef string, char *buffer, CFIndex bufferSize, CFStringEncoding encoding);
+const char *CFStringGetCStringPtr(CFStringRef string, CFStringEncoding encoding);
+CFIndex CFStringGetBytes(CFStringRef string, CFRange range, CFStringEncoding encoding, UInt8 lossByte, Boolean isExternalRepresentation, UInt8 *buffer, CFIndex maxBufLen, CFIndex *usedBufLen);
+CFComparisonResult CFStringCompare(CFStringRef string1, CFStringRef string2, CFOptionFlags compareOptions);
+Boolean CFStringHasPrefix(CFStringRef string, CFStringRef prefix);
+
+CFTypeID CFDataGetTypeID(void);
+CFDataRef CFDataCreate(CFAllocatorRef alloc, const UInt8 *bytes, CFIndex length);
+const UInt8 *CFDataGetBytePtr(CFDataRef data);
+CFIndex CFDataGetLength(CFDataRef data);
+
+CFTypeID CFBooleanGetTypeID(void);
+Boolean CFBooleanGetValue(CFBooleanRef boolean);
+
+CFTypeID CFNumberGetTypeID(void);
+CFNumberRef CFNumberCreate(CFAllocatorRef alloc, CFNumberType theType, const void *valuePtr);
+Boolean CFNumberGetValue(CFNumberRef number, CFNumberType theType, void *valuePtr);
+Boolean CFNumberIsFloatType(CFNumberRef number);
+CFComparisonResult CFNumberCompare(CFNumberRef number, CFNumberRef otherNumber, void *context);
+
+CFTypeID CFDateGetTypeID(void);
+CFDateRef CFDateCreate(CFAllocatorRef alloc, CFAbsoluteTime at);
+CFAbsoluteTime CFDateGetAbsoluteTime(CFDateRef date);
+CFComparisonResult CFDateCompare(CFDateRef theDate, CFDateRef otherDate, void *context);
+CFAbsoluteTime CFAbsoluteTimeGetCurrent(void);
+
+CFTypeID CFArrayGetTypeID(void);
+CFArrayRef CFArrayCreate(CFAllocatorRef alloc, const void **values, CFIndex numValues, const CFArrayCallBacks *callBacks);
+CFMutableArrayRef CFArrayCreateMutable(CFAllocatorRef alloc, CFIndex capacity, const CFArrayCallBacks *callBacks);
+void CFArrayAppendValue(CFMutableArrayRef array, const void *value);
+CFIndex CFArrayGetCount(CFArrayRef array);
+const void *CFArrayGetValueAtIndex(CFArrayRef array, CFIndex idx);
+
+CFTypeID CFDictionaryGetTypeID(void);
+CFDictionaryRef CFDictionaryCreate(CFAllocatorRef alloc, const void **keys, const void **values, CFIndex numValues, const CFDictionaryKeyCallBacks *keyCallBacks, const CFDictionaryValueCallBacks *valueCallBacks);
+CFMutableDictionaryRef CFDictionaryCreateMutable(CFAllocatorRef alloc, CFIndex capacity, const CFDictionaryKeyCallBacks *keyCallBacks, const CFDictionaryValueCallBacks *valueCallBacks);
+CFMutableDictionaryRef CFDictionaryCreateMutableCopy(CFAllocatorRef alloc, CFIndex capacity, CFDictionaryRef dict);
+CFIndex CFDictionaryGetCount(CFDictionaryRef dict);
+const void *CFDictionaryGetValue(CFDictionaryRef dict, const void *key);
+Boolean CFDictionaryGetValueIfPresent(CFDictionaryRef dict, const void *key, const void **value);
+Boolean CFDictionaryContainsKey(CFDictionaryRef dict, const void *key);
+void CFDictionarySetValue(CFMutableDictionaryRef dict, const void *key, const void *value);
+void CFDictionaryRemoveValue(CFMutableDictionaryRef dict, const void *key);
+void CFDictionaryRemoveAllValues(CFMutableDictionaryRef dict);
+void CFDictionaryApplyFunction(CFDictionaryRef dict, CFDictionaryApplierFunction applier, void *context);
+
+/*
+ * Runtime hooks so that the file backend can define its own CF types
+ * (SecKeychainRef, SecKeychainItemRef) that work with CFRetain/CFRelease/CFEqual.
+ */
+typedef struct {
+  CFTypeID type;
+  long refcount; /* -1 for immortal constants */
+} KCFRuntimeBase;
+
+typedef struct {
+  const char *name;
+  void (*finalize)(CFTypeRef cf);
+  Boolean (*equal)(CFTypeRef cf1, CFTypeRef cf2);
+  CFHashCode (*hash)(CFTypeRef cf);
+} KCFRuntimeClass;
+
+CFTypeID _KCFRuntimeRegisterClass(const KCFRuntimeClass *cls);
+void *_KCFRuntimeCreateInstance(CFTypeID type, size_t size);
+
+#define KCF_STRING_TYPE_ID 1
+#define KCF_CONST_STRING_INITIALIZER(literal) {{KCF_STRING_TYPE_ID, -1}, sizeof(literal) - 1, sizeof(literal) - 1, 0, (char*)(literal)}
+
+/* Exposed so that constant strings can be defined statically */
+struct __CFString {
+  KCFRuntimeBase base;
+  CFIndex length;      /* in UTF-16 units, as CoreFoundation counts them */
+  size_t byte_length;  /* UTF-8 bytes, excluding the terminator */
+  CFHashCode hash;     /* 0 until computed */
+  char *bytes;         /* NUL terminated UTF-8 */
+};
+
+#endif
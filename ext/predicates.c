@@ -0,0 +1,268 @@
+#include "predicates.h"
+#include "cf_conversions.h"
+
+#ifndef HAVE_RB_GC_MARK_MOVABLE
+#define rb_gc_mark_movable rb_gc_mark
+#define rb_gc_location(value) (value)
+#endif
+#ifndef RUBY_TYPED_FREE_IMMEDIATELY
+#define RUBY_TYPED_FREE_IMMEDIATELY 0
+#endif
+
+static VALUE rb_cKeychainPrefix;
+
+typedef enum {
+  PREDICATE_PREFIX,
+  PREDICATE_IN,
+  PREDICATE_RANGE,
+  PREDICATE_REGEXP
+} predicate_kind;
+
+typedef struct {
+  CFStringRef sec_key;
+  predicate_kind kind;
+  CFTypeRef value; /* the prefix, or the array of values for PREDICATE_IN */
+  CFTypeRef low, high; /* range bounds, NULL if open */
+  int exclude_end;
+  VALUE regexp;
+} keychain_predicate;
+
+typedef struct {
+  long count;
+  long limit;
+  keychain_predicate *items;
+} keychain_predicates;
+
+static void keychain_predicates_mark(void *ptr){
+  keychain_predicates *predicates = ptr;
+  for(long i = 0; i < predicates->count; i++){
+    rb_gc_mark_movable(predicates->items[i].regexp);
+  }
+}
+
+static void keychain_predicates_compact(void *ptr){
+  keychain_predicates *predicates = ptr;
+  for(long i = 0; i < predicates->count; i++){
+    predicates->items[i].regexp = rb_gc_location(predicates->items[i].regexp);
+  }
+}
+
+static void keychain_predicates_free(void *ptr){
+  keychain_predicates *predicates = ptr;
+  for(long i = 0; i < predicates->count; i++){
+    keychain_predicate *predicate = &predicates->items[i];
+    CFRelease(predicate->sec_key);
+    if(predicate->value){
+      CFRelease(predicate->value);
+    }
+    if(predicate->low){
+      CFRelease(predicate->low);
+    }
+    if(predicate->high){
+      CFRelease(predicate->high);
+    }
+  }
+  xfree(predicates->items);
+  xfree(predicates);
+}
+
+static size_t keychain_predicates_memsize(const void *ptr){
+  const keychain_predicates *predicates = ptr;
+  size_t size = sizeof(keychain_predicates) + predicates->count * sizeof(keychain_predicate);
+  for(long i = 0; i < predicates->count; i++){
+    const keychain_predicate *predicate = &predicates->items[i];
+    size += cf_memsize(predicate->value) + cf_memsize(predicate->low) + cf_memsize(predicate->high);
+  }
+  return size;
+}
+
+static const rb_data_type_t keychain_predicates_type = {
+  "Keychain::Predicates",
+  {keychain_predicates_mark, keychain_predicates_free, keychain_predicates_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+   keychain_predicates_compact,
+#endif
+  },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static keychain_predicates *get_keychain_predicates(VALUE self){
+  keychain_predicates *predicates;
+  TypedData_Get_Struct(self, keychain_predicates, &keychain_predicates_type, predicates);
+  return predicates;
+}
+
+int keychain_predicate_value_p(VALUE value){
+  return RB_TYPE_P(value, T_REGEXP) || RB_TYPE_P(value, T_ARRAY) ||
+    rb_obj_is_kind_of(value, rb_cRange) || rb_obj_is_kind_of(value, rb_cKeychainPrefix);
+}
+
+VALUE keychain_predicates_new(void){
+  keychain_predicates *predicates;
+  VALUE self = TypedData_Make_Struct(0, keychain_predicates, &keychain_predicates_type, predicates);
+  predicates->limit = -1;
+  return self;
+}
+
+static CFTypeRef create_bound(VALUE bound){
+  return NIL_P(bound) ? NULL : rb_create_cf_value(bound, 0);
+}
+
+void keychain_predicates_add(VALUE self, CFStringRef sec_key, VALUE value){
+  keychain_predicates *predicates = get_keychain_predicates(self);
+  REALLOC_N(predicates->items, keychain_predicate, predicates->count + 1);
+  keychain_predicate *predicate = &predicates->items[predicates->count];
+  MEMZERO(predicate, keychain_predicate, 1);
+  predicate->regexp = Qnil;
+  predicate->sec_key = CFRetain(sec_key);
+  /* counted now, so that the values converted below are released even if a later one raises */
+  predicates->count++;
+
+  if(RB_TYPE_P(value, T_REGEXP)){
+    predicate->kind = PREDICATE_REGEXP;
+    predicate->regexp = value;
+  }else if(RB_TYPE_P(value, T_ARRAY)){
+    predicate->kind = PREDICATE_IN;
+    CFMutableArrayRef values = CFArrayCreateMutable(NULL, RARRAY_LEN(value), &kCFTypeArrayCallBacks);
+    predicate->value = values;
+    for(long i = 0; i < RARRAY_LEN(value); i++){
+      CFTypeRef element = rb_create_cf_value(RARRAY_AREF(value, i), 0);
+      CFArrayAppendValue(values, element);
+      CFRelease(element);
+    }
+  }else if(rb_obj_is_kind_of(value, rb_cRange)){
+    VALUE low, high;
+    int exclude_end;
+    rb_range_values(value, &low, &high, &exclude_end);
+    predicate->kind = PREDICATE_RANGE;
+    predicate->exclude_end = exclude_end;
+    predicate->low = create_bound(low);
+    predicate->high = create_bound(high);
+  }else{
+    predicate->kind = PREDICATE_PREFIX;
+    VALUE prefix = rb_ivar_get(value, rb_intern("@prefix"));
+    StringValue(prefix);
+    predicate->value = rb_create_cf_string(prefix);
+  }
+}
+
+void keychain_predicates_set_limit(VALUE self, long limit){
+  get_keychain_predicates(self)->limit = limit;
+}
+
+#define NOT_COMPARABLE 2
+
+/* Compares two strings, numbers or dates. Anything else, or a mix of types, can't be compared */
+static int compare_values(CFTypeRef value, CFTypeRef other){
+  CFTypeID type = CFGetTypeID(value);
+  if(type != CFGetTypeID(other)){
+    return NOT_COMPARABLE;
+  }
+  if(type == CFStringGetTypeID()){
+    return (int)CFStringCompare(value, other, 0);
+  }
+  if(type == CFNumberGetTypeID()){
+    return (int)CFNumberCompare(value, other, NULL);
+  }
+  if(type == CFDateGetTypeID()){
+    return (int)CFDateCompare(value, other, NULL);
+  }
+  return NOT_COMPARABLE;
+}
+
+static int predicate_matches(keychain_predicate *predicate, CFTypeRef value){
+  if(!value){
+    return 0;
+  }
+  switch(predicate->kind){
+    case PREDICATE_PREFIX:
+      return CFGetTypeID(value) == CFStringGetTypeID() && CFStringHasPrefix(value, predicate->value);
+    case PREDICATE_IN:
+      for(CFIndex i = 0; i < CFArrayGetCount(predicate->value); i++){
+        CFTypeRef candidate = CFArrayGetValueAtIndex(predicate->value, i);
+        if(CFGetTypeID(candidate) == CFGetTypeID(value) && CFEqual(candidate, value)){
+          return 1;
+        }
+      }
+      return 0;
+    case PREDICATE_RANGE:
+      if(predicate->low){
+        int comparison = compare_values(value, predicate->low);
+        if(comparison == NOT_COMPARABLE || comparison < 0){
+          return 0;
+        }
+      }
+      if(predicate->high){
+        int comparison = compare_values(value, predicate->high);
+        if(comparison == NOT_COMPARABLE || comparison > 0 || (comparison == 0 && predicate->exclude_end)){
+          return 0;
+        }
+      }
+      return 1;
+    case PREDICATE_REGEXP:
+      /* only the attribute is converted, not the item */
+      return CFGetTypeID(value) == CFStringGetTypeID() &&
+        RTEST(rb_funcall(predicate->regexp, rb_intern("match?"), 1, cfstring_to_rb_string(value)));
+  }
+  return 0;
+}
+
+static int dictionary_matches(keychain_predicates *predicates, CFDictionaryRef attributes){
+  for(long i = 0; i < predicates->count; i++){
+    keychain_predicate *predicate = &predicates->items[i];
+    if(!predicate_matches(predicate, CFDictionaryGetValue(attributes, predicate->sec_key))){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+struct filter_args {
+  keychain_predicates *predicates;
+  CFTypeRef result;
+  CFMutableArrayRef matches;
+  long limit;
+};
+
+static VALUE filter_body(VALUE data){
+  struct filter_args *args = (struct filter_args*)data;
+  if(CFGetTypeID(args->result) == CFArrayGetTypeID()){
+    CFArrayRef results = args->result;
+    for(CFIndex i = 0; i < CFArrayGetCount(results) && CFArrayGetCount(args->matches) != args->limit; i++){
+      CFDictionaryRef attributes = CFArrayGetValueAtIndex(results, i);
+      if(dictionary_matches(args->predicates, attributes)){
+        CFArrayAppendValue(args->matches, attributes);
+      }
+    }
+  }else if(args->limit != 0 && dictionary_matches(args->predicates, args->result)){
+    CFArrayAppendValue(args->matches, args->result);
+  }
+  return Qnil;
+}
+
+static VALUE filter_ensure(VALUE data){
+  struct filter_args *args = (struct filter_args*)data;
+  CFRelease(args->result);
+  return Qnil;
+}
+
+CFArrayRef keychain_predicates_filter(VALUE self, CFTypeRef result, int first){
+  keychain_predicates *predicates = get_keychain_predicates(self);
+  struct filter_args args = {predicates, result, NULL, first ? 1 : predicates->limit};
+  args.matches = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+  int state = 0;
+  /* a regexp can raise (on a string with invalid bytes, say), so the arrays are released if it does */
+  rb_protect(filter_body, (VALUE)&args, &state);
+  filter_ensure((VALUE)&args);
+  if(state){
+    CFRelease(args.matches);
+    rb_jump_tag(state);
+  }
+  RB_GC_GUARD(self);
+  return args.matches;
+}
+
+void Init_keychain_predicates(VALUE rb_cKeychain){
+  rb_cKeychainPrefix = rb_const_get(rb_cKeychain, rb_intern("Prefix"));
+  rb_gc_register_address(&rb_cKeychainPrefix);
+}
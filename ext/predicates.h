@@ -0,0 +1,36 @@
+#ifndef KEYCHAIN_PREDICATES_H
+#define KEYCHAIN_PREDICATES_H
+
+/*
+ * Conditions that SecItemCopyMatching can't evaluate: prefixes (Keychain::Prefix), regexps,
+ * ranges and lists of values. find fetches everything matching the exact conditions, then
+ * keeps the result dictionaries these match before any of them is turned into an item.
+ *
+ * A set of predicates is a hidden ruby object, so that it is freed by the GC if building a
+ * query raises.
+ */
+
+#include "ruby.h"
+#ifdef KEYCHAIN_FILE_BACKEND
+#include "portable_cf.h"
+#else
+#include <CoreFoundation/CoreFoundation.h>
+#endif
+
+/* Whether value is a condition that has to be evaluated by keychain_predicates_filter */
+int keychain_predicate_value_p(VALUE value);
+
+VALUE keychain_predicates_new(void);
+/* Adds the condition that the attribute sec_key matches value */
+void keychain_predicates_add(VALUE predicates, CFStringRef sec_key, VALUE value);
+/* The number of matches to keep, as the query's limit would have; negative for all of them */
+void keychain_predicates_set_limit(VALUE predicates, long limit);
+/*
+ * Returns the dictionaries in result (an array, or a single dictionary) that match, up to the
+ * limit or just one if first is set. result is released.
+ */
+CFArrayRef keychain_predicates_filter(VALUE predicates, CFTypeRef result, int first);
+
+void Init_keychain_predicates(VALUE rb_cKeychain);
+
+#endif
@@ -0,0 +1,211 @@
+#define _DEFAULT_SOURCE
+
+#include "registry.h"
+#include "cf_conversions.h"
+#include "ruby/encoding.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+#include "ruby/ractor.h"
+#endif
+#ifndef RUBY_TYPED_FREE_IMMEDIATELY
+#define RUBY_TYPED_FREE_IMMEDIATELY 0
+#endif
+#ifndef RUBY_TYPED_FROZEN_SHAREABLE
+#define RUBY_TYPED_FROZEN_SHAREABLE 0
+#endif
+
+static VALUE rb_cKeychainClass;
+/*
+ * [WeakMap of path => Keychain, Mutex]. Lookups and insertions are made while holding the
+ * mutex. Neither can be shared between ractors, so each ractor has its own registry.
+ */
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+static rb_ractor_local_key_t registry_storage;
+/* only set in the main ractor */
+static rb_ractor_local_key_t main_ractor_storage;
+#else
+static VALUE registry = Qnil;
+#endif
+static ID id_registry_path;
+
+static VALUE registry_new(void){
+  VALUE weak_map = rb_const_get(rb_const_get(rb_cObject, rb_intern("ObjectSpace")), rb_intern("WeakMap"));
+  return rb_assoc_new(rb_class_new_instance(0, NULL, weak_map), rb_mutex_new());
+}
+
+static VALUE current_registry(void){
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  VALUE registry;
+  if(!rb_ractor_local_storage_value_lookup(registry_storage, &registry)){
+    registry = registry_new();
+    rb_ractor_local_storage_value_set(registry_storage, registry);
+  }
+#endif
+  return registry;
+}
+
+/*
+ * The key for a path. Interned strings are unique, which is what a WeakMap (comparing keys
+ * by identity) needs, and looking up one that already exists doesn't allocate.
+ */
+static VALUE registry_key(const char *path){
+  char canonical[PATH_MAX];
+  if(realpath(path, canonical)){
+    path = canonical;
+  }
+#ifdef HAVE_RB_ENC_INTERNED_STR
+  return rb_enc_interned_str(path, (long)strlen(path), rb_utf8_encoding());
+#else
+  return rb_funcall(rb_enc_str_new_cstr(path, rb_utf8_encoding()), rb_intern("-@"), 0);
+#endif
+}
+
+static void keychain_free(void *keychain){
+  CFRelease(keychain);
+}
+
+/* the keychain file's contents are shared by every reference to it, so aren't counted */
+static size_t keychain_memsize(const void *keychain){
+  return cf_memsize(keychain);
+}
+
+/* keychains are frozen once wrapped, so that they can be shared between ractors */
+static const rb_data_type_t keychain_type = {
+  "Keychain",
+  {NULL, keychain_free, keychain_memsize},
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+SecKeychainRef keychain_registry_ref(VALUE keychain){
+  SecKeychainRef ref;
+  TypedData_Get_Struct(keychain, struct OpaqueSecKeychainRef, &keychain_type, ref);
+  return ref;
+}
+
+static VALUE wrap_keychain_body(VALUE keychain){
+  return TypedData_Wrap_Struct(rb_cKeychainClass, &keychain_type, (void*)keychain);
+}
+
+/* path is the registry key, or nil */
+static VALUE wrap_keychain(SecKeychainRef keychain, VALUE path){
+  VALUE wrapped = cf_release_on_raise(wrap_keychain_body, (VALUE)keychain, keychain);
+  if(!NIL_P(path)){
+    rb_ivar_set(wrapped, id_registry_path, path);
+  }
+  return rb_obj_freeze(wrapped);
+}
+
+struct registry_args {
+  SecKeychainRef keychain; /* NULL once it has been wrapped or released */
+  const char *path;
+  VALUE registry;
+};
+
+static VALUE registry_intern(VALUE data){
+  struct registry_args *args = (struct registry_args*)data;
+  VALUE map = RARRAY_AREF(args->registry, 0);
+  VALUE key = registry_key(args->path);
+  VALUE existing = rb_funcall(map, rb_intern("[]"), 1, key);
+  SecKeychainRef keychain = args->keychain;
+  args->keychain = NULL;
+  /* a keychain deleted and created again by another ractor is a different keychain */
+  if(!NIL_P(existing) && CFEqual(keychain_registry_ref(existing), keychain)){
+    CFRelease(keychain);
+    return existing;
+  }
+  VALUE wrapped = wrap_keychain(keychain, key);
+  rb_funcall(map, rb_intern("[]="), 2, key, wrapped);
+  return wrapped;
+}
+
+static VALUE registry_synchronize(VALUE data){
+  struct registry_args *args = (struct registry_args*)data;
+  args->registry = current_registry();
+  return rb_mutex_synchronize(RARRAY_AREF(args->registry, 1), registry_intern, data);
+}
+
+VALUE keychain_registry_wrap(SecKeychainRef keychain){
+  char path[PATH_MAX];
+  UInt32 length = PATH_MAX;
+  if(SecKeychainGetPath(keychain, &length, path) != noErr || length >= PATH_MAX){
+    /* a keychain without a path can't be looked up again anyway */
+    return wrap_keychain(keychain, Qnil);
+  }
+  path[length] = '\0';
+  struct registry_args args = {keychain, path, Qnil};
+  int state = 0;
+  VALUE result = rb_protect(registry_synchronize, (VALUE)&args, &state);
+  if(state){
+    if(args.keychain){
+      CFRelease(args.keychain);
+    }
+    rb_jump_tag(state);
+  }
+  return result;
+}
+
+struct registry_remove_args {
+  VALUE map;
+  VALUE keychain;
+};
+
+static VALUE registry_remove(VALUE data){
+  struct registry_remove_args *args = (struct registry_remove_args*)data;
+  VALUE key = rb_attr_get(args->keychain, id_registry_path);
+  if(!NIL_P(key) && rb_funcall(args->map, rb_intern("[]"), 1, key) == args->keychain){
+    if(rb_respond_to(args->map, rb_intern("delete"))){
+      rb_funcall(args->map, rb_intern("delete"), 1, key);
+    }else{
+      rb_funcall(args->map, rb_intern("[]="), 2, key, Qnil);
+    }
+  }
+  return Qnil;
+}
+
+int keychain_main_ractor_p(void){
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  VALUE main;
+  return rb_ractor_local_storage_value_lookup(main_ractor_storage, &main);
+#else
+  return 1;
+#endif
+}
+
+void keychain_check_main_ractor(const char *what){
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  if(!keychain_main_ractor_p()){
+    rb_raise(rb_const_get(rb_cRactor, rb_intern("UnsafeError")), "%s can only be used from the main ractor", what);
+  }
+#endif
+}
+
+/* Keychain.main_ractor? - whether process wide state (such as the result caches) can be used */
+static VALUE rb_keychain_main_ractor(VALUE self){
+  return keychain_main_ractor_p() ? Qtrue : Qfalse;
+}
+
+/* Only from the current ractor's registry: the others replace their entry when they next look the path up */
+void keychain_registry_forget(VALUE keychain){
+  VALUE registry = current_registry();
+  struct registry_remove_args args = {RARRAY_AREF(registry, 0), keychain};
+  rb_mutex_synchronize(RARRAY_AREF(registry, 1), registry_remove, (VALUE)&args);
+}
+
+void Init_keychain_registry(VALUE rb_cKeychain){
+  rb_cKeychainClass = rb_cKeychain;
+  /* keychains are only ever wrapped here */
+  rb_undef_alloc_func(rb_cKeychain);
+  id_registry_path = rb_intern("registry_path");
+  rb_define_singleton_method(rb_cKeychain, "main_ractor?", RUBY_METHOD_FUNC(rb_keychain_main_ractor), 0);
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  registry_storage = rb_ractor_local_storage_value_newkey();
+  main_ractor_storage = rb_ractor_local_storage_value_newkey();
+  rb_ractor_local_storage_value_set(main_ractor_storage, Qtrue);
+#else
+  registry = registry_new();
+  rb_gc_register_address(&registry);
+#endif
+}
@@ -0,0 +1,41 @@
+#ifndef KEYCHAIN_REGISTRY_H
+#define KEYCHAIN_REGISTRY_H
+
+/*
+ * The Keychain objects in use, by canonical path, so that Keychain.default,
+ * Keychain.open, Item#keychain and so on return the same object for the same
+ * keychain rather than wrapping a new reference each time.
+ *
+ * Objects are held weakly (in an ObjectSpace::WeakMap), so a keychain nothing
+ * else refers to is still freed. Each Keychain holds on to its interned path,
+ * which keeps its entry alive for as long as it is.
+ *
+ * Keychains are frozen and can be shared between ractors, but each ractor has
+ * its own registry, so the same keychain may be a different object in each.
+ */
+
+#include "ruby.h"
+#ifdef KEYCHAIN_FILE_BACKEND
+#include "file_keychain.h"
+#else
+#include <Security/Security.h>
+#endif
+
+/* Returns the Keychain for keychain, taking ownership of the reference */
+VALUE keychain_registry_wrap(SecKeychainRef keychain);
+/* The reference a Keychain wraps. Raises TypeError for anything else */
+SecKeychainRef keychain_registry_ref(VALUE keychain);
+/* Removes a keychain, once deleted, so that a keychain created at the same path gets a new object */
+void keychain_registry_forget(VALUE keychain);
+
+/*
+ * Whether this is the main ractor. Process wide ruby objects (the operation subscriber, the
+ * event thread, caches) are only used from it.
+ */
+int keychain_main_ractor_p(void);
+/* Raises Ractor::UnsafeError, naming what, unless this is the main ractor */
+void keychain_check_main_ractor(const char *what);
+
+void Init_keychain_registry(VALUE rb_cKeychain);
+
+#endif
@@ -0,0 +1,243 @@
+#define _DEFAULT_SOURCE
+
+#include "secret_buffer.h"
+#include "ruby/io.h"
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include "ruby/thread.h"
+#else
+#define rb_thread_call_without_gvl(func, data, ubf, data2) (void*)rb_thread_blocking_region((rb_blocking_function_t*)(func), (data), (ubf), (data2))
+#endif
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef RUBY_TYPED_FREE_IMMEDIATELY
+#define RUBY_TYPED_FREE_IMMEDIATELY 0
+#endif
+
+VALUE rb_cKeychainSecretBuffer;
+
+typedef struct {
+  char *bytes;
+  long length;
+  size_t mapped;
+  int locked;
+} secret_buffer;
+
+/* called through a volatile pointer so that wiping a buffer that is about to be unmapped isn't optimised away */
+static void *(*volatile secret_buffer_memset)(void *, int, size_t) = memset;
+
+static void secret_buffer_wipe(secret_buffer *buffer){
+  if(buffer->bytes){
+    secret_buffer_memset(buffer->bytes, 0, buffer->mapped);
+  }
+  buffer->length = 0;
+}
+
+static void secret_buffer_unmap(secret_buffer *buffer){
+  if(buffer->bytes){
+    secret_buffer_wipe(buffer);
+    if(buffer->locked){
+      munlock(buffer->bytes, buffer->mapped);
+    }
+    munmap(buffer->bytes, buffer->mapped);
+    buffer->bytes = NULL;
+  }
+}
+
+static void secret_buffer_free(void *ptr){
+  secret_buffer *buffer = ptr;
+  secret_buffer_unmap(buffer);
+  xfree(buffer);
+}
+
+static size_t secret_buffer_memsize(const void *ptr){
+  const secret_buffer *buffer = ptr;
+  return sizeof(secret_buffer) + (buffer->bytes ? buffer->mapped : 0);
+}
+
+static const rb_data_type_t secret_buffer_type = {
+  "Keychain::SecretBuffer",
+  {NULL, secret_buffer_free, secret_buffer_memsize},
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE rb_secret_buffer_alloc(VALUE klass){
+  secret_buffer *buffer;
+  return TypedData_Make_Struct(klass, secret_buffer, &secret_buffer_type, buffer);
+}
+
+static void secret_buffer_fill(secret_buffer *buffer, const char *bytes, long length){
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t mapped = ((length > 0 ? (size_t)length : 1) + page - 1) / page * page;
+  void *mapping = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(mapping == MAP_FAILED){
+    rb_memerror();
+  }
+  buffer->bytes = mapping;
+  buffer->mapped = mapped;
+  /* locking can fail under RLIMIT_MEMLOCK: the buffer is still usable, and locked? says so */
+  buffer->locked = mlock(mapping, mapped) == 0;
+#ifdef MADV_DONTDUMP
+  madvise(mapping, mapped, MADV_DONTDUMP);
+#endif
+  memcpy(buffer->bytes, bytes, length);
+  buffer->length = length;
+}
+
+static secret_buffer *get_secret_buffer(VALUE self){
+  secret_buffer *buffer;
+  TypedData_Get_Struct(self, secret_buffer, &secret_buffer_type, buffer);
+  if(!buffer->bytes){
+    rb_raise(rb_eTypeError, "uninitialized secret buffer");
+  }
+  return buffer;
+}
+
+VALUE secret_buffer_new(const char *bytes, long length){
+  VALUE self = rb_secret_buffer_alloc(rb_cKeychainSecretBuffer);
+  secret_buffer *buffer;
+  TypedData_Get_Struct(self, secret_buffer, &secret_buffer_type, buffer);
+  secret_buffer_fill(buffer, bytes, length);
+  return self;
+}
+
+int secret_buffer_get(VALUE value, const char **bytes, long *length){
+  if(!rb_obj_is_kind_of(value, rb_cKeychainSecretBuffer)){
+    return 0;
+  }
+  secret_buffer *buffer = get_secret_buffer(value);
+  *bytes = buffer->bytes;
+  *length = buffer->length;
+  return 1;
+}
+
+/* SecretBuffer.new(string) copies the bytes of string. The string itself isn't changed */
+static VALUE rb_secret_buffer_initialize(VALUE self, VALUE string){
+  secret_buffer *buffer;
+  TypedData_Get_Struct(self, secret_buffer, &secret_buffer_type, buffer);
+  if(buffer->bytes){
+    rb_raise(rb_eTypeError, "already initialized secret buffer");
+  }
+  StringValue(string);
+  secret_buffer_fill(buffer, RSTRING_PTR(string), RSTRING_LEN(string));
+  return self;
+}
+
+static VALUE rb_secret_buffer_initialize_copy(VALUE self, VALUE original){
+  secret_buffer *buffer;
+  TypedData_Get_Struct(self, secret_buffer, &secret_buffer_type, buffer);
+  if(buffer->bytes){
+    rb_raise(rb_eTypeError, "already initialized secret buffer");
+  }
+  secret_buffer *source = get_secret_buffer(original);
+  secret_buffer_fill(buffer, source->bytes, source->length);
+  return self;
+}
+
+static VALUE rb_secret_buffer_bytesize(VALUE self){
+  return LONG2NUM(get_secret_buffer(self)->length);
+}
+
+/* Zeroes the secret. The buffer is empty afterwards */
+static VALUE rb_secret_buffer_wipe(VALUE self){
+  secret_buffer_wipe(get_secret_buffer(self));
+  return self;
+}
+
+static VALUE rb_secret_buffer_locked(VALUE self){
+  return get_secret_buffer(self)->locked ? Qtrue : Qfalse;
+}
+
+/* Returns a copy of the secret in an ordinary (ASCII-8BIT) string, which ruby won't wipe */
+static VALUE rb_secret_buffer_reveal(VALUE self){
+  secret_buffer *buffer = get_secret_buffer(self);
+  return rb_str_new(buffer->bytes, buffer->length);
+}
+
+/* Compares in time that depends only on the lengths, not on where the secrets differ */
+static VALUE rb_secret_buffer_equal(VALUE self, VALUE other){
+  secret_buffer *buffer = get_secret_buffer(self);
+  const char *other_bytes;
+  long other_length;
+  if(!secret_buffer_get(other, &other_bytes, &other_length)){
+    if(!RB_TYPE_P(other, T_STRING)){
+      return Qfalse;
+    }
+    other_bytes = RSTRING_PTR(other);
+    other_length = RSTRING_LEN(other);
+  }
+  if(other_length != buffer->length){
+    return Qfalse;
+  }
+  unsigned char difference = 0;
+  for(long i = 0; i < buffer->length; i++){
+    difference |= (unsigned char)(buffer->bytes[i] ^ other_bytes[i]);
+  }
+  RB_GC_GUARD(other);
+  return difference == 0 ? Qtrue : Qfalse;
+}
+
+static VALUE rb_secret_buffer_inspect(VALUE self){
+  secret_buffer *buffer;
+  TypedData_Get_Struct(self, secret_buffer, &secret_buffer_type, buffer);
+  return rb_sprintf("#<%"PRIsVALUE" bytesize=%ld>", rb_class_name(CLASS_OF(self)), buffer->length);
+}
+
+struct secret_buffer_write_call {
+  int fd;
+  const char *bytes;
+  long length;
+  ssize_t written;
+  int error;
+};
+
+static void *secret_buffer_write_without_gvl(void *data){
+  struct secret_buffer_write_call *call = data;
+  call->written = write(call->fd, call->bytes, call->length);
+  call->error = call->written < 0 ? errno : 0;
+  return NULL;
+}
+
+/* Writes the secret straight from the buffer to io's file descriptor, returning the number of bytes written */
+static VALUE rb_secret_buffer_write_to(VALUE self, VALUE io){
+  secret_buffer *buffer = get_secret_buffer(self);
+  io = rb_io_get_io(io);
+  rb_io_flush(io);
+  int fd = NUM2INT(rb_funcall(io, rb_intern("fileno"), 0));
+
+  long offset = 0;
+  while(offset < buffer->length){
+    struct secret_buffer_write_call call = {fd, buffer->bytes + offset, buffer->length - offset, 0, 0};
+    rb_thread_call_without_gvl(secret_buffer_write_without_gvl, &call, RUBY_UBF_IO, NULL);
+    if(call.written >= 0){
+      offset += call.written;
+    }else if(call.error == EAGAIN || call.error == EWOULDBLOCK){
+      rb_thread_fd_writable(fd);
+    }else if(call.error != EINTR){
+      errno = call.error;
+      rb_sys_fail("write");
+    }else{
+      rb_thread_check_ints();
+    }
+  }
+  return LONG2NUM(offset);
+}
+
+void Init_secret_buffer(VALUE rb_cKeychain){
+  rb_cKeychainSecretBuffer = rb_define_class_under(rb_cKeychain, "SecretBuffer", rb_cObject);
+  rb_define_alloc_func(rb_cKeychainSecretBuffer, rb_secret_buffer_alloc);
+  rb_define_method(rb_cKeychainSecretBuffer, "initialize", RUBY_METHOD_FUNC(rb_secret_buffer_initialize), 1);
+  rb_define_method(rb_cKeychainSecretBuffer, "initialize_copy", RUBY_METHOD_FUNC(rb_secret_buffer_initialize_copy), 1);
+  rb_define_method(rb_cKeychainSecretBuffer, "bytesize", RUBY_METHOD_FUNC(rb_secret_buffer_bytesize), 0);
+  rb_define_method(rb_cKeychainSecretBuffer, "wipe!", RUBY_METHOD_FUNC(rb_secret_buffer_wipe), 0);
+  rb_define_method(rb_cKeychainSecretBuffer, "locked?", RUBY_METHOD_FUNC(rb_secret_buffer_locked), 0);
+  rb_define_method(rb_cKeychainSecretBuffer, "reveal", RUBY_METHOD_FUNC(rb_secret_buffer_reveal), 0);
+  rb_define_method(rb_cKeychainSecretBuffer, "==", RUBY_METHOD_FUNC(rb_secret_buffer_equal), 1);
+  rb_define_method(rb_cKeychainSecretBuffer, "inspect", RUBY_METHOD_FUNC(rb_secret_buffer_inspect), 0);
+  rb_define_method(rb_cKeychainSecretBuffer, "write_to", RUBY_METHOD_FUNC(rb_secret_buffer_write_to), 1);
+}
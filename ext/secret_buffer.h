@@ -0,0 +1,22 @@
+#ifndef KEYCHAIN_SECRET_BUFFER_H
+#define KEYCHAIN_SECRET_BUFFER_H
+
+/*
+ * Keychain::SecretBuffer holds a secret in its own page aligned mapping, which
+ * is locked into memory where the process is allowed to (so it isn't written
+ * to swap), excluded from core dumps where supported and zeroed before it is
+ * unmapped. The bytes never move, so C code can hand them straight to the
+ * Security framework, a socket or a crypto library.
+ */
+
+#include "ruby.h"
+
+extern VALUE rb_cKeychainSecretBuffer;
+
+VALUE secret_buffer_new(const char *bytes, long length);
+/* Returns non zero, with the buffer's bytes, if value is a SecretBuffer */
+int secret_buffer_get(VALUE value, const char **bytes, long *length);
+
+void Init_secret_buffer(VALUE rb_cKeychain);
+
+#endif
@@ -5,8 +5,17 @@ class Keychain
       @limit = nil
       @keychains = [keychain].compact
       @conditions = {}
+      @with_passwords = false
+      @parallel = nil
     end
 
+    # Adds conditions on attributes. A value can be matched exactly, or with a Regexp, a Range
+    # (of strings, integers or times), an Array of acceptable values or a {Keychain.prefix}.
+    # Exact conditions are evaluated by the keychain; the others are applied to the results it
+    # returns before they are turned into items.
+    #
+    # @example
+    #   Keychain.generic_passwords.where(:service => Keychain.prefix('aws.'), :updated_at => (Time.now - 86400)..nil)
     def where(conditions)
       @conditions.merge! conditions
       self
@@ -17,42 +26,207 @@ class Keychain
       self
     end
 
+    # Fetches passwords in the same call as the items' attributes, rather than
+    # with a separate call the first time each item's password is read
+    def with_passwords
+      @with_passwords = true
+      self
+    end
+
+    # Limits the search to keychains, in the order given. With :parallel each keychain is
+    # queried on its own native thread (up to 16, or the number given) rather than one after
+    # another, and the results are merged in the same order. Once the keychains at the front
+    # have returned enough items for first or the limit, no more are queried. Only first, all
+    # and each search in parallel.
+    #
+    # @example
+    #   Keychain.generic_passwords.where(:service => 'ci').in(project_keychains, :parallel => true).all
+    #
+    # @param [Array<Keychain>] keychains
+    # @option options [Boolean, Integer] :parallel
     def in *keychains
+      options = keychains.last.is_a?(Hash) ? keychains.pop : {}
       @keychains = keychains.flatten
+      @parallel = options[:parallel]
       self
     end
 
     def first
-      do_find :first
+      cached_find :first
     end
 
     def all
-      do_find :all
+      cached_find :all
+    end
+
+    # Yields each matching item in turn, without building an array of all of them
+    # @return [Enumerator] if no block is given
+    def each(&block)
+      return enum_for(:each) unless block_given?
+      do_find :each, &block
+      self
+    end
+
+    # Yields matching items in arrays of up to batch_size items
+    # @return [Enumerator] if no block is given
+    def find_each(batch_size = 100, &block)
+      return enum_for(:find_each, batch_size) unless block_given?
+      do_find :each, :batch_size => batch_size, &block
+      self
+    end
+
+
+    # Compiles this query once so that it can be run repeatedly, with values for the named
+    # attributes supplied each time. Prepared queries don't use the result cache.
+    #
+    # @example
+    #   query = Keychain.generic_passwords.where(:service => 'aws').prepare(:account)
+    #   query.first(:account => 'bob')
+    #
+    # @param [Array<Symbol>] parameters the attributes bound when the query is run
+    # @return [Keychain::Query]
+    def prepare *parameters
+      Keychain::Query.new @kind, find_options, parameters.flatten
     end
 
+    # Like first, but returns a {Keychain::Async::Future} at once and runs the lookup on the
+    # async worker pool. Async lookups don't use the result cache.
+    # @return [Keychain::Async::Future]
+    def first_async
+      Keychain::Async.find :first, @kind, find_options
+    end
+
+    # Like all, but returns a {Keychain::Async::Future}
+    # @return [Keychain::Async::Future]
+    def all_async
+      Keychain::Async.find :all, @kind, find_options
+    end
+
+    # Sets attributes (which may include :password) on every matching item with a single
+    # keychain call, without loading the items
+    # @return [Boolean] whether any item matched
+    def update_all(attributes)
+      Keychain.update_all @kind, find_options, attributes
+    end
+
+    # Deletes every matching item with a single keychain call
+    # @return [Boolean] whether any item matched
+    def delete_all
+      Keychain.delete_all @kind, find_options
+    end
 
     # @return [Keychain::Item]
     def create(attributes)
       keychain = @keychains.first || Keychain.default
       keychain.add_password @kind, attributes
     end
+
+    # Like create, but returns [status, item] rather than raising, item being nil unless
+    # status is {Keychain::Status::SUCCESS}
+    # @return [Array(Integer, Keychain::Item)]
+    def try_create(attributes)
+      keychain = @keychains.first || Keychain.default
+      keychain.try_add_password @kind, attributes
+    end
+
+    # The status finding the first match would have, without raising or loading the item:
+    # {Keychain::Status::SUCCESS} or {Keychain::Status::ITEM_NOT_FOUND} (or another error status)
+    # @return [Integer]
+    def find_status
+      Keychain.find_status @kind, find_options
+    end
+
+    # Returns whether any item matches, without loading it
+    # @return [Boolean]
+    def exists?
+      status = find_status
+      return false if status == Keychain::Status::ITEM_NOT_FOUND
+      raise Keychain.error_for_status(status) unless status == Keychain::Status::SUCCESS
+      true
+    end
     private
 
-    def do_find first_or_all
+    def cached_find first_or_all
+      cache = Keychain.cache_for(@keychains)
+      return do_find(first_or_all) unless cache
+      key = [@kind, @conditions.to_a.sort_by {|name, _| name.to_s}, @limit, @keychains.map(&:path), @with_passwords, first_or_all]
+      cache.fetch(key) { do_find first_or_all }
+    end
+
+    def do_find first_or_all, options={}, &block
+      Keychain.find first_or_all, @kind, find_options.merge(options), &block
+    end
+
+    def find_options
       query = {:conditions => @conditions}
       query = query.merge(:keychains => @keychains) if @keychains.any?
       query = query.merge(:limit => @limit) if @limit
-      Keychain.find first_or_all, @kind,  query
+      query = query.merge(:with_passwords => true) if @with_passwords
+      query = query.merge(:parallel => @parallel) if @parallel
+      query
     end
 
   end
 
+  # A condition matching strings that begin with prefix. See {Keychain.prefix}
+  class Prefix
+    attr_reader :prefix
+
+    def initialize(prefix)
+      @prefix = prefix.to_str.dup.freeze
+      freeze
+    end
+
+    def ==(other)
+      other.is_a?(Prefix) && other.prefix == prefix
+    end
+    alias_method :eql?, :==
+
+    def hash
+      [Prefix, prefix].hash
+    end
+
+    def inspect
+      "#<Keychain::Prefix #{prefix.inspect}>"
+    end
+  end
+
+  # A condition for {Proxy#where} matching attributes that begin with prefix
+  # @return [Keychain::Prefix]
+  def self.prefix(prefix)
+    Prefix.new(prefix)
+  end
+
+  # A condition for {Proxy#where} matching a shell style pattern, where * matches any
+  # characters and ? any one character. Patterns whose only wildcard is a trailing * are
+  # matched as prefixes.
+  # @return [Keychain::Prefix, Regexp]
+  def self.wildcard(pattern)
+    literal = pattern[0...-1]
+    return prefix(literal) if pattern.end_with?('*') && literal !~ /[*?]/
+    source = pattern.split(/([*?])/).map do |part|
+      case part
+      when '*' then '.*'
+      when '?' then '.'
+      else Regexp.escape(part)
+      end
+    end
+    /\A#{source.join}\z/m
+  end
+
   class Error < StandardError
     attr_accessor :code
     def initialize(message, code)
       self.code = code
+      @message = message
       super message
     end
+
+    # Errors raised by the extension only carry their code until the message is asked for
+    # (see {Keychain.error_message})
+    def to_s
+      @message ||= Keychain.error_message(code)
+    end
   end
   class DuplicateItemError < Error; end
   class NoSuchKeychainError < Error; end
@@ -97,34 +271,10 @@ class Keychain
     (status & (1 << 2)).nonzero?
   end
      
-  def exists?
-    begin
-      readable?
-      true
-    rescue NoSuchKeychainError
-      false
-    end
-  end
-
 
 end
 
 require 'keychain/keychain'
-
-class Keychain::Item
-
-  Keychain::KEYCHAIN_MAP.each do |ruby_name, attr_name|
-    unless method_defined?(ruby_name)
-      define_method ruby_name do
-        @attributes[attr_name]
-      end
-      define_method ruby_name.to_s+'=' do |value|
-        @attributes[attr_name] = value
-      end
-    end
-  end
-
-  def password=(new_password)
-    @unsaved_password = new_password
-  end
-end
+require 'keychain/result_cache'
+require 'keychain/snapshot'
+require 'keychain/events'
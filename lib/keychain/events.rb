@@ -0,0 +1,98 @@
+require 'thread'
+
+class Keychain
+  # The kinds of change {Keychain.subscribe} and {Keychain#on} can report
+  EVENTS = [:lock, :unlock, :add, :update, :delete].freeze
+
+  # A change to a keychain: its type (one of {EVENTS}), the keychain it happened to (nil if
+  # the keychain didn't say) and the pid of the process that made it
+  Event = Struct.new(:type, :keychain, :pid)
+
+  # Returned by {Keychain.subscribe} and {Keychain#on}
+  class Subscription
+    # @return [Array<Symbol>] the types of event delivered
+    attr_reader :events
+    # @return [Keychain, nil] the keychain whose events are delivered, or nil for all keychains
+    attr_reader :keychain
+
+    def initialize(events, keychain, callback)
+      events = events.flatten
+      unknown = events - EVENTS
+      raise ArgumentError, "unknown keychain events #{unknown.inspect}" if unknown.any?
+      raise ArgumentError, 'a block is required' unless callback
+      @events = events.empty? ? EVENTS : events.freeze
+      @keychain = keychain
+      @callback = callback
+    end
+
+    # Stops delivering events to this subscription
+    def unsubscribe
+      Keychain.unsubscribe self
+    end
+
+    # @private
+    def deliver(event)
+      return unless events.include?(event.type) && (keychain.nil? || keychain == event.keychain)
+      @callback.call event
+    rescue StandardError => e
+      warn "Keychain event subscriber raised #{e.class}: #{e.message}"
+    end
+  end
+
+  @subscriptions = [].freeze
+  @subscriptions_mutex = Mutex.new
+
+  class << self
+    # Calls the block with a {Keychain::Event} whenever any keychain is locked or unlocked,
+    # or has an item added, updated or deleted. Events are delivered in order on a background
+    # thread; the keychain isn't kept waiting while the block runs.
+    #
+    # While there are subscriptions keychain statuses are cached, so {Keychain#locked?},
+    # {Keychain#readable?} and {Keychain#writeable?} only make a call after a lock or unlock.
+    #
+    # @example
+    #   Keychain.subscribe(:add, :delete) {|event| puts "#{event.type} in #{event.keychain.path}"}
+    #
+    # @param [Array<Symbol>] events the types of event wanted (see {EVENTS}); all if none are given
+    # @return [Keychain::Subscription]
+    def subscribe(*events, &block)
+      add_subscription Subscription.new(events, nil, block)
+    end
+
+    # Stops delivering events to subscription. Once there are no subscriptions left, events
+    # that haven't been delivered yet are discarded
+    def unsubscribe(subscription)
+      @subscriptions_mutex.synchronize do
+        @subscriptions = (@subscriptions - [subscription]).freeze
+        stop_events if @subscriptions.empty?
+      end
+      nil
+    end
+
+    # @return [Array<Keychain::Subscription>]
+    def subscriptions
+      @subscriptions
+    end
+
+    # @private
+    def add_subscription(subscription)
+      @subscriptions_mutex.synchronize do
+        start_events
+        @subscriptions = (@subscriptions + [subscription]).freeze
+      end
+      subscription
+    end
+
+    # @private called by the event thread
+    def deliver_event(type, keychain, pid)
+      event = Event.new(type, keychain, pid)
+      @subscriptions.each {|subscription| subscription.deliver event}
+    end
+  end
+
+  # Like {Keychain.subscribe}, but only for events in this keychain
+  # @return [Keychain::Subscription]
+  def on(*events, &block)
+    Keychain.add_subscription Subscription.new(events, self, block)
+  end
+end
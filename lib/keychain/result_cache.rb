@@ -0,0 +1,264 @@
+require 'thread'
+
+class Keychain
+  # An in process cache of the results of Proxy#first and Proxy#all
+  #
+  # Results are cached by kind, conditions, limit and keychains for up to ttl seconds. Once
+  # max_size queries are cached the least recently used is evicted. Adding, saving or
+  # deleting an item through this library removes any cached result the item could be part of.
+  #
+  # @example
+  #   Keychain.result_cache = Keychain::ResultCache.new(:ttl => 30, :max_size => 500)
+  #   keychain.result_cache = Keychain::ResultCache.new(:ttl => 5)
+  class ResultCache
+    attr_reader :ttl, :max_size
+
+    def initialize(options={})
+      @ttl = options.fetch(:ttl, 60)
+      @max_size = options.fetch(:max_size, 1000)
+      @entries = {}
+      @mutex = Mutex.new
+      @hits = @misses = @evictions = @invalidations = 0
+      # bumped by every invalidation, so that a result read before one isn't cached after it
+      @generation = 0
+    end
+
+    # Returns the cached result for key, or the result of the block (which is then cached).
+    # Items are duplicated on the way in and out so that callers can't change cached items.
+    # The result isn't cached if the cache was invalidated while the block ran.
+    def fetch(key)
+      generation = nil
+      @mutex.synchronize do
+        entry = @entries.delete(key)
+        if entry && entry[1] > now
+          @entries[key] = entry
+          @hits += 1
+          return copy(entry[0])
+        end
+        @evictions += 1 if entry
+        @misses += 1
+        generation = @generation
+      end
+
+      result = yield
+      @mutex.synchronize do
+        return result unless generation == @generation
+        @entries[key] = [copy(result), now + ttl]
+        while @entries.size > max_size
+          @entries.delete(@entries.first[0])
+          @evictions += 1
+        end
+      end
+      result
+    end
+
+    # Removes the results which could include an item of the given kind with these attributes,
+    # in the keychain at keychain_path (or in any keychain, if it is nil)
+    def invalidate(kind, attributes, keychain_path)
+      @mutex.synchronize do
+        @generation += 1
+        @entries.delete_if do |(entry_kind, conditions, _limit, keychain_paths, _with_passwords), _entry|
+          stale = entry_kind == kind &&
+            (keychain_path.nil? || keychain_paths.empty? || keychain_paths.include?(keychain_path)) &&
+            conditions.all? {|name, value| might_match?(attributes[name], value)}
+          @invalidations += 1 if stale
+          stale
+        end
+      end
+    end
+
+    def clear
+      @mutex.synchronize do
+        @generation += 1
+        @entries.clear
+      end
+    end
+
+    # @return [Hash] the number of hits, misses, evictions (for size or age), invalidations
+    #   and cached results
+    def stats
+      @mutex.synchronize do
+        {:hits => @hits, :misses => @misses, :evictions => @evictions, :invalidations => @invalidations, :size => @entries.size}
+      end
+    end
+
+    def reset_stats
+      @mutex.synchronize { @hits = @misses = @evictions = @invalidations = 0 }
+    end
+
+    private
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    def copy(result)
+      case result
+      when Array then result.map(&:dup)
+      when nil then nil
+      else result.dup
+      end
+    end
+
+    # Only values that can be compared reliably rule out a match
+    def might_match?(actual, expected)
+      return true unless actual.is_a?(expected.class) && (actual.is_a?(String) || actual.is_a?(Integer))
+      actual == expected
+    end
+  end
+
+  class << self
+    # The cache used for queries that don't have a keychain specific cache
+    attr_accessor :result_cache
+
+    # @private
+    def result_caches
+      @result_caches ||= {}
+    end
+
+    # The caches are shared by the whole process, so other ractors don't use them
+    # @private
+    def cache_for(keychains)
+      return nil unless main_ractor?
+      (keychains.length == 1 && result_caches[keychains.first.path]) || result_cache
+    end
+
+    # @private
+    def caching_results?
+      main_ractor? && (!result_cache.nil? || result_caches.any?)
+    end
+
+    # @private
+    def invalidate_cached_results(kind, attributes, keychain_path)
+      caches = result_caches.values + [result_cache]
+      caches.compact.each {|cache| cache.invalidate(kind, attributes, keychain_path)}
+    end
+
+    # The items matched by a query have at least the attributes in its conditions
+    # @private
+    def invalidate_cached_query(kind, options, changes={})
+      conditions = options[:conditions] || {}
+      paths = options[:keychains] ? options[:keychains].map(&:path) : [nil]
+      paths.each do |path|
+        invalidate_cached_results(kind, conditions, path)
+        invalidate_cached_results(kind, conditions.merge(changes), path) if changes.any?
+      end
+    end
+
+    alias_method :update_all_without_cache, :update_all
+    def update_all(kind, options, attributes)
+      updated = update_all_without_cache(kind, options, attributes)
+      invalidate_cached_query(kind, options, attributes) if updated && caching_results?
+      updated
+    end
+
+    alias_method :delete_all_without_cache, :delete_all
+    def delete_all(kind, options)
+      deleted = delete_all_without_cache(kind, options)
+      invalidate_cached_query(kind, options) if deleted && caching_results?
+      deleted
+    end
+  end
+
+  # The cache used for queries on only this keychain
+  def result_cache
+    Keychain.result_caches[path]
+  end
+
+  def result_cache=(cache)
+    if cache
+      Keychain.result_caches[path] = cache
+    else
+      Keychain.result_caches.delete(path)
+    end
+  end
+
+  alias_method :add_password_without_cache, :add_password
+  def add_password(kind, options)
+    item = add_password_without_cache(kind, options)
+    Keychain.invalidate_cached_results(kind, options, path) if Keychain.caching_results?
+    item
+  end
+
+  alias_method :try_add_password_without_cache, :try_add_password
+  def try_add_password(kind, options)
+    result = try_add_password_without_cache(kind, options)
+    Keychain.invalidate_cached_results(kind, options, path) if result[1] && Keychain.caching_results?
+    result
+  end
+
+  alias_method :add_passwords_without_cache, :add_passwords
+  def add_passwords(kind, items, options={})
+    results = add_passwords_without_cache(kind, items, options)
+    if Keychain.caching_results?
+      results.each_with_index do |result, index|
+        Keychain.invalidate_cached_results(kind, items[index], path) unless result.is_a?(Keychain::Error)
+      end
+    end
+    results
+  end
+
+  class Item
+    alias_method :save_without_cache!, :save!
+    def save!(options={})
+      return save_without_cache!(options) unless Keychain.caching_results? && changed?
+      invalidations = cache_invalidations
+      save_without_cache!(options)
+      invalidations.each {|args| Keychain.invalidate_cached_results(*args)}
+      self
+    end
+
+    class << self
+      alias_method :save_all_without_cache, :save_all
+      def save_all(items)
+        return save_all_without_cache(items) unless Keychain.caching_results?
+        invalidations = items.select(&:changed?).map {|item| [item, item.cache_invalidations]}
+        results = save_all_without_cache(items)
+        invalidations.each do |item, item_invalidations|
+          item_invalidations.each {|args| Keychain.invalidate_cached_results(*args)} unless item.changed?
+        end
+        results
+      end
+    end
+
+    # The invalidations a save of the current changes needs: for the saved attributes and
+    # for the attributes once saved
+    # @private
+    def cache_invalidations
+      previous = dup.to_h # the saved attributes, without unsaved changes
+      changes = {}
+      changed.each {|name| changes[name] = send(name) unless name == :password}
+      path = keychain.path
+      [[klass, previous, path], [klass, previous.merge(changes), path]]
+    end
+
+    alias_method :delete_without_cache, :delete
+    def delete
+      return delete_without_cache unless Keychain.caching_results?
+      attributes = to_h
+      delete_without_cache
+      Keychain.invalidate_cached_results(attributes[:klass], attributes, keychain.path)
+      self
+    end
+  end
+
+  # The async writes invalidate cached results when they are submitted, so a query cached
+  # while one is still running can miss its change until the cached result expires
+  module Async
+    class << self
+      alias_method :add_password_without_cache, :add_password
+      def add_password(keychain, kind, options)
+        Keychain.invalidate_cached_results(kind, options, keychain.path) if Keychain.caching_results?
+        add_password_without_cache(keychain, kind, options)
+      end
+
+      alias_method :save_without_cache!, :save!
+      def save!(item)
+        if Keychain.caching_results? && item.changed?
+          item.cache_invalidations.each {|args| Keychain.invalidate_cached_results(*args)}
+        end
+        save_without_cache!(item)
+      end
+    end
+  end
+end
@@ -0,0 +1,296 @@
+require 'openssl'
+require 'stringio'
+
+class Keychain
+  # A compact, encrypted and versioned binary format for copying items between keychains.
+  #
+  # A snapshot is a fixed size header followed by frames. Each frame is a length, the frame
+  # encrypted with AES-256-GCM and the GCM tag. The key is derived from a passphrase with
+  # PBKDF2-HMAC-SHA256, and each frame's nonce and associated data include its index and
+  # whether it is the last frame, so frames can't be reordered, dropped or truncated unnoticed.
+  #
+  #   header  "KCSNAP\r\n" version:u16 reserved:u16 iterations:u32 salt:16 nonce_prefix:4
+  #   frame   length:u32 (top bit set on the last frame) ciphertext tag:16
+  #   record  class:4 attribute_count:u8 (attribute:u8 type:u8 length:u32 value)*
+  #
+  # All integers are big endian. Frames hold whole records and are written once they reach
+  # FRAME_SIZE, so neither the writer nor the reader holds more than one frame in memory, and a
+  # reader given a mapped file can find each frame from the lengths alone. Records are at most
+  # MAX_RECORD_SIZE, so no frame is longer than MAX_FRAME_SIZE, and the reader rejects longer
+  # frames, and more than MAX_ITERATIONS, before reading them or deriving the key.
+  #
+  # The reader and writer only use ruby's openssl library, not the keychain, so snapshots can
+  # be written and read anywhere.
+  module Snapshot
+    MAGIC = "KCSNAP\r\n".b.freeze
+    VERSION = 1
+    HEADER_SIZE = 36
+    TAG_SIZE = 16
+    FRAME_SIZE = 64 * 1024
+    DEFAULT_ITERATIONS = 100_000
+    MAX_ITERATIONS = 10_000_000
+    MAX_RECORD_SIZE = 1024 * 1024
+    MAX_FRAME_SIZE = FRAME_SIZE + MAX_RECORD_SIZE
+    FINAL_FRAME = 1 << 31
+
+    # The attributes a snapshot can hold, by their number in the format. Numbers must never be
+    # reused: readers skip numbers they don't know.
+    ATTRIBUTES = [:password, :description, :comment, :account, :service, :server, :port,
+                  :security_domain, :negative, :invisible, :label, :path, :protocol].freeze
+    ATTRIBUTE_NUMBERS = Hash[ATTRIBUTES.each_with_index.to_a].freeze
+
+    STRING, DATA, INTEGER, TRUE, FALSE, TIME = 1, 2, 3, 4, 5, 6
+
+    # Raised when a snapshot is malformed, truncated or was written with another passphrase
+    class FormatError < StandardError; end
+
+    # @private
+    def self.cipher(mode, key, nonce_prefix, index, final, header)
+      cipher = OpenSSL::Cipher.new('aes-256-gcm')
+      mode == :encrypt ? cipher.encrypt : cipher.decrypt
+      cipher.key = key
+      cipher.iv = nonce_prefix + [index].pack('Q>')
+      cipher.auth_data = header + [index, final ? 1 : 0].pack('Q>C')
+      cipher
+    end
+
+    # @private
+    def self.derive_key(passphrase, salt, iterations)
+      raise ArgumentError, 'a passphrase is required' if passphrase.nil? || passphrase.empty?
+      OpenSSL::KDF.pbkdf2_hmac(passphrase, :salt => salt, :iterations => iterations, :length => 32, :hash => 'sha256')
+    end
+
+    # Writes records to an IO
+    #
+    # @example
+    #   writer = Keychain::Snapshot::Writer.new(io, 'passphrase')
+    #   writer.add Keychain::Item::Classes::GENERIC, :service => 'aservice', :password => 'secret'
+    #   writer.close
+    class Writer
+      # @return [Integer] the number of records added
+      attr_reader :count
+
+      def initialize(io, passphrase, options={})
+        iterations = options.fetch(:iterations, DEFAULT_ITERATIONS)
+        unless (1..MAX_ITERATIONS).cover?(iterations)
+          raise ArgumentError, "iterations must be between 1 and #{MAX_ITERATIONS}, not #{iterations}"
+        end
+        salt = OpenSSL::Random.random_bytes(16)
+        @nonce_prefix = OpenSSL::Random.random_bytes(4)
+        @header = [MAGIC, VERSION, 0, iterations, salt, @nonce_prefix].pack('a8nnNa16a4')
+        @key = Snapshot.derive_key(passphrase, salt, iterations)
+        @io = io
+        @io.write @header
+        @frame = String.new(:encoding => Encoding::BINARY, :capacity => FRAME_SIZE)
+        @index = 0
+        @count = 0
+      end
+
+      # Adds a record for an item of class kind. Attributes the format doesn't know, and nil
+      # values, are left out. Raises ArgumentError, adding nothing, if the record would be
+      # larger than MAX_RECORD_SIZE
+      def add(kind, attributes)
+        kind = kind.to_s.b
+        raise ArgumentError, "item class must be 4 bytes, not #{kind.inspect}" unless kind.bytesize == 4
+        fields = []
+        attributes.each do |name, value|
+          number = ATTRIBUTE_NUMBERS[name]
+          fields << [number, value] if number && !value.nil?
+        end
+        start = @frame.bytesize
+        begin
+          @frame << kind << fields.length.chr
+          fields.each {|number, value| encode_value(number, value)}
+          if @frame.bytesize - start > MAX_RECORD_SIZE
+            raise ArgumentError, "a snapshot record can't be larger than #{MAX_RECORD_SIZE} bytes"
+          end
+        rescue ArgumentError
+          @frame.slice!(start..-1)
+          raise
+        end
+        @count += 1
+        write_frame(false) if @frame.bytesize >= FRAME_SIZE
+        self
+      end
+      alias_method :<<, :add
+
+      # Writes the final frame. The snapshot is incomplete until this is called; the IO is not closed
+      def close
+        write_frame(true)
+        @key = nil
+      end
+
+      private
+
+      def encode_value(number, value)
+        case value
+        when String
+          type = value.encoding == Encoding::BINARY ? DATA : STRING
+          bytes = type == STRING ? value.encode(Encoding::UTF_8).b : value
+        when Integer then type, bytes = INTEGER, [value].pack('q>')
+        when true then type, bytes = TRUE, ''
+        when false then type, bytes = FALSE, ''
+        when Time then type, bytes = TIME, [value.to_i, value.nsec].pack('q>N')
+        else
+          raise ArgumentError, "can't store #{value.class} in a snapshot"
+        end
+        @frame << [number, type, bytes.bytesize].pack('CCN') << bytes
+      end
+
+      def write_frame(final)
+        raise IOError, 'snapshot already closed' unless @key
+        cipher = Snapshot.cipher(:encrypt, @key, @nonce_prefix, @index, final, @header)
+        ciphertext = @frame.empty? ? ''.b : cipher.update(@frame)
+        ciphertext << cipher.final
+        @io.write [ciphertext.bytesize | (final ? FINAL_FRAME : 0)].pack('N'), ciphertext, cipher.auth_tag(TAG_SIZE)
+        @frame.clear
+        @index += 1
+      end
+    end
+
+    # Reads the records written by a Writer
+    class Reader
+      include Enumerable
+
+      # @param [IO, String] io the snapshot, or an IO it can be read from
+      def initialize(io, passphrase)
+        @io = io.is_a?(String) ? StringIO.new(io) : io
+        @header = read_exactly(HEADER_SIZE)
+        magic, version, _reserved, iterations, salt, @nonce_prefix = @header.unpack('a8nnNa16a4')
+        raise FormatError, 'not a keychain snapshot' unless magic == MAGIC
+        raise FormatError, "unsupported snapshot version #{version}" unless version == VERSION
+        raise FormatError, "unsupported iteration count #{iterations}" unless (1..MAX_ITERATIONS).cover?(iterations)
+        @key = Snapshot.derive_key(passphrase, salt, iterations)
+      end
+
+      # Yields the class and attributes of each record in turn
+      def each
+        return enum_for(:each) unless block_given?
+        index = 0
+        loop do
+          length = read_exactly(4).unpack('N').first
+          final = length & FINAL_FRAME != 0
+          length &= ~FINAL_FRAME
+          raise FormatError, "frame is too long (#{length} bytes)" if length > MAX_FRAME_SIZE
+          ciphertext = read_exactly(length)
+          tag = read_exactly(TAG_SIZE)
+          frame = decrypt(ciphertext, tag, index, final)
+          decode_frame(frame) {|kind, attributes| yield kind, attributes}
+          index += 1
+          break if final
+        end
+        raise FormatError, 'unexpected data after the last frame' unless @io.read(1).nil?
+        self
+      end
+
+      private
+
+      def read_exactly(length)
+        bytes = length.zero? ? ''.b : @io.read(length)
+        raise FormatError, 'snapshot is truncated' if bytes.nil? || bytes.bytesize != length
+        bytes
+      end
+
+      def decrypt(ciphertext, tag, index, final)
+        cipher = Snapshot.cipher(:decrypt, @key, @nonce_prefix, index, final, @header)
+        cipher.auth_tag = tag
+        plaintext = ciphertext.empty? ? ''.b : cipher.update(ciphertext)
+        plaintext << cipher.final
+      rescue OpenSSL::Cipher::CipherError
+        raise FormatError, 'wrong passphrase, or the snapshot has been modified'
+      end
+
+      def decode_frame(frame)
+        offset = 0
+        while offset < frame.bytesize
+          raise FormatError, 'record is truncated' if offset + 5 > frame.bytesize
+          kind = frame.byteslice(offset, 4).force_encoding(Encoding::UTF_8)
+          count = frame.getbyte(offset + 4)
+          offset += 5
+          attributes = {}
+          count.times do
+            number, type, length = frame.unpack("@#{offset}CCN")
+            raise FormatError, 'record is truncated' if length.nil? || offset + 6 + length > frame.bytesize
+            bytes = frame.byteslice(offset + 6, length)
+            offset += 6 + length
+            name = ATTRIBUTES[number]
+            attributes[name] = decode_value(type, bytes) if name
+          end
+          yield kind, attributes
+        end
+      end
+
+      def decode_value(type, bytes)
+        case type
+        when STRING then bytes.force_encoding(Encoding::UTF_8)
+        when DATA then bytes
+        when INTEGER then bytes.unpack('q>').first
+        when TRUE then true
+        when FALSE then false
+        when TIME
+          seconds, nsec = bytes.unpack('q>N')
+          Time.at(seconds, nsec, :nsec)
+        else
+          raise FormatError, "unknown value type #{type}"
+        end
+      end
+    end
+  end
+
+  # Writes every generic and internet password in this keychain, with its password, to io as
+  # an encrypted snapshot (see {Keychain::Snapshot}). Passwords are fetched along with the
+  # items rather than read one by one.
+  #
+  # @param [IO] io where the snapshot is written
+  # @param [Hash] options :passphrase (required) and :iterations, the PBKDF2 iteration count
+  # @return [Integer] the number of items written
+  def export_snapshot(io, options={})
+    writer = Snapshot::Writer.new(io, options[:passphrase], options)
+    [Item::Classes::GENERIC, Item::Classes::INTERNET].each do |kind|
+      Keychain.find(:each, kind, :keychains => [self], :with_passwords => true, :batch_size => 500) do |items|
+        items.each do |item|
+          attributes = item.to_h
+          password = item.password
+          attributes[:password] = password.b if password
+          writer.add kind, attributes
+        end
+      end
+    end
+    writer.close
+    writer.count
+  end
+
+  # Adds the items in a snapshot written by {#export_snapshot} to a keychain, in batches.
+  # Items that already exist are skipped; any other error is raised once the batch it occurred
+  # in has been added.
+  #
+  # @param [IO, String] io the snapshot
+  # @param [Hash] options :passphrase (required), :keychain (defaults to the default keychain)
+  #   and :batch_size
+  # @return [Hash] the number of items :added and :skipped
+  def self.import_snapshot(io, options={})
+    keychain = options[:keychain] || Keychain.default
+    batch_size = options.fetch(:batch_size, 500)
+    totals = {:added => 0, :skipped => 0}
+    batches = Hash.new {|hash, kind| hash[kind] = []}
+    add_batch = lambda do |kind|
+      batch = batches.delete(kind)
+      keychain.add_passwords(kind, batch, :return_items => false).each do |result|
+        if result == true
+          totals[:added] += 1
+        elsif result.is_a?(DuplicateItemError)
+          totals[:skipped] += 1
+        else
+          raise result
+        end
+      end
+    end
+
+    Snapshot::Reader.new(io, options[:passphrase]).each do |kind, attributes|
+      batches[kind] << attributes
+      add_batch.call(kind) if batches[kind].length >= batch_size
+    end
+    batches.keys.each {|kind| add_batch.call(kind)}
+    totals
+  end
+end
@@ -0,0 +1,178 @@
+require 'spec_helper'
+
+describe Keychain::Async do
+  before(:each) do
+    @keychain = Keychain.create(File.join(Dir.tmpdir, "async_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+    @item = @keychain.generic_passwords.create(:service => 'aservice', :account => 'anaccount', :password => 'some-password')
+  end
+
+  after(:each) do
+    Keychain::Async.pool_size = 4
+    @keychain.delete
+  end
+
+  describe 'find' do
+    it 'should find the first item' do
+      future = Keychain::Async.find(:first, Keychain::Item::Classes::GENERIC, :keychains => [@keychain], :conditions => {:service => 'aservice'})
+      future.should be_a(Keychain::Async::Future)
+      future.value.account.should == 'anaccount'
+    end
+
+    it 'should find all items' do
+      @keychain.generic_passwords.create(:service => 'aservice', :account => 'other', :password => 'other-password')
+      future = @keychain.generic_passwords.where(:service => 'aservice').all_async
+      future.value.collect(&:account).sort.should == %w(anaccount other)
+    end
+
+    it 'should return nil from first when nothing matches' do
+      @keychain.generic_passwords.where(:service => 'doesntexist').first_async.value.should be_nil
+    end
+
+    it 'should not support each' do
+      expect {Keychain::Async.find(:each, Keychain::Item::Classes::GENERIC)}.to raise_error(ArgumentError)
+    end
+  end
+
+  describe 'add_password' do
+    it 'should add the item' do
+      item = Keychain::Async.add_password(@keychain, Keychain::Item::Classes::GENERIC, :service => 'aservice-2', :password => 'pass-2').value
+      item.service.should == 'aservice-2'
+      @keychain.generic_passwords.where(:service => 'aservice-2').first.password.should == 'pass-2'
+    end
+
+    it 'should raise the error from value' do
+      future = Keychain::Async.add_password(@keychain, Keychain::Item::Classes::GENERIC, :service => 'aservice', :account => 'anaccount')
+      expect {future.value}.to raise_error(Keychain::DuplicateItemError)
+      expect {future.value}.to raise_error(Keychain::DuplicateItemError)
+    end
+  end
+
+  describe 'save!' do
+    it 'should save and reload the item' do
+      @item.account = 'new-account'
+      @item.password = 'new-password'
+      Keychain::Async.save!(@item).value.should be(@item)
+      @item.account.should == 'new-account'
+      @keychain.generic_passwords.where(:service => 'aservice').first.password.should == 'new-password'
+    end
+
+    it 'should leave attributes assigned while saving unsaved' do
+      @item.account = 'new-account'
+      future = Keychain::Async.save!(@item)
+      @item.comment = 'a comment'
+      future.value
+      @item.changed.should == [:comment]
+      @item.account.should == 'new-account'
+    end
+  end
+
+  describe 'password' do
+    it 'should read the password' do
+      item = @keychain.generic_passwords.where(:service => 'aservice').first
+      Keychain::Async.password(item).value.should == 'some-password'
+    end
+
+    it 'should return an unsaved password' do
+      @item.password = 'unsaved'
+      Keychain::Async.password(@item).value.should == 'unsaved'
+    end
+  end
+
+  describe 'Future' do
+    it 'should wait with a timeout' do
+      future = Keychain::Async.password(@item)
+      future.wait(5).should == true
+      future.should be_ready
+    end
+
+    it 'should not be cancellable once finished' do
+      future = Keychain::Async.password(@item)
+      future.wait
+      future.cancel.should == false
+      future.should_not be_cancelled
+    end
+
+    it 'should record stats when resolved' do
+      Keychain.reset_stats
+      Keychain::Async.find(:all, Keychain::Item::Classes::GENERIC, :keychains => [@keychain]).value
+      Keychain.stats[:copy_matching][:calls].should == 1
+      Keychain.stats[:copy_matching][:items].should == 1
+    end
+
+    it 'should resolve once when value is called from several threads' do
+      begin
+        Keychain.simulated_latency = 0.2
+        Keychain.reset_stats
+        future = @keychain.generic_passwords.where(:service => 'aservice').first_async
+        items = Array.new(4) { Thread.new { future.value } }.map(&:value)
+        items.uniq.length.should == 1
+        items.first.account.should == 'anaccount'
+        Keychain.stats[:copy_matching][:calls].should == 1
+
+        @item.account = 'new-account'
+        future = Keychain::Async.save!(@item)
+        Array.new(4) { Thread.new { future.value } }.map(&:value).each {|item| item.should be(@item)}
+        Keychain.stats[:update][:calls].should == 1
+      ensure
+        Keychain.simulated_latency = 0
+      end
+    end
+  end
+
+  describe 'pool_size' do
+    it 'should default to 4' do
+      Keychain::Async.pool_size.should == 4
+    end
+
+    it 'should be at least 1' do
+      expect {Keychain::Async.pool_size = 0}.to raise_error(ArgumentError)
+    end
+  end
+
+  if Keychain.respond_to?(:simulated_latency=)
+    describe 'with slow calls' do
+      before(:each) do
+        Keychain.simulated_latency = 0.2
+      end
+
+      after(:each) do
+        Keychain.simulated_latency = 0
+      end
+
+      it 'should run calls concurrently' do
+        started = Time.now
+        futures = 4.times.collect { @keychain.generic_passwords.where(:service => 'aservice').first_async }
+        futures.collect(&:value).collect(&:account).should == ['anaccount'] * 4
+        (Time.now - started).should < 0.6
+      end
+
+      it 'should return before the call has finished' do
+        future = Keychain::Async.password(@item)
+        future.should_not be_ready
+        future.wait(0.01).should == false
+        future.value.should == 'some-password'
+      end
+
+      it 'should cancel queued calls' do
+        Keychain::Async.pool_size = 1
+        running = Keychain::Async.password(@item)
+        queued = Keychain::Async.password(@item)
+        queued.cancel.should == true
+        queued.should be_cancelled
+        expect {queued.value}.to raise_error(Keychain::Async::CancelledError)
+        running.value.should == 'some-password'
+      end
+
+      it 'should leave the changes of a cancelled save unsaved' do
+        Keychain::Async.pool_size = 1
+        running = Keychain::Async.password(@item)
+        @item.comment = 'a comment'
+        Keychain::Async.save!(@item).cancel.should == true
+        running.value
+        @item.changed.should == [:comment]
+        @item.save!
+        @keychain.generic_passwords.where(:service => 'aservice').first.comment.should == 'a comment'
+      end
+    end
+  end
+end
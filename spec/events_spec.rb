@@ -0,0 +1,170 @@
+require 'spec_helper'
+require 'timeout'
+
+describe Keychain do
+  before(:each) do
+    @keychain = Keychain.create(File.join(Dir.tmpdir, "events_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+    @other = Keychain.create(File.join(Dir.tmpdir, "events_spec_other_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+    @events = Queue.new
+  end
+
+  after(:each) do
+    Keychain.subscriptions.each(&:unsubscribe)
+    @keychain.delete
+    @other.delete
+  end
+
+  def next_event
+    Timeout.timeout(5) { @events.pop }
+  end
+
+  def no_more_events
+    sleep 0.1
+    @events.should be_empty
+  end
+
+  describe 'subscribe' do
+    it 'should deliver item changes' do
+      Keychain.subscribe {|event| @events << event}
+      item = @keychain.generic_passwords.create(:service => 'aservice', :password => 'secret')
+      event = next_event
+      event.type.should == :add
+      event.keychain.should == @keychain
+      event.pid.should == Process.pid
+
+      item.password = 'changed'
+      item.save!
+      next_event.type.should == :update
+      item.delete
+      next_event.type.should == :delete
+    end
+
+    it 'should deliver an event for each item changed' do
+      Keychain.subscribe(:add, :update) {|event| @events << event.type}
+      @keychain.add_passwords(Keychain::Item::Classes::GENERIC, [{:service => 'one'}, {:service => 'two'}])
+      @keychain.generic_passwords.update_all(:comment => 'changed')
+      4.times.collect { next_event }.should == [:add, :add, :update, :update]
+    end
+
+    it 'should only deliver the types of event asked for' do
+      Keychain.subscribe(:delete) {|event| @events << event.type}
+      @keychain.generic_passwords.create(:service => 'aservice').delete
+      next_event.should == :delete
+      no_more_events
+    end
+
+    it 'should deliver lock and unlock events' do
+      Keychain.subscribe(:lock, :unlock) {|event| @events << event.type}
+      @keychain.lock!
+      @keychain.unlock! 'pass'
+      [next_event, next_event].should == [:lock, :unlock]
+    end
+
+    it 'should reject unknown events' do
+      expect {Keychain.subscribe(:explode) {}}.to raise_error(ArgumentError)
+      expect {Keychain.subscribe(:add)}.to raise_error(ArgumentError)
+      Keychain.receiving_events?.should == false
+    end
+
+    it 'should keep delivering when a subscriber raises' do
+      Keychain.subscribe { raise 'broken' }
+      Keychain.subscribe {|event| @events << event.type}
+      $stderr, stderr = StringIO.new, $stderr
+      begin
+        @keychain.generic_passwords.create(:service => 'aservice')
+        next_event.should == :add
+      ensure
+        $stderr = stderr
+      end
+    end
+  end
+
+  describe 'unsubscribe' do
+    it 'should stop delivering events' do
+      subscription = Keychain.subscribe {|event| @events << event}
+      subscription.unsubscribe
+      Keychain.subscriptions.should == []
+      Keychain.receiving_events?.should == false
+      @keychain.generic_passwords.create(:service => 'aservice')
+      no_more_events
+    end
+
+    it 'should keep receiving events while other subscriptions remain' do
+      first = Keychain.subscribe {}
+      Keychain.subscribe {|event| @events << event.type}
+      first.unsubscribe
+      Keychain.receiving_events?.should == true
+      @keychain.generic_passwords.create(:service => 'aservice')
+      next_event.should == :add
+    end
+
+    it 'should be possible from a subscriber' do
+      Keychain.subscribe {|event| @events << event.type; Keychain.subscriptions.each(&:unsubscribe)}
+      @keychain.generic_passwords.create(:service => 'aservice')
+      next_event.should == :add
+      Keychain.subscribe {|event| @events << event.type}
+      @keychain.generic_passwords.create(:service => 'aservice-2')
+      next_event.should == :add
+    end
+  end
+
+  describe 'on' do
+    it 'should only deliver events for that keychain' do
+      @keychain.on(:add) {|event| @events << event}
+      @other.generic_passwords.create(:service => 'aservice')
+      @keychain.generic_passwords.create(:service => 'aservice')
+      event = next_event
+      event.keychain.should == @keychain
+      no_more_events
+    end
+  end
+
+  describe 'status' do
+    it 'should be cached while receiving events' do
+      Keychain.subscribe {}
+      @keychain.locked?.should == false
+      Keychain.reset_stats
+      @keychain.locked?.should == false
+      @keychain.writeable?
+      Keychain.stats[:status][:calls].should == 0
+    end
+
+    it 'should follow locking and unlocking' do
+      Keychain.subscribe {|event| @events << event.type}
+      @keychain.locked?.should == false
+      @keychain.lock!
+      @keychain.locked?.should == true
+      @keychain.unlock! 'pass'
+      @keychain.locked?.should == false
+      [next_event, next_event].should == [:lock, :unlock]
+      @keychain.locked?.should == false
+    end
+
+    it 'should follow locking while a subscriber is busy' do
+      release = Queue.new
+      Keychain.subscribe {|event| release.pop; @events << event.type}
+      @keychain.locked?.should == false
+      @keychain.lock!
+      @keychain.locked?.should == true
+      @keychain.unlock! 'pass'
+      @keychain.locked?.should == false
+      2.times { release << true }
+      [next_event, next_event].should == [:lock, :unlock]
+    end
+
+    it 'should not make a keychain deleted elsewhere look like it exists' do
+      keychain = Keychain.create(File.join(Dir.tmpdir, "events_spec_deleted_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+      Keychain.subscribe {}
+      keychain.locked?.should == false
+      File.delete(keychain.path)
+      keychain.exists?.should == false
+    end
+
+    it 'should not be cached without subscriptions' do
+      @keychain.locked?
+      Keychain.reset_stats
+      @keychain.locked?
+      Keychain.stats[:status][:calls].should == 1
+    end
+  end
+end
@@ -28,6 +28,20 @@ describe Keychain::Item do
     end
   end
 
+  describe 'password_buffer' do
+    it 'should retrieve the password into a secret buffer' do
+      buffer = subject.password_buffer
+      buffer.should be_a(Keychain::SecretBuffer)
+      buffer.should == 'some-password'
+    end
+
+    it 'should save a secret buffer as the password' do
+      subject.password = Keychain::SecretBuffer.new('new-password')
+      subject.save!
+      find_item.password.should == 'new-password'
+    end
+  end
+
   describe 'service' do
     it 'should retrieve the service' do
       subject.service.should == 'some-service'
@@ -46,6 +60,23 @@ describe Keychain::Item do
     end
   end
 
+  describe 'to_h' do
+    it 'should return the attributes keyed by name' do
+      attributes = subject.to_h
+      attributes[:service].should == 'some-service'
+      attributes[:account].should == 'some-account'
+      attributes.should_not have_key(:password)
+    end
+  end
+
+  describe 'attribute assignment' do
+    it 'should return the assigned value before saving' do
+      subject.account = 'new-account'
+      subject.account.should == 'new-account'
+      find_item.account.should == 'some-account'
+    end
+  end
+
   describe 'save' do
     it 'should update attributes and password' do
       subject.password = 'new-password'
@@ -56,6 +87,179 @@ describe Keychain::Item do
       fresh.password.should == 'new-password'
       fresh.account.should == 'new-account'
     end
+
+    it 'should save boolean attributes' do
+      subject.invisible = true
+      subject.save!
+      find_item.invisible.should == true
+    end
+
+    it 'should save strings in other encodings as UTF-8' do
+      subject.comment = "caf\xe9".force_encoding('ISO-8859-1')
+      subject.save!
+      find_item.comment.should == "caf\u00e9"
+    end
+
+    it 'should reject strings that are not valid in their encoding' do
+      subject.comment = "caf\xe9"
+      expect {subject.save!}.to raise_error(ArgumentError)
+    end
+
+    it 'should reject values that cannot be converted, keeping the changes' do
+      subject.comment = 1.5
+      subject.password = 'new-password'
+      expect {subject.save!}.to raise_error(TypeError)
+      subject.changed.should == [:comment, :password]
+      find_item.password.should == 'some-password'
+    end
+
+    it 'should succeed when nothing has been read or changed' do
+      subject.save!
+      subject.service.should == 'some-service'
+    end
+
+    it 'should not call the keychain when nothing has changed' do
+      subject.account.should == 'some-account'
+      Keychain.reset_stats
+      subject.save!
+      Keychain.stats[:update][:calls].should == 0
+      Keychain.stats[:copy_matching][:calls].should == 0
+    end
+
+    it 'should change a password with a single call' do
+      item = subject
+      Keychain.reset_stats
+      item.password = 'new-password'
+      item.save!
+      Keychain.stats[:update][:calls].should == 1
+      Keychain.stats[:copy_matching][:calls].should == 0
+      item.password.should == 'new-password'
+    end
+
+    it 'should only send the attributes that were changed' do
+      other = find_item
+      other.account.should == 'some-account'
+      subject.comment = 'a comment'
+      subject.save!
+      other.account = 'new-account'
+      other.save!
+      fresh = find_item
+      fresh.comment.should == 'a comment'
+      fresh.account.should == 'new-account'
+    end
+
+    it 'should keep the saved values without reloading' do
+      subject.account = 'new-account'
+      subject.save!
+      subject.account.should == 'new-account'
+      subject.service.should == 'some-service'
+      subject.to_h[:account].should == 'new-account'
+    end
+
+    it 'should fetch the modification date when it is next read' do
+      item = subject
+      item.comment = 'a comment'
+      item.save!
+      Keychain.reset_stats
+      item.updated_at.should be_within(2).of(Time.now)
+      Keychain.stats[:copy_matching][:calls].should == 1
+      item.comment.should == 'a comment'
+    end
+
+    it 'should reload when asked to' do
+      item = subject
+      item.comment = 'a comment'
+      Keychain.reset_stats
+      item.save!(:reload => true)
+      Keychain.stats[:copy_matching][:calls].should == 1
+      item.comment.should == 'a comment'
+    end
+
+    it 'should keep changes that failed to save' do
+      subject.comment = "caf\xe9"
+      expect {subject.save!}.to raise_error(ArgumentError)
+      subject.changed.should == [:comment]
+    end
+  end
+
+  describe 'save_all' do
+    before(:each) do
+      @keychain.generic_passwords.create :service => 'other-service', :account => 'other-account', :password => 'other-password'
+    end
+
+    it 'should save the changes to each item' do
+      items = @keychain.generic_passwords.all
+      items.each {|item| item.password = "#{item.service}-rotated"}
+      Keychain.reset_stats
+      Keychain::Item.save_all(items).should == items
+      Keychain.stats[:update_batch][:calls].should == 1
+      Keychain.stats[:update_batch][:items].should == 2
+      items.each {|item| item.changed?.should == false}
+      @keychain.generic_passwords.where(:service => 'other-service').first.password.should == 'other-service-rotated'
+      find_item.password.should == 'some-service-rotated'
+    end
+
+    it 'should skip items without changes' do
+      item = find_item
+      Keychain.reset_stats
+      Keychain::Item.save_all([item]).should == [item]
+      Keychain.stats[:update_batch][:items].should == 0
+    end
+
+    it 'should report failures without raising' do
+      other = @keychain.generic_passwords.where(:service => 'other-service').first
+      item = find_item
+      item.comment = 'a comment'
+      other.service = 'some-service'
+      other.account = 'some-account'
+      results = Keychain::Item.save_all([item, other])
+      results[0].should == item
+      results[1].should be_a(Keychain::DuplicateItemError)
+      other.changed.should == [:account, :service]
+      find_item.comment.should == 'a comment'
+    end
+
+    it 'should require items' do
+      expect {Keychain::Item.save_all(['item'])}.to raise_error(TypeError)
+    end
+
+    it 'should leave every item unsaved when a value cannot be converted' do
+      other = @keychain.generic_passwords.where(:service => 'other-service').first
+      item = find_item
+      item.comment = 'a comment'
+      other.comment = 1.5
+      expect {Keychain::Item.save_all([item, other])}.to raise_error(TypeError)
+      item.changed.should == [:comment]
+      find_item.comment.should be_nil
+    end
+  end
+
+  describe 'changed' do
+    it 'should list the assigned attributes and password' do
+      item = subject
+      item.changed?.should == false
+      item.account = 'new-account'
+      item.password = 'new-password'
+      item.changed.should == [:account, :password]
+      item.changed?.should == true
+    end
+
+    it 'should be empty once saved' do
+      item = subject
+      item.account = 'new-account'
+      item.save!
+      item.changed.should == []
+    end
+  end
+
+  describe 'reload' do
+    it 'should discard unsaved changes' do
+      subject.account = 'new-account'
+      subject.password = 'new-password'
+      subject.reload
+      subject.account.should == 'some-account'
+      subject.password.should == 'some-password'
+    end
   end
 
   describe 'delete' do
@@ -64,4 +268,54 @@ describe Keychain::Item do
       find_item.should be_nil
     end
   end
+
+  describe 'freeze' do
+    it 'should keep every attribute readable' do
+      item = subject.freeze
+      item.service.should == 'some-service'
+      item.account.should == 'some-account'
+      item.updated_at.should be_a(Time)
+      item.password.should == 'some-password'
+    end
+
+    it 'should not allow changes' do
+      subject.freeze
+      expect {subject.comment = 'a comment'}.to raise_error(FrozenError)
+      expect {subject.password = 'new-password'}.to raise_error(FrozenError)
+      expect {subject.save!}.to raise_error(FrozenError)
+      expect {Keychain::Item.save_all([subject])}.to raise_error(FrozenError)
+    end
+
+    it 'should let items be shared with other ractors', :if => defined?(Ractor) do
+      item = Ractor.make_shareable(subject)
+      Ractor.shareable?(item).should be_true
+      experimental, Warning[:experimental] = Warning[:experimental], false
+      begin
+        Ractor.new(item) {|shared| [shared.service, shared.password]}.take.should == ['some-service', 'some-password']
+      ensure
+        Warning[:experimental] = experimental
+      end
+    end
+  end
+
+  describe 'memory' do
+    it 'should count its attributes in its memory size' do
+      @keychain.generic_passwords.create :service => 'long-service', :comment => 'c' * 1000, :password => 'p'
+      long = @keychain.generic_passwords.where(:service => 'long-service').first
+      ObjectSpace.memsize_of(long).should > ObjectSpace.memsize_of(subject) + 900
+    end
+
+    it 'should keep converted and assigned values when compacted' do
+      item = subject
+      item.service
+      item.comment = 'a' * 100
+      item.password = 'new-' + 'password'
+      GC.verify_compaction_references(:expand_heap => true, :toward => :empty) if GC.respond_to?(:verify_compaction_references)
+      item.service.should == 'some-service'
+      item.comment.should == 'a' * 100
+      item.password.should == 'new-password'
+      item.save!
+      find_item.comment.should == 'a' * 100
+    end
+  end
 end
\ No newline at end of file
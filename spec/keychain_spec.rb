@@ -14,6 +14,51 @@ describe Keychain do
     end
   end
 
+  describe 'keychain objects' do
+    before(:each) do
+      @path = File.join(Dir.tmpdir, "registry_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain")
+      @keychain = Keychain.create(@path, 'pass')
+    end
+
+    after(:each) do
+      @keychain.delete
+    end
+
+    it 'should be the same object for the same keychain' do
+      Keychain.default.should be(Keychain.default)
+      Keychain.open(@path).should be(@keychain)
+      Keychain.open(File.join(Dir.tmpdir, '.', File.basename(@path))).should be(@keychain)
+      @keychain.generic_passwords.create(:service => 'aservice').keychain.should be(@keychain)
+    end
+
+    it 'should not allocate when looking up the default keychain again' do
+      Keychain.default
+      before = GC.stat(:total_allocated_objects)
+      100.times { Keychain.default }
+      (GC.stat(:total_allocated_objects) - before).should < 10
+    end
+
+    it 'should be a new object once the keychain has been deleted' do
+      @keychain.delete
+      @keychain = Keychain.create(@path, 'pass')
+      Keychain.open(@path).should be(@keychain)
+    end
+
+    it 'should compare keychains' do
+      (@keychain == Keychain.open(@path)).should == true
+      (@keychain == Keychain.default).should == false
+      (@keychain == @path).should == false
+    end
+
+    it 'should only be created by the extension' do
+      expect {Keychain.allocate}.to raise_error(TypeError)
+    end
+
+    it 'should report their native memory' do
+      ObjectSpace.memsize_of(@keychain).should > ObjectSpace.memsize_of(Object.new)
+    end
+  end
+
   describe 'new' do
     it 'should create the keychain' do
       begin
@@ -39,6 +84,94 @@ describe Keychain do
         k.exists?.should be_false
       end
     end
+
+    context 'the keychain has been deleted' do
+      it 'should return false' do
+        keychain = Keychain.create(File.join(Dir.tmpdir, "exists_spec_#{Time.now.to_i}_#{rand(1000)}.keychain"), 'pass')
+        keychain.exists?.should be_true
+        keychain.delete
+        keychain.exists?.should be_false
+      end
+    end
+  end
+
+  describe 'errors' do
+    it 'should build their message when it is first read' do
+      error = begin
+        Keychain.open('/some/path/that/does/not/exist').unlock! 'pass'
+        nil
+      rescue Keychain::NoSuchKeychainError => e
+        e
+      end
+      error.code.should == Keychain::Status::NO_SUCH_KEYCHAIN
+      error.instance_variable_get(:@message).should be_nil
+      error.message.should == Keychain.error_message(Keychain::Status::NO_SUCH_KEYCHAIN)
+      error.message.should be(error.message)
+    end
+
+    it 'should keep a message they were created with' do
+      Keychain::Error.new('broken', -1).message.should == 'broken'
+    end
+
+    it 'should be looked up by status' do
+      Keychain.error_for_status(Keychain::Status::DUPLICATE_ITEM).should be_a(Keychain::DuplicateItemError)
+      Keychain.error_for_status(-1).class.should == Keychain::Error
+    end
+  end
+
+  describe 'ractors', :if => defined?(Ractor) do
+    before(:all) do
+      @experimental = Warning[:experimental]
+      Warning[:experimental] = false
+    end
+
+    after(:all) do
+      Warning[:experimental] = @experimental
+    end
+
+    before(:each) do
+      @path = File.join(Dir.tmpdir, "ractor_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain")
+      @keychain = Keychain.create(@path, 'pass')
+      @keychain.generic_passwords.create :service => 'aservice', :account => 'anaccount', :password => 'some-password'
+    end
+
+    after(:each) do
+      @keychain.delete
+    end
+
+    it 'should have shareable constants and keychains' do
+      Ractor.shareable?(Keychain::KEYCHAIN_MAP).should be_true
+      Ractor.shareable?(Keychain::Item::Classes::GENERIC).should be_true
+      Ractor.shareable?(@keychain).should be_true
+    end
+
+    it 'should find items from several ractors at once' do
+      ractors = Array.new(3) do
+        Ractor.new(@keychain, @path) do |keychain, path|
+          passwords = Array.new(20) { keychain.generic_passwords.where(:service => 'aservice').first.password }
+          [passwords.uniq, Keychain.open(path) == keychain, keychain.generic_passwords.where(:service => /\Aa/).all.length]
+        end
+      end
+      ractors.map(&:take).should == [[['some-password'], true, 1]] * 3
+    end
+
+    it 'should only use the result cache and operation subscriber from the main ractor' do
+      begin
+        Keychain.result_cache = Keychain::ResultCache.new
+        result = Ractor.new(@keychain) do |keychain|
+          keychain.generic_passwords.where(:service => 'aservice').first
+          begin
+            Keychain.operation_subscriber
+          rescue Ractor::UnsafeError => e
+            e.class
+          end
+        end.take
+        result.should == Ractor::UnsafeError
+        Keychain.result_cache.stats[:misses].should == 0
+      ensure
+        Keychain.result_cache = nil
+      end
+    end
   end
 
   describe 'settings' do
@@ -78,6 +211,358 @@ describe Keychain do
         @keychain.unlock! 'pass'
         @keychain.should_not be_locked
       end
+
+      it 'should unlock with a secret buffer' do
+        @keychain.unlock! Keychain::SecretBuffer.new('pass')
+        @keychain.should_not be_locked
+      end
+    end
+  end
+
+  describe 'add_passwords' do
+    before(:each) do
+      @keychain = Keychain.create(File.join(Dir.tmpdir, "keychain_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+    end
+
+    after(:each) do
+      @keychain.delete
+    end
+
+    it 'should add each item' do
+      items = @keychain.add_passwords(Keychain::Item::Classes::GENERIC, [{:service => 'aservice-1', :password => 'some-password-1'},
+                                                                        {:service => 'aservice-2', :password => 'some-password-2'}])
+      items.length.should == 2
+      items.first.should be_a(Keychain::Item)
+      items.first.service.should == 'aservice-1'
+      @keychain.generic_passwords.where(:service => 'aservice-2').first.password.should == 'some-password-2'
+    end
+
+    it 'should return true for each added item when return_items is false' do
+      @keychain.add_passwords(Keychain::Item::Classes::GENERIC, [{:service => 'aservice-1'}, {:service => 'aservice-2'}], :return_items => false).should == [true, true]
+    end
+
+    it 'should report duplicates without raising' do
+      @keychain.generic_passwords.create(:service => 'aservice-1', :password => 'some-password')
+      results = @keychain.add_passwords(Keychain::Item::Classes::GENERIC, [{:service => 'aservice-1'}, {:service => 'aservice-2'}, {:service => 'aservice-2'}], :return_items => false)
+      results[0].should be_a(Keychain::DuplicateItemError)
+      results[1].should == true
+      results[2].should be_a(Keychain::DuplicateItemError)
+      @keychain.generic_passwords.where(:service => 'aservice-2').all.length.should == 1
+    end
+  end
+
+  describe 'update_all and delete_all' do
+    before(:each) do
+      @keychain = Keychain.create(File.join(Dir.tmpdir, "keychain_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+      @keychain.add_passwords(Keychain::Item::Classes::GENERIC, [{:service => 'aservice', :account => 'account-1', :password => 'old'},
+                                                                {:service => 'aservice', :account => 'account-2', :password => 'old'},
+                                                                {:service => 'other', :account => 'account-3', :password => 'old'}])
+    end
+
+    after(:each) do
+      @keychain.delete
+    end
+
+    it 'should update every matching item in one call' do
+      Keychain.reset_stats
+      @keychain.generic_passwords.where(:service => 'aservice').update_all(:password => 'new', :comment => 'rotated').should == true
+      Keychain.stats[:update][:calls].should == 1
+      items = @keychain.generic_passwords.where(:service => 'aservice').all
+      items.collect(&:password).should == ['new', 'new']
+      items.collect(&:comment).should == ['rotated', 'rotated']
+      @keychain.generic_passwords.where(:service => 'other').first.password.should == 'old'
+    end
+
+    it 'should return false when nothing matches' do
+      @keychain.generic_passwords.where(:service => 'doesntexist').update_all(:password => 'new').should == false
+      @keychain.generic_passwords.where(:service => 'doesntexist').delete_all.should == false
+    end
+
+    it 'should not allow a limit' do
+      expect {@keychain.generic_passwords.where(:service => 'aservice').limit(1).update_all(:password => 'new')}.to raise_error(ArgumentError)
+      expect {@keychain.generic_passwords.where(:service => 'aservice').limit(1).delete_all}.to raise_error(ArgumentError)
+    end
+
+    it 'should require attributes to update' do
+      expect {@keychain.generic_passwords.update_all(:unknown => 'value')}.to raise_error(ArgumentError)
+    end
+
+    it 'should reject unknown attributes before changing anything' do
+      Keychain.reset_stats
+      expect {@keychain.generic_passwords.where(:service => 'aservice').update_all(:comment => 'changed', :unknown => 'value')}.to raise_error(ArgumentError)
+      Keychain.stats[:update][:calls].should == 0
+      @keychain.generic_passwords.where(:service => 'aservice').first.comment.should_not == 'changed'
+    end
+
+    it 'should delete every matching item in one call' do
+      Keychain.reset_stats
+      @keychain.generic_passwords.where(:service => 'aservice').delete_all.should == true
+      Keychain.stats[:delete][:calls].should == 1
+      @keychain.generic_passwords.where(:service => 'aservice').all.should == []
+      @keychain.generic_passwords.all.collect(&:service).should == ['other']
+    end
+  end
+
+  describe 'values that cannot be converted' do
+    before(:each) do
+      @keychain = Keychain.create(File.join(Dir.tmpdir, "keychain_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+      @keychain.generic_passwords.create(:service => 'aservice', :password => 'secret')
+    end
+
+    after(:each) do
+      @keychain.delete
+    end
+
+    # these are also the paths spec/leak_check.rb checks release what they had built
+    it 'should raise TypeError when adding' do
+      expect {@keychain.generic_passwords.create(:service => 'other', :comment => 1.5)}.to raise_error(TypeError)
+      expect {@keychain.generic_passwords.try_create(:service => 'other', :comment => 1.5)}.to raise_error(TypeError)
+      expect {@keychain.add_passwords(Keychain::Item::Classes::GENERIC, [{:service => 'one'}, {:service => 'two', :comment => 1.5}])}.to raise_error(TypeError)
+      @keychain.generic_passwords.where(:service => 'other').first.should be_nil
+      @keychain.generic_passwords.where(:service => 'one').first.should be_nil
+    end
+
+    it 'should raise TypeError when finding' do
+      expect {@keychain.generic_passwords.where(:service => 1.5).first}.to raise_error(TypeError)
+      expect {@keychain.generic_passwords.where(:service => 1.5).all}.to raise_error(TypeError)
+      expect {@keychain.generic_passwords.where(:service => 1.5).find_status}.to raise_error(TypeError)
+      expect {@keychain.generic_passwords.where(:service => [1.5]).all}.to raise_error(TypeError)
+      expect {Keychain.find(:all, Keychain::Item::Classes::GENERIC, :keychains => [@keychain, 'keychain'])}.to raise_error(TypeError)
+      expect {@keychain.generic_passwords.where(:service => 1.5).prepare(:account)}.to raise_error(TypeError)
+      expect {@keychain.generic_passwords.prepare(:service).first(:service => 1.5)}.to raise_error(TypeError)
+    end
+
+    it 'should raise TypeError when updating or deleting' do
+      expect {@keychain.generic_passwords.where(:service => 'aservice').update_all(:comment => 1.5)}.to raise_error(TypeError)
+      expect {@keychain.generic_passwords.where(:service => 1.5).update_all(:comment => 'changed')}.to raise_error(TypeError)
+      expect {@keychain.generic_passwords.where(:service => 1.5).delete_all}.to raise_error(TypeError)
+      @keychain.generic_passwords.where(:service => 'aservice').first.comment.should be_nil
+    end
+
+    it 'should raise TypeError before submitting async calls' do
+      expect {@keychain.generic_passwords.where(:service => 1.5).first_async}.to raise_error(TypeError)
+      expect {Keychain::Async.add_password(@keychain, Keychain::Item::Classes::GENERIC, :service => 'other', :comment => 1.5)}.to raise_error(TypeError)
+      item = @keychain.generic_passwords.first
+      item.comment = 1.5
+      expect {Keychain::Async.save!(item)}.to raise_error(TypeError)
+    end
+  end
+
+  describe 'where with predicates' do
+    before(:each) do
+      @keychain = Keychain.create(File.join(Dir.tmpdir, "keychain_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+      @keychain.add_passwords(Keychain::Item::Classes::GENERIC, [{:service => 'aws.prod', :account => 'alice', :password => 'one'},
+                                                                {:service => 'aws.staging', :account => 'bob', :password => 'two'},
+                                                                {:service => 'gcp.prod', :account => 'carol', :password => 'three'}])
+      @keychain.add_passwords(Keychain::Item::Classes::INTERNET, [{:server => 'a.example.com', :port => 80, :account => 'alice', :protocol => Keychain::Protocols::HTTP},
+                                                                 {:server => 'b.example.com', :port => 8080, :account => 'alice', :protocol => Keychain::Protocols::HTTP},
+                                                                 {:server => 'c.example.com', :port => 8443, :account => 'alice', :protocol => Keychain::Protocols::HTTP}])
+    end
+
+    after(:each) do
+      @keychain.delete
+    end
+
+    def services(conditions)
+      @keychain.generic_passwords.where(conditions).all.collect(&:service).sort
+    end
+
+    it 'should match prefixes' do
+      services(:service => Keychain.prefix('aws.')).should == ['aws.prod', 'aws.staging']
+    end
+
+    it 'should match regular expressions' do
+      services(:service => /\.prod\z/).should == ['aws.prod', 'gcp.prod']
+    end
+
+    it 'should match wildcards' do
+      services(:service => Keychain.wildcard('*.prod')).should == ['aws.prod', 'gcp.prod']
+      services(:service => Keychain.wildcard('aws.*')).should == ['aws.prod', 'aws.staging']
+      services(:service => Keychain.wildcard('?cp.*')).should == ['gcp.prod']
+    end
+
+    it 'should match lists of values' do
+      services(:account => ['alice', 'carol', 'dave']).should == ['aws.prod', 'gcp.prod']
+    end
+
+    it 'should match ranges' do
+      services(:account => 'b'..'c').should == ['aws.staging']
+      @keychain.internet_passwords.where(:port => 8000..8999).all.collect(&:port).sort.should == [8080, 8443]
+      @keychain.internet_passwords.where(:port => 80...8443).all.collect(&:port).sort.should == [80, 8080]
+    end
+
+    it 'should match open ended time ranges' do
+      services(:updated_at => (Time.now - 3600)..nil).length.should == 3
+      services(:updated_at => (Time.now + 3600)..nil).should == []
+    end
+
+    it 'should combine predicates with exact conditions' do
+      services(:account => 'alice', :service => /prod/).should == ['aws.prod']
+      services(:account => 'bob', :service => Keychain.prefix('gcp')).should == []
+    end
+
+    it 'should not match items without the attribute' do
+      services(:comment => /.*/).should == []
+    end
+
+    it 'should apply the limit to the matching items' do
+      @keychain.generic_passwords.where(:service => /prod/).limit(1).all.length.should == 1
+      @keychain.generic_passwords.where(:service => /prod/).first.service.should =~ /prod/
+      @keychain.generic_passwords.where(:service => /nothing/).first.should be_nil
+    end
+
+    it 'should work with each, prepared queries and async finds' do
+      @keychain.generic_passwords.where(:service => /prod/).each.to_a.length.should == 2
+      @keychain.generic_passwords.where(:service => /prod/).find_each(1).to_a.length.should == 2
+      query = @keychain.generic_passwords.where(:service => Keychain.prefix('aws')).prepare(:account)
+      query.all(:account => 'bob').collect(&:service).should == ['aws.staging']
+      query.first(:account => 'carol').should be_nil
+      @keychain.generic_passwords.where(:service => /prod/).all_async.value.length.should == 2
+    end
+
+    it 'should not allow predicates in update_all and delete_all' do
+      expect {@keychain.generic_passwords.where(:service => /prod/).update_all(:comment => 'x')}.to raise_error(ArgumentError)
+      expect {@keychain.generic_passwords.where(:service => /prod/).delete_all}.to raise_error(ArgumentError)
+    end
+  end
+
+  if Keychain.respond_to?(:simulated_latency=)
+    describe 'blocking calls' do
+      before(:each) do
+        @keychain = Keychain.create(File.join(Dir.tmpdir, "keychain_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+        @item = @keychain.generic_passwords.create(:service => 'aservice', :account => 'anaccount', :password => 'some-password')
+        Keychain.simulated_latency = 0.25
+      end
+
+      after(:each) do
+        Keychain.simulated_latency = 0
+        @keychain.delete
+      end
+
+      # counts how often another thread got to run while the block was running
+      def ticks_during
+        ticks = 0
+        ticker = Thread.new { loop { ticks += 1; sleep 0.01 } }
+        sleep 0.05
+        start = ticks
+        yield
+        ticks - start
+      ensure
+        ticker.kill
+      end
+
+      it 'should let other threads run while finding items' do
+        ticks_during { @keychain.generic_passwords.where(:service => 'aservice').first }.should > 5
+      end
+
+      it 'should let other threads run while adding items in bulk' do
+        ticks_during { @keychain.add_passwords(Keychain::Item::Classes::GENERIC, [{:service => 'aservice-2'}, {:service => 'aservice-3'}]) }.should > 5
+      end
+
+      it 'should let other threads run while adding items' do
+        ticks_during { @keychain.generic_passwords.create(:service => 'aservice-2', :password => 'some-password') }.should > 5
+      end
+
+      it 'should let other threads run while saving items' do
+        @item.password = 'new-password'
+        ticks_during { @item.save! }.should > 5
+      end
+
+      it 'should let other threads run while reading passwords' do
+        ticks_during { @item.password }.should > 5
+      end
+
+      it 'should let other threads run while unlocking' do
+        @keychain.lock!
+        ticks_during { @keychain.unlock! 'pass' }.should > 5
+      end
+    end
+  end
+
+  describe 'stats' do
+    before(:each) do
+      @keychain = Keychain.create(File.join(Dir.tmpdir, "keychain_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+      @keychain.generic_passwords.create(:service => 'stats-service', :account => 'account', :password => 'password')
+      Keychain.reset_stats
+    end
+
+    after(:each) do
+      Keychain.operation_subscriber = nil
+      @keychain.delete
+    end
+
+    it 'should count calls and items' do
+      @keychain.generic_passwords.where(:service => 'stats-service').all
+      @keychain.generic_passwords.where(:service => 'doesntexist').all
+      stats = Keychain.stats[:copy_matching]
+      stats[:calls].should == 2
+      stats[:items].should == 1
+      stats[:errors].should == 1
+      stats[:histogram].values.inject(:+).should == 2
+    end
+
+    it 'should count raised errors by code' do
+      @keychain.lock!
+      expect {@keychain.unlock! 'badpassword'}.to raise_error(Keychain::AuthFailedError)
+      Keychain.stats[:unlock][:errors].should == 1
+      Keychain.stats[:errors].should == {-25293 => 1}
+    end
+
+    it 'should reset' do
+      @keychain.generic_passwords.all
+      Keychain.reset_stats
+      Keychain.stats[:copy_matching][:calls].should == 0
+    end
+
+    describe 'operation_subscriber' do
+      it 'should be passed each operation' do
+        calls = []
+        Keychain.operation_subscriber = lambda {|*args| calls << args}
+        @keychain.generic_passwords.create(:service => 'other-service', :account => 'account', :password => 'password')
+        operation, seconds, status, items = calls.first
+        operation.should == :add
+        seconds.should be_a(Float)
+        status.should == 0
+        items.should == 1
+      end
+
+      it 'should not fail operations when it raises' do
+        Keychain.operation_subscriber = lambda {|*args| raise 'oops'}
+        stderr, $stderr = $stderr, StringIO.new
+        begin
+          @keychain.generic_passwords.where(:service => 'stats-service').first.should be_a(Keychain::Item)
+          $stderr.string.should include('oops')
+        ensure
+          $stderr = stderr
+        end
+      end
+
+      it 'should be passed calls from other threads while it is busy' do
+        entered, gate, calls = Queue.new, Queue.new, Queue.new
+        Keychain.operation_subscriber = lambda do |operation, *args|
+          calls << [Thread.current, operation]
+          if Thread.current != Thread.main
+            entered << true
+            gate.pop
+          end
+        end
+        thread = Thread.new { @keychain.generic_passwords.where(:service => 'stats-service').first }
+        begin
+          entered.pop
+          @keychain.generic_passwords.where(:service => 'stats-service').first
+          calls.size.should == 2
+        ensure
+          gate << true
+          thread.join
+        end
+      end
+
+      it 'should be able to kill the calling thread' do
+        Keychain.operation_subscriber = lambda {|*args| Thread.current.kill unless Thread.current == Thread.main}
+        thread = Thread.new { @keychain.generic_passwords.where(:service => 'stats-service').first; :finished }
+        thread.join.value.should be_nil
+        @keychain.generic_passwords.where(:service => 'stats-service').first.should be_a(Keychain::Item)
+      end
     end
   end
 
@@ -156,6 +641,113 @@ describe Keychain do
         end
       end
     end
+    describe 'with_passwords' do
+      it 'should fetch passwords along with the items' do
+        items = @keychain_1.send(subject).where(search_arguments).with_passwords.all
+        @keychain_1.send(subject).where(search_arguments).first.delete
+        items.first.password.should == 'some-password-1'
+      end
+    end
+
+    describe 'parallel search' do
+      def passwords(items)
+        items.map(&:password)
+      end
+
+      it 'should merge the results in search list order' do
+        items = Keychain.send(subject).where(search_arguments_with_multiple_results).in(@keychain_3, @keychain_1, @keychain_2, :parallel => true).all
+        passwords(items).should == ['some-password-3', 'some-password-1', 'some-password-2']
+      end
+
+      it 'should return the first match in search list order' do
+        Keychain.send(subject).where(search_arguments_with_multiple_results).in(@keychain_2, @keychain_1, :parallel => true).first.password.should == 'some-password-2'
+        Keychain.send(subject).where(search_arguments_with_no_results).in(@keychain_2, @keychain_1, :parallel => true).first.should be_nil
+      end
+
+      it 'should apply the limit after merging' do
+        items = Keychain.send(subject).where(search_arguments_with_multiple_results).limit(2).in(@keychain_3, @keychain_1, @keychain_2, :parallel => 2).all
+        passwords(items).should == ['some-password-3', 'some-password-1']
+      end
+
+      it 'should apply conditions the keychain cannot evaluate to the merged results' do
+        proxy = Keychain.send(subject).where(:account => /\Aanacc/).limit(2).in(@keychain_2, @keychain_3, @keychain_1, :parallel => true)
+        passwords(proxy.all).should == ['some-password-2', 'some-password-3']
+        passwords(proxy.each.to_a).should == ['some-password-2', 'some-password-3']
+      end
+
+      it 'should stop querying keychains once enough items have been found' do
+        Keychain.reset_stats
+        Keychain.send(subject).where(search_arguments_with_multiple_results).in(@keychain_1, @keychain_2, @keychain_3, :parallel => 1).first.password.should == 'some-password-1'
+        Keychain.stats[:copy_matching][:calls].should == 1
+      end
+
+      it 'should reject a thread count that is not positive' do
+        expect {Keychain.send(subject).in(@keychain_1, @keychain_2, :parallel => 0).all}.to raise_error(ArgumentError)
+      end
+    end
+
+    describe 'each' do
+      it 'should yield each matching item' do
+        passwords = []
+        Keychain.send(subject).where(search_arguments_with_multiple_results).each {|item| passwords << item.password}
+        passwords.sort.should == ['some-password-1', 'some-password-2', 'some-password-3']
+      end
+
+      it 'should return an enumerator without a block' do
+        enumerator = Keychain.send(subject).where(search_arguments_with_multiple_results).in(@keychain_1, @keychain_2).each
+        enumerator.should be_a(Enumerator)
+        enumerator.to_a.length.should == 2
+      end
+
+      it 'should not yield when there are no matching items' do
+        @keychain_1.send(subject).where(search_arguments_with_no_results).each.to_a.should == []
+      end
+    end
+
+    describe 'find_each' do
+      it 'should yield batches of matching items' do
+        batches = Keychain.send(subject).where(search_arguments_with_multiple_results).find_each(2).to_a
+        batches.map(&:length).should == [2, 1]
+        batches.flatten.each {|item| item.should be_a(Keychain::Item)}
+      end
+    end
+
+    describe 'prepare' do
+      it 'should find items using the bound values' do
+        query = Keychain.send(subject).prepare(:account)
+        query.all(:account => 'anaccount').length.should == 3
+        query.first(:account => 'doesntexist').should be_nil
+      end
+
+      it 'should keep the conditions, limit and keychains of the proxy' do
+        query = Keychain.send(subject).where(search_arguments_with_multiple_results).in(@keychain_1, @keychain_2).prepare
+        query.all.length.should == 2
+        query.each.to_a.length.should == 2
+        Keychain.send(subject).limit(1).prepare(:account).all(:account => 'anaccount').length.should == 1
+      end
+
+      it 'should replace conditions on a parameter with the bound value' do
+        query = @keychain_1.send(subject).where(:account => 'doesntexist').prepare(:account)
+        query.first(:account => 'anaccount').password.should == 'some-password-1'
+      end
+
+      it 'should require a value for each parameter' do
+        query = Keychain.send(subject).prepare(:account)
+        expect {query.first}.to raise_error(ArgumentError)
+        expect {query.first(:account => 'anaccount', :service => 'aservice-1')}.to raise_error(ArgumentError)
+      end
+
+      it 'should reject unknown parameters' do
+        expect {Keychain.send(subject).prepare(:colour)}.to raise_error(ArgumentError)
+      end
+
+      it 'should count the dictionaries it holds in its memory size' do
+        query = Keychain.send(subject).prepare(:account)
+        longer = Keychain.send(subject).where(:label => 'a' * 1000).prepare(:account)
+        ObjectSpace.memsize_of(longer).should >= ObjectSpace.memsize_of(query) + 2000
+      end
+    end
+
     describe 'first' do
       context 'when the keychain does not contain a matching item' do
         it 'should return nil' do
@@ -181,6 +773,36 @@ describe Keychain do
         end
       end
     end
+
+    describe 'find_status and exists?' do
+      it 'should report a match' do
+        @keychain_1.send(subject).where(search_arguments).find_status.should == Keychain::Status::SUCCESS
+        @keychain_1.send(subject).where(search_arguments).exists?.should == true
+      end
+
+      it 'should report a missing item without raising' do
+        @keychain_1.send(subject).where(search_arguments_with_no_results).find_status.should == Keychain::Status::ITEM_NOT_FOUND
+        @keychain_1.send(subject).where(search_arguments_with_no_results).exists?.should == false
+      end
+
+      it 'should apply predicates' do
+        @keychain_1.send(subject).where(search_arguments).where(:comment => /nothing like this/).find_status.should == Keychain::Status::ITEM_NOT_FOUND
+        @keychain_1.send(subject).where(search_arguments).where(:created_at => (Time.now - 3600)..nil).find_status.should == Keychain::Status::SUCCESS
+      end
+    end
+
+    describe 'try_create' do
+      it 'should return the status and item' do
+        status, item = @keychain_1.send(subject).try_create(create_arguments)
+        status.should == Keychain::Status::SUCCESS
+        item.password.should == 'some-password'
+      end
+
+      it 'should return the status of a duplicate without raising' do
+        @keychain_1.send(subject).create(create_arguments)
+        @keychain_1.send(subject).try_create(create_arguments).should == [Keychain::Status::DUPLICATE_ITEM, nil]
+      end
+    end
   end
 
   describe 'generic_passwords' do
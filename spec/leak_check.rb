@@ -0,0 +1,89 @@
+# Runs the specs against a build of the extension instrumented for leak detection, failing if
+# any memory allocated by the extension is still unreachable when ruby exits. Run with
+# rake leaks or
+#
+#   ruby spec/leak_check.rb [spec files]
+#
+# LEAK_CHECKER  asan (the default) builds with -fsanitize=address and preloads libasan into
+#               ruby, which isn't itself instrumented; valgrind runs ruby under valgrind's
+#               memcheck instead
+# RSPEC         the command that runs the specs (default: ruby -S rspec)
+#
+# Only leaks allocated from the extension's own sources (ext/*.c, or keychain.so in stacks
+# without symbols) are counted: ruby itself doesn't free everything at exit. RUBY_FREE_AT_EXIT
+# is set so that as much as possible is, including every Keychain, Item and Query object.
+require 'fileutils'
+require 'rbconfig'
+require 'shellwords'
+
+root = File.expand_path('../..', __FILE__)
+checker = ENV['LEAK_CHECKER'] || 'asan'
+abort "unknown LEAK_CHECKER #{checker}" unless %w(asan valgrind).include?(checker)
+build = File.join(root, 'tmp', "leaks-#{checker}")
+logs = File.join(build, 'logs')
+FileUtils.rm_rf build
+FileUtils.mkdir_p [logs, File.join(build, 'lib', 'keychain')]
+
+configure = [RbConfig.ruby, File.join(root, 'ext', 'extconf.rb')]
+configure << '--with-sanitizer=address' if checker == 'asan'
+Dir.chdir(build) do
+  # extconf.rb looks for the sources in ext, relative to where it is run
+  File.symlink File.join(root, 'ext'), 'ext'
+  system(*configure, :out => File::NULL) or abort 'extconf.rb failed'
+  system('make', :out => File::NULL) or abort 'make failed'
+  library = "keychain.#{RbConfig::CONFIG['DLEXT']}"
+  FileUtils.mv library, File.join('lib', 'keychain', library)
+end
+
+# rspec puts lib at the front of the load path, so the instrumented build is loaded before it can
+File.write File.join(build, 'preload.rb'), <<-RUBY
+  $LOAD_PATH.unshift #{File.join(build, 'lib').inspect}, #{File.join(root, 'lib').inspect}
+  require 'keychain'
+  unless $LOADED_FEATURES.any? {|feature| feature.start_with?(#{build.inspect})}
+    abort 'the instrumented keychain extension was not loaded'
+  end
+RUBY
+environment = {
+  'RUBYOPT' => "-r#{File.join(build, 'preload.rb')} #{ENV['RUBYOPT']}".strip,
+  'RUBY_FREE_AT_EXIT' => '1'
+}
+command = Shellwords.split(ENV['RSPEC'] || "#{RbConfig.ruby} -S rspec") + (ARGV.empty? ? ['spec'] : ARGV)
+case checker
+when 'asan'
+  libasan = `#{RbConfig::CONFIG['CC'].split.first} -print-file-name=libasan.so`.strip
+  abort 'libasan.so not found' unless File.exist?(libasan)
+  environment['LD_PRELOAD'] = libasan
+  # ruby's threads set up their own signal stacks
+  environment['ASAN_OPTIONS'] = "detect_leaks=1:use_sigaltstack=0:log_path=#{logs}/asan"
+  # leaks are counted below, so that those in ruby itself don't fail the run
+  environment['LSAN_OPTIONS'] = 'exitcode=0'
+when 'valgrind'
+  command = %W(valgrind --leak-check=full --show-leak-kinds=definite,indirect --num-callers=40
+               --trace-children=yes --log-file=#{logs}/valgrind.%p) + command
+end
+
+passed = Dir.chdir(root) { system(environment, *command) }
+
+sources = Dir[File.join(root, 'ext', '*.c')].map {|path| File.basename(path)}
+# asan prints the path a source was compiled from, valgrind just its name
+from_extension = lambda do |record|
+  record =~ /\bext\/\w+\.c:\d+|keychain\.so/ ||
+    record.scan(/\((\w+\.c):\d+\)/).flatten.any? {|file| sources.include?(file)}
+end
+leaks = []
+errors = []
+Dir[File.join(logs, '*')].each do |log|
+  text = File.read(log)
+  if checker == 'asan'
+    errors << text[/^=+\d+=+ERROR: AddressSanitizer: (?!detected memory leaks).*/m] if text =~ /ERROR: AddressSanitizer: (?!detected memory leaks)/
+    records = text.split(/\n\s*\n/).grep(/\A(Direct|Indirect) leak of/)
+  else
+    records = text.split(/^==\d+== \n/).grep(/are (definitely|indirectly) lost/)
+  end
+  leaks.concat records.select(&from_extension)
+end
+
+errors.each {|error| $stderr.puts error}
+leaks.each {|record| $stderr.puts record, ''}
+$stderr.puts "#{leaks.length} leak#{'s' unless leaks.length == 1} from the extension (logs in #{logs})"
+exit(passed && leaks.empty? && errors.empty?)
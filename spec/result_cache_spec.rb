@@ -0,0 +1,132 @@
+require 'spec_helper'
+
+describe Keychain::ResultCache do
+  before(:each) do
+    @keychain = Keychain.create(File.join(Dir.tmpdir, "keychain_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+    @keychain.generic_passwords.create(:service => 'aservice', :account => 'anaccount', :password => 'some-password')
+    @cache = Keychain::ResultCache.new(:ttl => 60, :max_size => 2)
+    @keychain.result_cache = @cache
+  end
+
+  after(:each) do
+    @keychain.result_cache = nil
+    @keychain.delete
+  end
+
+  def find(conditions = {:service => 'aservice'})
+    @keychain.generic_passwords.where(conditions).first
+  end
+
+  it 'should answer repeated queries from the cache' do
+    find.password.should == 'some-password'
+    find.account.should == 'anaccount'
+    @cache.stats[:hits].should == 1
+    @cache.stats[:misses].should == 1
+  end
+
+  it 'should not share items between callers' do
+    find.account = 'changed'
+    find.account.should == 'anaccount'
+  end
+
+  it 'should expire results after the ttl' do
+    cache = Keychain::ResultCache.new(:ttl => 0)
+    @keychain.result_cache = cache
+    find
+    find
+    cache.stats[:hits].should == 0
+    cache.stats[:evictions].should == 1
+  end
+
+  it 'should evict the least recently used result when full' do
+    find(:service => 'aservice')
+    find(:service => 'other')
+    find(:service => 'aservice')
+    find(:service => 'another')
+    @cache.stats[:evictions].should == 1
+    find(:service => 'aservice')
+    @cache.stats[:hits].should == 2
+  end
+
+  it 'should cache searches of the same keychains in a different order separately' do
+    other = Keychain.create(File.join(Dir.tmpdir, "keychain_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+    begin
+      Keychain.result_cache = Keychain::ResultCache.new
+      other.generic_passwords.create(:service => 'aservice', :account => 'otheraccount', :password => 'other-password')
+      Keychain.generic_passwords.where(:service => 'aservice').in(@keychain, other).first.account.should == 'anaccount'
+      Keychain.generic_passwords.where(:service => 'aservice').in(other, @keychain).first.account.should == 'otheraccount'
+    ensure
+      Keychain.result_cache = nil
+      other.delete
+    end
+  end
+
+  it 'should not cache a result read before a concurrent write' do
+    key = [Keychain::Item::Classes::GENERIC, [[:service, 'other']], nil, [@keychain.path], false, :first]
+    reading, written = Queue.new, Queue.new
+    fetch = Thread.new do
+      @cache.fetch(key) do
+        reading << true
+        written.pop
+        :before_write
+      end
+    end
+    reading.pop
+    @keychain.generic_passwords.create(:service => 'other', :password => 'other-password')
+    written << true
+    fetch.value.should == :before_write
+    @cache.fetch(key) { :after_write }.should == :after_write
+  end
+
+  it 'should be invalidated when a matching item is added' do
+    find(:service => 'other').should be_nil
+    @keychain.generic_passwords.create(:service => 'other', :password => 'other-password')
+    find(:service => 'other').password.should == 'other-password'
+  end
+
+  it 'should not be invalidated when an item that does not match is added' do
+    find
+    @keychain.generic_passwords.create(:service => 'other', :password => 'other-password')
+    find
+    @cache.stats[:hits].should == 1
+  end
+
+  it 'should be invalidated when a matching item is saved' do
+    item = find
+    item.password = 'new-password'
+    item.save!
+    find.password.should == 'new-password'
+  end
+
+  it 'should be invalidated when an item is changed to match' do
+    find(:service => 'renamed').should be_nil
+    item = find
+    item.service = 'renamed'
+    item.save!
+    find(:service => 'renamed').should_not be_nil
+  end
+
+  it 'should be invalidated when a matching item is deleted' do
+    find.delete
+    find.should be_nil
+  end
+
+  it 'should be invalidated by update_all' do
+    find.password.should == 'some-password'
+    @keychain.generic_passwords.where(:account => 'anaccount').update_all(:password => 'new-password')
+    find.password.should == 'new-password'
+  end
+
+  it 'should be invalidated by delete_all' do
+    find.should_not be_nil
+    Keychain.generic_passwords.where(:service => 'aservice').delete_all
+    find.should be_nil
+  end
+
+  it 'should be invalidated by save_all' do
+    item = find
+    item.password = 'new-password'
+    Keychain::Item.save_all([item])
+    find.password.should == 'new-password'
+  end
+end
@@ -0,0 +1,50 @@
+require 'spec_helper'
+
+describe Keychain::SecretBuffer do
+  subject { Keychain::SecretBuffer.new('some-secret') }
+
+  it 'should copy the secret' do
+    subject.bytesize.should == 11
+    subject.reveal.should == 'some-secret'
+  end
+
+  it 'should compare with strings and other buffers' do
+    subject.should == 'some-secret'
+    subject.should == Keychain::SecretBuffer.new('some-secret')
+    subject.should_not == 'some-secreT'
+    subject.should_not == 'some'
+  end
+
+  it 'should not show the secret when inspected' do
+    subject.inspect.should_not include('some-secret')
+  end
+
+  it 'should count its mapping in its memory size' do
+    ObjectSpace.memsize_of(subject).should >= 4096
+  end
+
+  describe 'wipe!' do
+    it 'should empty the buffer' do
+      subject.wipe!
+      subject.bytesize.should == 0
+      subject.reveal.should == ''
+    end
+  end
+
+  describe 'dup' do
+    it 'should copy into a separate buffer' do
+      copy = subject.dup
+      subject.wipe!
+      copy.should == 'some-secret'
+    end
+  end
+
+  describe 'write_to' do
+    it 'should write the secret to the io' do
+      reader, writer = IO.pipe
+      subject.write_to(writer).should == 11
+      writer.close
+      reader.read.should == 'some-secret'
+    end
+  end
+end
@@ -0,0 +1,149 @@
+require 'spec_helper'
+
+describe Keychain::Snapshot do
+  let(:generic) { Keychain::Item::Classes::GENERIC }
+  let(:internet) { Keychain::Item::Classes::INTERNET }
+
+  def write(records, passphrase = 'passphrase')
+    io = StringIO.new(''.b)
+    writer = Keychain::Snapshot::Writer.new(io, passphrase, :iterations => 1000)
+    records.each {|kind, attributes| writer.add kind, attributes}
+    writer.close
+    io.string
+  end
+
+  def read(snapshot, passphrase = 'passphrase')
+    Keychain::Snapshot::Reader.new(snapshot, passphrase).to_a
+  end
+
+  describe 'Writer and Reader' do
+    it 'should round trip records' do
+      records = [[generic, {:service => 'café', :password => "\x00\xffsecret".b, :invisible => true, :negative => false}],
+                 [internet, {:server => 'example.com', :port => 8080, :protocol => Keychain::Protocols::HTTP, :comment => 'c'}],
+                 [generic, {:description => 'when', :path => 'p'}]]
+      read(write(records)).should == records
+    end
+
+    it 'should store times' do
+      time = Time.at(1400000000, 123456789, :nsec)
+      writer = Keychain::Snapshot::Writer.new(io = StringIO.new(''.b), 'passphrase', :iterations => 1000)
+      writer.add generic, :comment => time
+      writer.close
+      read(io.string).first[1][:comment].should == time
+    end
+
+    it 'should leave out unknown attributes and nil values' do
+      read(write([[generic, {:service => 's', :created_at => Time.now, :klass => generic, :comment => nil}]])).should == [[generic, {:service => 's'}]]
+    end
+
+    it 'should split records across frames' do
+      records = Array.new(2000) {|i| [generic, {:service => "service-#{i}", :password => 'x' * 100}]}
+      snapshot = write(records)
+      snapshot.bytesize.should > Keychain::Snapshot::FRAME_SIZE * 2
+      read(snapshot).should == records
+    end
+
+    it 'should be encrypted' do
+      write([[generic, {:service => 'visible-service', :password => 'visible-password'}]]).should_not include('visible')
+    end
+
+    it 'should reject the wrong passphrase' do
+      snapshot = write([[generic, {:service => 's'}]])
+      expect {read(snapshot, 'wrong')}.to raise_error(Keychain::Snapshot::FormatError)
+    end
+
+    it 'should require a passphrase' do
+      expect {write([], nil)}.to raise_error(ArgumentError)
+    end
+
+    it 'should detect modified snapshots' do
+      snapshot = write([[generic, {:service => 's'}]])
+      snapshot.setbyte(Keychain::Snapshot::HEADER_SIZE + 6, snapshot.getbyte(Keychain::Snapshot::HEADER_SIZE + 6) ^ 1)
+      expect {read(snapshot)}.to raise_error(Keychain::Snapshot::FormatError)
+    end
+
+    it 'should detect a missing last frame' do
+      records = Array.new(2000) {|i| [generic, {:service => "service-#{i}", :password => 'x' * 100}]}
+      snapshot = write(records)
+      first_frame = Keychain::Snapshot::HEADER_SIZE + 4 + (snapshot.byteslice(Keychain::Snapshot::HEADER_SIZE, 4).unpack('N').first) + Keychain::Snapshot::TAG_SIZE
+      expect {read(snapshot.byteslice(0, first_frame))}.to raise_error(Keychain::Snapshot::FormatError)
+      expect {read(snapshot.byteslice(0, snapshot.bytesize - 1))}.to raise_error(Keychain::Snapshot::FormatError)
+    end
+
+    it 'should reject too many iterations before deriving the key' do
+      snapshot = write([[generic, {:service => 's'}]])
+      snapshot[12, 4] = [Keychain::Snapshot::MAX_ITERATIONS + 1].pack('N')
+      expect {read(snapshot)}.to raise_error(Keychain::Snapshot::FormatError, /iteration/)
+    end
+
+    it 'should reject frames that are too long before reading them' do
+      snapshot = write([[generic, {:service => 's'}]])
+      snapshot[Keychain::Snapshot::HEADER_SIZE, 4] = [Keychain::Snapshot::MAX_FRAME_SIZE + 1].pack('N')
+      reader = Keychain::Snapshot::Reader.new(StringIO.new(snapshot), 'passphrase')
+      expect {reader.to_a}.to raise_error(Keychain::Snapshot::FormatError, /too long/)
+    end
+
+    it 'should not write records larger than MAX_RECORD_SIZE' do
+      writer = Keychain::Snapshot::Writer.new(io = StringIO.new(''.b), 'passphrase', :iterations => 1000)
+      expect {writer.add generic, :password => 'x' * Keychain::Snapshot::MAX_RECORD_SIZE}.to raise_error(ArgumentError)
+      writer.add generic, :service => 's'
+      writer.close
+      read(io.string).should == [[generic, {:service => 's'}]]
+    end
+
+    it 'should reject other files' do
+      expect {read('not a snapshot, but long enough to have a header')}.to raise_error(Keychain::Snapshot::FormatError)
+    end
+  end
+
+  describe 'export and import' do
+    before(:each) do
+      @source = Keychain.create(File.join(Dir.tmpdir, "snapshot_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+      @destination = Keychain.create(File.join(Dir.tmpdir, "snapshot_spec_#{Time.now.to_i}_#{Time.now.usec}_#{rand(1000)}.keychain"), 'pass')
+      @source.generic_passwords.create(:service => 'aservice', :account => 'anaccount', :password => 'generic-password', :comment => 'a comment')
+      @source.internet_passwords.create(:server => 'example.com', :account => 'anaccount', :password => 'internet-password',
+                                        :protocol => Keychain::Protocols::HTTP, :port => 8080)
+    end
+
+    after(:each) do
+      @source.delete
+      @destination.delete
+    end
+
+    def export
+      io = StringIO.new(''.b)
+      @source.export_snapshot(io, :passphrase => 'passphrase', :iterations => 1000).should == 2
+      io.string
+    end
+
+    it 'should copy items and passwords' do
+      Keychain.import_snapshot(export, :passphrase => 'passphrase', :keychain => @destination).should == {:added => 2, :skipped => 0}
+      generic = @destination.generic_passwords.where(:service => 'aservice').first
+      generic.password.should == 'generic-password'
+      generic.comment.should == 'a comment'
+      internet = @destination.internet_passwords.where(:server => 'example.com').first
+      internet.password.should == 'internet-password'
+      internet.port.should == 8080
+      internet.protocol.should == Keychain::Protocols::HTTP
+    end
+
+    it 'should not read passwords one at a time' do
+      Keychain.reset_stats
+      export
+      Keychain.stats[:copy_data][:calls].should == 0
+    end
+
+    it 'should skip items that already exist' do
+      snapshot = export
+      Keychain.import_snapshot(snapshot, :passphrase => 'passphrase', :keychain => @destination)
+      Keychain.import_snapshot(snapshot, :passphrase => 'passphrase', :keychain => @destination, :batch_size => 1).should == {:added => 0, :skipped => 2}
+    end
+
+    it 'should import from a file' do
+      path = File.join(Dir.tmpdir, "snapshot_spec_#{rand(100000)}.snapshot")
+      File.open(path, 'wb') {|file| @source.export_snapshot(file, :passphrase => 'passphrase', :iterations => 1000)}
+      File.open(path, 'rb') {|file| Keychain.import_snapshot(file, :passphrase => 'passphrase', :keychain => @destination)}[:added].should == 2
+      File.delete(path)
+    end
+  end
+end
@@ -5,6 +5,8 @@ $: << File.dirname(__FILE__) + '/../lib'
 
 require 'keychain'
 require 'tmpdir'
+require 'stringio'
+require 'objspace'
 RSpec.configure do |config|
   
 end
\ No newline at end of file